@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Crypto backend comparison for presign
+# Builds every backend (openssl, mbedtls, native, and native fully static)
+# into its own directory under build/backends, then reports binary size and
+# runs the benchmark harness, cold start included, against each build.
+# Backends whose library is not installed are skipped. Extra arguments are
+# passed to presign-bench, e.g. ./bench/backends.sh --filter sha256.
+
+set -u
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+ROOT_DIR="$(cd "$SCRIPT_DIR/.." && pwd)"
+OUT_DIR="$ROOT_DIR/build/backends"
+
+# name backend static_link
+VARIANTS=(
+    "openssl openssl 0"
+    "mbedtls mbedtls 0"
+    "native native 0"
+    "native-static native 1"
+)
+
+printf '%-14s %10s\n' "backend" "size"
+BUILT=()
+for variant in "${VARIANTS[@]}"; do
+    read -r name backend static <<< "$variant"
+    dir="$OUT_DIR/$name"
+    mkdir -p "$dir"
+    if ! make -s -C "$ROOT_DIR" CRYPTO_BACKEND="$backend" STATIC_LINK="$static" \
+            BUILDDIR="$dir/build" BINDIR="$dir/bin" LIBDIR="$dir/lib" \
+            all "$dir/build/presign-bench" > "$dir/build.log" 2>&1; then
+        printf '%-14s %s\n' "$name" "skipped (build failed, see $dir/build.log)"
+        continue
+    fi
+    BUILT+=("$name")
+    printf '%-14s %10s\n' "$name" "$(wc -c < "$(readlink -f "$dir/bin/presign")")"
+done
+
+status=0
+for name in "${BUILT[@]}"; do
+    echo ""
+    echo "=== $name ==="
+    "$OUT_DIR/$name/build/presign-bench" --binary "$OUT_DIR/$name/bin/presign" "$@" || status=1
+done
+exit $status
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "presign_internal.h"
+
+/*
+ * Bump allocator for the strings of one request.
+ *
+ * Allocations are carved from the caller's initial buffer (usually a small
+ * array on the stack) and, once that is used up, from heap blocks that
+ * double in size. Nothing is freed individually: arena_reset() drops every
+ * allocation at once and keeps the largest heap block for the next request,
+ * so a long-lived arena stops calling malloc after its first few requests.
+ */
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN_BLOCK 4096
+
+struct arena_block {
+    arena_block_t *next;
+    size_t size;
+};
+
+// Block headers are padded so that block data is aligned like malloc memory.
+#define ARENA_BLOCK_HEADER ((sizeof(arena_block_t) + 15) & ~(size_t)15)
+
+void arena_init(arena_t *arena, void *initial, size_t initial_size) {
+    arena->initial = initial;
+    arena->initial_size = initial ? initial_size : 0;
+    arena->blocks = NULL;
+    arena->base = initial;
+    arena->size = arena->initial_size;
+    arena->used = 0;
+}
+
+// Padding needed after used bytes of the current block for an aligned start.
+static size_t align_padding(const arena_t *arena) {
+    uintptr_t next = (uintptr_t)arena->base + arena->used;
+    return (size_t)(-next & (ARENA_ALIGN - 1));
+}
+
+static int arena_grow(arena_t *arena, size_t size) {
+    size_t block_size = arena->blocks ? arena->blocks->size * 2 : ARENA_MIN_BLOCK;
+    while (block_size < size) {
+        if (block_size > SIZE_MAX / 2 - ARENA_BLOCK_HEADER) {
+            return -1;
+        }
+        block_size *= 2;
+    }
+    arena_block_t *block = malloc(ARENA_BLOCK_HEADER + block_size);
+    if (!block) {
+        return -1;
+    }
+    block->next = arena->blocks;
+    block->size = block_size;
+    arena->blocks = block;
+    arena->base = (char *)block + ARENA_BLOCK_HEADER;
+    arena->size = block_size;
+    arena->used = 0;
+    return 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size_t padding = align_padding(arena);
+    if (arena->base == NULL || size > arena->size - arena->used || padding > arena->size - arena->used - size) {
+        if (arena_grow(arena, size) != 0) {
+            return NULL;
+        }
+        padding = 0;
+    }
+    char *p = arena->base + arena->used + padding;
+    arena->used += padding + size;
+    return p;
+}
+
+char *arena_strndup(arena_t *arena, const char *src, size_t len) {
+    if (len == SIZE_MAX) {
+        return NULL;
+    }
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, src, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void arena_shrink(arena_t *arena, void *last, size_t size) {
+    char *p = last;
+    if (p >= arena->base && p <= arena->base + arena->used && size <= (size_t)(arena->base + arena->used - p)) {
+        arena->used = (size_t)(p - arena->base) + size;
+    }
+}
+
+void arena_reset(arena_t *arena) {
+    arena_block_t *keep = arena->blocks;
+    if (!keep) {
+        arena->base = arena->initial;
+        arena->size = arena->initial_size;
+        arena->used = 0;
+        return;
+    }
+    // The newest block is the largest; older ones are released.
+    arena_block_t *block = keep->next;
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    keep->next = NULL;
+    arena->base = (char *)keep + ARENA_BLOCK_HEADER;
+    arena->size = keep->size;
+    arena->used = 0;
+}
+
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->blocks;
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena, arena->initial, arena->initial_size);
+}
@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * Batch mode: input lines are grouped into chunks of BATCH_CHUNK_LINES. Each
+ * chunk is signed as a unit, either inline or by a worker thread, and chunks
+ * are written back strictly in input order, so the output matches a
+ * single-threaded run byte for byte.
+ *
+ * With a profiles file a line may start with PROFILE<TAB>; the rest of the
+ * line is then signed with that profile's signer, which the reading thread
+ * resolves before the chunk is handed out.
+ *
+ * With --payload-files a line ends in <TAB>LOCAL_FILE. The reading thread
+ * only checks that the file exists and adds up the sizes; the worker that
+ * signs the chunk hashes the files, so several files are hashed at once
+ * with --threads. A chunk is handed out early once its files add up to
+ * BATCH_CHUNK_PAYLOAD_BYTES, so a few large files do not end up on a
+ * single thread.
+ */
+
+#define PROFILE_NAME_DISPLAY 64
+
+typedef struct batch_chunk {
+    struct batch_chunk *next_pending;
+    struct batch_chunk *next_inflight;
+    buffer_t lines;                     // NUL-terminated lines back to back
+    size_t offsets[BATCH_CHUNK_LINES];
+    unsigned long line_numbers[BATCH_CHUNK_LINES];
+    signer_t *signers[BATCH_CHUNK_LINES];
+    size_t payload_offsets[BATCH_CHUNK_LINES];  // LOCAL_FILE of each line with --payload-files
+    char payload_hashes[BATCH_CHUNK_LINES][PAYLOAD_HEX_LEN + 1];
+    unsigned long long payload_bytes;
+    int payloads;
+    size_t line_count;
+    buffer_t out;
+    buffer_t group_urls;                // URL_SLOT_LEN slots for grouped signing
+    buffer_t errors;
+    int failed;
+    int done;
+} batch_chunk_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t chunk_done;
+    batch_chunk_t *pending_head;
+    batch_chunk_t *pending_tail;
+    int finished;
+} batch_pool_t;
+
+static void append_line_error(buffer_t *buf, unsigned long line_no, const char *detail) {
+    char message[256];
+    int written = snprintf(message, sizeof(message), "Error: batch line %lu skipped: %s\n", line_no, detail);
+    if (written > 0) {
+        buffer_append(buf, message, (size_t)written < sizeof(message) ? (size_t)written : sizeof(message) - 1);
+    }
+}
+
+static batch_chunk_t *chunk_new(void) {
+    batch_chunk_t *chunk = calloc(1, sizeof(*chunk));
+    if (!chunk) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+    return chunk;
+}
+
+static void chunk_reset(batch_chunk_t *chunk) {
+    chunk->next_pending = NULL;
+    chunk->next_inflight = NULL;
+    chunk->lines.len = 0;
+    chunk->line_count = 0;
+    chunk->payload_bytes = 0;
+    chunk->payloads = 0;
+    chunk->out.len = 0;
+    chunk->errors.len = 0;
+    chunk->failed = 0;
+    chunk->done = 0;
+}
+
+static void chunk_free(batch_chunk_t *chunk) {
+    free(chunk->lines.data);
+    free(chunk->out.data);
+    free(chunk->group_urls.data);
+    free(chunk->errors.data);
+    free(chunk);
+}
+
+// Signs req and appends its URL line to the chunk output.
+static void sign_line(signer_t *signer, batch_chunk_t *chunk, unsigned long line_no, const presign_request_t *req) {
+    int status = append_signed_url(signer->ctx, req, &chunk->out);
+    if (status == PRESIGN_OK && end_url_line(&chunk->out, req) != 0) {
+        status = PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    if (status != PRESIGN_OK) {
+        append_line_error(&chunk->errors, line_no, presign_strerror(status));
+        chunk->failed = 1;
+    }
+}
+
+// Signs lines [first, first + count) of a chunk with one sign_url_group call
+// into URL_SLOT_LEN slots, then appends the URLs in order. A URL too long
+// for its slot is signed again on its own at its place in the output.
+// Returns -1 if the slots cannot be reserved.
+static int sign_group(signer_t *signer, batch_chunk_t *chunk, size_t first, size_t count) {
+    presign_request_t reqs[BATCH_GROUP_LINES];
+    char *outs[BATCH_GROUP_LINES];
+    size_t url_lens[BATCH_GROUP_LINES];
+    int statuses[BATCH_GROUP_LINES];
+
+    chunk->group_urls.len = 0;
+    if (buffer_reserve(&chunk->group_urls, count * URL_SLOT_LEN) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        reqs[i] = signer->request;
+        reqs[i].path = chunk->lines.data + chunk->offsets[first + i];
+        if (chunk->payloads) {
+            reqs[i].payload_hash = chunk->payload_hashes[first + i];
+        }
+        outs[i] = chunk->group_urls.data + i * URL_SLOT_LEN;
+    }
+
+    int status = sign_url_group(signer->ctx, reqs, count, outs, URL_SLOT_LEN - 1, url_lens, statuses);
+    for (size_t i = 0; i < count; i++) {
+        unsigned long line_no = chunk->line_numbers[first + i];
+        if (status == PRESIGN_OK && statuses[i] == PRESIGN_ERR_BUFFER_TOO_SMALL) {
+            sign_line(signer, chunk, line_no, &reqs[i]);
+            continue;
+        }
+        if (status != PRESIGN_OK || statuses[i] != PRESIGN_OK) {
+            append_line_error(&chunk->errors, line_no, presign_strerror(status != PRESIGN_OK ? status : statuses[i]));
+            chunk->failed = 1;
+            continue;
+        }
+        if (buffer_append(&chunk->out, outs[i], url_lens[i]) != 0 || end_url_line(&chunk->out, &reqs[i]) != 0) {
+            append_line_error(&chunk->errors, line_no, presign_strerror(PRESIGN_ERR_OUT_OF_MEMORY));
+            chunk->failed = 1;
+        }
+    }
+    return 0;
+}
+
+// Hashes the payload file of every line. Lines whose file cannot be read
+// are reported and dropped from the chunk; the rest keep their order.
+static void hash_payloads(batch_chunk_t *chunk) {
+    size_t kept = 0;
+    for (size_t i = 0; i < chunk->line_count; i++) {
+        const char *file = chunk->lines.data + chunk->payload_offsets[i];
+        if (presign_hash_file(file, chunk->payload_hashes[kept], NULL) != PRESIGN_OK) {
+            char detail[128];
+            snprintf(detail, sizeof(detail), "cannot read payload file: %s", strerror(errno));
+            append_line_error(&chunk->errors, chunk->line_numbers[i], detail);
+            chunk->failed = 1;
+            continue;
+        }
+        chunk->offsets[kept] = chunk->offsets[i];
+        chunk->line_numbers[kept] = chunk->line_numbers[i];
+        chunk->signers[kept] = chunk->signers[i];
+        kept++;
+    }
+    chunk->line_count = kept;
+}
+
+// Signs every line of a chunk into its output buffer. When a multi-buffer
+// SHA-256 kernel is available, lines are signed BATCH_GROUP_LINES at a time.
+static void sign_chunk(batch_chunk_t *chunk) {
+    if (chunk->payloads) {
+        hash_payloads(chunk);
+    }
+    size_t group_start = 0;
+    size_t group_len = 0;
+    int grouped = sha256_mb_lanes() > 1;
+
+    for (size_t i = 0; i <= chunk->line_count; i++) {
+        const char *line = i < chunk->line_count ? chunk->lines.data + chunk->offsets[i] : NULL;
+        signer_t *signer = line ? chunk->signers[i] : NULL;
+
+        // A group ends at the end of the chunk, when it is full and when the
+        // signer changes; lines must keep their input order.
+        if (group_len > 0 && (!line || group_len == BATCH_GROUP_LINES || signer != chunk->signers[group_start])) {
+            if (sign_group(chunk->signers[group_start], chunk, group_start, group_len) != 0) {
+                for (size_t j = group_start; j < group_start + group_len; j++) {
+                    append_line_error(&chunk->errors, chunk->line_numbers[j], presign_strerror(PRESIGN_ERR_OUT_OF_MEMORY));
+                }
+                chunk->failed = 1;
+            }
+            group_len = 0;
+        }
+        if (!line) {
+            break;
+        }
+
+        if (grouped) {
+            if (group_len++ == 0) {
+                group_start = i;
+            }
+            continue;
+        }
+
+        presign_request_t req = signer->request;
+        req.path = line;
+        if (chunk->payloads) {
+            req.payload_hash = chunk->payload_hashes[i];
+        }
+        sign_line(signer, chunk, chunk->line_numbers[i], &req);
+    }
+}
+
+static void *batch_worker(void *p) {
+    batch_pool_t *pool = p;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->pending_head && !pool->finished) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        batch_chunk_t *chunk = pool->pending_head;
+        if (!chunk) {
+            break;
+        }
+        pool->pending_head = chunk->next_pending;
+        if (!pool->pending_head) {
+            pool->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        sign_chunk(chunk);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&pool->chunk_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Blocks until a worker marked chunk as signed.
+static void wait_for_chunk(batch_pool_t *pool, batch_chunk_t *chunk) {
+    pthread_mutex_lock(&pool->lock);
+    while (!chunk->done) {
+        pthread_cond_wait(&pool->chunk_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Writes a finished chunk; URLs go to stdout, per-line errors to stderr.
+static int write_chunk(batch_chunk_t *chunk) {
+    if (chunk->errors.len > 0) {
+        fflush(stdout);
+        fwrite(chunk->errors.data, 1, chunk->errors.len, stderr);
+    }
+    uint64_t write_start = stats_enabled ? stats_clock() : 0;
+    if (chunk->out.len > 0 && fwrite(chunk->out.data, 1, chunk->out.len, stdout) != chunk->out.len) {
+        return -1;
+    }
+    if (stats_enabled && chunk->out.len > 0) {
+        stats_record(STAT_OUTPUT, stats_clock() - write_start);
+        stats_count(STAT_OUTPUT_BYTES, chunk->out.len);
+    }
+    return chunk->failed;
+}
+
+// Picks the signer for lines without a profile: --profile, else the
+// environment. With a profiles file but neither --profile nor complete
+// environment settings there is none, and such lines are rejected.
+static int default_signer(const presign_args_t *args, signer_t *env_signer, signer_t **out) {
+    *out = NULL;
+    if (args->profile) {
+        *out = profile_signer(args->profiles, args->profile, args);
+        return *out ? 0 : -1;
+    }
+    if (args->profiles && (!getenv("AWS_ACCESS_KEY_ID") || !getenv("AWS_SECRET_ACCESS_KEY") ||
+                           args->region[0] == '\0' || args->bucket_url[0] == '\0')) {
+        return 0;
+    }
+    if (init_signer(env_signer, args, NULL) != 0) {
+        return -1;
+    }
+    *out = env_signer;
+    return 0;
+}
+
+// Resolves the signer of one input line and strips its PROFILE<TAB> prefix.
+// Returns NULL after adding the reason to the chunk's errors.
+static signer_t *line_signer(const presign_args_t *args, signer_t *fallback, batch_chunk_t *chunk,
+                             unsigned long line_no, char **line) {
+    char *tab = args->profiles ? strchr(*line, '\t') : NULL;
+    // With payload files the only tab may be the one before LOCAL_FILE
+    if (tab && args->payload_files && !strchr(tab + 1, '\t')) {
+        tab = NULL;
+    }
+    if (!tab) {
+        if (!fallback) {
+            append_line_error(&chunk->errors, line_no, "no PROFILE<TAB> prefix and no default credentials");
+        }
+        return fallback;
+    }
+    size_t name_len = (size_t)(tab - *line);
+    profile_t *profile = profiles_find(args->profiles, *line, name_len);
+    signer_t *signer = profile ? profile_signer(args->profiles, profile, args) : NULL;
+    if (!signer) {
+        char detail[PROFILE_NAME_DISPLAY + 32];
+        snprintf(detail, sizeof(detail), "%s profile '%.*s'", profile ? "unusable" : "unknown",
+                 (int)(name_len < PROFILE_NAME_DISPLAY ? name_len : PROFILE_NAME_DISPLAY), *line);
+        append_line_error(&chunk->errors, line_no, detail);
+    }
+    *line = tab + 1;
+    return signer;
+}
+
+// Splits the <TAB>LOCAL_FILE off the end of a --payload-files line and
+// checks that the file is there. Returns the file, or NULL after adding the
+// reason to the chunk's errors.
+static char *line_payload(char *path, batch_chunk_t *chunk, unsigned long line_no, unsigned long long *size) {
+    char *tab = strrchr(path, '\t');
+    if (!tab || tab[1] == '\0') {
+        append_line_error(&chunk->errors, line_no, "no <TAB>LOCAL_FILE for --payload-files");
+        return NULL;
+    }
+    *tab = '\0';
+    struct stat st;
+    if (stat(tab + 1, &st) != 0) {
+        char detail[128];
+        snprintf(detail, sizeof(detail), "cannot read payload file: %s", strerror(errno));
+        append_line_error(&chunk->errors, line_no, detail);
+        return NULL;
+    }
+    *size = S_ISREG(st.st_mode) ? (unsigned long long)st.st_size : 0;
+    return tab + 1;
+}
+
+// Signs one S3_PATH per line read from source ("-" for stdin). All other
+// parameters, the credentials and the derived signing key are shared across
+// lines; output goes through a large stdio buffer. Bad lines are reported and
+// skipped, and make the run exit non-zero. With threads > 1 chunks are signed
+// by a worker pool and reordered before they are written.
+int run_batch(const presign_args_t *args, const char *source, int threads) {
+    FILE *in = stdin;
+    if (strcmp(source, "-") != 0) {
+        in = fopen(source, "r");
+        if (!in) {
+            fprintf(stderr, "Error: Cannot open batch file '%s'\n", source);
+            return 1;
+        }
+    }
+
+    static char out_buffer[BATCH_OUTPUT_BUFFER];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    signer_t env_signer = {0};
+    signer_t *fallback = NULL;
+    if (default_signer(args, &env_signer, &fallback) != 0) {
+        if (in != stdin) {
+            fclose(in);
+        }
+        return 1;
+    }
+
+    batch_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.chunk_done, NULL);
+
+    pthread_t workers[MAX_BATCH_THREADS];
+    int worker_count = 0;
+    int failed = 0;
+
+    if (threads > 1) {
+        for (; worker_count < threads; worker_count++) {
+            if (pthread_create(&workers[worker_count], NULL, batch_worker, &pool) != 0) {
+                break;
+            }
+        }
+    }
+
+    // Chunks handed out but not yet written, oldest first. Bounding their
+    // number keeps memory flat when one chunk is slow.
+    batch_chunk_t *inflight_head = NULL;
+    batch_chunk_t *inflight_tail = NULL;
+    int inflight = 0;
+    int max_inflight = worker_count > 0 ? worker_count * 4 : 1;
+    batch_chunk_t *free_chunks = NULL;
+    batch_chunk_t *chunk = NULL;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    unsigned long line_no = 0;
+    int eof = 0;
+
+    while (!eof) {
+        if (!chunk) {
+            if (free_chunks) {
+                chunk = free_chunks;
+                free_chunks = chunk->next_inflight;
+                chunk_reset(chunk);
+            } else if (!(chunk = chunk_new())) {
+                failed = 1;
+                break;
+            }
+        }
+
+        line_len = getline(&line, &line_cap, in);
+        if (line_len == -1) {
+            eof = 1;
+        } else {
+            line_no++;
+            while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+                line[--line_len] = '\0';
+            }
+            if (line_len == 0) {
+                continue;
+            }
+            char *path = line;
+            signer_t *signer = line_signer(args, fallback, chunk, line_no, &path);
+            char *payload = NULL;
+            unsigned long long payload_size = 0;
+            if (!signer || (args->payload_files && !(payload = line_payload(path, chunk, line_no, &payload_size)))) {
+                chunk->failed = 1;
+                continue;
+            }
+            size_t offset = chunk->lines.len;
+            if (buffer_append(&chunk->lines, path, (size_t)(line + line_len - path) + 1) != 0) {
+                fprintf(stderr, "Error: Out of memory\n");
+                failed = 1;
+                eof = 1;
+            } else {
+                chunk->offsets[chunk->line_count] = offset;
+                chunk->line_numbers[chunk->line_count] = line_no;
+                chunk->signers[chunk->line_count] = signer;
+                if (payload) {
+                    chunk->payload_offsets[chunk->line_count] = offset + (size_t)(payload - path);
+                    chunk->payload_bytes += payload_size;
+                    chunk->payloads = 1;
+                }
+                chunk->line_count++;
+            }
+        }
+
+        if (chunk->line_count < BATCH_CHUNK_LINES && chunk->payload_bytes < BATCH_CHUNK_PAYLOAD_BYTES && !eof) {
+            continue;
+        }
+        // A last chunk without lines may still carry rejected ones
+        if (chunk->line_count == 0 && chunk->errors.len == 0) {
+            break;
+        }
+
+        if (worker_count == 0) {
+            sign_chunk(chunk);
+            if (write_chunk(chunk) != 0) {
+                failed = 1;
+            }
+            chunk_reset(chunk);
+            continue;
+        }
+
+        // Only this thread touches the in-flight list, so the finished head
+        // can be written without holding the pool lock.
+        while (inflight >= max_inflight) {
+            batch_chunk_t *head = inflight_head;
+            wait_for_chunk(&pool, head);
+            inflight_head = head->next_inflight;
+            if (!inflight_head) {
+                inflight_tail = NULL;
+            }
+            inflight--;
+            if (write_chunk(head) != 0) {
+                failed = 1;
+            }
+            head->next_inflight = free_chunks;
+            free_chunks = head;
+        }
+        if (inflight_tail) {
+            inflight_tail->next_inflight = chunk;
+        } else {
+            inflight_head = chunk;
+        }
+        inflight_tail = chunk;
+        inflight++;
+
+        pthread_mutex_lock(&pool.lock);
+        if (pool.pending_tail) {
+            pool.pending_tail->next_pending = chunk;
+        } else {
+            pool.pending_head = chunk;
+        }
+        pool.pending_tail = chunk;
+        pthread_cond_signal(&pool.work_ready);
+        pthread_mutex_unlock(&pool.lock);
+        chunk = NULL;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (inflight_head) {
+        batch_chunk_t *head = inflight_head;
+        wait_for_chunk(&pool, head);
+        inflight_head = head->next_inflight;
+        if (write_chunk(head) != 0) {
+            failed = 1;
+        }
+        chunk_free(head);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    while (free_chunks) {
+        batch_chunk_t *next = free_chunks->next_inflight;
+        chunk_free(free_chunks);
+        free_chunks = next;
+    }
+    if (chunk) {
+        chunk_free(chunk);
+    }
+
+    pthread_cond_destroy(&pool.chunk_done);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_mutex_destroy(&pool.lock);
+    free(line);
+    presign_ctx_free(env_signer.ctx);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (fflush(stdout) != 0) {
+        fprintf(stderr, "Error: Failed to write batch output\n");
+        return 1;
+    }
+    return failed;
+}
@@ -0,0 +1,169 @@
+#ifndef CLI_H
+#define CLI_H
+
+/*
+ * Types and entry points shared by the presign command-line modes.
+ */
+
+#include <stdio.h>
+#include "presign.h"
+#include "presign_internal.h"
+
+#define BATCH_OUTPUT_BUFFER (1 << 16)
+#define BATCH_CHUNK_LINES 1024
+#define BATCH_GROUP_LINES 64
+#define MAX_BATCH_THREADS 256
+// Room reserved for one URL before signing it. Longer URLs grow the output
+// buffer (or, in grouped signing, are signed again on their own).
+#define URL_SLOT_LEN MAX_URL_LEN
+// A batch chunk with payload files is handed out once its files add up to
+// this many bytes, so large files spread over the worker threads.
+#define BATCH_CHUNK_PAYLOAD_BYTES (64ull << 20)
+#define PAYLOAD_HEX_LEN 64
+// aws-chunked chunk sizes; AWS wants at least 8 KiB in every chunk but the
+// last.
+#define DEFAULT_CHUNK_SIZE (64u << 10)
+#define MIN_CHUNK_SIZE (8u << 10)
+#define MAX_CHUNK_SIZE (64u << 20)
+#define MAX_QUERY_PARAMS 32
+
+typedef struct profiles profiles_t;
+typedef struct profile profile_t;
+
+// Parsed command line. path and header values point into argv; header
+// names are copied into strings. region and bucket_url come from the
+// command line or the environment and may be empty when a profiles file is
+// loaded; a profile's own values win over the environment's, not over the
+// command line's.
+typedef struct {
+    char service[16];
+    char method[16];
+    char region[64];
+    char bucket_url[MAX_URL_LEN];
+    int region_from_cli;
+    int endpoint_from_cli;
+    const char *path;
+    int expire_min;
+    presign_header_t headers[MAX_HEADERS];
+    int header_count;
+    char now_override[32];
+    int time_bucket_min;        // --time-bucket, 0 when off
+    char payload_hash[PAYLOAD_HEX_LEN + 1];     // of --payload-file, empty when off
+    int payload_files;          // --payload-files: batch lines end in <TAB>LOCAL_FILE
+    int chunked;                // --chunked or --chunked-body: aws-chunked upload
+    size_t chunk_size;          // --chunk-size
+    const char *decoded_length; // --decoded-length, NULL when not signed
+    presign_param_t params[MAX_QUERY_PARAMS];   // --query, names copied into strings
+    int param_count;
+    const char *upload_id;      // --multipart, NULL when off
+    unsigned int part_count;    // --parts
+    unsigned long long object_size;     // --ranges, 0 when off
+    unsigned long long range_size;      // --range-size, or from --range-count
+    const char *content_type;   // --content-type of a POST form, NULL for any
+    unsigned long long min_length;      // --content-length-range of a POST form
+    unsigned long long max_length;      // 0 when off
+    int tree_jsonl;             // --format jsonl for --tree
+    int tree_format_set;
+    const char *region_set;     // --region-set: sign with SigV4A, NULL when off
+    arena_t strings;
+    profiles_t *profiles;       // --profiles FILE or PRESIGN_PROFILES
+    profile_t *profile;         // --profile NAME
+} presign_args_t;
+
+// Growable byte buffer used for batch chunks and socket I/O.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+// Shared state of one invocation: the library signer plus the request
+// template that batch mode reuses for every line.
+typedef struct {
+    presign_ctx_t *ctx;
+    presign_header_t headers[MAX_HEADERS];
+    presign_request_t request;
+} signer_t;
+
+// One [name] section of a profiles file. name and body point into the
+// mapped file; the settings are filled in when the profile is first used.
+struct profile {
+    const char *name;                 // not NUL-terminated
+    size_t name_len;
+    const char *body;                 // the lines after [name]
+    const char *body_end;
+    char *storage;                    // headers and the parsed copy of body
+    size_t storage_size;
+    const char *access_key;
+    const char *secret_key;
+    const char *session_token;
+    const char *region;
+    const char *endpoint;
+    presign_header_t *headers;        // sent before the --header ones
+    size_t header_count;
+    signer_t *signer;
+    int unusable;
+};
+
+struct profiles {
+    const char *path;
+    char *data;
+    size_t size;
+    profile_t *entries;               // in file order
+    size_t count;
+    uint32_t *slots;                  // hash table of entry index + 1, 0 when free
+    size_t slot_mask;
+    profile_t *last;                  // most recent lookup
+};
+
+// Memo cache of signed URLs keyed by request frame and time bucket (see
+// memo.c). key is scratch space for the frame being signed.
+typedef struct memo_entry memo_entry_t;
+typedef struct {
+    memo_entry_t *entries;
+    size_t set_mask;
+    uint64_t clock;
+    unsigned long long hits;
+    unsigned long long misses;
+    buffer_t key;
+} memo_t;
+
+int buffer_reserve(buffer_t *buf, size_t extra);
+int buffer_append(buffer_t *buf, const char *data, size_t len);
+
+int init_signer(signer_t *signer, const presign_args_t *args, const profile_t *profile);
+// Runs fn with the --profile signer, or with a signer created from the
+// environment for the call. fn returns 0 or, after reporting on stderr,
+// non-zero. Returns the exit status: 0 on success, 1 otherwise.
+typedef int (*signer_fn_t)(signer_t *signer, const presign_args_t *args, void *arg);
+int with_signer(const presign_args_t *args, signer_fn_t fn, void *arg);
+int append_signed_url(presign_ctx_t *ctx, const presign_request_t *req, buffer_t *out);
+int end_url_line(buffer_t *out, const presign_request_t *req);
+int sign_path(signer_t *signer, const char *path, FILE *out);
+int run_batch(const presign_args_t *args, const char *source, int threads);
+int run_tree(const presign_args_t *args, const char *root, int threads);
+int run_chunked_body(const presign_args_t *args, const char *source);
+int run_serve(int argc, char *argv[]);
+int run_client(int argc, char *argv[]);
+int run_verify(int argc, char *argv[]);
+int run_s3_local(int argc, char *argv[]);
+int run_load(int argc, char *argv[]);
+int write_stats(void);
+int parse_time_bucket(const char *text, int expire_min, int *minutes);
+
+int memo_init(memo_t *memo, size_t capacity);
+uint64_t memo_hash(const char *key, size_t len);
+// Returns the URL stored for key in bucket, or NULL, and counts the hit or
+// miss. The URL is not NUL-terminated and is valid until the next store.
+const char *memo_lookup(memo_t *memo, uint64_t hash, const char *key, size_t key_len, time_t bucket,
+                        size_t *url_len);
+void memo_store(memo_t *memo, uint64_t hash, const char *key, size_t key_len, time_t bucket, const char *url,
+                size_t url_len);
+void memo_free(memo_t *memo);
+
+profiles_t *profiles_load(const char *path);
+profile_t *profiles_find(profiles_t *profiles, const char *name, size_t len);
+signer_t *profile_signer(profiles_t *profiles, profile_t *profile, const presign_args_t *args);
+void profiles_free(profiles_t *profiles);
+
+#endif
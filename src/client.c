@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * presign client: talks to a running `presign serve`.
+ *
+ * Without --bench, request frames are read from stdin, pipelined over one
+ * connection and the response lines are copied to stdout in order. With
+ * --bench N, N generated GET requests are sent with up to --pipeline
+ * requests outstanding, and the latency of every request (enqueue to
+ * response) is recorded and summarised as percentiles.
+ */
+
+#define CLIENT_MAX_FRAME 2048
+#define CLIENT_READ_CHUNK 65536
+#define CLIENT_DEFAULT_PIPELINE 1
+
+typedef struct {
+    int fd;
+    buffer_t out;        // frames not yet written to the socket
+    size_t out_sent;
+    unsigned long sent;     // frames queued so far
+    unsigned long received; // response lines seen so far
+    unsigned long errors;   // response lines starting with ERR
+    int at_line_start;
+} client_conn_t;
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int connect_socket(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Cannot connect to '%s': %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        fprintf(stderr, "Error: Cannot configure socket: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Writes as much queued data as the socket takes. Returns -1 on error.
+static int client_flush(client_conn_t *conn) {
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = write(conn->fd, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            fprintf(stderr, "Error: Failed to send request: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->out_sent += (size_t)n;
+    }
+    if (conn->out_sent == conn->out.len) {
+        conn->out.len = 0;
+        conn->out_sent = 0;
+    }
+    return 0;
+}
+
+// Reads available responses and counts complete lines. With latencies set,
+// the latency of each answered request is recorded; with echo set the bytes
+// are copied to stdout. Returns -1 on error or when the server hung up.
+static int client_read(client_conn_t *conn, int echo, double *latencies, const double *sent_at) {
+    char chunk[CLIENT_READ_CHUNK];
+    for (;;) {
+        ssize_t n = read(conn->fd, chunk, sizeof(chunk));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            fprintf(stderr, "Error: Failed to read response: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: Server closed the connection\n");
+            return -1;
+        }
+
+        double now = latencies ? monotonic_seconds() : 0.0;
+        for (ssize_t i = 0; i < n; i++) {
+            if (conn->at_line_start && chunk[i] == 'E') {
+                conn->errors++;
+            }
+            conn->at_line_start = chunk[i] == '\n';
+            if (chunk[i] == '\n') {
+                if (latencies) {
+                    latencies[conn->received] = now - sent_at[conn->received];
+                }
+                conn->received++;
+            }
+        }
+        if (echo && fwrite(chunk, 1, (size_t)n, stdout) != (size_t)n) {
+            fprintf(stderr, "Error: Failed to write output\n");
+            return -1;
+        }
+    }
+}
+
+// Waits until the socket is readable, or writable while data is queued.
+static int client_wait(client_conn_t *conn) {
+    struct pollfd pfd;
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    if (conn->out.len > conn->out_sent) {
+        pfd.events |= POLLOUT;
+    }
+    pfd.revents = 0;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Forwards stdin frames and prints responses; exits non-zero if any request
+// was answered with ERR.
+static int client_pipe(client_conn_t *conn) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    int eof = 0;
+    int failed = 0;
+
+    while (!eof || conn->received < conn->sent) {
+        // Queue input until a reasonable amount is waiting to be sent; the
+        // server answers in order, so there is no need to wait in between.
+        while (!eof && conn->out.len < CLIENT_READ_CHUNK) {
+            line_len = getline(&line, &line_cap, stdin);
+            if (line_len == -1) {
+                eof = 1;
+                break;
+            }
+            while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+                line[--line_len] = '\0';
+            }
+            if (line_len == 0) {
+                continue;
+            }
+            line[line_len++] = '\n';
+            if (buffer_append(&conn->out, line, (size_t)line_len) != 0) {
+                fprintf(stderr, "Error: Out of memory\n");
+                failed = 1;
+                eof = 1;
+                break;
+            }
+            conn->sent++;
+        }
+        if (client_flush(conn) != 0 || client_wait(conn) != 0 || client_read(conn, 1, NULL, NULL) != 0) {
+            failed = 1;
+            break;
+        }
+    }
+
+    free(line);
+    if (fflush(stdout) != 0) {
+        fprintf(stderr, "Error: Failed to write output\n");
+        failed = 1;
+    }
+    return failed || conn->errors > 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned long count, double p) {
+    unsigned long index = (unsigned long)(p * (double)(count - 1) + 0.5);
+    return sorted[index];
+}
+
+// Sends count generated requests with up to depth outstanding and reports
+// the latency distribution in microseconds.
+static int client_bench(client_conn_t *conn, unsigned long count, unsigned long depth, const char *prefix) {
+    double *sent_at = malloc(count * sizeof(double));
+    double *latencies = malloc(count * sizeof(double));
+    if (!sent_at || !latencies) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(sent_at);
+        free(latencies);
+        return 1;
+    }
+
+    int failed = 0;
+    double start = monotonic_seconds();
+    while (conn->received < count) {
+        while (conn->sent < count && conn->sent - conn->received < depth) {
+            char frame[CLIENT_MAX_FRAME];
+            int len = snprintf(frame, sizeof(frame), "GET\t15\t%s/object-%08lu\n", prefix, conn->sent);
+            if (len < 0 || len >= (int)sizeof(frame) || buffer_append(&conn->out, frame, (size_t)len) != 0) {
+                fprintf(stderr, "Error: Cannot build request\n");
+                failed = 1;
+                break;
+            }
+            sent_at[conn->sent++] = monotonic_seconds();
+        }
+        if (failed || client_flush(conn) != 0 || client_wait(conn) != 0 ||
+            client_read(conn, 0, latencies, sent_at) != 0) {
+            failed = 1;
+            break;
+        }
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    if (!failed) {
+        qsort(latencies, count, sizeof(double), compare_doubles);
+        printf("requests:   %lu (pipeline %lu, %lu errors)\n", count, depth, conn->errors);
+        printf("elapsed:    %.3f s\n", elapsed);
+        printf("throughput: %.0f req/s\n", (double)count / elapsed);
+        printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               percentile(latencies, count, 0.50) * 1e6, percentile(latencies, count, 0.90) * 1e6,
+               percentile(latencies, count, 0.99) * 1e6, percentile(latencies, count, 0.999) * 1e6,
+               latencies[count - 1] * 1e6);
+    }
+
+    free(sent_at);
+    free(latencies);
+    return failed || conn->errors > 0;
+}
+
+static void print_client_usage(const char *prog_name) {
+    printf("Usage: %s client --socket PATH\n", prog_name);
+    printf("       %s client --socket PATH --bench N [--pipeline DEPTH] [--prefix S3_PATH]\n", prog_name);
+    printf("\nWithout --bench, request lines are read from stdin and the responses\n");
+    printf("are written to stdout in order. --bench sends N generated GET requests\n");
+    printf("with up to DEPTH outstanding (default: 1) and prints latency percentiles.\n");
+}
+
+int run_client(int argc, char *argv[]) {
+    const char *socket_path = NULL;
+    const char *prefix = "bench-bucket";
+    unsigned long bench = 0;
+    unsigned long depth = CLIENT_DEFAULT_PIPELINE;
+
+    for (int i = 2; i < argc; i++) {
+        char *end = NULL;
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || bench == 0) {
+                fprintf(stderr, "Error: --bench must be a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            depth = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || depth == 0) {
+                fprintf(stderr, "Error: --pipeline must be a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            prefix = argv[++i];
+            if (strlen(prefix) >= CLIENT_MAX_FRAME - 32) {
+                fprintf(stderr, "Error: --prefix too long\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            print_client_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!socket_path) {
+        fprintf(stderr, "Error: --socket is required\n");
+        print_client_usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    client_conn_t conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.at_line_start = 1;
+    conn.fd = connect_socket(socket_path);
+    if (conn.fd < 0) {
+        return 1;
+    }
+
+    int rc = bench > 0 ? client_bench(&conn, bench, depth, prefix) : client_pipe(&conn);
+    close(conn.fd);
+    free(conn.out.data);
+    return rc;
+}
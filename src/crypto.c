@@ -0,0 +1,736 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include "presign_internal.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/opensslv.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define CRYPTO_OPENSSL3 1
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/param_build.h>
+#endif
+#elif defined(USE_MBEDTLS)
+#include <mbedtls/md.h>
+#elif !defined(USE_NATIVE_CRYPTO)
+#error "Define USE_OPENSSL, USE_MBEDTLS or USE_NATIVE_CRYPTO"
+#endif
+
+/*
+ * SHA-256 and HMAC-SHA256 on top of the selected crypto backend.
+ *
+ * Besides the one-shot helpers there is an incremental SHA-256 stream, used
+ * to hash the canonical request piece by piece instead of assembling it
+ * first, and an HMAC key whose inner and outer midstates (the hash state
+ * after absorbing key^ipad and key^opad) are computed once. A MAC with a
+ * prepared key starts from copies of those states, which saves two
+ * compression rounds and the key setup per signature.
+ *
+ * Library contexts are not created per call. The algorithms are fetched
+ * once per process (on OpenSSL 3 every EVP_sha256()/HMAC() call otherwise
+ * goes through a provider lookup), and each thread keeps a crypto_ctx_t with
+ * a digest context, the two HMAC halves and a MAC context (EVP_MAC on
+ * OpenSSL 3, an HMAC mbedtls_md_context_t on mbedTLS) that are reset rather
+ * than reallocated between signatures.
+ *
+ * The native backend (CRYPTO_BACKEND=native) needs no library at all: the
+ * stream is a plain SHA-256 state over the compression kernels of sha256.c,
+ * which use SHA-NI or the ARMv8 SHA2 instructions when the CPU has them.
+ */
+
+#define SHA256_BLOCK_LEN 64
+
+struct sha256_stream {
+#ifdef USE_OPENSSL
+    EVP_MD_CTX *md;
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_context_t md;
+#else
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[SHA256_BLOCK_LEN];
+    size_t block_len;
+#endif
+};
+
+struct crypto_ctx {
+    sha256_stream_t *hash;
+    sha256_stream_t *inner;
+    sha256_stream_t *outer;
+#ifdef CRYPTO_OPENSSL3
+    EVP_MAC_CTX *mac;
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_context_t mac;
+    int mac_ready;
+#endif
+};
+
+#ifdef CRYPTO_OPENSSL3
+static EVP_MD *fetched_sha256;
+static EVP_MAC *fetched_hmac;
+static pthread_once_t fetch_once = PTHREAD_ONCE_INIT;
+
+// Kept for the life of the process.
+static void fetch_algorithms(void) {
+    fetched_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+    fetched_hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+}
+
+static const EVP_MD *sha256_md(void) {
+    pthread_once(&fetch_once, fetch_algorithms);
+    return fetched_sha256;
+}
+#elif defined(USE_OPENSSL)
+static const EVP_MD *sha256_md(void) {
+    return EVP_sha256();
+}
+#endif
+
+const char *crypto_backend_name(void) {
+#ifdef USE_OPENSSL
+    return "openssl";
+#elif defined(USE_MBEDTLS)
+    return "mbedtls";
+#else
+    return "native";
+#endif
+}
+
+#ifdef USE_NATIVE_CRYPTO
+static void store_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void native_start(sha256_stream_t *stream) {
+    memcpy(stream->state, sha256_initial_state, sizeof(stream->state));
+    stream->length = 0;
+    stream->block_len = 0;
+}
+
+static void native_update(sha256_stream_t *stream, const unsigned char *data, size_t len) {
+    stream->length += len;
+    if (stream->block_len > 0) {
+        size_t take = SHA256_BLOCK_LEN - stream->block_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(stream->block + stream->block_len, data, take);
+        stream->block_len += take;
+        data += take;
+        len -= take;
+        if (stream->block_len < SHA256_BLOCK_LEN) {
+            return;
+        }
+        sha256_compress(stream->state, stream->block, 1);
+        stream->block_len = 0;
+    }
+    if (len >= SHA256_BLOCK_LEN) {
+        size_t blocks = len / SHA256_BLOCK_LEN;
+        sha256_compress(stream->state, data, blocks);
+        data += blocks * SHA256_BLOCK_LEN;
+        len -= blocks * SHA256_BLOCK_LEN;
+    }
+    memcpy(stream->block, data, len);
+    stream->block_len = len;
+}
+
+static void native_finish(sha256_stream_t *stream, unsigned char *digest) {
+    uint64_t bit_len = stream->length * 8;
+    size_t used = stream->block_len;
+
+    stream->block[used++] = 0x80;
+    if (used > SHA256_BLOCK_LEN - 8) {
+        memset(stream->block + used, 0, SHA256_BLOCK_LEN - used);
+        sha256_compress(stream->state, stream->block, 1);
+        used = 0;
+    }
+    memset(stream->block + used, 0, SHA256_BLOCK_LEN - 8 - used);
+    store_be32(stream->block + SHA256_BLOCK_LEN - 8, (uint32_t)(bit_len >> 32));
+    store_be32(stream->block + SHA256_BLOCK_LEN - 4, (uint32_t)bit_len);
+    sha256_compress(stream->state, stream->block, 1);
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + i * 4, stream->state[i]);
+    }
+    stream->block_len = 0;
+}
+
+static void native_hmac(const unsigned char *key, size_t key_len, const unsigned char *data, size_t data_len,
+                        unsigned char *mac) {
+    sha256_stream_t stream;
+    unsigned char block[SHA256_BLOCK_LEN];
+    unsigned char pad[SHA256_BLOCK_LEN];
+    unsigned char inner_digest[32];
+
+    memset(block, 0, sizeof(block));
+    if (key_len > SHA256_BLOCK_LEN) {
+        native_start(&stream);
+        native_update(&stream, key, key_len);
+        native_finish(&stream, block);
+    } else {
+        memcpy(block, key, key_len);
+    }
+
+    for (size_t i = 0; i < SHA256_BLOCK_LEN; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    native_start(&stream);
+    native_update(&stream, pad, sizeof(pad));
+    native_update(&stream, data, data_len);
+    native_finish(&stream, inner_digest);
+
+    for (size_t i = 0; i < SHA256_BLOCK_LEN; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    native_start(&stream);
+    native_update(&stream, pad, sizeof(pad));
+    native_update(&stream, inner_digest, sizeof(inner_digest));
+    native_finish(&stream, mac);
+
+    memset(&stream, 0, sizeof(stream));
+    memset(block, 0, sizeof(block));
+    memset(pad, 0, sizeof(pad));
+}
+#endif
+
+// One-shot HMAC on the context's MAC (or, without one, on its streams).
+int crypto_hmac(crypto_ctx_t *cc, const void *key, size_t key_len, const void *data, size_t data_len,
+                unsigned char *mac) {
+#ifdef CRYPTO_OPENSSL3
+    size_t mac_len;
+    return EVP_MAC_init(cc->mac, key, key_len, NULL) &&
+           EVP_MAC_update(cc->mac, data, data_len) &&
+           EVP_MAC_final(cc->mac, mac, &mac_len, 32) ? 0 : -1;
+#elif defined(USE_OPENSSL)
+    unsigned int mac_len;
+    (void)cc;
+    if (key_len > INT_MAX) {
+        return -1;
+    }
+    return HMAC(sha256_md(), key, (int)key_len, data, data_len, mac, &mac_len) ? 0 : -1;
+#elif defined(USE_MBEDTLS)
+    return mbedtls_md_hmac_starts(&cc->mac, key, key_len) == 0 &&
+           mbedtls_md_hmac_update(&cc->mac, data, data_len) == 0 &&
+           mbedtls_md_hmac_finish(&cc->mac, mac) == 0 ? 0 : -1;
+#else
+    (void)cc;
+    native_hmac(key, key_len, data, data_len, mac);
+    return 0;
+#endif
+}
+
+int crypto_sha256(crypto_ctx_t *cc, const void *data, size_t len, unsigned char *digest) {
+    return sha256_stream_start(cc->hash) != 0 ||
+           sha256_stream_update(cc->hash, data, len) != 0 ||
+           sha256_stream_finish(cc->hash, digest) != 0 ? -1 : 0;
+}
+
+int hmac_sha256(const char *key, int key_len, const char *data, int data_len, unsigned char *result) {
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc || key_len < 0 || data_len < 0) {
+        return -1;
+    }
+    return crypto_hmac(cc, key, (size_t)key_len, data, (size_t)data_len, result);
+}
+
+int sha256_hash(const char *data, int data_len, unsigned char *result) {
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc || data_len < 0) {
+        return -1;
+    }
+    return crypto_sha256(cc, data, (size_t)data_len, result);
+}
+
+int derive_signing_key(const char *secret, const char *date, const char *region, const char *service, unsigned char *signing_key) {
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc) {
+        return -1;
+    }
+    char aws_secret[MAX_ENV_VAR_LEN + 4];
+    int secret_len = snprintf(aws_secret, sizeof(aws_secret), "AWS4%s", secret);
+    if (secret_len < 0 || (size_t)secret_len >= sizeof(aws_secret)) {
+        return -1;
+    }
+
+    unsigned char date_key[32];
+    unsigned char date_region_key[32];
+    unsigned char date_region_service_key[32];
+
+    int rc = crypto_hmac(cc, aws_secret, (size_t)secret_len, date, strlen(date), date_key) != 0 ||
+             crypto_hmac(cc, date_key, 32, region, strlen(region), date_region_key) != 0 ||
+             crypto_hmac(cc, date_region_key, 32, service, strlen(service), date_region_service_key) != 0 ||
+             crypto_hmac(cc, date_region_service_key, 32, "aws4_request", strlen("aws4_request"), signing_key) != 0
+             ? -1 : 0;
+    memset(aws_secret, 0, sizeof(aws_secret));
+    memset(date_key, 0, sizeof(date_key));
+    memset(date_region_key, 0, sizeof(date_region_key));
+    memset(date_region_service_key, 0, sizeof(date_region_service_key));
+    return rc;
+}
+
+sha256_stream_t *sha256_stream_new(void) {
+    sha256_stream_t *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        return NULL;
+    }
+#ifdef USE_OPENSSL
+    stream->md = EVP_MD_CTX_new();
+    if (!stream->md) {
+        free(stream);
+        return NULL;
+    }
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_init(&stream->md);
+    if (mbedtls_md_setup(&stream->md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0) {
+        mbedtls_md_free(&stream->md);
+        free(stream);
+        return NULL;
+    }
+#else
+    native_start(stream);
+#endif
+    return stream;
+}
+
+void sha256_stream_free(sha256_stream_t *stream) {
+    if (!stream) {
+        return;
+    }
+#ifdef USE_OPENSSL
+    EVP_MD_CTX_free(stream->md);
+#elif defined(USE_MBEDTLS)
+    mbedtls_md_free(&stream->md);
+#else
+    memset(stream, 0, sizeof(*stream));
+#endif
+    free(stream);
+}
+
+int sha256_stream_start(sha256_stream_t *stream) {
+#ifdef USE_OPENSSL
+    const EVP_MD *md = sha256_md();
+    return md && EVP_DigestInit_ex(stream->md, md, NULL) ? 0 : -1;
+#elif defined(USE_MBEDTLS)
+    return mbedtls_md_starts(&stream->md) == 0 ? 0 : -1;
+#else
+    native_start(stream);
+    return 0;
+#endif
+}
+
+int sha256_stream_update(sha256_stream_t *stream, const void *data, size_t len) {
+#ifdef USE_OPENSSL
+    return EVP_DigestUpdate(stream->md, data, len) ? 0 : -1;
+#elif defined(USE_MBEDTLS)
+    return mbedtls_md_update(&stream->md, (const unsigned char *)data, len) == 0 ? 0 : -1;
+#else
+    native_update(stream, data, len);
+    return 0;
+#endif
+}
+
+int sha256_stream_finish(sha256_stream_t *stream, unsigned char *digest) {
+#ifdef USE_OPENSSL
+    return EVP_DigestFinal_ex(stream->md, digest, NULL) ? 0 : -1;
+#elif defined(USE_MBEDTLS)
+    return mbedtls_md_finish(&stream->md, digest) == 0 ? 0 : -1;
+#else
+    native_finish(stream, digest);
+    return 0;
+#endif
+}
+
+int sha256_stream_copy(sha256_stream_t *dst, const sha256_stream_t *src) {
+#ifdef USE_OPENSSL
+    return EVP_MD_CTX_copy_ex(dst->md, src->md) ? 0 : -1;
+#elif defined(USE_MBEDTLS)
+    return mbedtls_md_clone(&dst->md, &src->md) == 0 ? 0 : -1;
+#else
+    *dst = *src;
+    return 0;
+#endif
+}
+
+int hmac_sha256_key_init(hmac_sha256_key_t *mac_key, const unsigned char *key, size_t key_len) {
+    unsigned char block[SHA256_BLOCK_LEN];
+    unsigned char pad[SHA256_BLOCK_LEN];
+    int rc = -1;
+
+    memset(mac_key, 0, sizeof(*mac_key));
+    memset(block, 0, sizeof(block));
+    mac_key->inner = sha256_stream_new();
+    mac_key->outer = sha256_stream_new();
+    if (!mac_key->inner || !mac_key->outer) {
+        goto done;
+    }
+
+    if (key_len > SHA256_BLOCK_LEN) {
+        if (sha256_stream_start(mac_key->inner) != 0 ||
+            sha256_stream_update(mac_key->inner, key, key_len) != 0 ||
+            sha256_stream_finish(mac_key->inner, block) != 0) {
+            goto done;
+        }
+    } else {
+        memcpy(block, key, key_len);
+    }
+
+    for (size_t i = 0; i < SHA256_BLOCK_LEN; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    if (sha256_stream_start(mac_key->inner) != 0 ||
+        sha256_stream_update(mac_key->inner, pad, sizeof(pad)) != 0) {
+        goto done;
+    }
+    for (size_t i = 0; i < SHA256_BLOCK_LEN; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    if (sha256_stream_start(mac_key->outer) != 0 ||
+        sha256_stream_update(mac_key->outer, pad, sizeof(pad)) != 0) {
+        goto done;
+    }
+    rc = 0;
+
+done:
+    memset(block, 0, sizeof(block));
+    memset(pad, 0, sizeof(pad));
+    if (rc != 0) {
+        hmac_sha256_key_clear(mac_key);
+    }
+    return rc;
+}
+
+void hmac_sha256_key_clear(hmac_sha256_key_t *mac_key) {
+    sha256_stream_free(mac_key->inner);
+    sha256_stream_free(mac_key->outer);
+    mac_key->inner = NULL;
+    mac_key->outer = NULL;
+}
+
+int hmac_sha256_begin(const hmac_sha256_key_t *mac_key, sha256_stream_t *inner, sha256_stream_t *outer) {
+    if (sha256_stream_copy(inner, mac_key->inner) != 0 ||
+        sha256_stream_copy(outer, mac_key->outer) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int hmac_sha256_end(sha256_stream_t *inner, sha256_stream_t *outer, unsigned char *mac) {
+    unsigned char inner_digest[32];
+    if (sha256_stream_finish(inner, inner_digest) != 0 ||
+        sha256_stream_update(outer, inner_digest, sizeof(inner_digest)) != 0 ||
+        sha256_stream_finish(outer, mac) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+crypto_ctx_t *crypto_ctx_new(void) {
+    crypto_ctx_t *cc = calloc(1, sizeof(*cc));
+    if (!cc) {
+        return NULL;
+    }
+    cc->hash = sha256_stream_new();
+    cc->inner = sha256_stream_new();
+    cc->outer = sha256_stream_new();
+    int ok = cc->hash && cc->inner && cc->outer;
+#ifdef CRYPTO_OPENSSL3
+    if (ok) {
+        pthread_once(&fetch_once, fetch_algorithms);
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+            OSSL_PARAM_construct_end(),
+        };
+        cc->mac = fetched_hmac ? EVP_MAC_CTX_new(fetched_hmac) : NULL;
+        ok = cc->mac && EVP_MAC_CTX_set_params(cc->mac, params);
+    }
+#elif defined(USE_MBEDTLS)
+    if (ok) {
+        mbedtls_md_init(&cc->mac);
+        cc->mac_ready = 1;
+        ok = mbedtls_md_setup(&cc->mac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0;
+    }
+#endif
+    if (!ok) {
+        crypto_ctx_free(cc);
+        return NULL;
+    }
+    return cc;
+}
+
+void crypto_ctx_free(crypto_ctx_t *cc) {
+    if (!cc) {
+        return;
+    }
+    sha256_stream_free(cc->hash);
+    sha256_stream_free(cc->inner);
+    sha256_stream_free(cc->outer);
+#ifdef CRYPTO_OPENSSL3
+    EVP_MAC_CTX_free(cc->mac);
+#elif defined(USE_MBEDTLS)
+    if (cc->mac_ready) {
+        mbedtls_md_free(&cc->mac);
+    }
+#endif
+    free(cc);
+}
+
+sha256_stream_t *crypto_ctx_inner(crypto_ctx_t *cc) {
+    return cc->inner;
+}
+
+sha256_stream_t *crypto_ctx_outer(crypto_ctx_t *cc) {
+    return cc->outer;
+}
+
+static pthread_key_t thread_ctx_key;
+static pthread_once_t thread_ctx_once = PTHREAD_ONCE_INIT;
+static int thread_ctx_key_ok;
+
+static void free_thread_ctx(void *cc) {
+    crypto_ctx_free(cc);
+}
+
+static void create_thread_ctx_key(void) {
+    thread_ctx_key_ok = pthread_key_create(&thread_ctx_key, free_thread_ctx) == 0;
+}
+
+crypto_ctx_t *crypto_thread_ctx(void) {
+    pthread_once(&thread_ctx_once, create_thread_ctx_key);
+    if (!thread_ctx_key_ok) {
+        return NULL;
+    }
+    crypto_ctx_t *cc = pthread_getspecific(thread_ctx_key);
+    if (!cc) {
+        cc = crypto_ctx_new();
+        if (cc && pthread_setspecific(thread_ctx_key, cc) != 0) {
+            crypto_ctx_free(cc);
+            cc = NULL;
+        }
+    }
+    return cc;
+}
+
+/*
+ * SigV4A signs with an ECDSA P-256 key derived from the credential instead
+ * of an HMAC key per day and region. The private key is the first counter
+ * value for which the NIST SP 800-108 counter-mode KDF (HMAC-SHA256, one
+ * 256-bit block) keyed with "AWS4A" + secret and fed with the label
+ * "AWS4-ECDSA-P256-SHA256", the access key and the counter gives a number
+ * k0 <= n - 2, where n is the order of the curve; the key is k0 + 1.
+ *
+ * Deriving it takes an HMAC or two and a scalar multiplication for the
+ * public point, so callers keep the key (see keytable.c). Only the OpenSSL
+ * backend signs with it.
+ */
+
+#define SIGV4A_LABEL "AWS4-ECDSA-P256-SHA256"
+#define SIGV4A_MAX_COUNTER 254
+
+// Order of P-256 minus 2
+static const unsigned char p256_n_minus_2[32] = {
+    0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xbc, 0xe6, 0xfa, 0xad, 0xa7, 0x17, 0x9e, 0x84, 0xf3, 0xb9, 0xca, 0xc2, 0xfc, 0x63, 0x25, 0x4f,
+};
+
+struct ecdsa_key {
+#ifdef USE_OPENSSL
+    EVP_PKEY *pkey;
+#endif
+    unsigned char public_point[65];     // 0x04, X, Y
+};
+
+int ecdsa_supported(void) {
+#ifdef USE_OPENSSL
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// Compares two 32-byte big-endian numbers without branching on their
+// bytes: negative, zero or positive as a < b, a == b or a > b.
+static int compare_be256(const unsigned char *a, const unsigned char *b) {
+    int result = 0;
+    for (int i = 0; i < 32; i++) {
+        int diff = (int)a[i] - (int)b[i];
+        // Keep the first difference: only taken while result is still 0
+        result |= diff & ~((result | -result) >> 31);
+    }
+    return result;
+}
+
+int sigv4a_derive_private_key(const char *access_key, const char *secret_key, unsigned char *private_key) {
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    size_t access_len = strlen(access_key);
+    size_t secret_len = strlen(secret_key);
+    if (!cc || access_len >= MAX_ENV_VAR_LEN || secret_len >= MAX_ENV_VAR_LEN) {
+        return -1;
+    }
+    // i (always 1) || label || 0x00 || access key || counter || L (256)
+    unsigned char input[4 + sizeof(SIGV4A_LABEL) + MAX_ENV_VAR_LEN + 1 + 4];
+    char hmac_key[5 + MAX_ENV_VAR_LEN];
+    memcpy(hmac_key, "AWS4A", 5);
+    memcpy(hmac_key + 5, secret_key, secret_len);
+    unsigned char *p = input;
+    memcpy(p, "\x00\x00\x00\x01", 4);
+    p += 4;
+    memcpy(p, SIGV4A_LABEL, sizeof(SIGV4A_LABEL));      // with its NUL as the separator
+    p += sizeof(SIGV4A_LABEL);
+    memcpy(p, access_key, access_len);
+    p += access_len;
+    unsigned char *counter = p++;
+    memcpy(p, "\x00\x00\x01\x00", 4);
+    p += 4;
+
+    int rc = -1;
+    for (int c = 1; c <= SIGV4A_MAX_COUNTER && rc != 0; c++) {
+        *counter = (unsigned char)c;
+        if (crypto_hmac(cc, hmac_key, 5 + secret_len, input, (size_t)(p - input), private_key) != 0) {
+            break;
+        }
+        if (compare_be256(private_key, p256_n_minus_2) <= 0) {
+            // k0 + 1, with the carry rippling up
+            unsigned int carry = 1;
+            for (int i = 31; i >= 0; i--) {
+                carry += private_key[i];
+                private_key[i] = (unsigned char)carry;
+                carry >>= 8;
+            }
+            rc = 0;
+        }
+    }
+    memset(hmac_key, 0, sizeof(hmac_key));
+    if (rc != 0) {
+        memset(private_key, 0, 32);
+    }
+    return rc;
+}
+
+#ifdef USE_OPENSSL
+// The public point d * G, uncompressed.
+static int p256_public_point(const BIGNUM *d, unsigned char *point) {
+    EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_POINT *q = group ? EC_POINT_new(group) : NULL;
+    int ok = q && EC_POINT_mul(group, q, d, NULL, NULL, NULL) &&
+             EC_POINT_point2oct(group, q, POINT_CONVERSION_UNCOMPRESSED, point, 65, NULL) == 65;
+    EC_POINT_free(q);
+    EC_GROUP_free(group);
+    return ok ? 0 : -1;
+}
+
+static EVP_PKEY *p256_pkey(const BIGNUM *d, const unsigned char *point) {
+    EVP_PKEY *pkey = NULL;
+#ifdef CRYPTO_OPENSSL3
+    OSSL_PARAM_BLD *build = OSSL_PARAM_BLD_new();
+    OSSL_PARAM *params = NULL;
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL);
+    if (!build || !pctx ||
+        !OSSL_PARAM_BLD_push_utf8_string(build, OSSL_PKEY_PARAM_GROUP_NAME, "prime256v1", 0) ||
+        !OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_PRIV_KEY, d) ||
+        !OSSL_PARAM_BLD_push_octet_string(build, OSSL_PKEY_PARAM_PUB_KEY, point, 65) ||
+        (params = OSSL_PARAM_BLD_to_param(build)) == NULL || EVP_PKEY_fromdata_init(pctx) <= 0 ||
+        EVP_PKEY_fromdata(pctx, &pkey, EVP_PKEY_KEYPAIR, params) <= 0) {
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(build);
+    EVP_PKEY_CTX_free(pctx);
+#else
+    EC_KEY *ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_POINT *q = ec ? EC_POINT_new(EC_KEY_get0_group(ec)) : NULL;
+    if (q && EC_POINT_oct2point(EC_KEY_get0_group(ec), q, point, 65, NULL) && EC_KEY_set_private_key(ec, d) &&
+        EC_KEY_set_public_key(ec, q) && (pkey = EVP_PKEY_new()) != NULL && EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+        ec = NULL;
+    } else {
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    EC_POINT_free(q);
+    EC_KEY_free(ec);
+#endif
+    return pkey;
+}
+#endif
+
+ecdsa_key_t *ecdsa_key_derive(const char *access_key, const char *secret_key) {
+#ifdef USE_OPENSSL
+    unsigned char private_key[32];
+    if (sigv4a_derive_private_key(access_key, secret_key, private_key) != 0) {
+        return NULL;
+    }
+    ecdsa_key_t *key = calloc(1, sizeof(*key));
+    BIGNUM *d = key ? BN_bin2bn(private_key, sizeof(private_key), NULL) : NULL;
+    memset(private_key, 0, sizeof(private_key));
+    if (d && p256_public_point(d, key->public_point) == 0) {
+        key->pkey = p256_pkey(d, key->public_point);
+    }
+    BN_clear_free(d);
+    if (key && !key->pkey) {
+        free(key);
+        key = NULL;
+    }
+    return key;
+#else
+    (void)access_key;
+    (void)secret_key;
+    return NULL;
+#endif
+}
+
+void ecdsa_key_free(ecdsa_key_t *key) {
+    if (!key) {
+        return;
+    }
+#ifdef USE_OPENSSL
+    EVP_PKEY_free(key->pkey);
+#endif
+    free(key);
+}
+
+void ecdsa_public_key(const ecdsa_key_t *key, unsigned char *x, unsigned char *y) {
+    memcpy(x, key->public_point + 1, 32);
+    memcpy(y, key->public_point + 33, 32);
+}
+
+int ecdsa_sign(const ecdsa_key_t *key, const unsigned char *digest, unsigned char *der, size_t *der_len) {
+#ifdef USE_OPENSSL
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(key->pkey, NULL);
+    *der_len = ECDSA_SIGNATURE_MAX;
+    int ok = pctx && EVP_PKEY_sign_init(pctx) > 0 && EVP_PKEY_sign(pctx, der, der_len, digest, 32) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+#else
+    (void)key;
+    (void)digest;
+    (void)der;
+    (void)der_len;
+    return -1;
+#endif
+}
+
+int ecdsa_verify(const ecdsa_key_t *key, const unsigned char *digest, const unsigned char *der, size_t der_len) {
+#ifdef USE_OPENSSL
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(key->pkey, NULL);
+    int ok = pctx && EVP_PKEY_verify_init(pctx) > 0 && EVP_PKEY_verify(pctx, der, der_len, digest, 32) == 1;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+#else
+    (void)key;
+    (void)digest;
+    (void)der;
+    (void)der_len;
+    return -1;
+#endif
+}
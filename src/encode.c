@@ -0,0 +1,430 @@
+#include <string.h>
+#include <pthread.h>
+#include "presign_internal.h"
+
+/*
+ * URI encoding and hex formatting for the signer.
+ *
+ * url_encode_bytes() runs on the path and signed header list of every URL
+ * (and once per signer on the access key, scope and session token), and
+ * to_hex() on every digest. Besides
+ * the portable scalar versions there are vector kernels that classify 16
+ * (SSE2, NEON) or 32 (AVX2) bytes at a time: a block of unreserved bytes is
+ * copied with one store, and only the bytes that need escaping go through
+ * the scalar path. The best kernel the CPU supports is picked on first use;
+ * all kernels produce byte-identical output and return the same status.
+ * base64_encode() only runs once per POST policy and has no kernels.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define ENCODE_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define ENCODE_AVX2 1
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define ENCODE_NEON 1
+#include <arm_neon.h>
+#endif
+
+static const char upper_hex[] = "0123456789ABCDEF";
+static const char lower_hex[] = "0123456789abcdef";
+
+// Encodes len bytes of s into d, which has remaining bytes of room, and
+// terminates it; the output started at dest. Shared by the scalar encoder and
+// the tails of the vector kernels, so all of them fail at exactly the same
+// point.
+static int encode_tail(const unsigned char *s, size_t len, char *dest, char *d, size_t remaining, int keep_slash,
+                       size_t *encoded_len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        if ((c >= 'A' && c <= 'Z') ||
+            (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.' || c == '~' ||
+            (keep_slash && c == '/')) {
+            if (remaining <= 1) {
+                return -1;
+            }
+            *d++ = (char)c;
+            remaining--;
+        } else {
+            if (remaining <= 3) {
+                return -1;
+            }
+            *d++ = '%';
+            *d++ = upper_hex[c >> 4];
+            *d++ = upper_hex[c & 0xF];
+            remaining -= 3;
+        }
+    }
+
+    if (remaining == 0) {
+        return -1;
+    }
+
+    *d = '\0';
+    if (encoded_len) {
+        *encoded_len = (size_t)(d - dest);
+    }
+    return 0;
+}
+
+static int url_encode_scalar(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                             size_t *encoded_len) {
+    if (dest_size == 0) {
+        return -1;
+    }
+    return encode_tail((const unsigned char *)src, len, dest, dest, dest_size, keep_slash, encoded_len);
+}
+
+int url_encode_component_scalar(const char *src, char *dest, size_t dest_size, int keep_slash) {
+    return url_encode_scalar(src, strlen(src), dest, dest_size, keep_slash, NULL);
+}
+
+void to_hex_scalar(const unsigned char *data, int len, char *hex) {
+    for (int i = 0; i < len; i++) {
+        hex[i * 2] = lower_hex[(data[i] >> 4) & 0xF];
+        hex[i * 2 + 1] = lower_hex[data[i] & 0xF];
+    }
+    hex[len * 2] = '\0';
+}
+
+#ifdef ENCODE_SSE2
+// Bytes are range-checked with signed compares: adding (0x80 - lo) maps
+// [lo, lo + n) onto [-128, -128 + n).
+static int url_encode_sse2(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                           size_t *encoded_len) {
+    if (dest_size == 0) {
+        return -1;
+    }
+
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0;
+    char *d = dest;
+    size_t remaining = dest_size;
+
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i alpha_bias = _mm_set1_epi8((char)(0x80 - 'a'));
+    const __m128i alpha_limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i digit_bias = _mm_set1_epi8((char)(0x80 - '0'));
+    const __m128i digit_limit = _mm_set1_epi8((char)(-128 + 10));
+    const __m128i dash = _mm_set1_epi8('-');
+    const __m128i underscore = _mm_set1_epi8('_');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i tilde = _mm_set1_epi8('~');
+    const __m128i slash = _mm_set1_epi8(keep_slash ? '/' : '-');
+
+    // Each store writes a full block, so keep more than one block of room.
+    while (len - i >= 16 && remaining > 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i alpha = _mm_cmplt_epi8(_mm_add_epi8(_mm_or_si128(v, case_bit), alpha_bias), alpha_limit);
+        __m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, digit_bias), digit_limit);
+        __m128i punct = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, dash), _mm_cmpeq_epi8(v, underscore)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, dot), _mm_cmpeq_epi8(v, tilde)));
+        punct = _mm_or_si128(punct, _mm_cmpeq_epi8(v, slash));
+        unsigned int escape = ~(unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), punct)) & 0xFFFF;
+
+        _mm_storeu_si128((__m128i *)d, v);
+        if (escape == 0) {
+            d += 16;
+            remaining -= 16;
+            i += 16;
+            continue;
+        }
+
+        unsigned int run = (unsigned int)__builtin_ctz(escape);
+        d += run;
+        remaining -= run;
+        i += run;
+        if (remaining <= 3) {
+            break;
+        }
+        d[0] = '%';
+        d[1] = upper_hex[s[i] >> 4];
+        d[2] = upper_hex[s[i] & 0xF];
+        d += 3;
+        remaining -= 3;
+        i++;
+    }
+
+    return encode_tail(s + i, len - i, dest, d, remaining, keep_slash, encoded_len);
+}
+
+static void to_hex_sse2(const unsigned char *data, int len, char *hex) {
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero_char = _mm_set1_epi8('0');
+    const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble);
+        __m128i lo = _mm_and_si128(v, low_nibble);
+        __m128i first = _mm_unpacklo_epi8(hi, lo);
+        __m128i second = _mm_unpackhi_epi8(hi, lo);
+        first = _mm_add_epi8(_mm_add_epi8(first, zero_char), _mm_and_si128(_mm_cmpgt_epi8(first, nine), letter_gap));
+        second = _mm_add_epi8(_mm_add_epi8(second, zero_char), _mm_and_si128(_mm_cmpgt_epi8(second, nine), letter_gap));
+        _mm_storeu_si128((__m128i *)(hex + i * 2), first);
+        _mm_storeu_si128((__m128i *)(hex + i * 2 + 16), second);
+    }
+
+    to_hex_scalar(data + i, len - i, hex + i * 2);
+}
+#endif
+
+#ifdef ENCODE_AVX2
+__attribute__((target("avx2")))
+static int url_encode_avx2(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                           size_t *encoded_len) {
+    if (dest_size == 0) {
+        return -1;
+    }
+
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0;
+    char *d = dest;
+    size_t remaining = dest_size;
+
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i alpha_bias = _mm256_set1_epi8((char)(0x80 - 'a'));
+    const __m256i alpha_limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i digit_bias = _mm256_set1_epi8((char)(0x80 - '0'));
+    const __m256i digit_limit = _mm256_set1_epi8((char)(-128 + 10));
+    const __m256i dash = _mm256_set1_epi8('-');
+    const __m256i underscore = _mm256_set1_epi8('_');
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i tilde = _mm256_set1_epi8('~');
+    const __m256i slash = _mm256_set1_epi8(keep_slash ? '/' : '-');
+
+    while (len - i >= 32 && remaining > 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i alpha = _mm256_cmpgt_epi8(alpha_limit, _mm256_add_epi8(_mm256_or_si256(v, case_bit), alpha_bias));
+        __m256i digit = _mm256_cmpgt_epi8(digit_limit, _mm256_add_epi8(v, digit_bias));
+        __m256i punct = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, dash), _mm256_cmpeq_epi8(v, underscore)),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, dot), _mm256_cmpeq_epi8(v, tilde)));
+        punct = _mm256_or_si256(punct, _mm256_cmpeq_epi8(v, slash));
+        unsigned int escape = ~(unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), punct));
+
+        _mm256_storeu_si256((__m256i *)d, v);
+        if (escape == 0) {
+            d += 32;
+            remaining -= 32;
+            i += 32;
+            continue;
+        }
+
+        unsigned int run = (unsigned int)__builtin_ctz(escape);
+        d += run;
+        remaining -= run;
+        i += run;
+        if (remaining <= 3) {
+            break;
+        }
+        d[0] = '%';
+        d[1] = upper_hex[s[i] >> 4];
+        d[2] = upper_hex[s[i] & 0xF];
+        d += 3;
+        remaining -= 3;
+        i++;
+    }
+
+    return encode_tail(s + i, len - i, dest, d, remaining, keep_slash, encoded_len);
+}
+
+// Widening each byte to 16 bits puts its two nibbles next to each other, so
+// 16 input bytes become 32 output characters without crossing lanes.
+__attribute__((target("avx2")))
+static void to_hex_avx2(const unsigned char *data, int len, char *hex) {
+    const __m256i low_nibble = _mm256_set1_epi16(0x0F);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero_char = _mm256_set1_epi8('0');
+    const __m256i letter_gap = _mm256_set1_epi8('a' - '0' - 10);
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + i)));
+        __m256i n = _mm256_or_si256(_mm256_srli_epi16(w, 4), _mm256_slli_epi16(_mm256_and_si256(w, low_nibble), 8));
+        n = _mm256_add_epi8(_mm256_add_epi8(n, zero_char), _mm256_and_si256(_mm256_cmpgt_epi8(n, nine), letter_gap));
+        _mm256_storeu_si256((__m256i *)(hex + i * 2), n);
+    }
+
+    to_hex_scalar(data + i, len - i, hex + i * 2);
+}
+#endif
+
+#ifdef ENCODE_NEON
+static int url_encode_neon(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                           size_t *encoded_len) {
+    if (dest_size == 0) {
+        return -1;
+    }
+
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0;
+    char *d = dest;
+    size_t remaining = dest_size;
+
+    const uint8x16_t case_bit = vdupq_n_u8(0x20);
+    const uint8x16_t slash = vdupq_n_u8(keep_slash ? '/' : '-');
+
+    while (len - i >= 16 && remaining > 16) {
+        uint8x16_t v = vld1q_u8(s + i);
+        uint8x16_t alpha = vcltq_u8(vsubq_u8(vorrq_u8(v, case_bit), vdupq_n_u8('a')), vdupq_n_u8(26));
+        uint8x16_t digit = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+        uint8x16_t punct = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('-')), vceqq_u8(v, vdupq_n_u8('_'))),
+                                    vorrq_u8(vceqq_u8(v, vdupq_n_u8('.')), vceqq_u8(v, vdupq_n_u8('~'))));
+        punct = vorrq_u8(punct, vceqq_u8(v, slash));
+        uint8x16_t escape = vmvnq_u8(vorrq_u8(vorrq_u8(alpha, digit), punct));
+        // Narrowing shift packs the byte mask into 4 bits per byte.
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(escape), 4)), 0);
+
+        vst1q_u8((uint8_t *)d, v);
+        if (bits == 0) {
+            d += 16;
+            remaining -= 16;
+            i += 16;
+            continue;
+        }
+
+        unsigned int run = (unsigned int)__builtin_ctzll(bits) >> 2;
+        d += run;
+        remaining -= run;
+        i += run;
+        if (remaining <= 3) {
+            break;
+        }
+        d[0] = '%';
+        d[1] = upper_hex[s[i] >> 4];
+        d[2] = upper_hex[s[i] & 0xF];
+        d += 3;
+        remaining -= 3;
+        i++;
+    }
+
+    return encode_tail(s + i, len - i, dest, d, remaining, keep_slash, encoded_len);
+}
+
+static void to_hex_neon(const unsigned char *data, int len, char *hex) {
+    const uint8x16_t nine = vdupq_n_u8(9);
+    const uint8x16_t zero_char = vdupq_n_u8('0');
+    const uint8x16_t letter_gap = vdupq_n_u8('a' - '0' - 10);
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16x2_t out;
+        out.val[0] = vshrq_n_u8(v, 4);
+        out.val[1] = vandq_u8(v, vdupq_n_u8(0x0F));
+        out.val[0] = vaddq_u8(vaddq_u8(out.val[0], zero_char), vandq_u8(vcgtq_u8(out.val[0], nine), letter_gap));
+        out.val[1] = vaddq_u8(vaddq_u8(out.val[1], zero_char), vandq_u8(vcgtq_u8(out.val[1], nine), letter_gap));
+        vst2q_u8((uint8_t *)(hex + i * 2), out);
+    }
+
+    to_hex_scalar(data + i, len - i, hex + i * 2);
+}
+#endif
+
+typedef struct {
+    const char *name;
+    int (*url_encode)(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                      size_t *encoded_len);
+    void (*to_hex)(const unsigned char *data, int len, char *hex);
+    int (*supported)(void);
+} encode_kernel_t;
+
+static int always_supported(void) {
+    return 1;
+}
+
+#ifdef ENCODE_AVX2
+static int avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// In order of preference.
+static const encode_kernel_t encode_kernels[] = {
+#ifdef ENCODE_AVX2
+    {"avx2", url_encode_avx2, to_hex_avx2, avx2_supported},
+#endif
+#ifdef ENCODE_SSE2
+    {"sse2", url_encode_sse2, to_hex_sse2, always_supported},
+#endif
+#ifdef ENCODE_NEON
+    {"neon", url_encode_neon, to_hex_neon, always_supported},
+#endif
+    {"scalar", url_encode_scalar, to_hex_scalar, always_supported},
+};
+
+#define ENCODE_KERNEL_COUNT (sizeof(encode_kernels) / sizeof(encode_kernels[0]))
+
+static const encode_kernel_t *active_kernel = &encode_kernels[ENCODE_KERNEL_COUNT - 1];
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_best_kernel(void) {
+    for (size_t i = 0; i < ENCODE_KERNEL_COUNT; i++) {
+        if (encode_kernels[i].supported()) {
+            active_kernel = &encode_kernels[i];
+            return;
+        }
+    }
+}
+
+int url_encode_bytes(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                     size_t *encoded_len) {
+    pthread_once(&kernel_once, select_best_kernel);
+    return active_kernel->url_encode(src, len, dest, dest_size, keep_slash, encoded_len);
+}
+
+int url_encode_component(const char *src, char *dest, size_t dest_size, int keep_slash) {
+    return url_encode_bytes(src, strlen(src), dest, dest_size, keep_slash, NULL);
+}
+
+void to_hex(const unsigned char *data, int len, char *hex) {
+    pthread_once(&kernel_once, select_best_kernel);
+    active_kernel->to_hex(data, len, hex);
+}
+
+const char *encode_kernel_name(void) {
+    pthread_once(&kernel_once, select_best_kernel);
+    return active_kernel->name;
+}
+
+int encode_select_kernel(const char *name) {
+    pthread_once(&kernel_once, select_best_kernel);
+    for (size_t i = 0; i < ENCODE_KERNEL_COUNT; i++) {
+        if (strcmp(encode_kernels[i].name, name) == 0) {
+            if (!encode_kernels[i].supported()) {
+                return -1;
+            }
+            active_kernel = &encode_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// One policy document per form, so a plain table lookup is enough here.
+size_t base64_encode(const void *src, size_t len, char *dest) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *s = src;
+    char *d = dest;
+    for (; len >= 3; s += 3, len -= 3) {
+        *d++ = alphabet[s[0] >> 2];
+        *d++ = alphabet[((s[0] & 0x03) << 4) | (s[1] >> 4)];
+        *d++ = alphabet[((s[1] & 0x0f) << 2) | (s[2] >> 6)];
+        *d++ = alphabet[s[2] & 0x3f];
+    }
+    if (len > 0) {
+        *d++ = alphabet[s[0] >> 2];
+        *d++ = alphabet[((s[0] & 0x03) << 4) | (len > 1 ? s[1] >> 4 : 0)];
+        *d++ = len > 1 ? alphabet[(s[1] & 0x0f) << 2] : '=';
+        *d++ = '=';
+    }
+    *d = '\0';
+    return (size_t)(d - dest);
+}
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "presign.h"
+#include "presign_internal.h"
+
+/*
+ * Process-wide table of derived signing keys.
+ *
+ * A SigV4 signing key depends on the secret, the UTC date, the region and
+ * the service, so it is good for a whole day. Signers with the same
+ * credential, region and service share one slot, however many presign_ctx_t
+ * the process creates, and a slot holds the keys of its most recent dates:
+ * today's, tomorrow's once pre-warmed, and the week before, which verifying
+ * URLs signed up to PRESIGN_MAX_EXPIRES ago needs.
+ *
+ * Keys are derived without any lock held and published by swapping a
+ * pointer under the slot's write lock; signers only take the read lock to
+ * copy a key's midstates. The first signature within KEY_PREWARM_WINDOW
+ * seconds of 00:00 UTC derives the next day's key, so the date change does
+ * not stall every signing thread on a derivation at once.
+ *
+ * A SigV4A key only depends on the credential, and deriving it costs a
+ * scalar multiplication, so a slot derives it on first use and keeps it for
+ * as long as the slot lives. It is never replaced, so signers use it
+ * without holding the lock.
+ */
+
+#define KEY_TABLE_BUCKETS 64
+#define KEY_PREWARM_WINDOW (10 * 60)
+#define SECONDS_PER_DAY 86400
+#define SLOT_KEYS 9
+
+typedef struct {
+    char date_stamp[9];
+    unsigned char key[32];
+    hmac_sha256_key_t mac_key;
+    uint32_t inner_state[8];              // raw midstates for the multi-buffer engine
+    uint32_t outer_state[8];
+} signing_key_t;
+
+struct key_slot {
+    key_slot_t *next;
+    unsigned long hash;
+    int refs;
+    // "access key\0secret\0region\0service\0"
+    char *identity;
+    size_t identity_len;
+    const char *secret_key;
+    const char *region;
+    const char *service;
+    pthread_rwlock_t lock;
+    signing_key_t *keys[SLOT_KEYS];      // newest date first
+    ecdsa_key_t *ecdsa;                  // SigV4A key, NULL until first used
+    int prewarming;
+};
+
+static key_slot_t *buckets[KEY_TABLE_BUCKETS];
+static size_t slot_count;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Updated with relaxed atomics from every signing thread.
+static unsigned long long key_hits;
+static unsigned long long key_misses;
+static unsigned long long key_prewarms;
+
+static void count(unsigned long long *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long hash_identity(const char *data, size_t len) {
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+static void free_key(signing_key_t *key) {
+    if (key) {
+        hmac_sha256_key_clear(&key->mac_key);
+        memset(key, 0, sizeof(*key));
+        free(key);
+    }
+}
+
+// Derives the key for date_stamp with no lock held.
+static signing_key_t *derive_key(const key_slot_t *slot, const char *date_stamp) {
+    signing_key_t *key = calloc(1, sizeof(*key));
+    if (!key) {
+        return NULL;
+    }
+    memcpy(key->date_stamp, date_stamp, 8);
+    if (derive_signing_key(slot->secret_key, key->date_stamp, slot->region, slot->service, key->key) != 0 ||
+        hmac_sha256_key_init(&key->mac_key, key->key, sizeof(key->key)) != 0) {
+        free_key(key);
+        return NULL;
+    }
+
+    unsigned char pad[64];
+    memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < sizeof(key->key); i++) {
+        pad[i] ^= key->key[i];
+    }
+    sha256_midstate(pad, key->inner_state);
+    memset(pad, 0x5c, sizeof(pad));
+    for (size_t i = 0; i < sizeof(key->key); i++) {
+        pad[i] ^= key->key[i];
+    }
+    sha256_midstate(pad, key->outer_state);
+    memset(pad, 0, sizeof(pad));
+    return key;
+}
+
+// Called with the slot lock held.
+static signing_key_t *find_key(const key_slot_t *slot, const char *date_stamp) {
+    for (int i = 0; i < SLOT_KEYS; i++) {
+        if (slot->keys[i] && memcmp(slot->keys[i]->date_stamp, date_stamp, 8) == 0) {
+            return slot->keys[i];
+        }
+    }
+    return NULL;
+}
+
+// Inserts key by date under the write lock and returns the key for its date
+// that is now in the slot. *unused receives whatever the caller has to free
+// after unlocking: key itself when another thread got there first or when it
+// is older than every kept date (it is still returned for one use), or the
+// key that dropped out.
+static signing_key_t *install_key(key_slot_t *slot, signing_key_t *key, signing_key_t **unused) {
+    signing_key_t *existing = find_key(slot, key->date_stamp);
+    if (existing) {
+        *unused = key;
+        return existing;
+    }
+    int position = 0;
+    while (position < SLOT_KEYS && slot->keys[position] &&
+           memcmp(slot->keys[position]->date_stamp, key->date_stamp, 8) > 0) {
+        position++;
+    }
+    if (position == SLOT_KEYS) {
+        *unused = key;
+        return key;
+    }
+    *unused = slot->keys[SLOT_KEYS - 1];
+    for (int i = SLOT_KEYS - 1; i > position; i--) {
+        slot->keys[i] = slot->keys[i - 1];
+    }
+    slot->keys[position] = key;
+    return key;
+}
+
+// Where a signer wants the key: backend streams or raw midstates.
+typedef struct {
+    sha256_stream_t *inner;
+    sha256_stream_t *outer;
+    uint32_t *inner_state;
+    uint32_t *outer_state;
+} key_copy_t;
+
+static int copy_key(const signing_key_t *key, const key_copy_t *copy) {
+    if (copy->inner) {
+        return hmac_sha256_begin(&key->mac_key, copy->inner, copy->outer) == 0 ? PRESIGN_OK : PRESIGN_ERR_CRYPTO;
+    }
+    memcpy(copy->inner_state, key->inner_state, sizeof(key->inner_state));
+    memcpy(copy->outer_state, key->outer_state, sizeof(key->outer_state));
+    return PRESIGN_OK;
+}
+
+static void format_date_stamp(time_t when, char *date_stamp) {
+    struct tm utc_tm;
+    gmtime_r(&when, &utc_tm);
+    strftime(date_stamp, 9, "%Y%m%d", &utc_tm);
+}
+
+// Derives and installs the key for the day of when unless it is there.
+static int warm_date(key_slot_t *slot, const char *date_stamp) {
+    pthread_rwlock_rdlock(&slot->lock);
+    int present = find_key(slot, date_stamp) != NULL;
+    pthread_rwlock_unlock(&slot->lock);
+    if (present) {
+        return PRESIGN_OK;
+    }
+    signing_key_t *key = derive_key(slot, date_stamp);
+    if (!key) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    signing_key_t *unused = NULL;
+    pthread_rwlock_wrlock(&slot->lock);
+    install_key(slot, key, &unused);
+    pthread_rwlock_unlock(&slot->lock);
+    free_key(unused);
+    count(&key_prewarms);
+    return PRESIGN_OK;
+}
+
+// Close to midnight, one signer derives the next day's key for everyone.
+static void maybe_prewarm(key_slot_t *slot, time_t now) {
+    long into_day = (long)(now % SECONDS_PER_DAY);
+    if (into_day < 0) {
+        into_day += SECONDS_PER_DAY;
+    }
+    long left = SECONDS_PER_DAY - into_day;
+    if (left > KEY_PREWARM_WINDOW || __atomic_exchange_n(&slot->prewarming, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    char next[9];
+    format_date_stamp(now + left, next);
+    warm_date(slot, next);
+    __atomic_store_n(&slot->prewarming, 0, __ATOMIC_RELEASE);
+}
+
+static int use_key(key_slot_t *slot, time_t now, const char *date_stamp, const key_copy_t *copy) {
+    pthread_rwlock_rdlock(&slot->lock);
+    signing_key_t *key = find_key(slot, date_stamp);
+    int newest = key && key == slot->keys[0];
+    int status = key ? copy_key(key, copy) : PRESIGN_OK;
+    pthread_rwlock_unlock(&slot->lock);
+    if (key) {
+        count(&key_hits);
+        if (newest) {
+            maybe_prewarm(slot, now);
+        }
+        return status;
+    }
+
+    count(&key_misses);
+    signing_key_t *fresh = derive_key(slot, date_stamp);
+    if (!fresh) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    signing_key_t *unused = NULL;
+    pthread_rwlock_wrlock(&slot->lock);
+    key = install_key(slot, fresh, &unused);
+    status = copy_key(key, copy);
+    newest = key == slot->keys[0];
+    pthread_rwlock_unlock(&slot->lock);
+    free_key(unused);
+    if (newest) {
+        maybe_prewarm(slot, now);
+    }
+    return status;
+}
+
+int key_table_begin(key_slot_t *slot, time_t now, const char *date_stamp,
+                    sha256_stream_t *inner, sha256_stream_t *outer) {
+    key_copy_t copy = {inner, outer, NULL, NULL};
+    return use_key(slot, now, date_stamp, &copy);
+}
+
+int key_table_midstates(key_slot_t *slot, time_t now, const char *date_stamp,
+                        uint32_t *inner_state, uint32_t *outer_state) {
+    key_copy_t copy = {NULL, NULL, inner_state, outer_state};
+    return use_key(slot, now, date_stamp, &copy);
+}
+
+int key_table_prewarm(key_slot_t *slot, time_t when) {
+    char date_stamp[9];
+    format_date_stamp(when, date_stamp);
+    return warm_date(slot, date_stamp);
+}
+
+int key_table_ecdsa(key_slot_t *slot, const ecdsa_key_t **key) {
+    pthread_rwlock_rdlock(&slot->lock);
+    *key = slot->ecdsa;
+    pthread_rwlock_unlock(&slot->lock);
+    if (*key) {
+        count(&key_hits);
+        return PRESIGN_OK;
+    }
+
+    count(&key_misses);
+    // identity starts with the access key, then the secret
+    ecdsa_key_t *fresh = ecdsa_key_derive(slot->identity, slot->secret_key);
+    if (!fresh) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    pthread_rwlock_wrlock(&slot->lock);
+    if (!slot->ecdsa) {
+        slot->ecdsa = fresh;
+        fresh = NULL;
+    }
+    *key = slot->ecdsa;
+    pthread_rwlock_unlock(&slot->lock);
+    ecdsa_key_free(fresh);
+    return PRESIGN_OK;
+}
+
+key_slot_t *key_table_acquire(const char *access_key, const char *secret_key, const char *region,
+                              const char *service) {
+    size_t access_len = strlen(access_key) + 1;
+    size_t secret_len = strlen(secret_key) + 1;
+    size_t region_len = strlen(region) + 1;
+    size_t service_len = strlen(service) + 1;
+    size_t identity_len = access_len + secret_len + region_len + service_len;
+    char *identity = malloc(identity_len);
+    if (!identity) {
+        return NULL;
+    }
+    memcpy(identity, access_key, access_len);
+    memcpy(identity + access_len, secret_key, secret_len);
+    memcpy(identity + access_len + secret_len, region, region_len);
+    memcpy(identity + access_len + secret_len + region_len, service, service_len);
+    unsigned long hash = hash_identity(identity, identity_len);
+
+    pthread_mutex_lock(&table_lock);
+    key_slot_t **bucket = &buckets[hash % KEY_TABLE_BUCKETS];
+    key_slot_t *slot = *bucket;
+    while (slot && !(slot->hash == hash && slot->identity_len == identity_len &&
+                     memcmp(slot->identity, identity, identity_len) == 0)) {
+        slot = slot->next;
+    }
+    if (slot) {
+        slot->refs++;
+        memset(identity, 0, identity_len);
+        free(identity);
+    } else if ((slot = calloc(1, sizeof(*slot))) != NULL) {
+        if (pthread_rwlock_init(&slot->lock, NULL) != 0) {
+            free(slot);
+            slot = NULL;
+        } else {
+            slot->hash = hash;
+            slot->refs = 1;
+            slot->identity = identity;
+            slot->identity_len = identity_len;
+            slot->secret_key = identity + access_len;
+            slot->region = slot->secret_key + secret_len;
+            slot->service = slot->region + region_len;
+            slot->next = *bucket;
+            *bucket = slot;
+            slot_count++;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    if (!slot) {
+        memset(identity, 0, identity_len);
+        free(identity);
+    }
+    return slot;
+}
+
+void key_table_release(key_slot_t *slot) {
+    if (!slot) {
+        return;
+    }
+    pthread_mutex_lock(&table_lock);
+    int last = --slot->refs == 0;
+    if (last) {
+        key_slot_t **link = &buckets[slot->hash % KEY_TABLE_BUCKETS];
+        while (*link != slot) {
+            link = &(*link)->next;
+        }
+        *link = slot->next;
+        slot_count--;
+    }
+    pthread_mutex_unlock(&table_lock);
+    if (!last) {
+        return;
+    }
+    for (int i = 0; i < SLOT_KEYS; i++) {
+        free_key(slot->keys[i]);
+    }
+    ecdsa_key_free(slot->ecdsa);
+    pthread_rwlock_destroy(&slot->lock);
+    // Do not leave the secret behind in freed memory
+    memset(slot->identity, 0, slot->identity_len);
+    free(slot->identity);
+    free(slot);
+}
+
+void presign_key_stats(presign_key_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+    stats->hits = __atomic_load_n(&key_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&key_misses, __ATOMIC_RELAXED);
+    stats->prewarms = __atomic_load_n(&key_prewarms, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&table_lock);
+    stats->slots = slot_count;
+    pthread_mutex_unlock(&table_lock);
+}
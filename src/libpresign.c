@@ -0,0 +1,2301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "presign.h"
+#include "presign_internal.h"
+
+#define MAX_REGION_LEN 64
+#define MAX_SERVICE_LEN 16
+#define MAX_METHOD_LEN 16
+#define MAX_HOST_LEN 256
+#define DATE_STAMP_LEN 8                // YYYYMMDD
+#define DATETIME_LEN 16                 // YYYYMMDDTHHMMSSZ
+// "/<region>/<service>/aws4_request"
+#define MAX_SCOPE_SUFFIX_LEN (MAX_REGION_LEN + MAX_SERVICE_LEN + sizeof("/aws4_request"))
+#define MAX_REGION_SET_LEN 512
+// Hex digits of an HMAC signature, and the most an ECDSA one can take
+#define HMAC_SIGNATURE_HEX_LEN 64
+#define MAX_SIGNATURE_HEX_LEN (2 * ECDSA_SIGNATURE_MAX)
+
+#define LITERAL_LEN(s) (sizeof(s) - 1)
+
+// The X-Amz-* query parameters in canonical (byte) order; the request's
+// own parameters are merged in between. Each one starts with its '&'.
+static const char ALGORITHM_PARAM[] = "&X-Amz-Algorithm=AWS4-HMAC-SHA256";
+static const char CREDENTIAL_PARAM[] = "&X-Amz-Credential=";
+static const char DATE_PARAM[] = "&X-Amz-Date=";
+static const char EXPIRES_PARAM[] = "&X-Amz-Expires=";
+static const char REGION_SET_PARAM[] = "&X-Amz-Region-Set=";
+static const char TOKEN_PARAM[] = "&X-Amz-Security-Token=";
+static const char SIGNED_HEADERS_PARAM[] = "&X-Amz-SignedHeaders=";
+static const char SIGNATURE_PARAM[] = "&X-Amz-Signature=";
+enum {
+    PARAM_ALGORITHM, PARAM_CREDENTIAL, PARAM_DATE, PARAM_EXPIRES, PARAM_REGION_SET, PARAM_TOKEN, PARAM_SIGNED_HEADERS,
+    FIXED_PARAMS
+};
+static const char *const FIXED_PARAM_NAMES[FIXED_PARAMS] = {
+    "X-Amz-Algorithm", "X-Amz-Credential", "X-Amz-Date", "X-Amz-Expires", "X-Amz-Region-Set", "X-Amz-Security-Token",
+    "X-Amz-SignedHeaders",
+};
+static const char ALGORITHM_LINE[] = "AWS4-HMAC-SHA256\n";
+static const char SIGV4A_ALGORITHM_PARAM[] = "&X-Amz-Algorithm=AWS4-ECDSA-P256-SHA256";
+static const char SIGV4A_ALGORITHM_LINE[] = "AWS4-ECDSA-P256-SHA256\n";
+static const char PAYLOAD_LINE[] = "\nUNSIGNED-PAYLOAD";
+static const char CONTENT_SHA256_HEADER[] = "x-amz-content-sha256";
+static const char CHUNK_ALGORITHM_LINE[] = "AWS4-HMAC-SHA256-PAYLOAD\n";
+static const char CHUNK_SIGNATURE[] = ";chunk-signature=";
+// SHA-256 of the empty string, the hash of the (absent) chunk headers
+static const char EMPTY_SHA256[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+#define PAYLOAD_HASH_LEN 64
+
+struct presign_ctx {
+    char access_key[MAX_ENV_VAR_LEN];
+    char region[MAX_REGION_LEN];
+    char service[MAX_SERVICE_LEN];
+    char endpoint[MAX_URL_LEN];
+    size_t endpoint_len;
+    char host[MAX_HOST_LEN];
+    size_t host_len;
+    // Query and scope pieces that only depend on the signer, encoded once:
+    // "<access key>%2F" goes before the date in X-Amz-Credential and the
+    // scope suffix after it (raw in the string to sign, encoded in the query).
+    // token_param is empty without a session token.
+    char credential_prefix[MAX_ENV_VAR_LEN * 3 + 3];
+    size_t credential_prefix_len;
+    char scope_suffix[MAX_SCOPE_SUFFIX_LEN];
+    size_t scope_suffix_len;
+    char scope_suffix_encoded[MAX_SCOPE_SUFFIX_LEN * 3];
+    size_t scope_suffix_encoded_len;
+    char token_param[LITERAL_LEN(TOKEN_PARAM) + MAX_ENV_VAR_LEN * 3];
+    size_t token_param_len;
+    char session_token[MAX_ENV_VAR_LEN];    // raw, for POST policies
+    // SigV4A: the algorithm differs, the scope suffix has no region and
+    // region_set_param ("&X-Amz-Region-Set=...", empty for SigV4) joins
+    // the fixed parameters.
+    int sigv4a;
+    str_view_t algorithm_param;
+    str_view_t algorithm_line;
+    char region_set_param[LITERAL_LEN(REGION_SET_PARAM) + MAX_REGION_SET_LEN * 3];
+    size_t region_set_param_len;
+    FILE *debug;
+    key_slot_t *keys;                   // shared with signers of the same credential and scope
+};
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} header_view_t;
+
+// "&name=value" of one request query parameter, encoded.
+typedef struct {
+    str_view_t text;
+    size_t name_len;
+} param_view_t;
+
+const char *presign_strerror(int status) {
+    switch (status) {
+    case PRESIGN_OK:                         return "Success";
+    case PRESIGN_ERR_INVALID_ARGUMENT:       return "Invalid argument";
+    case PRESIGN_ERR_OUT_OF_MEMORY:          return "Out of memory";
+    case PRESIGN_ERR_MISSING_CREDENTIALS:    return "Access key and secret key must be set";
+    case PRESIGN_ERR_ACCESS_KEY_TOO_LONG:    return "Access key too long (max 511 chars)";
+    case PRESIGN_ERR_ACCESS_KEY_INVALID:     return "Access key contains invalid characters";
+    case PRESIGN_ERR_SECRET_KEY_INVALID:     return "Secret key invalid length (1-511 chars)";
+    case PRESIGN_ERR_SESSION_TOKEN_TOO_LONG: return "Session token too long (max 511 chars)";
+    case PRESIGN_ERR_REGION_INVALID:         return "Region name missing or too long (max 63 chars), or invalid region set";
+    case PRESIGN_ERR_SERVICE_INVALID:        return "Service name missing or too long (max 15 chars)";
+    case PRESIGN_ERR_ENDPOINT_INVALID:       return "Invalid bucket URL format";
+    case PRESIGN_ERR_HOST_TOO_LONG:          return "Bucket host too long (max 255 chars)";
+    case PRESIGN_ERR_METHOD_INVALID:         return "Invalid HTTP method";
+    case PRESIGN_ERR_EXPIRES_INVALID:        return "Expiry must be between 1 second and 7 days";
+    case PRESIGN_ERR_TIME_INVALID:           return "Invalid time. Use YYYY-MM-DDTHH:MM:SSZ";
+    case PRESIGN_ERR_PATH_TOO_LONG:          return "Encoded PATH exceeds maximum length";
+    case PRESIGN_ERR_HEADER_INVALID:         return "Invalid header name or value";
+    case PRESIGN_ERR_TOO_MANY_HEADERS:       return "Too many headers (max 32)";
+    case PRESIGN_ERR_HEADERS_TOO_LONG:       return "Too many/large headers - canonical headers buffer overflow";
+    case PRESIGN_ERR_QUERY_TOO_LONG:         return "Query parameters too long";
+    case PRESIGN_ERR_BUFFER_TOO_SMALL:       return "Output buffer too small";
+    case PRESIGN_ERR_CRYPTO:                 return "Crypto backend failure";
+    case PRESIGN_ERR_PAYLOAD_HASH_INVALID:   return "Payload hash must be 64 lowercase hex digits or STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+    case PRESIGN_ERR_PAYLOAD_FILE:           return "Cannot read payload file";
+    case PRESIGN_ERR_PARAM_INVALID:          return "Invalid or reserved query parameter name";
+    case PRESIGN_ERR_PART_INVALID:           return "Part numbers must be between 1 and 10000 with an upload ID";
+    case PRESIGN_ERR_RANGE_INVALID:          return "Ranges must split a non-empty object into at most 10000 pieces";
+    case PRESIGN_ERR_URL_INVALID:            return "Malformed presigned URL";
+    case PRESIGN_ERR_CREDENTIAL_MISMATCH:    return "URL credential, token or host is not this signer's";
+    case PRESIGN_ERR_EXPIRED:                return "Presigned URL has expired or is not valid yet";
+    case PRESIGN_ERR_SIGNATURE_MISMATCH:     return "Signature does not match";
+    case PRESIGN_ERR_POLICY_INVALID:         return "Invalid POST policy bucket, key prefix, content type or length range";
+    case PRESIGN_ERR_SIGV4A_UNSUPPORTED:     return "Not supported with SigV4A (a region set) or by this crypto backend";
+    default:                                 return "Unknown error";
+    }
+}
+
+int presign_parse_timestamp(const char *text, time_t *out) {
+    struct tm tm_value = {0};
+    if (!text || !out || strptime(text, "%Y-%m-%dT%H:%M:%SZ", &tm_value) == NULL) {
+        return PRESIGN_ERR_TIME_INVALID;
+    }
+
+    #ifdef _WIN32
+        time_t value = _mkgmtime(&tm_value);
+    #else
+        time_t value = timegm(&tm_value);
+    #endif
+
+    if (value == (time_t)-1) {
+        return PRESIGN_ERR_TIME_INVALID;
+    }
+    *out = value;
+    return PRESIGN_OK;
+}
+
+static int copy_bounded(char *dest, size_t dest_size, const char *src) {
+    size_t len = strlen(src);
+    if (len >= dest_size) {
+        return -1;
+    }
+    memcpy(dest, src, len + 1);
+    return 0;
+}
+
+int presign_ctx_new(const presign_config_t *config, presign_ctx_t **ctx_out) {
+    if (!config || !ctx_out) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    *ctx_out = NULL;
+
+    if (!config->access_key || !config->secret_key) {
+        return PRESIGN_ERR_MISSING_CREDENTIALS;
+    }
+    if (strlen(config->access_key) >= MAX_ENV_VAR_LEN) {
+        return PRESIGN_ERR_ACCESS_KEY_TOO_LONG;
+    }
+    // Validate access key doesn't contain format specifiers
+    if (strchr(config->access_key, '%') != NULL) {
+        return PRESIGN_ERR_ACCESS_KEY_INVALID;
+    }
+    size_t secret_len = strlen(config->secret_key);
+    if (secret_len == 0 || secret_len >= MAX_ENV_VAR_LEN) {
+        return PRESIGN_ERR_SECRET_KEY_INVALID;
+    }
+    if (config->session_token && strlen(config->session_token) >= MAX_ENV_VAR_LEN) {
+        return PRESIGN_ERR_SESSION_TOKEN_TOO_LONG;
+    }
+    // A region set replaces the region: lowercase names, digits, '-', ','
+    // and '*'
+    if (config->region_set) {
+        size_t set_len = strlen(config->region_set);
+        if (set_len == 0 || set_len >= MAX_REGION_SET_LEN ||
+            strspn(config->region_set, "abcdefghijklmnopqrstuvwxyz0123456789-,*") != set_len) {
+            return PRESIGN_ERR_REGION_INVALID;
+        }
+        if (!ecdsa_supported()) {
+            return PRESIGN_ERR_SIGV4A_UNSUPPORTED;
+        }
+    } else if (!config->region || strlen(config->region) >= MAX_REGION_LEN) {
+        return PRESIGN_ERR_REGION_INVALID;
+    }
+    const char *service = config->service ? config->service : "s3";
+    if (service[0] == '\0' || strlen(service) >= MAX_SERVICE_LEN) {
+        return PRESIGN_ERR_SERVICE_INVALID;
+    }
+    if (!config->endpoint || strlen(config->endpoint) >= MAX_URL_LEN) {
+        return PRESIGN_ERR_ENDPOINT_INVALID;
+    }
+
+    presign_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+
+    copy_bounded(ctx->access_key, sizeof(ctx->access_key), config->access_key);
+    if (!config->region_set) {
+        copy_bounded(ctx->region, sizeof(ctx->region), config->region);
+    }
+    copy_bounded(ctx->service, sizeof(ctx->service), service);
+    for (size_t i = 0; ctx->service[i]; i++) {
+        ctx->service[i] = (char)tolower((unsigned char)ctx->service[i]);
+    }
+
+    // The buffers hold three times their (already checked) inputs, so the
+    // encoders cannot run out of room.
+    size_t access_key_len = strlen(ctx->access_key);
+    url_encode_bytes(ctx->access_key, access_key_len, ctx->credential_prefix, sizeof(ctx->credential_prefix) - 3, 0,
+                     &ctx->credential_prefix_len);
+    memcpy(ctx->credential_prefix + ctx->credential_prefix_len, "%2F", 4);
+    ctx->credential_prefix_len += 3;
+
+    ctx->algorithm_param = (str_view_t){ALGORITHM_PARAM, LITERAL_LEN(ALGORITHM_PARAM)};
+    ctx->algorithm_line = (str_view_t){ALGORITHM_LINE, LITERAL_LEN(ALGORITHM_LINE)};
+    if (config->region_set) {
+        ctx->sigv4a = 1;
+        ctx->algorithm_param = (str_view_t){SIGV4A_ALGORITHM_PARAM, LITERAL_LEN(SIGV4A_ALGORITHM_PARAM)};
+        ctx->algorithm_line = (str_view_t){SIGV4A_ALGORITHM_LINE, LITERAL_LEN(SIGV4A_ALGORITHM_LINE)};
+        memcpy(ctx->region_set_param, REGION_SET_PARAM, LITERAL_LEN(REGION_SET_PARAM));
+        url_encode_bytes(config->region_set, strlen(config->region_set),
+                         ctx->region_set_param + LITERAL_LEN(REGION_SET_PARAM),
+                         sizeof(ctx->region_set_param) - LITERAL_LEN(REGION_SET_PARAM), 0, &ctx->region_set_param_len);
+        ctx->region_set_param_len += LITERAL_LEN(REGION_SET_PARAM);
+        ctx->scope_suffix_len = (size_t)snprintf(ctx->scope_suffix, sizeof(ctx->scope_suffix), "/%s/aws4_request",
+                                                 ctx->service);
+    } else {
+        ctx->scope_suffix_len = (size_t)snprintf(ctx->scope_suffix, sizeof(ctx->scope_suffix),
+                                                 "/%s/%s/aws4_request", ctx->region, ctx->service);
+    }
+    url_encode_bytes(ctx->scope_suffix, ctx->scope_suffix_len, ctx->scope_suffix_encoded,
+                     sizeof(ctx->scope_suffix_encoded), 0, &ctx->scope_suffix_encoded_len);
+
+    if (config->session_token) {
+        memcpy(ctx->token_param, TOKEN_PARAM, LITERAL_LEN(TOKEN_PARAM));
+        if (url_encode_bytes(config->session_token, strlen(config->session_token),
+                             ctx->token_param + LITERAL_LEN(TOKEN_PARAM),
+                             sizeof(ctx->token_param) - LITERAL_LEN(TOKEN_PARAM), 0, &ctx->token_param_len) != 0) {
+            free(ctx);
+            return PRESIGN_ERR_SESSION_TOKEN_TOO_LONG;
+        }
+        ctx->token_param_len += LITERAL_LEN(TOKEN_PARAM);
+        copy_bounded(ctx->session_token, sizeof(ctx->session_token), config->session_token);
+    }
+
+    copy_bounded(ctx->endpoint, sizeof(ctx->endpoint), config->endpoint);
+    ctx->endpoint_len = strlen(ctx->endpoint);
+    while (ctx->endpoint_len > 0 && ctx->endpoint[ctx->endpoint_len - 1] == '/') {
+        ctx->endpoint[--ctx->endpoint_len] = '\0';
+    }
+
+    const char *url_start = strstr(ctx->endpoint, "://");
+    if (!url_start) {
+        free(ctx);
+        return PRESIGN_ERR_ENDPOINT_INVALID;
+    }
+    url_start += 3;
+    const char *path_start = strchr(url_start, '/');
+    size_t host_len = path_start ? (size_t)(path_start - url_start) : strlen(url_start);
+    if (host_len >= sizeof(ctx->host)) {
+        free(ctx);
+        return PRESIGN_ERR_HOST_TOO_LONG;
+    }
+    memcpy(ctx->host, url_start, host_len);
+    ctx->host[host_len] = '\0';
+    ctx->host_len = host_len;
+
+    ctx->debug = config->debug;
+    ctx->keys = key_table_acquire(ctx->access_key, config->secret_key, ctx->region, ctx->service);
+    if (!ctx->keys) {
+        free(ctx);
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+
+    *ctx_out = ctx;
+    return PRESIGN_OK;
+}
+
+void presign_ctx_free(presign_ctx_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    key_table_release(ctx->keys);
+    memset(ctx, 0, sizeof(*ctx));
+    free(ctx);
+}
+
+int presign_prewarm(presign_ctx_t *ctx, time_t when) {
+    if (!ctx) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    return key_table_prewarm(ctx->keys, when ? when : time(NULL));
+}
+
+static int compare_header_names(const void *a, const void *b) {
+    const header_view_t *ha = (const header_view_t *)a;
+    const header_view_t *hb = (const header_view_t *)b;
+    size_t len = ha->name_len < hb->name_len ? ha->name_len : hb->name_len;
+    for (size_t i = 0; i < len; i++) {
+        int ca = tolower((unsigned char)ha->name[i]);
+        int cb = tolower((unsigned char)hb->name[i]);
+        if (ca != cb) {
+            return ca - cb;
+        }
+    }
+    return (ha->name_len > hb->name_len) - (ha->name_len < hb->name_len);
+}
+
+// Writes len bytes of src lowercased to dest and returns the end.
+static char *copy_lower(char *dest, const char *src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        dest[i] = (char)tolower((unsigned char)src[i]);
+    }
+    return dest + len;
+}
+
+// Builds the canonical header block and the signed header list. Header names
+// are lowercased and sorted, values trimmed of surrounding whitespace. Both
+// are sized up front and NUL-terminated. A payload hash is signed as the
+// x-amz-content-sha256 header, which the caller may then not set itself.
+int canonicalize_headers(const presign_ctx_t *ctx, const presign_request_t *req, arena_t *arena,
+                         str_view_t *canonical_headers, str_view_t *signed_headers) {
+    if (req->header_count > MAX_HEADERS) {
+        return PRESIGN_ERR_TOO_MANY_HEADERS;
+    }
+    header_view_t *views = arena_alloc(arena, (req->header_count + 2) * sizeof(*views));
+    if (!views) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    views[0].name = "host";
+    views[0].name_len = 4;
+    views[0].value = ctx->host;
+    views[0].value_len = ctx->host_len;
+    size_t total_headers = 1;
+    if (req->payload_hash) {
+        views[1].name = CONTENT_SHA256_HEADER;
+        views[1].name_len = LITERAL_LEN(CONTENT_SHA256_HEADER);
+        views[1].value = req->payload_hash;
+        views[1].value_len = strlen(req->payload_hash);
+        total_headers = 2;
+    }
+
+    for (size_t i = 0; i < req->header_count; i++) {
+        const presign_header_t *header = &req->headers[i];
+        if (!header->name || !header->value) {
+            return PRESIGN_ERR_INVALID_ARGUMENT;
+        }
+
+        size_t name_len = strlen(header->name);
+        size_t value_len = strlen(header->value);
+        if (name_len == 0 || (req->payload_hash && name_len == LITERAL_LEN(CONTENT_SHA256_HEADER) &&
+                              strncasecmp(header->name, CONTENT_SHA256_HEADER, name_len) == 0)) {
+            return PRESIGN_ERR_HEADER_INVALID;
+        }
+        for (size_t j = 0; j < name_len; j++) {
+            unsigned char c = (unsigned char)header->name[j];
+            if (c <= ' ' || c == ':' || c == 127) {
+                return PRESIGN_ERR_HEADER_INVALID;
+            }
+        }
+        for (size_t j = 0; j < value_len; j++) {
+            unsigned char c = (unsigned char)header->value[j];
+            if (c < 32 && c != '\t') {
+                return PRESIGN_ERR_HEADER_INVALID;
+            }
+        }
+
+        const char *start = header->value;
+        const char *end = header->value + value_len;
+        while (start < end && isspace((unsigned char)*start)) {
+            start++;
+        }
+        while (end > start && isspace((unsigned char)end[-1])) {
+            end--;
+        }
+
+        views[total_headers].name = header->name;
+        views[total_headers].name_len = name_len;
+        views[total_headers].value = start;
+        views[total_headers].value_len = (size_t)(end - start);
+        total_headers++;
+    }
+
+    qsort(views, total_headers, sizeof(header_view_t), compare_header_names);
+
+    // "name:value\n" per header; names joined by ';'
+    size_t canonical_len = 0;
+    size_t signed_len = total_headers - 1;
+    for (size_t i = 0; i < total_headers; i++) {
+        canonical_len += views[i].name_len + 1 + views[i].value_len + 1;
+        signed_len += views[i].name_len;
+    }
+    char *canonical = arena_alloc(arena, canonical_len + 1);
+    char *signed_list = arena_alloc(arena, signed_len + 1);
+    if (!canonical || !signed_list) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+
+    char *c = canonical;
+    char *s = signed_list;
+    for (size_t i = 0; i < total_headers; i++) {
+        c = copy_lower(c, views[i].name, views[i].name_len);
+        *c++ = ':';
+        memcpy(c, views[i].value, views[i].value_len);
+        c += views[i].value_len;
+        *c++ = '\n';
+
+        if (i > 0) {
+            *s++ = ';';
+        }
+        s = copy_lower(s, views[i].name, views[i].name_len);
+    }
+    *c = '\0';
+    *s = '\0';
+
+    canonical_headers->data = canonical;
+    canonical_headers->len = canonical_len;
+    signed_headers->data = signed_list;
+    signed_headers->len = signed_len;
+    return PRESIGN_OK;
+}
+
+// Everything a signature is computed from, before any hashing. The views
+// point into the request arena; all lengths are known before the URL is
+// written.
+typedef struct {
+    char method[MAX_METHOD_LEN];
+    size_t method_len;
+    char date_stamp[DATE_STAMP_LEN + 1];
+    char datetime[DATETIME_LEN + 1];
+    time_t now;
+    char expires[16];
+    size_t expires_len;
+    str_view_t canonical_uri;
+    str_view_t canonical_headers;
+    str_view_t signed_headers;
+    str_view_t signed_headers_encoded;
+    str_view_t payload_line;            // "\n" and the hash, UNSIGNED-PAYLOAD or the streaming marker
+    param_view_t *params;               // req->params, sorted
+    size_t param_count;
+    char payload_hash_line[1 + PAYLOAD_HASH_LEN];
+    size_t query_len;
+} request_parts_t;
+
+static char *put(char *p, const void *src, size_t len) {
+    memcpy(p, src, len);
+    return p + len;
+}
+
+// Writes value as exactly width decimal digits.
+static void put_digits(char *p, unsigned int value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// URI-encodes len bytes of src into the arena, after a '/' when add_slash
+// is set. The worst case (every byte escaped) is reserved and the rest
+// given back.
+static int encode_view(arena_t *arena, const char *src, size_t len, int add_slash, int keep_slash,
+                       str_view_t *out) {
+    if (len > (SIZE_MAX - 2) / 3) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    size_t capacity = (add_slash ? 1 : 0) + len * 3 + 1;
+    char *encoded = arena_alloc(arena, capacity);
+    if (!encoded) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    char *d = encoded;
+    if (add_slash) {
+        *d++ = '/';
+    }
+    size_t encoded_len;
+    if (url_encode_bytes(src, len, d, capacity - (size_t)(d - encoded), keep_slash, &encoded_len) != 0) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    out->data = encoded;
+    out->len = (size_t)(d - encoded) + encoded_len;
+    arena_shrink(arena, encoded, out->len + 1);
+    return PRESIGN_OK;
+}
+
+static int compare_params(const void *a, const void *b) {
+    const param_view_t *pa = (const param_view_t *)a;
+    const param_view_t *pb = (const param_view_t *)b;
+    size_t len = pa->name_len < pb->name_len ? pa->name_len : pb->name_len;
+    int c = memcmp(pa->text.data + 1, pb->text.data + 1, len);
+    if (c != 0 || pa->name_len != pb->name_len) {
+        return c != 0 ? c : (pa->name_len > pb->name_len) - (pa->name_len < pb->name_len);
+    }
+    // Same name: by value
+    size_t a_value = pa->text.len - 2 - pa->name_len;
+    size_t b_value = pb->text.len - 2 - pb->name_len;
+    len = a_value < b_value ? a_value : b_value;
+    c = memcmp(pa->text.data + 2 + pa->name_len, pb->text.data + 2 + pb->name_len, len);
+    return c != 0 ? c : (a_value > b_value) - (a_value < b_value);
+}
+
+// Whether an encoded parameter name sorts before the fixed parameter.
+static int param_before(const param_view_t *param, int fixed) {
+    const char *name = FIXED_PARAM_NAMES[fixed];
+    size_t name_len = strlen(name);
+    size_t len = param->name_len < name_len ? param->name_len : name_len;
+    int c = memcmp(param->text.data + 1, name, len);
+    return c < 0 || (c == 0 && param->name_len < name_len);
+}
+
+// Encodes req->params as "&name=value" into the arena and sorts them by
+// name, then value. The X-Amz-* names the signer writes are reserved.
+static int encode_params(const presign_request_t *req, arena_t *arena, request_parts_t *parts) {
+    parts->params = NULL;
+    parts->param_count = 0;
+    if (req->param_count == 0) {
+        return PRESIGN_OK;
+    }
+    param_view_t *views = arena_alloc(arena, req->param_count * sizeof(*views));
+    if (!views) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < req->param_count; i++) {
+        const char *name = req->params[i].name;
+        const char *value = req->params[i].value ? req->params[i].value : "";
+        if (!name || name[0] == '\0') {
+            return PRESIGN_ERR_PARAM_INVALID;
+        }
+        size_t name_len = strlen(name);
+        size_t value_len = strlen(value);
+        if (name_len > (SIZE_MAX - 3) / 3 - value_len) {
+            return PRESIGN_ERR_OUT_OF_MEMORY;
+        }
+        size_t capacity = 2 + (name_len + value_len) * 3 + 1;
+        char *text = arena_alloc(arena, capacity);
+        if (!text) {
+            return PRESIGN_ERR_OUT_OF_MEMORY;
+        }
+        size_t encoded_name_len;
+        size_t encoded_value_len;
+        text[0] = '&';
+        url_encode_bytes(name, name_len, text + 1, capacity - 1, 0, &encoded_name_len);
+        text[1 + encoded_name_len] = '=';
+        url_encode_bytes(value, value_len, text + 2 + encoded_name_len, capacity - 2 - encoded_name_len, 0,
+                         &encoded_value_len);
+        views[i].text.data = text;
+        views[i].text.len = 2 + encoded_name_len + encoded_value_len;
+        views[i].name_len = encoded_name_len;
+        arena_shrink(arena, text, views[i].text.len + 1);
+
+        for (int fixed = 0; fixed <= FIXED_PARAMS; fixed++) {
+            const char *reserved = fixed < FIXED_PARAMS ? FIXED_PARAM_NAMES[fixed] : SIGNATURE_PARAM + 1;
+            size_t reserved_len = fixed < FIXED_PARAMS ? strlen(reserved) : LITERAL_LEN(SIGNATURE_PARAM) - 2;
+            if (encoded_name_len == reserved_len && memcmp(text + 1, reserved, reserved_len) == 0) {
+                return PRESIGN_ERR_PARAM_INVALID;
+            }
+        }
+    }
+    qsort(views, req->param_count, sizeof(*views), compare_params);
+    parts->params = views;
+    parts->param_count = req->param_count;
+    return PRESIGN_OK;
+}
+
+// Writes now as YYYYMMDDTHHMMSSZ and its YYYYMMDD date, both terminated.
+static int format_datetime(time_t now, char *datetime, char *date_stamp) {
+    struct tm utc_tm;
+    if (!gmtime_r(&now, &utc_tm) || utc_tm.tm_year < -1900 || utc_tm.tm_year > 9999 - 1900) {
+        return -1;
+    }
+    char *d = datetime;
+    put_digits(d, (unsigned int)(utc_tm.tm_year + 1900), 4);
+    put_digits(d + 4, (unsigned int)utc_tm.tm_mon + 1, 2);
+    put_digits(d + 6, (unsigned int)utc_tm.tm_mday, 2);
+    d[8] = 'T';
+    put_digits(d + 9, (unsigned int)utc_tm.tm_hour, 2);
+    put_digits(d + 11, (unsigned int)utc_tm.tm_min, 2);
+    put_digits(d + 13, (unsigned int)utc_tm.tm_sec, 2);
+    d[15] = 'Z';
+    d[DATETIME_LEN] = '\0';
+    memcpy(date_stamp, d, DATE_STAMP_LEN);
+    date_stamp[DATE_STAMP_LEN] = '\0';
+    return 0;
+}
+
+time_t bucket_start(time_t now, int bucket) {
+    time_t offset = now % bucket;
+    return now - (offset < 0 ? offset + bucket : offset);
+}
+
+// Validates req and lays out the canonical URI and headers in arena, and
+// measures the query string without writing it.
+static int compose_request(presign_ctx_t *ctx, const presign_request_t *req, arena_t *arena,
+                           request_parts_t *parts, stats_timer_t *timer) {
+    if (!req || !req->method || !req->path || (req->header_count > 0 && !req->headers) ||
+        (req->param_count > 0 && !req->params)) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+
+    size_t method_len = strlen(req->method);
+    if (method_len == 0 || method_len >= sizeof(parts->method)) {
+        return PRESIGN_ERR_METHOD_INVALID;
+    }
+    for (size_t i = 0; i <= method_len; i++) {
+        unsigned char c = (unsigned char)req->method[i];
+        if (i < method_len && !isalpha(c)) {
+            return PRESIGN_ERR_METHOD_INVALID;
+        }
+        parts->method[i] = (char)toupper(c);
+    }
+    parts->method_len = method_len;
+
+    if (req->expires <= 0 || req->expires > PRESIGN_MAX_EXPIRES) {
+        return PRESIGN_ERR_EXPIRES_INVALID;
+    }
+    if (req->time_bucket < 0 || req->time_bucket > PRESIGN_MAX_EXPIRES - req->expires) {
+        return PRESIGN_ERR_EXPIRES_INVALID;
+    }
+    if (req->header_count > MAX_HEADERS) {
+        return PRESIGN_ERR_TOO_MANY_HEADERS;
+    }
+    parts->payload_line.data = PAYLOAD_LINE;
+    parts->payload_line.len = LITERAL_LEN(PAYLOAD_LINE);
+    if (req->payload_hash && strcmp(req->payload_hash, PRESIGN_STREAMING_PAYLOAD) == 0) {
+        // SigV4A bodies would need their own chunk signatures
+        if (ctx->sigv4a) {
+            return PRESIGN_ERR_SIGV4A_UNSUPPORTED;
+        }
+        parts->payload_hash_line[0] = '\n';
+        memcpy(parts->payload_hash_line + 1, PRESIGN_STREAMING_PAYLOAD, LITERAL_LEN(PRESIGN_STREAMING_PAYLOAD));
+        parts->payload_line.data = parts->payload_hash_line;
+        parts->payload_line.len = 1 + LITERAL_LEN(PRESIGN_STREAMING_PAYLOAD);
+    } else if (req->payload_hash) {
+        for (size_t i = 0; i <= PAYLOAD_HASH_LEN; i++) {
+            char c = req->payload_hash[i];
+            if (i == PAYLOAD_HASH_LEN ? c != '\0' : !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+                return PRESIGN_ERR_PAYLOAD_HASH_INVALID;
+            }
+        }
+        parts->payload_hash_line[0] = '\n';
+        memcpy(parts->payload_hash_line + 1, req->payload_hash, PAYLOAD_HASH_LEN);
+        parts->payload_line.data = parts->payload_hash_line;
+        parts->payload_line.len = sizeof(parts->payload_hash_line);
+    }
+
+    // A bucketed URL is signed at the start of its bucket and stays valid
+    // for expires seconds after the end of it.
+    time_t now = req->now ? req->now : time(NULL);
+    int expires = req->expires;
+    if (req->time_bucket > 0) {
+        now = bucket_start(now, req->time_bucket);
+        expires += req->time_bucket;
+    }
+    int expires_digits = 1;
+    for (int v = expires; v >= 10; v /= 10) {
+        expires_digits++;
+    }
+    put_digits(parts->expires, (unsigned int)expires, expires_digits);
+    parts->expires_len = (size_t)expires_digits;
+
+    parts->now = now;
+    if (format_datetime(now, parts->datetime, parts->date_stamp) != 0) {
+        return PRESIGN_ERR_TIME_INVALID;
+    }
+    STATS_LAP(timer, STAT_CANONICALIZE);
+
+    int status = encode_view(arena, req->path, strlen(req->path), req->path[0] != '/', 1, &parts->canonical_uri);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    STATS_LAP(timer, STAT_ENCODE);
+
+    status = canonicalize_headers(ctx, req, arena, &parts->canonical_headers, &parts->signed_headers);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    STATS_LAP(timer, STAT_CANONICALIZE);
+
+    status = encode_view(arena, parts->signed_headers.data, parts->signed_headers.len, 0, 0,
+                         &parts->signed_headers_encoded);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    status = encode_params(req, arena, parts);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    STATS_LAP(timer, STAT_ENCODE);
+
+    // Without the '&' of the first parameter
+    parts->query_len = ctx->algorithm_param.len + LITERAL_LEN(CREDENTIAL_PARAM) + ctx->credential_prefix_len +
+                       DATE_STAMP_LEN + ctx->scope_suffix_encoded_len + LITERAL_LEN(DATE_PARAM) + DATETIME_LEN +
+                       LITERAL_LEN(EXPIRES_PARAM) + parts->expires_len + ctx->region_set_param_len +
+                       LITERAL_LEN(SIGNED_HEADERS_PARAM) + parts->signed_headers_encoded.len + ctx->token_param_len - 1;
+    for (size_t i = 0; i < parts->param_count; i++) {
+        parts->query_len += parts->params[i].text.len;
+    }
+    return PRESIGN_OK;
+}
+
+// Room for the signature: ECDSA signatures vary in length, so SigV4A URLs
+// are measured with the longest one.
+static size_t signature_hex_room(const presign_ctx_t *ctx) {
+    return ctx->sigv4a ? MAX_SIGNATURE_HEX_LEN : HMAC_SIGNATURE_HEX_LEN;
+}
+
+static size_t url_length(const presign_ctx_t *ctx, const request_parts_t *parts) {
+    return ctx->endpoint_len + parts->canonical_uri.len + 1 + parts->query_len + LITERAL_LEN(SIGNATURE_PARAM) +
+           signature_hex_room(ctx);
+}
+
+static char *write_fixed_param(const presign_ctx_t *ctx, const request_parts_t *parts, int fixed, char *p) {
+    switch (fixed) {
+    case PARAM_ALGORITHM:
+        return put(p, ctx->algorithm_param.data, ctx->algorithm_param.len);
+    case PARAM_CREDENTIAL:
+        p = put(p, CREDENTIAL_PARAM, LITERAL_LEN(CREDENTIAL_PARAM));
+        p = put(p, ctx->credential_prefix, ctx->credential_prefix_len);
+        p = put(p, parts->date_stamp, DATE_STAMP_LEN);
+        return put(p, ctx->scope_suffix_encoded, ctx->scope_suffix_encoded_len);
+    case PARAM_DATE:
+        p = put(p, DATE_PARAM, LITERAL_LEN(DATE_PARAM));
+        return put(p, parts->datetime, DATETIME_LEN);
+    case PARAM_EXPIRES:
+        p = put(p, EXPIRES_PARAM, LITERAL_LEN(EXPIRES_PARAM));
+        return put(p, parts->expires, parts->expires_len);
+    case PARAM_REGION_SET:
+        return put(p, ctx->region_set_param, ctx->region_set_param_len);
+    case PARAM_TOKEN:
+        return put(p, ctx->token_param, ctx->token_param_len);
+    default:
+        p = put(p, SIGNED_HEADERS_PARAM, LITERAL_LEN(SIGNED_HEADERS_PARAM));
+        return put(p, parts->signed_headers_encoded.data, parts->signed_headers_encoded.len);
+    }
+}
+
+// Writes the URL up to and including "X-Amz-Signature=" and returns the
+// position of the signature; the caller checked the size with url_length().
+// The query string is only ever written here, already in canonical order,
+// and *query points at it so the canonical request can be hashed from the
+// URL.
+static char *write_url_prefix(const presign_ctx_t *ctx, const request_parts_t *parts, char *out,
+                              str_view_t *query) {
+    char *p = put(out, ctx->endpoint, ctx->endpoint_len);
+    p = put(p, parts->canonical_uri.data, parts->canonical_uri.len);
+    // Every parameter starts with '&'; the first one's becomes the '?'
+    char *question = p;
+    size_t next = 0;
+    for (int fixed = 0; fixed < FIXED_PARAMS; fixed++) {
+        while (next < parts->param_count && param_before(&parts->params[next], fixed)) {
+            p = put(p, parts->params[next].text.data, parts->params[next].text.len);
+            next++;
+        }
+        p = write_fixed_param(ctx, parts, fixed, p);
+    }
+    for (; next < parts->param_count; next++) {
+        p = put(p, parts->params[next].text.data, parts->params[next].text.len);
+    }
+    *question = '?';
+    query->data = question + 1;
+    query->len = parts->query_len;
+    return put(p, SIGNATURE_PARAM, LITERAL_LEN(SIGNATURE_PARAM));
+}
+
+// METHOD \n URI \n QUERY \n HEADERS \n SIGNED_HEADERS \n PAYLOAD
+static size_t canonical_request_length(const request_parts_t *parts) {
+    return parts->method_len + 1 + parts->canonical_uri.len + 1 + parts->query_len + 1 +
+           parts->canonical_headers.len + 1 + parts->signed_headers.len + parts->payload_line.len;
+}
+
+static char *write_canonical_request(const request_parts_t *parts, const str_view_t *query, char *p) {
+    p = put(p, parts->method, parts->method_len);
+    *p++ = '\n';
+    p = put(p, parts->canonical_uri.data, parts->canonical_uri.len);
+    *p++ = '\n';
+    p = put(p, query->data, query->len);
+    *p++ = '\n';
+    p = put(p, parts->canonical_headers.data, parts->canonical_headers.len);
+    *p++ = '\n';
+    p = put(p, parts->signed_headers.data, parts->signed_headers.len);
+    return put(p, parts->payload_line.data, parts->payload_line.len);
+}
+
+// Hashes the same bytes as write_canonical_request() without laying them
+// out.
+static int hash_canonical_request(sha256_stream_t *stream, const request_parts_t *parts, const str_view_t *query,
+                                  unsigned char *hash) {
+    return sha256_stream_start(stream) != 0 ||
+           sha256_stream_update(stream, parts->method, parts->method_len) != 0 ||
+           sha256_stream_update(stream, "\n", 1) != 0 ||
+           sha256_stream_update(stream, parts->canonical_uri.data, parts->canonical_uri.len) != 0 ||
+           sha256_stream_update(stream, "\n", 1) != 0 ||
+           sha256_stream_update(stream, query->data, query->len) != 0 ||
+           sha256_stream_update(stream, "\n", 1) != 0 ||
+           sha256_stream_update(stream, parts->canonical_headers.data, parts->canonical_headers.len) != 0 ||
+           sha256_stream_update(stream, "\n", 1) != 0 ||
+           sha256_stream_update(stream, parts->signed_headers.data, parts->signed_headers.len) != 0 ||
+           sha256_stream_update(stream, parts->payload_line.data, parts->payload_line.len) != 0 ||
+           sha256_stream_finish(stream, hash) != 0 ? -1 : 0;
+}
+
+// Room for the string to sign, whose longest scope is MAX_SCOPE_SUFFIX_LEN.
+#define STRING_TO_SIGN_LEN 256
+
+// Writes the string to sign up to the hex canonical request hash and
+// returns the position of the hash, which takes 64 more characters.
+static char *write_string_to_sign(const presign_ctx_t *ctx, const request_parts_t *parts, char *out) {
+    char *p = put(out, ctx->algorithm_line.data, ctx->algorithm_line.len);
+    p = put(p, parts->datetime, DATETIME_LEN);
+    *p++ = '\n';
+    p = put(p, parts->date_stamp, DATE_STAMP_LEN);
+    p = put(p, ctx->scope_suffix, ctx->scope_suffix_len);
+    *p++ = '\n';
+    return p;
+}
+
+// SigV4A: hex of the DER ECDSA signature of the SHA-256 of the string to
+// sign, with the credential's cached key. Writes up to
+// MAX_SIGNATURE_HEX_LEN digits and a terminator to hex.
+static int sign_ecdsa(presign_ctx_t *ctx, crypto_ctx_t *cc, const char *string_to_sign, size_t len, char *hex,
+                      size_t *hex_len) {
+    const ecdsa_key_t *key;
+    int status = key_table_ecdsa(ctx->keys, &key);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    unsigned char digest[32];
+    unsigned char der[ECDSA_SIGNATURE_MAX];
+    size_t der_len;
+    if (crypto_sha256(cc, string_to_sign, len, digest) != 0 || ecdsa_sign(key, digest, der, &der_len) != 0) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    to_hex(der, (int)der_len, hex);
+    *hex_len = 2 * der_len;
+    return PRESIGN_OK;
+}
+
+// Signs req into out with its strings in arena; parts keeps what the
+// signature was computed from.
+static int sign_url(presign_ctx_t *ctx, const presign_request_t *req, arena_t *arena,
+                    char *out, size_t out_size, size_t *out_len, request_parts_t *parts) {
+    stats_timer_t timer;
+    STATS_START(&timer);
+    int status = compose_request(ctx, req, arena, parts, &timer);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    size_t url_len = url_length(ctx, parts);
+    if (url_len >= out_size) {
+        if (out_len) {
+            *out_len = url_len;
+        }
+        return PRESIGN_ERR_BUFFER_TOO_SMALL;
+    }
+
+    str_view_t query;
+    char *signature_hex = write_url_prefix(ctx, parts, out, &query);
+    STATS_LAP(&timer, STAT_CANONICALIZE);
+
+    // The thread's reusable streams; nothing is allocated per signature.
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    sha256_stream_t *inner = crypto_ctx_inner(cc);
+    sha256_stream_t *outer = crypto_ctx_outer(cc);
+
+    unsigned char canonical_hash[32];
+    int crypto_failed = hash_canonical_request(inner, parts, &query, canonical_hash) != 0;
+    STATS_LAP(&timer, STAT_HASH);
+
+    char string_to_sign[STRING_TO_SIGN_LEN];
+    char *canonical_hash_hex = write_string_to_sign(ctx, parts, string_to_sign);
+    to_hex(canonical_hash, 32, canonical_hash_hex);
+    size_t string_to_sign_len = (size_t)(canonical_hash_hex + 64 - string_to_sign);
+
+    // The stream that hashed the canonical request is reused for the
+    // inner half of the HMAC.
+    unsigned char signature[32];
+    if (!crypto_failed && ctx->sigv4a) {
+        size_t signature_len;
+        status = sign_ecdsa(ctx, cc, string_to_sign, string_to_sign_len, signature_hex, &signature_len);
+        crypto_failed = status != PRESIGN_OK;
+        url_len -= crypto_failed ? 0 : MAX_SIGNATURE_HEX_LEN - signature_len;
+    } else if (!crypto_failed) {
+        STATS_LAP(&timer, STAT_SIGN);
+        status = key_table_begin(ctx->keys, parts->now, parts->date_stamp, inner, outer);
+        STATS_LAP(&timer, STAT_KEY);
+        crypto_failed = status != PRESIGN_OK ||
+                        sha256_stream_update(inner, string_to_sign, string_to_sign_len) != 0 ||
+                        hmac_sha256_end(inner, outer, signature) != 0;
+    }
+    if (crypto_failed) {
+        out[0] = '\0';
+        return status != PRESIGN_OK ? status : PRESIGN_ERR_CRYPTO;
+    }
+
+    if (!ctx->sigv4a) {
+        to_hex(signature, 32, signature_hex);
+    }
+    STATS_LAP(&timer, STAT_SIGN);
+    STATS_END(&timer, STAT_REQUEST);
+
+    if (ctx->debug) {
+        fprintf(ctx->debug, "DEBUG canonical_request:\n%s\n%s\n%.*s\n%s\n%s%.*s\n",
+                parts->method, parts->canonical_uri.data, (int)query.len, query.data, parts->canonical_headers.data,
+                parts->signed_headers.data, (int)parts->payload_line.len, parts->payload_line.data);
+        fprintf(ctx->debug, "DEBUG canonical_hash:%s\n", canonical_hash_hex);
+        fprintf(ctx->debug, "DEBUG string_to_sign:\n%s\n", string_to_sign);
+        fprintf(ctx->debug, "DEBUG credential_scope:%s%s\n", parts->date_stamp, ctx->scope_suffix);
+        fprintf(ctx->debug, "DEBUG signed_headers:%s\n", parts->signed_headers.data);
+        fprintf(ctx->debug, "DEBUG signature:%s\n", signature_hex);
+        fprintf(ctx->debug, "DEBUG query_params:%.*s\n", (int)query.len, query.data);
+    }
+
+    if (out_len) {
+        *out_len = url_len;
+    }
+    return PRESIGN_OK;
+}
+
+int presign_sign_url(presign_ctx_t *ctx, const presign_request_t *req,
+                     char *out, size_t out_size, size_t *out_len) {
+    if (!ctx || !req || !out) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+
+    // Typical requests fit in the inline buffer; long paths and many
+    // headers spill to the heap.
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    request_parts_t parts;
+    int status = sign_url(ctx, req, &arena, out, out_size, out_len, &parts);
+    arena_free(&arena);
+    // A call that only measured the URL is retried, not failed
+    if (status != PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        STATS_COUNT(status == PRESIGN_OK ? STAT_SIGNATURES : STAT_SIGN_ERRORS, 1);
+    }
+    return status;
+}
+
+static const char PART_NUMBER[] = "partNumber";
+static const char UPLOAD_ID[] = "uploadId";
+static const char RANGE_HEADER[] = "range";
+
+// Longest value of a series: "bytes=" and two 20-digit offsets
+#define SERIES_VALUE_MAX 48
+
+// Requests that differ only in the value of one query parameter or header,
+// which is empty in the template. Query values go into the URL; header
+// values follow it after a tab, since the client has to send them.
+typedef struct {
+    int in_query;
+    const char *name;
+    unsigned int count;
+    // Writes value i and returns its length
+    size_t (*value)(const void *arg, unsigned int i, char *buf);
+    const void *arg;
+} series_t;
+
+// Finds "name=" in the query or "name:" in the canonical headers and
+// returns the offset of its (empty) value in the canonical request.
+static size_t find_series_value(const char *canonical, size_t start, size_t end, const series_t *series) {
+    size_t name_len = strlen(series->name);
+    char separator = series->in_query ? '&' : '\n';
+    const char *p = canonical + start;
+    const char *stop = canonical + end;
+    while (p) {
+        if ((size_t)(stop - p) > name_len && memcmp(p, series->name, name_len) == 0 &&
+            p[name_len] == (series->in_query ? '=' : ':')) {
+            return (size_t)(p - canonical) + name_len + 1;
+        }
+        p = memchr(p, separator, (size_t)(stop - p));
+        p = p ? p + 1 : NULL;
+    }
+    return end;
+}
+
+// The template is composed and its URL and canonical request laid out
+// once, and the canonical request is hashed once up to the series value;
+// each request then only hashes its value and the rest of the canonical
+// request from a copy of that midstate before the HMAC.
+static int sign_series(presign_ctx_t *ctx, const presign_request_t *template_req, const series_t *series,
+                       arena_t *arena, char *out, size_t out_size, size_t *out_len) {
+    stats_timer_t timer;
+    STATS_START(&timer);
+    request_parts_t parts;
+    int status = compose_request(ctx, template_req, arena, &parts, &timer);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    size_t url_len = url_length(ctx, &parts);
+    size_t total = 0;
+    char value[SERIES_VALUE_MAX];
+    for (unsigned int i = 0; i < series->count; i++) {
+        total += url_len + series->value(series->arg, i, value) + (series->in_query ? 1 : 2);
+    }
+    if (out_len) {
+        *out_len = total;
+    }
+    if (total >= out_size) {
+        return PRESIGN_ERR_BUFFER_TOO_SMALL;
+    }
+
+    size_t canonical_len = canonical_request_length(&parts);
+    char *url = arena_alloc(arena, url_len + 1);
+    char *canonical = arena_alloc(arena, canonical_len);
+    if (!url || !canonical) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    str_view_t query;
+    char *signature_hex = write_url_prefix(ctx, &parts, url, &query);
+    write_canonical_request(&parts, &query, canonical);
+    size_t query_start = parts.method_len + 1 + parts.canonical_uri.len + 1;
+    size_t headers_start = query_start + parts.query_len + 1;
+    size_t split = series->in_query
+                       ? find_series_value(canonical, query_start, headers_start - 1, series)
+                       : find_series_value(canonical, headers_start, headers_start + parts.canonical_headers.len,
+                                           series);
+    size_t url_split = series->in_query ? (size_t)(query.data - url) + split - query_start
+                                        : (size_t)(signature_hex - url);
+    size_t url_rest = (size_t)(signature_hex - url) - url_split;
+    STATS_LAP(&timer, STAT_CANONICALIZE);
+
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    sha256_stream_t *prefix = cc ? sha256_stream_new() : NULL;
+    if (!prefix) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    sha256_stream_t *inner = crypto_ctx_inner(cc);
+    sha256_stream_t *outer = crypto_ctx_outer(cc);
+    int crypto_failed = sha256_stream_start(prefix) != 0 || sha256_stream_update(prefix, canonical, split) != 0;
+
+    char string_to_sign[STRING_TO_SIGN_LEN];
+    char *canonical_hash_hex = write_string_to_sign(ctx, &parts, string_to_sign);
+    size_t string_to_sign_len = (size_t)(canonical_hash_hex + 64 - string_to_sign);
+
+    char *p = out;
+    for (unsigned int i = 0; i < series->count && !crypto_failed; i++) {
+        size_t value_len = series->value(series->arg, i, value);
+        unsigned char digest[32];
+        crypto_failed = sha256_stream_copy(inner, prefix) != 0 ||
+                        sha256_stream_update(inner, value, value_len) != 0 ||
+                        sha256_stream_update(inner, canonical + split, canonical_len - split) != 0 ||
+                        sha256_stream_finish(inner, digest) != 0;
+        STATS_LAP(&timer, STAT_HASH);
+        if (crypto_failed) {
+            break;
+        }
+        to_hex(digest, 32, canonical_hash_hex);
+        char signature[MAX_SIGNATURE_HEX_LEN + 1];
+        size_t signature_len = HMAC_SIGNATURE_HEX_LEN;
+        if (ctx->sigv4a) {
+            status = sign_ecdsa(ctx, cc, string_to_sign, string_to_sign_len, signature, &signature_len);
+            crypto_failed = status != PRESIGN_OK;
+        } else {
+            status = key_table_begin(ctx->keys, parts.now, parts.date_stamp, inner, outer);
+            STATS_LAP(&timer, STAT_KEY);
+            crypto_failed = status != PRESIGN_OK ||
+                            sha256_stream_update(inner, string_to_sign, string_to_sign_len) != 0 ||
+                            hmac_sha256_end(inner, outer, digest) != 0;
+            to_hex(digest, 32, signature);
+        }
+        if (crypto_failed) {
+            break;
+        }
+        p = put(p, url, url_split);
+        if (series->in_query) {
+            p = put(p, value, value_len);
+        }
+        p = put(p, url + url_split, url_rest);
+        p = put(p, signature, signature_len);
+        if (!series->in_query) {
+            *p++ = '\t';
+            p = put(p, value, value_len);
+        }
+        *p++ = '\n';
+        STATS_LAP(&timer, STAT_SIGN);
+    }
+    sha256_stream_free(prefix);
+    if (crypto_failed) {
+        out[0] = '\0';
+        return status != PRESIGN_OK ? status : PRESIGN_ERR_CRYPTO;
+    }
+    *p = '\0';
+    if (out_len) {
+        *out_len = (size_t)(p - out);
+    }
+    STATS_END(&timer, STAT_REQUEST);
+    return PRESIGN_OK;
+}
+
+// Signs the series in a request arena and counts its signatures.
+static int sign_series_counted(presign_ctx_t *ctx, const presign_request_t *template_req, const series_t *series,
+                               arena_t *arena, char *out, size_t out_size, size_t *out_len) {
+    int status = sign_series(ctx, template_req, series, arena, out, out_size, out_len);
+    arena_free(arena);
+    if (status != PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        STATS_COUNT(status == PRESIGN_OK ? STAT_SIGNATURES : STAT_SIGN_ERRORS,
+                    status == PRESIGN_OK ? series->count : 1);
+    }
+    return status;
+}
+
+static size_t part_number_value(const void *arg, unsigned int i, char *buf) {
+    return (size_t)snprintf(buf, SERIES_VALUE_MAX, "%u", *(const unsigned int *)arg + i);
+}
+
+int presign_sign_parts(presign_ctx_t *ctx, const presign_request_t *req, const char *upload_id,
+                       unsigned int first_part, unsigned int part_count,
+                       char *out, size_t out_size, size_t *out_len) {
+    if (!ctx || !req || !out || (req->param_count > 0 && !req->params)) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    if (!upload_id || upload_id[0] == '\0' || first_part < 1 || part_count < 1 ||
+        part_count > PRESIGN_MAX_PARTS || first_part > PRESIGN_MAX_PARTS - part_count + 1) {
+        return PRESIGN_ERR_PART_INVALID;
+    }
+    for (size_t i = 0; i < req->param_count; i++) {
+        const char *name = req->params[i].name;
+        if (name && (strcmp(name, PART_NUMBER) == 0 || strcmp(name, UPLOAD_ID) == 0)) {
+            return PRESIGN_ERR_PARAM_INVALID;
+        }
+    }
+
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    presign_param_t *params = arena_alloc(&arena, (req->param_count + 2) * sizeof(*params));
+    if (!params) {
+        arena_free(&arena);
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    if (req->param_count > 0) {
+        memcpy(params, req->params, req->param_count * sizeof(*params));
+    }
+    params[req->param_count] = (presign_param_t){PART_NUMBER, ""};
+    params[req->param_count + 1] = (presign_param_t){UPLOAD_ID, upload_id};
+    presign_request_t template_req = *req;
+    template_req.params = params;
+    template_req.param_count = req->param_count + 2;
+
+    series_t series = {1, PART_NUMBER, part_count, part_number_value, &first_part};
+    return sign_series_counted(ctx, &template_req, &series, &arena, out, out_size, out_len);
+}
+
+typedef struct {
+    unsigned long long object_size;
+    unsigned long long range_size;
+} ranges_t;
+
+static size_t range_value(const void *arg, unsigned int i, char *buf) {
+    const ranges_t *ranges = arg;
+    unsigned long long first = (unsigned long long)i * ranges->range_size;
+    unsigned long long last = ranges->object_size - first > ranges->range_size ? first + ranges->range_size - 1
+                                                                               : ranges->object_size - 1;
+    return (size_t)snprintf(buf, SERIES_VALUE_MAX, "bytes=%llu-%llu", first, last);
+}
+
+int presign_sign_ranges(presign_ctx_t *ctx, const presign_request_t *req, unsigned long long object_size,
+                        unsigned long long range_size, char *out, size_t out_size, size_t *out_len) {
+    if (!ctx || !req || !out || (req->header_count > 0 && !req->headers)) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    if (object_size == 0 || range_size == 0 || (object_size - 1) / range_size >= PRESIGN_MAX_RANGES) {
+        return PRESIGN_ERR_RANGE_INVALID;
+    }
+    if (req->header_count >= MAX_HEADERS) {
+        return PRESIGN_ERR_TOO_MANY_HEADERS;
+    }
+    for (size_t i = 0; i < req->header_count; i++) {
+        if (req->headers[i].name && strcasecmp(req->headers[i].name, RANGE_HEADER) == 0) {
+            return PRESIGN_ERR_HEADER_INVALID;
+        }
+    }
+
+    // The range header joins the others and is canonicalized with them
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    presign_header_t *headers = arena_alloc(&arena, (req->header_count + 1) * sizeof(*headers));
+    if (!headers) {
+        arena_free(&arena);
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    if (req->header_count > 0) {
+        memcpy(headers, req->headers, req->header_count * sizeof(*headers));
+    }
+    headers[req->header_count] = (presign_header_t){RANGE_HEADER, ""};
+    presign_request_t template_req = *req;
+    template_req.headers = headers;
+    template_req.header_count = req->header_count + 1;
+
+    ranges_t ranges = {object_size, range_size};
+    series_t series = {0, RANGE_HEADER, (unsigned int)((object_size - 1) / range_size + 1), range_value, &ranges};
+    return sign_series_counted(ctx, &template_req, &series, &arena, out, out_size, out_len);
+}
+
+// Browser POST policies. The base64 policy document is itself the string
+// to sign, so a policy costs one HMAC with the signing key of its day.
+
+static const char POST_ALGORITHM[] = "AWS4-HMAC-SHA256";
+// Policy and form text around the caller's strings
+#define POST_FIXED_LEN 768
+
+// A policy string: no control characters, which neither the form lines
+// nor the JSON would carry.
+static int post_string_valid(const char *s) {
+    for (; *s; s++) {
+        if ((unsigned char)*s < 0x20 || *s == 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writes s as the inside of a JSON string.
+static char *put_json(char *p, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            *p++ = '\\';
+        }
+        *p++ = s[i];
+    }
+    return p;
+}
+
+static char *put_str(char *p, const char *s) {
+    return put(p, s, strlen(s));
+}
+
+static char *put_field(char *p, const char *name, const char *value, size_t value_len) {
+    p = put_str(p, name);
+    *p++ = '\t';
+    p = put(p, value, value_len);
+    *p++ = '\n';
+    return p;
+}
+
+int presign_sign_post(presign_ctx_t *ctx, const presign_post_t *post, char *out, size_t out_size, size_t *out_len) {
+    if (!ctx || !post || !out || !post->bucket) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    if (ctx->sigv4a) {
+        return PRESIGN_ERR_SIGV4A_UNSUPPORTED;
+    }
+    const char *prefix = post->key_prefix ? post->key_prefix : "";
+    const char *content_type = post->content_type;
+    size_t type_len = content_type ? strlen(content_type) : 0;
+    int type_prefix = type_len > 0 && content_type[type_len - 1] == '*';
+    if (post->bucket[0] == '\0' || strchr(post->bucket, '/') || !post_string_valid(post->bucket) ||
+        !post_string_valid(prefix) || (content_type && (type_len == 0 || !post_string_valid(content_type))) ||
+        (post->min_length > 0 && post->max_length == 0) || post->min_length > post->max_length) {
+        return PRESIGN_ERR_POLICY_INVALID;
+    }
+    if (post->expires <= 0 || post->expires > PRESIGN_MAX_EXPIRES) {
+        return PRESIGN_ERR_EXPIRES_INVALID;
+    }
+
+    time_t now = post->now ? post->now : time(NULL);
+    time_t expiration = now + post->expires;
+    char datetime[DATETIME_LEN + 1];
+    char date_stamp[DATE_STAMP_LEN + 1];
+    struct tm expiration_tm;
+    if (format_datetime(now, datetime, date_stamp) != 0 || !gmtime_r(&expiration, &expiration_tm) ||
+        expiration_tm.tm_year > 9999 - 1900) {
+        return PRESIGN_ERR_TIME_INVALID;
+    }
+    char expiration_text[] = "YYYY-MM-DDTHH:MM:SSZ";
+    put_digits(expiration_text, (unsigned int)(expiration_tm.tm_year + 1900), 4);
+    put_digits(expiration_text + 5, (unsigned int)expiration_tm.tm_mon + 1, 2);
+    put_digits(expiration_text + 8, (unsigned int)expiration_tm.tm_mday, 2);
+    put_digits(expiration_text + 11, (unsigned int)expiration_tm.tm_hour, 2);
+    put_digits(expiration_text + 14, (unsigned int)expiration_tm.tm_min, 2);
+    put_digits(expiration_text + 17, (unsigned int)expiration_tm.tm_sec, 2);
+
+    // "<access key>/<date>/<region>/<service>/aws4_request"
+    char credential[MAX_ENV_VAR_LEN + DATE_STAMP_LEN + MAX_SCOPE_SUFFIX_LEN + 1];
+    char *c = put_str(credential, ctx->access_key);
+    *c++ = '/';
+    c = put(c, date_stamp, DATE_STAMP_LEN);
+    c = put(c, ctx->scope_suffix, ctx->scope_suffix_len);
+    size_t credential_len = (size_t)(c - credential);
+    *c = '\0';
+
+    size_t bucket_len = strlen(post->bucket);
+    size_t prefix_len = strlen(prefix);
+    size_t token_len = strlen(ctx->session_token);
+    size_t strings_len = bucket_len + prefix_len + type_len + credential_len + token_len;
+    if (strings_len > (SIZE_MAX - POST_FIXED_LEN) / 8) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    // Escaping at most doubles the strings, and base64 grows the policy by
+    // a third; the bucket is URI-encoded in the action URL.
+    size_t policy_max = POST_FIXED_LEN + 2 * strings_len;
+    char *policy = arena_alloc(&arena, policy_max);
+    char *policy_base64 = arena_alloc(&arena, 4 * (policy_max / 3 + 1) + 1);
+    char *bucket_encoded = arena_alloc(&arena, 3 * bucket_len + 1);
+    if (!policy || !policy_base64 || !bucket_encoded) {
+        arena_free(&arena);
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+
+    char *p = put_str(policy, "{\"expiration\":\"");
+    p = put_str(p, expiration_text);
+    p = put_str(p, "\",\"conditions\":[{\"bucket\":\"");
+    p = put_json(p, post->bucket, bucket_len);
+    p = put_str(p, "\"},[\"starts-with\",\"$key\",\"");
+    p = put_json(p, prefix, prefix_len);
+    p = put_str(p, "\"]");
+    if (post->max_length > 0) {
+        p += snprintf(p, 64, ",[\"content-length-range\",%llu,%llu]", post->min_length, post->max_length);
+    }
+    if (type_prefix) {
+        p = put_str(p, ",[\"starts-with\",\"$Content-Type\",\"");
+        p = put_json(p, content_type, type_len - 1);
+        p = put_str(p, "\"]");
+    } else if (content_type) {
+        p = put_str(p, ",{\"Content-Type\":\"");
+        p = put_json(p, content_type, type_len);
+        p = put_str(p, "\"}");
+    }
+    p = put_str(p, ",{\"x-amz-algorithm\":\"");
+    p = put_str(p, POST_ALGORITHM);
+    p = put_str(p, "\"},{\"x-amz-credential\":\"");
+    p = put_json(p, credential, credential_len);
+    p = put_str(p, "\"},{\"x-amz-date\":\"");
+    p = put(p, datetime, DATETIME_LEN);
+    if (token_len > 0) {
+        p = put_str(p, "\"},{\"x-amz-security-token\":\"");
+        p = put_json(p, ctx->session_token, token_len);
+    }
+    p = put_str(p, "\"}]}");
+    size_t base64_len = base64_encode(policy, (size_t)(p - policy), policy_base64);
+    size_t bucket_encoded_len = 0;
+    url_encode_bytes(post->bucket, bucket_len, bucket_encoded, 3 * bucket_len + 1, 0, &bucket_encoded_len);
+
+    size_t form_len = LITERAL_LEN("action\t/\n") + ctx->endpoint_len + bucket_encoded_len +
+                      LITERAL_LEN("key\t${filename}\n") + prefix_len +
+                      (content_type && !type_prefix ? LITERAL_LEN("Content-Type\t\n") + type_len : 0) +
+                      LITERAL_LEN("policy\t\n") + base64_len +
+                      LITERAL_LEN("x-amz-algorithm\t\n") + LITERAL_LEN(POST_ALGORITHM) +
+                      LITERAL_LEN("x-amz-credential\t\n") + credential_len +
+                      LITERAL_LEN("x-amz-date\t\n") + DATETIME_LEN +
+                      (token_len > 0 ? LITERAL_LEN("x-amz-security-token\t\n") + token_len : 0) +
+                      LITERAL_LEN("x-amz-signature\t\n") + 64;
+    if (out_len) {
+        *out_len = form_len;
+    }
+    if (form_len >= out_size) {
+        arena_free(&arena);
+        return PRESIGN_ERR_BUFFER_TOO_SMALL;
+    }
+
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc) {
+        arena_free(&arena);
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    sha256_stream_t *inner = crypto_ctx_inner(cc);
+    sha256_stream_t *outer = crypto_ctx_outer(cc);
+    unsigned char signature[32];
+    int status = key_table_begin(ctx->keys, now, date_stamp, inner, outer);
+    if (status == PRESIGN_OK && (sha256_stream_update(inner, policy_base64, base64_len) != 0 ||
+                                 hmac_sha256_end(inner, outer, signature) != 0)) {
+        status = PRESIGN_ERR_CRYPTO;
+    }
+    if (status != PRESIGN_OK) {
+        arena_free(&arena);
+        STATS_COUNT(STAT_SIGN_ERRORS, 1);
+        return status;
+    }
+    char signature_hex[65];
+    to_hex(signature, 32, signature_hex);
+
+    char *o = put_str(out, "action\t");
+    o = put(o, ctx->endpoint, ctx->endpoint_len);
+    *o++ = '/';
+    o = put(o, bucket_encoded, bucket_encoded_len);
+    *o++ = '\n';
+    o = put_str(o, "key\t");
+    o = put(o, prefix, prefix_len);
+    o = put_str(o, "${filename}\n");
+    if (content_type && !type_prefix) {
+        o = put_field(o, "Content-Type", content_type, type_len);
+    }
+    o = put_field(o, "policy", policy_base64, base64_len);
+    o = put_field(o, "x-amz-algorithm", POST_ALGORITHM, LITERAL_LEN(POST_ALGORITHM));
+    o = put_field(o, "x-amz-credential", credential, credential_len);
+    o = put_field(o, "x-amz-date", datetime, DATETIME_LEN);
+    if (token_len > 0) {
+        o = put_field(o, "x-amz-security-token", ctx->session_token, token_len);
+    }
+    o = put_field(o, "x-amz-signature", signature_hex, 64);
+    *o = '\0';
+
+    if (ctx->debug) {
+        fprintf(ctx->debug, "DEBUG policy:%.*s\n", (int)(p - policy), policy);
+        fprintf(ctx->debug, "DEBUG signature:%s\n", signature_hex);
+    }
+    arena_free(&arena);
+    STATS_COUNT(STAT_SIGNATURES, 1);
+    return PRESIGN_OK;
+}
+
+// aws-chunked body signer. string_to_sign holds
+// "AWS4-HMAC-SHA256-PAYLOAD\n<datetime>\n<scope>\n<previous signature>\n
+// <empty hash>\n<chunk hash>"; each chunk fills in its hash, and its
+// signature replaces the previous one for the next chunk.
+struct presign_chunked {
+    presign_ctx_t *ctx;
+    time_t now;
+    char date_stamp[DATE_STAMP_LEN + 1];
+    char string_to_sign[STRING_TO_SIGN_LEN + 3 * (PAYLOAD_HASH_LEN + 1)];
+    size_t string_to_sign_len;
+    char *previous;
+    char *chunk_hash;
+    int finished;
+};
+
+presign_chunked_t *chunked_begin(presign_ctx_t *ctx, time_t now, const char *seed_signature) {
+    presign_chunked_t *chunked = calloc(1, sizeof(*chunked));
+    if (!chunked) {
+        return NULL;
+    }
+    char datetime[DATETIME_LEN + 1];
+    if (format_datetime(now, datetime, chunked->date_stamp) != 0) {
+        free(chunked);
+        return NULL;
+    }
+    chunked->ctx = ctx;
+    chunked->now = now;
+    char *p = put(chunked->string_to_sign, CHUNK_ALGORITHM_LINE, LITERAL_LEN(CHUNK_ALGORITHM_LINE));
+    p = put(p, datetime, DATETIME_LEN);
+    *p++ = '\n';
+    p = put(p, chunked->date_stamp, DATE_STAMP_LEN);
+    p = put(p, ctx->scope_suffix, ctx->scope_suffix_len);
+    *p++ = '\n';
+    chunked->previous = p;
+    p = put(p, seed_signature, PAYLOAD_HASH_LEN);
+    *p++ = '\n';
+    p = put(p, EMPTY_SHA256, LITERAL_LEN(EMPTY_SHA256));
+    *p++ = '\n';
+    chunked->chunk_hash = p;
+    chunked->string_to_sign_len = (size_t)(p + PAYLOAD_HASH_LEN - chunked->string_to_sign);
+    return chunked;
+}
+
+int presign_chunked_new(presign_ctx_t *ctx, const presign_request_t *req, char *url, size_t url_size,
+                        size_t *url_len, presign_chunked_t **chunked_out) {
+    if (!ctx || !req || !url || !chunked_out) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    *chunked_out = NULL;
+    presign_request_t seed_req = *req;
+    seed_req.payload_hash = PRESIGN_STREAMING_PAYLOAD;
+
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    request_parts_t parts;
+    size_t len = 0;
+    int status = sign_url(ctx, &seed_req, &arena, url, url_size, &len, &parts);
+    arena_free(&arena);
+    if (url_len) {
+        *url_len = len;
+    }
+    if (status != PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        STATS_COUNT(status == PRESIGN_OK ? STAT_SIGNATURES : STAT_SIGN_ERRORS, 1);
+    }
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    // The seed signature ends the URL
+    *chunked_out = chunked_begin(ctx, parts.now, url + len - PAYLOAD_HASH_LEN);
+    return *chunked_out ? PRESIGN_OK : PRESIGN_ERR_OUT_OF_MEMORY;
+}
+
+int presign_chunked_sign(presign_chunked_t *chunked, const void *data, size_t len,
+                         char *header, size_t header_size, size_t *header_len) {
+    if (!chunked || chunked->finished || (!data && len > 0) || !header) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    int size_digits = 1;
+    for (size_t v = len; v >= 16; v /= 16) {
+        size_digits++;
+    }
+    size_t needed = (size_t)size_digits + LITERAL_LEN(CHUNK_SIGNATURE) + PAYLOAD_HASH_LEN + 2;
+    if (header_len) {
+        *header_len = needed;
+    }
+    if (needed >= header_size) {
+        return PRESIGN_ERR_BUFFER_TOO_SMALL;
+    }
+
+    stats_timer_t timer;
+    STATS_START(&timer);
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    unsigned char digest[32];
+    if (crypto_sha256(cc, len ? data : "", len, digest) != 0) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    to_hex(digest, 32, chunked->chunk_hash);
+    STATS_LAP(&timer, STAT_HASH);
+
+    sha256_stream_t *inner = crypto_ctx_inner(cc);
+    sha256_stream_t *outer = crypto_ctx_outer(cc);
+    int status = key_table_begin(chunked->ctx->keys, chunked->now, chunked->date_stamp, inner, outer);
+    STATS_LAP(&timer, STAT_KEY);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    if (sha256_stream_update(inner, chunked->string_to_sign, chunked->string_to_sign_len) != 0 ||
+        hmac_sha256_end(inner, outer, digest) != 0) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    to_hex(digest, 32, chunked->previous);
+    chunked->previous[PAYLOAD_HASH_LEN] = '\n';
+
+    // <hex size>;chunk-signature=<signature>\r\n
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t v = len;
+    for (int i = size_digits - 1; i >= 0; i--) {
+        header[i] = hex_digits[v & 15];
+        v >>= 4;
+    }
+    char *p = put(header + size_digits, CHUNK_SIGNATURE, LITERAL_LEN(CHUNK_SIGNATURE));
+    p = put(p, chunked->previous, PAYLOAD_HASH_LEN);
+    p = put(p, "\r\n", 3);
+    chunked->finished = len == 0;
+    STATS_LAP(&timer, STAT_SIGN);
+    STATS_END(&timer, STAT_CHUNK);
+    STATS_COUNT(STAT_PAYLOAD_BYTES, len);
+    return PRESIGN_OK;
+}
+
+void presign_chunked_free(presign_chunked_t *chunked) {
+    if (chunked) {
+        memset(chunked, 0, sizeof(*chunked));
+        free(chunked);
+    }
+}
+
+typedef struct {
+    size_t canonical_offset;
+    size_t canonical_len;
+    char *signature_hex;
+    unsigned char canonical_hash[32];
+    unsigned char inner_digest[32];
+    unsigned char signature[32];
+    uint32_t inner_state[8];
+    uint32_t outer_state[8];
+    size_t string_to_sign_len;
+    char string_to_sign[STRING_TO_SIGN_LEN];
+} group_entry_t;
+
+// Makes room for data_len more bytes after len in a growing scratch buffer.
+static int scratch_reserve(char **buf, size_t len, size_t *cap, size_t data_len) {
+    if (data_len > SIZE_MAX / 2 - len) {
+        return -1;
+    }
+    if (len + data_len > *cap) {
+        size_t new_cap = *cap ? *cap : 4096;
+        while (new_cap < len + data_len) {
+            new_cap *= 2;
+        }
+        char *grown = realloc(*buf, new_cap);
+        if (!grown) {
+            return -1;
+        }
+        *buf = grown;
+        *cap = new_cap;
+    }
+    return 0;
+}
+
+int sign_url_group(presign_ctx_t *ctx, const presign_request_t *reqs, size_t count,
+                   char *const outs[], size_t out_size, size_t *out_lens, int *statuses) {
+    if (!ctx || (count > 0 && (!reqs || !outs || !statuses))) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    // Debug output is only produced by the one-at-a-time path, and SigV4A
+    // signatures are ECDSA, not HMACs the engine could batch.
+    if (ctx->debug || ctx->sigv4a) {
+        for (size_t i = 0; i < count; i++) {
+            statuses[i] = presign_sign_url(ctx, &reqs[i], outs[i], out_size, out_lens ? &out_lens[i] : NULL);
+        }
+        return PRESIGN_OK;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        statuses[i] = PRESIGN_OK;
+    }
+
+    // Requests record their own stages as they are laid out; the group adds
+    // its hash rounds and its total.
+    uint64_t group_start = stats_enabled ? stats_clock() : 0;
+    uint64_t rounds_start = 0;
+    request_parts_t parts;
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    group_entry_t *entries = malloc(count * sizeof(*entries));
+    sha256_mb_job_t *jobs = malloc(count * sizeof(*jobs));
+    char *canonical = NULL;
+    size_t canonical_len = 0;
+    size_t canonical_cap = 0;
+    int status = PRESIGN_OK;
+    if (!entries || !jobs) {
+        status = PRESIGN_ERR_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    // Lay out every canonical request back to back and write each URL up
+    // to its signature. The arena only has to hold one request at a time.
+    for (size_t i = 0; i < count; i++) {
+        group_entry_t *entry = &entries[i];
+        stats_timer_t timer;
+        STATS_START(&timer);
+        arena_reset(&arena);
+        statuses[i] = compose_request(ctx, &reqs[i], &arena, &parts, &timer);
+        if (statuses[i] != PRESIGN_OK) {
+            continue;
+        }
+        size_t url_len = url_length(ctx, &parts);
+        if (url_len >= out_size) {
+            statuses[i] = PRESIGN_ERR_BUFFER_TOO_SMALL;
+            if (out_lens) {
+                out_lens[i] = url_len;
+            }
+            continue;
+        }
+        if (key_table_midstates(ctx->keys, parts.now, parts.date_stamp, entry->inner_state,
+                                entry->outer_state) != PRESIGN_OK) {
+            statuses[i] = PRESIGN_ERR_CRYPTO;
+            continue;
+        }
+        STATS_LAP(&timer, STAT_KEY);
+
+        entry->canonical_len = canonical_request_length(&parts);
+        if (scratch_reserve(&canonical, canonical_len, &canonical_cap, entry->canonical_len) != 0) {
+            status = PRESIGN_ERR_OUT_OF_MEMORY;
+            goto done;
+        }
+        str_view_t query;
+        entry->signature_hex = write_url_prefix(ctx, &parts, outs[i], &query);
+        entry->signature_hex[64] = '\0';
+        entry->canonical_offset = canonical_len;
+        write_canonical_request(&parts, &query, canonical + canonical_len);
+        canonical_len += entry->canonical_len;
+        if (out_lens) {
+            out_lens[i] = url_len;
+        }
+        // Everything but the hash, which is filled in after the first round
+        char *hash_hex = write_string_to_sign(ctx, &parts, entry->string_to_sign);
+        entry->string_to_sign_len = (size_t)(hash_hex + 64 - entry->string_to_sign);
+        STATS_LAP(&timer, STAT_CANONICALIZE);
+        STATS_END(&timer, -1);
+    }
+    if (stats_enabled) {
+        rounds_start = stats_clock();
+    }
+
+    // Three rounds over all lanes: canonical request hashes, inner HMAC
+    // from the ipad midstate, outer HMAC from the opad midstate.
+    size_t job_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (statuses[i] == PRESIGN_OK) {
+            sha256_mb_job_t *job = &jobs[job_count++];
+            memset(job, 0, sizeof(*job));
+            job->data = (const unsigned char *)canonical + entries[i].canonical_offset;
+            job->len = entries[i].canonical_len;
+            job->digest = entries[i].canonical_hash;
+        }
+    }
+    if (sha256_mb_run(jobs, job_count) != 0) {
+        status = PRESIGN_ERR_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    job_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (statuses[i] == PRESIGN_OK) {
+            group_entry_t *entry = &entries[i];
+            to_hex(entry->canonical_hash, 32, entry->string_to_sign + entry->string_to_sign_len - 64);
+
+            sha256_mb_job_t *job = &jobs[job_count++];
+            memset(job, 0, sizeof(*job));
+            job->init = entry->inner_state;
+            job->prefix_len = 64;
+            job->data = (const unsigned char *)entry->string_to_sign;
+            job->len = entry->string_to_sign_len;
+            job->digest = entry->inner_digest;
+        }
+    }
+    if (sha256_mb_run(jobs, job_count) != 0) {
+        status = PRESIGN_ERR_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    job_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (statuses[i] == PRESIGN_OK) {
+            sha256_mb_job_t *job = &jobs[job_count++];
+            memset(job, 0, sizeof(*job));
+            job->init = entries[i].outer_state;
+            job->prefix_len = 64;
+            job->data = entries[i].inner_digest;
+            job->len = 32;
+            job->digest = entries[i].signature;
+        }
+    }
+    if (sha256_mb_run(jobs, job_count) != 0) {
+        status = PRESIGN_ERR_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (statuses[i] == PRESIGN_OK) {
+            to_hex(entries[i].signature, 32, entries[i].signature_hex);
+        }
+    }
+
+done:
+    if (status != PRESIGN_OK) {
+        for (size_t i = 0; i < count; i++) {
+            if (statuses[i] == PRESIGN_OK) {
+                statuses[i] = status;
+            }
+        }
+    }
+    if (stats_enabled) {
+        uint64_t end = stats_clock();
+        size_t signed_count = 0;
+        size_t failed_count = 0;
+        for (size_t i = 0; i < count; i++) {
+            signed_count += statuses[i] == PRESIGN_OK;
+            failed_count += statuses[i] != PRESIGN_OK && statuses[i] != PRESIGN_ERR_BUFFER_TOO_SMALL;
+        }
+        if (status == PRESIGN_OK) {
+            stats_record(STAT_GROUP_HASH, end - rounds_start);
+            stats_record(STAT_GROUP, end - group_start);
+        }
+        stats_count(STAT_SIGNATURES, signed_count);
+        stats_count(STAT_GROUPED_SIGNATURES, signed_count);
+        stats_count(STAT_SIGN_ERRORS, failed_count);
+    }
+    arena_free(&arena);
+    if (entries) {
+        memset(entries, 0, count * sizeof(*entries));
+    }
+    free(entries);
+    free(jobs);
+    free(canonical);
+    return status;
+}
+
+// Verification runs the signer's canonicalization on the parts of a
+// received URL. Query parameters are percent-decoded and encoded again the
+// way the signer encodes them, so the canonical request does not depend on
+// how the client escaped the URL, and sorted with compare_params(); the
+// signed headers go through canonicalize_headers(). Everything lives in a
+// request arena on the stack unless the URL is unusually long.
+
+#define VERIFY_MAX_PARAMS 64
+// How far in the future X-Amz-Date may be, as S3 allows
+#define VERIFY_CLOCK_SKEW (15 * 60)
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = (char)(c | 0x20);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Decodes the %XX escapes of src into dest, which has room for len bytes.
+static int percent_decode(const char *src, size_t len, char *dest, size_t *dest_len) {
+    char *d = dest;
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] != '%') {
+            *d++ = src[i];
+            continue;
+        }
+        int high = i + 2 < len ? hex_value(src[i + 1]) : -1;
+        int low = high >= 0 ? hex_value(src[i + 2]) : -1;
+        if (low < 0) {
+            return -1;
+        }
+        *d++ = (char)(high << 4 | low);
+        i += 2;
+    }
+    *dest_len = (size_t)(d - dest);
+    return 0;
+}
+
+// Parses YYYYMMDDTHHMMSSZ.
+static int parse_amz_date(const char *text, size_t len, time_t *out) {
+    if (len != DATETIME_LEN || text[8] != 'T' || text[15] != 'Z') {
+        return -1;
+    }
+    int fields[6];
+    static const int offsets[6] = {0, 4, 6, 9, 11, 13};
+    static const int widths[6] = {4, 2, 2, 2, 2, 2};
+    for (int f = 0; f < 6; f++) {
+        fields[f] = 0;
+        for (int i = 0; i < widths[f]; i++) {
+            char c = text[offsets[f] + i];
+            if (c < '0' || c > '9') {
+                return -1;
+            }
+            fields[f] = fields[f] * 10 + (c - '0');
+        }
+    }
+    struct tm tm_value = {0};
+    tm_value.tm_year = fields[0] - 1900;
+    tm_value.tm_mon = fields[1] - 1;
+    tm_value.tm_mday = fields[2];
+    tm_value.tm_hour = fields[3];
+    tm_value.tm_min = fields[4];
+    tm_value.tm_sec = fields[5];
+    if (fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > 31 || fields[3] > 23 || fields[4] > 59 ||
+        fields[5] > 60) {
+        return -1;
+    }
+    #ifdef _WIN32
+        *out = _mkgmtime(&tm_value);
+    #else
+        *out = timegm(&tm_value);
+    #endif
+    return *out == (time_t)-1 ? -1 : 0;
+}
+
+// A decoded X-Amz-* parameter of the URL.
+typedef struct {
+    const char *value;
+    size_t len;
+    const param_view_t *view;   // its encoded form in the canonical query
+} fixed_param_t;
+
+typedef struct {
+    param_view_t views[VERIFY_MAX_PARAMS];
+    size_t count;
+    fixed_param_t fixed[FIXED_PARAMS];
+    unsigned char signature[ECDSA_SIGNATURE_MAX];   // HMAC or, for SigV4A, DER ECDSA
+    size_t signature_len;
+    int has_signature;
+} verify_query_t;
+
+static int is_unreserved(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' ||
+           c == '.' || c == '~';
+}
+
+// Whether text is already encoded the way the signer encodes it: unreserved
+// bytes as they are, every other byte as %XX in upper case. Signed URLs
+// are, so their parameters are used where they lie in the URL.
+static int is_canonical(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (is_unreserved(c)) {
+            continue;
+        }
+        if (c != '%' || i + 2 >= len) {
+            return 0;
+        }
+        int high = hex_value(text[i + 1]);
+        int low = hex_value(text[i + 2]);
+        if (high < 0 || low < 0 || (text[i + 1] >= 'a' && text[i + 1] <= 'f') ||
+            (text[i + 2] >= 'a' && text[i + 2] <= 'f') || is_unreserved((unsigned char)(high << 4 | low))) {
+            return 0;
+        }
+        i += 2;
+    }
+    return 1;
+}
+
+// Splits the query into canonical parameters and picks out the X-Amz-* ones,
+// decoded, and the signature. A parameter that is not in canonical form is
+// decoded and encoded again into the arena.
+static int parse_query(const char *query, size_t len, arena_t *arena, verify_query_t *parsed) {
+    const char *end = query + len;
+    const char *p = query;
+    while (p < end) {
+        const char *amp = memchr(p, '&', (size_t)(end - p));
+        const char *piece_end = amp ? amp : end;
+        const char *equals = memchr(p, '=', (size_t)(piece_end - p));
+        const char *name_end = equals ? equals : piece_end;
+        const char *value = equals ? equals + 1 : piece_end;
+        size_t name_len = (size_t)(name_end - p);
+        size_t value_len = (size_t)(piece_end - value);
+        if (name_len == 0) {
+            if (piece_end == p) {
+                p = piece_end + 1;
+                continue;
+            }
+            return PRESIGN_ERR_URL_INVALID;
+        }
+
+        // The view is "&name=value"; the first parameter follows '?', not '&'
+        const char *dname = p;
+        const char *dvalue = value;
+        size_t dn = name_len;
+        size_t dv = value_len;
+        int in_place = p > query && equals && is_canonical(p, name_len) && is_canonical(value, value_len);
+        const char *text = p - 1;
+        size_t text_len = (size_t)(piece_end - text);
+        size_t en = name_len;
+        if (!in_place) {
+            char *decoded = arena_alloc(arena, 4 * (name_len + value_len) + 2);
+            if (!decoded) {
+                return PRESIGN_ERR_OUT_OF_MEMORY;
+            }
+            if (percent_decode(p, name_len, decoded, &dn) != 0 ||
+                percent_decode(value, value_len, decoded + dn, &dv) != 0) {
+                return PRESIGN_ERR_URL_INVALID;
+            }
+            dname = decoded;
+            dvalue = decoded + dn;
+            char *encoded = decoded + dn + dv;
+            size_t capacity = 3 * (dn + dv) + 2;
+            size_t ev;
+            encoded[0] = '&';
+            url_encode_bytes(dname, dn, encoded + 1, capacity - 1, 0, &en);
+            encoded[1 + en] = '=';
+            url_encode_bytes(dvalue, dv, encoded + 2 + en, capacity - 2 - en, 0, &ev);
+            text = encoded;
+            text_len = 2 + en + ev;
+        }
+        p = piece_end + 1;
+
+        int fixed = -1;
+        int is_signature = dn == LITERAL_LEN(SIGNATURE_PARAM) - 2 && memcmp(dname, SIGNATURE_PARAM + 1, dn) == 0;
+        for (int f = 0; f < FIXED_PARAMS && !is_signature && fixed < 0; f++) {
+            if (strlen(FIXED_PARAM_NAMES[f]) == dn && memcmp(FIXED_PARAM_NAMES[f], dname, dn) == 0) {
+                fixed = f;
+            }
+        }
+        // Only the X-Amz-* values are read, so only they are decoded
+        if (in_place && (fixed >= 0 || is_signature) && memchr(dvalue, '%', dv)) {
+            char *decoded = arena_alloc(arena, value_len);
+            if (!decoded || percent_decode(value, value_len, decoded, &dv) != 0) {
+                return decoded ? PRESIGN_ERR_URL_INVALID : PRESIGN_ERR_OUT_OF_MEMORY;
+            }
+            dvalue = decoded;
+        }
+
+        if (is_signature) {
+            if (parsed->has_signature || dv % 2 != 0 || dv < HMAC_SIGNATURE_HEX_LEN || dv > MAX_SIGNATURE_HEX_LEN) {
+                return PRESIGN_ERR_URL_INVALID;
+            }
+            parsed->signature_len = dv / 2;
+            for (size_t i = 0; i < parsed->signature_len; i++) {
+                int high = hex_value(dvalue[2 * i]);
+                int low = hex_value(dvalue[2 * i + 1]);
+                if (high < 0 || low < 0) {
+                    return PRESIGN_ERR_URL_INVALID;
+                }
+                parsed->signature[i] = (unsigned char)(high << 4 | low);
+            }
+            parsed->has_signature = 1;
+            continue;
+        }
+        if (parsed->count == VERIFY_MAX_PARAMS) {
+            return PRESIGN_ERR_URL_INVALID;
+        }
+        param_view_t *view = &parsed->views[parsed->count++];
+        view->text.data = text;
+        view->text.len = text_len;
+        view->name_len = en;
+        if (fixed >= 0) {
+            if (parsed->fixed[fixed].value) {
+                return PRESIGN_ERR_URL_INVALID;
+            }
+            parsed->fixed[fixed].value = dvalue;
+            parsed->fixed[fixed].len = dv;
+            parsed->fixed[fixed].view = view;
+        }
+    }
+    // The views move when sorted; the fixed ones are only read before that
+    return PRESIGN_OK;
+}
+
+// Checks the algorithm, scope, session token and validity period, and
+// fills in the signing time of parts.
+static int check_scope(const presign_ctx_t *ctx, const verify_query_t *parsed, time_t now, request_parts_t *parts) {
+    const fixed_param_t *fixed = parsed->fixed;
+    if (!parsed->has_signature || !fixed[PARAM_ALGORITHM].value || !fixed[PARAM_CREDENTIAL].value ||
+        !fixed[PARAM_DATE].value || !fixed[PARAM_EXPIRES].value || !fixed[PARAM_SIGNED_HEADERS].value ||
+        fixed[PARAM_ALGORITHM].view->text.len != ctx->algorithm_param.len ||
+        memcmp(fixed[PARAM_ALGORITHM].view->text.data, ctx->algorithm_param.data, ctx->algorithm_param.len) != 0 ||
+        (!ctx->sigv4a && parsed->signature_len != 32)) {
+        return PRESIGN_ERR_URL_INVALID;
+    }
+
+    time_t signed_at;
+    if (parse_amz_date(fixed[PARAM_DATE].value, fixed[PARAM_DATE].len, &signed_at) != 0) {
+        return PRESIGN_ERR_URL_INVALID;
+    }
+    memcpy(parts->datetime, fixed[PARAM_DATE].value, DATETIME_LEN);
+    parts->datetime[DATETIME_LEN] = '\0';
+    memcpy(parts->date_stamp, fixed[PARAM_DATE].value, DATE_STAMP_LEN);
+    parts->date_stamp[DATE_STAMP_LEN] = '\0';
+    parts->now = signed_at;
+
+    long expires = 0;
+    for (size_t i = 0; i < fixed[PARAM_EXPIRES].len; i++) {
+        char c = fixed[PARAM_EXPIRES].value[i];
+        if (c < '0' || c > '9' || i >= 6) {
+            return PRESIGN_ERR_URL_INVALID;
+        }
+        expires = expires * 10 + (c - '0');
+    }
+    if (expires <= 0 || expires > PRESIGN_MAX_EXPIRES) {
+        return PRESIGN_ERR_URL_INVALID;
+    }
+
+    // <access key>/<date>/<region>/<service>/aws4_request
+    size_t access_key_len = strlen(ctx->access_key);
+    const char *credential = fixed[PARAM_CREDENTIAL].value;
+    if (fixed[PARAM_CREDENTIAL].len != access_key_len + 1 + DATE_STAMP_LEN + ctx->scope_suffix_len ||
+        memcmp(credential, ctx->access_key, access_key_len) != 0 || credential[access_key_len] != '/' ||
+        memcmp(credential + access_key_len + 1, parts->date_stamp, DATE_STAMP_LEN) != 0 ||
+        memcmp(credential + access_key_len + 1 + DATE_STAMP_LEN, ctx->scope_suffix, ctx->scope_suffix_len) != 0) {
+        return PRESIGN_ERR_CREDENTIAL_MISMATCH;
+    }
+    const param_view_t *token = fixed[PARAM_TOKEN].view;
+    if (token ? token->text.len != ctx->token_param_len ||
+                    memcmp(token->text.data, ctx->token_param, ctx->token_param_len) != 0
+              : ctx->token_param_len != 0) {
+        return PRESIGN_ERR_CREDENTIAL_MISMATCH;
+    }
+    // SigV4A URLs must carry the signer's own region set
+    const param_view_t *region_set = fixed[PARAM_REGION_SET].view;
+    if (region_set ? region_set->text.len != ctx->region_set_param_len ||
+                         memcmp(region_set->text.data, ctx->region_set_param, ctx->region_set_param_len) != 0
+                   : ctx->region_set_param_len != 0) {
+        return PRESIGN_ERR_CREDENTIAL_MISMATCH;
+    }
+
+    if (signed_at > now + VERIFY_CLOCK_SKEW || now - signed_at >= expires) {
+        return PRESIGN_ERR_EXPIRED;
+    }
+    return PRESIGN_OK;
+}
+
+// Finds the received value of each signed header and canonicalizes them;
+// the result has to list exactly the URL's X-Amz-SignedHeaders.
+static int verify_headers(const presign_ctx_t *ctx, const verify_query_t *parsed, const presign_header_t *received,
+                          size_t received_count, arena_t *arena, request_parts_t *parts) {
+    const fixed_param_t *list = &parsed->fixed[PARAM_SIGNED_HEADERS];
+    char *names = arena_strndup(arena, list->value, list->len);
+    presign_header_t headers[MAX_HEADERS];
+    presign_request_t req = {0};
+    if (!names) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    req.headers = headers;
+    for (char *name = names; name;) {
+        char *next = strchr(name, ';');
+        if (next) {
+            *next++ = '\0';
+        }
+        const char *value = NULL;
+        for (size_t i = 0; i < received_count && !value; i++) {
+            if (received[i].name && strcasecmp(received[i].name, name) == 0) {
+                value = received[i].value ? received[i].value : "";
+            }
+        }
+        if (strcmp(name, "host") == 0) {
+            // Always the signer's host
+        } else if (!value) {
+            return PRESIGN_ERR_HEADER_INVALID;
+        } else if (strcmp(name, CONTENT_SHA256_HEADER) == 0) {
+            req.payload_hash = value;
+        } else if (req.header_count == MAX_HEADERS) {
+            return PRESIGN_ERR_TOO_MANY_HEADERS;
+        } else {
+            headers[req.header_count].name = name;
+            headers[req.header_count++].value = value;
+        }
+        name = next;
+    }
+
+    int status = canonicalize_headers(ctx, &req, arena, &parts->canonical_headers, &parts->signed_headers);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    if (parts->signed_headers.len != list->len || memcmp(parts->signed_headers.data, list->value, list->len) != 0) {
+        return PRESIGN_ERR_URL_INVALID;
+    }
+    parts->payload_line.data = PAYLOAD_LINE;
+    parts->payload_line.len = LITERAL_LEN(PAYLOAD_LINE);
+    if (req.payload_hash) {
+        size_t hash_len = strlen(req.payload_hash);
+        char *line = arena_alloc(arena, hash_len + 1);
+        if (!line) {
+            return PRESIGN_ERR_OUT_OF_MEMORY;
+        }
+        line[0] = '\n';
+        memcpy(line + 1, req.payload_hash, hash_len);
+        parts->payload_line.data = line;
+        parts->payload_line.len = hash_len + 1;
+    }
+    return PRESIGN_OK;
+}
+
+static int verify_url(presign_ctx_t *ctx, const char *method, const char *url, size_t url_len,
+                      const presign_header_t *headers, size_t header_count, time_t now, arena_t *arena,
+                      stats_timer_t *timer) {
+    request_parts_t parts;
+    size_t method_len = strlen(method);
+    if (method_len == 0 || method_len >= sizeof(parts.method)) {
+        return PRESIGN_ERR_METHOD_INVALID;
+    }
+    for (size_t i = 0; i <= method_len; i++) {
+        unsigned char c = (unsigned char)method[i];
+        if (i < method_len && !isalpha(c)) {
+            return PRESIGN_ERR_METHOD_INVALID;
+        }
+        parts.method[i] = (char)toupper(c);
+    }
+    parts.method_len = method_len;
+
+    // [scheme://host]/path?query; the host must be the signer's
+    const char *end = url + url_len;
+    const char *path = url;
+    const char *endpoint_path = strstr(ctx->endpoint, "://") + 3 + ctx->host_len;
+    size_t endpoint_path_len = ctx->endpoint_len - (size_t)(endpoint_path - ctx->endpoint);
+    if (url_len > 0 && url[0] != '/') {
+        const char *scheme_end = url;
+        while (scheme_end < end && (isalnum((unsigned char)*scheme_end) || *scheme_end == '+' ||
+                                    *scheme_end == '-' || *scheme_end == '.')) {
+            scheme_end++;
+        }
+        if (scheme_end == url || !isalpha((unsigned char)url[0]) || end - scheme_end < 3 ||
+            memcmp(scheme_end, "://", 3) != 0) {
+            return PRESIGN_ERR_URL_INVALID;
+        }
+        const char *host = scheme_end + 3;
+        path = host;
+        while (path < end && *path != '/' && *path != '?') {
+            path++;
+        }
+        if ((size_t)(path - host) != ctx->host_len || strncasecmp(host, ctx->host, ctx->host_len) != 0) {
+            return PRESIGN_ERR_CREDENTIAL_MISMATCH;
+        }
+    }
+    const char *question = memchr(path, '?', (size_t)(end - path));
+    if (!question) {
+        return PRESIGN_ERR_URL_INVALID;
+    }
+    // The signer's URIs leave out the endpoint's own path
+    size_t path_len = (size_t)(question - path);
+    if (endpoint_path_len > 0 && path_len > endpoint_path_len && path[endpoint_path_len] == '/' &&
+        memcmp(path, endpoint_path, endpoint_path_len) == 0) {
+        path += endpoint_path_len;
+        path_len -= endpoint_path_len;
+    }
+    char *decoded_path = arena_alloc(arena, path_len + 1);
+    size_t decoded_path_len = 0;
+    if (!decoded_path) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    if (percent_decode(path, path_len, decoded_path, &decoded_path_len) != 0) {
+        return PRESIGN_ERR_URL_INVALID;
+    }
+    int status = encode_view(arena, decoded_path, decoded_path_len,
+                             decoded_path_len == 0 || decoded_path[0] != '/', 1, &parts.canonical_uri);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+
+    verify_query_t parsed;
+    parsed.count = 0;
+    parsed.has_signature = 0;
+    parsed.signature_len = 0;
+    memset(parsed.fixed, 0, sizeof(parsed.fixed));
+    status = parse_query(question + 1, (size_t)(end - question - 1), arena, &parsed);
+    if (status == PRESIGN_OK) {
+        status = check_scope(ctx, &parsed, now, &parts);
+    }
+    if (status == PRESIGN_OK) {
+        status = verify_headers(ctx, &parsed, headers, header_count, arena, &parts);
+    }
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    qsort(parsed.views, parsed.count, sizeof(parsed.views[0]), compare_params);
+    STATS_LAP(timer, STAT_CANONICALIZE);
+
+    crypto_ctx_t *cc = crypto_thread_ctx();
+    if (!cc) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    sha256_stream_t *inner = crypto_ctx_inner(cc);
+    sha256_stream_t *outer = crypto_ctx_outer(cc);
+    int crypto_failed = sha256_stream_start(inner) != 0 ||
+                        sha256_stream_update(inner, parts.method, parts.method_len) != 0 ||
+                        sha256_stream_update(inner, "\n", 1) != 0 ||
+                        sha256_stream_update(inner, parts.canonical_uri.data, parts.canonical_uri.len) != 0 ||
+                        sha256_stream_update(inner, "\n", 1) != 0;
+    for (size_t i = 0; i < parsed.count && !crypto_failed; i++) {
+        size_t skip = i == 0 ? 1 : 0;
+        crypto_failed = sha256_stream_update(inner, parsed.views[i].text.data + skip,
+                                             parsed.views[i].text.len - skip) != 0;
+    }
+    unsigned char digest[32];
+    crypto_failed = crypto_failed || sha256_stream_update(inner, "\n", 1) != 0 ||
+                    sha256_stream_update(inner, parts.canonical_headers.data, parts.canonical_headers.len) != 0 ||
+                    sha256_stream_update(inner, "\n", 1) != 0 ||
+                    sha256_stream_update(inner, parts.signed_headers.data, parts.signed_headers.len) != 0 ||
+                    sha256_stream_update(inner, parts.payload_line.data, parts.payload_line.len) != 0 ||
+                    sha256_stream_finish(inner, digest) != 0;
+    STATS_LAP(timer, STAT_HASH);
+    if (crypto_failed) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+
+    char string_to_sign[STRING_TO_SIGN_LEN];
+    char *canonical_hash_hex = write_string_to_sign(ctx, &parts, string_to_sign);
+    to_hex(digest, 32, canonical_hash_hex);
+    if (ctx->sigv4a) {
+        const ecdsa_key_t *key;
+        status = key_table_ecdsa(ctx->keys, &key);
+        STATS_LAP(timer, STAT_KEY);
+        if (status != PRESIGN_OK) {
+            return status;
+        }
+        if (crypto_sha256(cc, string_to_sign, (size_t)(canonical_hash_hex + 64 - string_to_sign), digest) != 0) {
+            return PRESIGN_ERR_CRYPTO;
+        }
+        status = ecdsa_verify(key, digest, parsed.signature, parsed.signature_len) == 0
+                     ? PRESIGN_OK : PRESIGN_ERR_SIGNATURE_MISMATCH;
+        STATS_LAP(timer, STAT_SIGN);
+        return status;
+    }
+    status = key_table_begin(ctx->keys, now, parts.date_stamp, inner, outer);
+    STATS_LAP(timer, STAT_KEY);
+    if (status != PRESIGN_OK) {
+        return status;
+    }
+    if (sha256_stream_update(inner, string_to_sign, (size_t)(canonical_hash_hex + 64 - string_to_sign)) != 0 ||
+        hmac_sha256_end(inner, outer, digest) != 0) {
+        return PRESIGN_ERR_CRYPTO;
+    }
+    // Constant time: every byte is compared whatever the first difference
+    unsigned char difference = 0;
+    for (int i = 0; i < 32; i++) {
+        difference |= (unsigned char)(digest[i] ^ parsed.signature[i]);
+    }
+    STATS_LAP(timer, STAT_SIGN);
+    return difference == 0 ? PRESIGN_OK : PRESIGN_ERR_SIGNATURE_MISMATCH;
+}
+
+int presign_verify_url(presign_ctx_t *ctx, const char *method, const char *url, size_t url_len,
+                       const presign_header_t *headers, size_t header_count, time_t now) {
+    if (!ctx || !method || !url || (header_count > 0 && !headers)) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    stats_timer_t timer;
+    STATS_START(&timer);
+    char inline_buffer[REQUEST_ARENA_INLINE];
+    arena_t arena;
+    arena_init(&arena, inline_buffer, sizeof(inline_buffer));
+    int status = verify_url(ctx, method, url, url_len, headers, header_count, now ? now : time(NULL), &arena,
+                            &timer);
+    arena_free(&arena);
+    STATS_END(&timer, STAT_VERIFY);
+    STATS_COUNT(status == PRESIGN_OK ? STAT_VERIFIED : STAT_VERIFY_FAILURES, 1);
+    return status;
+}
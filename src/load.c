@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * presign load: drives presigned requests against an S3 endpoint over
+ * plain HTTP, normally a `presign s3-local` stand-in, and reports what a
+ * client sees end to end.
+ *
+ * --concurrency workers each keep one connection open and cycle through
+ * PUT, GET and DELETE of their own objects, signing every request just
+ * before sending it. A request's latency runs from the start of signing to
+ * the end of the response, so the report can show which share of it went
+ * to signing. Responses are classified as successes, signature rejections
+ * (403), other HTTP errors and transport errors; GET bodies are compared
+ * with what was uploaded. --corrupt-every K damages the signature of every
+ * Kth GET, which the server has to reject: those rejections are expected
+ * and reported separately, so a run checks the failure counting too.
+ */
+
+#define LOAD_DEFAULT_REQUESTS 10000
+#define LOAD_DEFAULT_CONCURRENCY 4
+#define LOAD_DEFAULT_SIZE 1024
+#define LOAD_MAX_CONCURRENCY 1024
+#define LOAD_MAX_SIZE (64u << 20)
+#define LOAD_MAX_HEAD 16384
+
+typedef struct {
+    presign_ctx_t *ctx;
+    const char *host;           // host[:port] of the endpoint, the Host header
+    const char *port;
+    char host_name[256];        // without the port, for getaddrinfo()
+    const char *bucket;
+    const char *body;
+    size_t size;
+    unsigned long corrupt_every;
+} load_config_t;
+
+typedef struct {
+    const load_config_t *config;
+    unsigned int id;
+    unsigned long count;        // requests to send
+    double *latencies;          // seconds, one per request sent
+    unsigned long done;
+    double sign_seconds;
+    unsigned long ok;
+    unsigned long signature_failures;
+    unsigned long expected_failures;
+    unsigned long http_errors;
+    unsigned long transport_errors;
+    int fd;
+    char head[LOAD_MAX_HEAD];
+    size_t head_len;            // response bytes read past the last response
+    char *scratch;              // GET bodies
+} load_worker_t;
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int connect_endpoint(const load_config_t *config) {
+    struct addrinfo hints;
+    struct addrinfo *addresses = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config->host_name, config->port, &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Reads len bytes of body into out (NULL to drop them), starting with the
+// bytes already read past the response head.
+static int read_body(load_worker_t *worker, char *out, size_t len) {
+    size_t buffered = worker->head_len < len ? worker->head_len : len;
+    if (out) {
+        memcpy(out, worker->head, buffered);
+    }
+    memmove(worker->head, worker->head + buffered, worker->head_len - buffered);
+    worker->head_len -= buffered;
+    for (size_t filled = buffered; filled < len;) {
+        char drop[16384];
+        size_t want = len - filled;
+        char *into = out ? out + filled : drop;
+        if (!out && want > sizeof(drop)) {
+            want = sizeof(drop);
+        }
+        ssize_t got = recv(worker->fd, into, want, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        filled += (size_t)got;
+    }
+    return 0;
+}
+
+// Reads one response: its status, and its body into out when it has
+// exactly expected_len bytes (compared by the caller), or dropped.
+// *body_len receives the body length. Returns -1 on transport errors.
+static int read_response(load_worker_t *worker, int *status, char *out, size_t expected_len, size_t *body_len) {
+    char *end;
+    while (!(end = memmem(worker->head, worker->head_len, "\r\n\r\n", 4))) {
+        if (worker->head_len == sizeof(worker->head)) {
+            return -1;
+        }
+        ssize_t got = recv(worker->fd, worker->head + worker->head_len, sizeof(worker->head) - worker->head_len, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        worker->head_len += (size_t)got;
+    }
+    *end = '\0';
+    if (sscanf(worker->head, "HTTP/1.%*d %d", status) != 1) {
+        return -1;
+    }
+    unsigned long long length = 0;
+    for (char *line = strstr(worker->head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "content-length:", 15) == 0) {
+            length = strtoull(line + 17, NULL, 10);
+        }
+    }
+    size_t head_len = (size_t)(end + 4 - worker->head);
+    memmove(worker->head, worker->head + head_len, worker->head_len - head_len);
+    worker->head_len -= head_len;
+    *body_len = (size_t)length;
+    return read_body(worker, length == expected_len ? out : NULL, (size_t)length);
+}
+
+// Signs and sends request number n of the worker and reads its response.
+static void run_request(load_worker_t *worker, unsigned long n) {
+    const load_config_t *config = worker->config;
+    static const char *const methods[] = {"PUT", "GET", "DELETE"};
+    const char *method = methods[n % 3];
+    int is_put = n % 3 == 0;
+    int is_get = n % 3 == 1;
+    char path[256];
+    snprintf(path, sizeof(path), "%s/load/%u/%lu", config->bucket, worker->id, n / 3);
+
+    presign_request_t req = {0};
+    req.method = method;
+    req.path = path;
+    req.expires = 300;
+    char url[MAX_URL_LEN];
+    size_t url_len = 0;
+    double start = monotonic_seconds();
+    int signed_ok = presign_sign_url(config->ctx, &req, url, sizeof(url), &url_len) == PRESIGN_OK;
+    double signed_at = monotonic_seconds();
+    worker->sign_seconds += signed_at - start;
+    if (!signed_ok) {
+        worker->http_errors++;
+        return;
+    }
+    int corrupt = is_get && config->corrupt_every > 0 && (n / 3) % config->corrupt_every == config->corrupt_every - 1;
+    if (corrupt) {
+        url[url_len - 1] = url[url_len - 1] == '0' ? '1' : '0';
+    }
+
+    // Origin form of the URL: everything from the path on
+    const char *target = strstr(url, "://");
+    target = target ? strchr(target + 3, '/') : NULL;
+    char head[MAX_URL_LEN + 512];
+    int head_len = target ? snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\n\r\n",
+                                     method, target, config->host, is_put ? config->size : 0)
+                          : -1;
+    int status = 0;
+    size_t body_len = 0;
+    if (head_len < 0 || head_len >= (int)sizeof(head)) {
+        worker->http_errors++;
+        return;
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (worker->fd < 0) {
+            worker->fd = connect_endpoint(config);
+            worker->head_len = 0;
+        }
+        if (worker->fd >= 0 && send_all(worker->fd, head, (size_t)head_len) == 0 &&
+            (!is_put || send_all(worker->fd, config->body, config->size) == 0) &&
+            read_response(worker, &status, is_get ? worker->scratch : NULL, config->size, &body_len) == 0) {
+            break;
+        }
+        // A kept-alive connection the server closed is retried once
+        if (worker->fd >= 0) {
+            close(worker->fd);
+        }
+        worker->fd = -1;
+        status = 0;
+    }
+    worker->latencies[worker->done++] = monotonic_seconds() - start;
+
+    if (status == 0) {
+        worker->transport_errors++;
+    } else if (status == 403) {
+        worker->signature_failures++;
+        worker->expected_failures += corrupt;
+    } else if (status / 100 != 2 ||
+               (is_get && (body_len != config->size || memcmp(worker->scratch, config->body, config->size) != 0))) {
+        worker->http_errors++;
+    } else {
+        worker->ok++;
+    }
+}
+
+static void *worker_thread(void *arg) {
+    load_worker_t *worker = arg;
+    for (unsigned long n = 0; n < worker->count; n++) {
+        run_request(worker, n);
+    }
+    if (worker->fd >= 0) {
+        close(worker->fd);
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned long count, double p) {
+    unsigned long index = (unsigned long)(p * (double)(count - 1) + 0.5);
+    return sorted[index];
+}
+
+// Runs the workers and prints the report. Returns 1 when any request
+// failed other than the damaged ones.
+static int run_workers(const load_config_t *config, unsigned long requests, unsigned int concurrency) {
+    load_worker_t *workers = calloc(concurrency, sizeof(*workers));
+    pthread_t *threads = calloc(concurrency, sizeof(*threads));
+    double *latencies = malloc(requests * sizeof(double));
+    int failed = !workers || !threads || !latencies;
+    unsigned long assigned = 0;
+    for (unsigned int i = 0; i < concurrency && !failed; i++) {
+        load_worker_t *worker = &workers[i];
+        worker->config = config;
+        worker->id = i;
+        worker->count = requests / concurrency + (i < requests % concurrency);
+        worker->latencies = latencies + assigned;
+        worker->fd = -1;
+        worker->scratch = malloc(config->size + 1);
+        assigned += worker->count;
+        failed = !worker->scratch;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+
+    unsigned int started = 0;
+    double start = monotonic_seconds();
+    for (; started < concurrency && !failed; started++) {
+        if (pthread_create(&threads[started], NULL, worker_thread, &workers[started]) != 0) {
+            fprintf(stderr, "Error: Cannot start worker thread\n");
+            failed = 1;
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    if (!failed) {
+        unsigned long done = 0;
+        unsigned long ok = 0;
+        unsigned long signature_failures = 0;
+        unsigned long expected = 0;
+        unsigned long http_errors = 0;
+        unsigned long transport_errors = 0;
+        double sign_seconds = 0;
+        double latency_seconds = 0;
+        for (unsigned int i = 0; i < concurrency; i++) {
+            // Each worker's latencies follow the previous worker's
+            memmove(latencies + done, workers[i].latencies, workers[i].done * sizeof(double));
+            for (unsigned long j = 0; j < workers[i].done; j++) {
+                latency_seconds += workers[i].latencies[j];
+            }
+            done += workers[i].done;
+            ok += workers[i].ok;
+            signature_failures += workers[i].signature_failures;
+            expected += workers[i].expected_failures;
+            http_errors += workers[i].http_errors;
+            transport_errors += workers[i].transport_errors;
+            sign_seconds += workers[i].sign_seconds;
+        }
+        qsort(latencies, done, sizeof(double), compare_doubles);
+        printf("requests:   %lu (concurrency %u, %zu-byte objects, %lu ok)\n", requests, concurrency, config->size, ok);
+        printf("elapsed:    %.3f s\n", elapsed);
+        printf("throughput: %.0f req/s\n", (double)done / elapsed);
+        if (done > 0) {
+            printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                   percentile(latencies, done, 0.50) * 1e6, percentile(latencies, done, 0.90) * 1e6,
+                   percentile(latencies, done, 0.99) * 1e6, percentile(latencies, done, 0.999) * 1e6,
+                   latencies[done - 1] * 1e6);
+            printf("signing:    %.2f us per request, %.2f%% of latency\n", sign_seconds / (double)requests * 1e6,
+                   latency_seconds > 0 ? 100.0 * sign_seconds / latency_seconds : 0.0);
+        }
+        printf("failures:   signature %lu (%lu expected), http %lu, transport %lu\n", signature_failures, expected,
+               http_errors, transport_errors);
+        failed = signature_failures != expected || http_errors > 0 || transport_errors > 0;
+    }
+
+    for (unsigned int i = 0; workers && i < concurrency; i++) {
+        free(workers[i].scratch);
+    }
+    free(workers);
+    free(threads);
+    free(latencies);
+    return failed;
+}
+
+static void print_load_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s load --endpoint http://HOST:PORT [--region REGION] [--requests N]\n"
+                    "       %*s [--concurrency N] [--size BYTES] [--bucket NAME] [--corrupt-every K]\n",
+            prog_name, (int)strlen(prog_name), "");
+}
+
+static int parse_count(const char *option, const char *text, unsigned long max, unsigned long *out) {
+    char *end = NULL;
+    errno = 0;
+    *out = strtoul(text, &end, 10);
+    if (*text == '\0' || *text == '-' || *end != '\0' || errno != 0 || *out == 0 || *out > max) {
+        fprintf(stderr, "Error: %s must be between 1 and %lu\n", option, max);
+        return -1;
+    }
+    return 0;
+}
+
+int run_load(int argc, char *argv[]) {
+    const char *region = getenv("S3_REGION");
+    const char *endpoint = getenv("S3_ENDPOINT");
+    unsigned long requests = LOAD_DEFAULT_REQUESTS;
+    unsigned long concurrency = LOAD_DEFAULT_CONCURRENCY;
+    unsigned long size = LOAD_DEFAULT_SIZE;
+    static load_config_t config;
+    config.bucket = "load-bucket";
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--endpoint") == 0 && i + 1 < argc) {
+            endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            region = argv[++i];
+        } else if (strcmp(argv[i], "--bucket") == 0 && i + 1 < argc) {
+            config.bucket = argv[++i];
+            if (strlen(config.bucket) > 63 || *config.bucket == '\0' || strchr(config.bucket, '/')) {
+                fprintf(stderr, "Error: Invalid --bucket name\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            if (parse_count("--requests", argv[++i], 100000000ul, &requests) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc) {
+            if (parse_count("--concurrency", argv[++i], LOAD_MAX_CONCURRENCY, &concurrency) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (parse_count("--size", argv[++i], LOAD_MAX_SIZE, &size) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--corrupt-every") == 0 && i + 1 < argc) {
+            if (parse_count("--corrupt-every", argv[++i], 1000000ul, &config.corrupt_every) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            i++;    // enabled by main()
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            print_load_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!endpoint || strncmp(endpoint, "http://", 7) != 0) {
+        fprintf(stderr, "Error: --endpoint must be an http:// URL (the load generator does not speak TLS)\n");
+        print_load_usage(argv[0]);
+        return 1;
+    }
+    if (!region) {
+        fprintf(stderr, "Error: REGION is required (provide --region or set S3_REGION)\n");
+        return 1;
+    }
+
+    // http://host[:port][/...]
+    static char host[256];
+    const char *authority = endpoint + 7;
+    size_t authority_len = strcspn(authority, "/");
+    if (authority_len == 0 || authority_len >= sizeof(host)) {
+        fprintf(stderr, "Error: Invalid --endpoint '%s'\n", endpoint);
+        return 1;
+    }
+    memcpy(host, authority, authority_len);
+    host[authority_len] = '\0';
+    memcpy(config.host_name, host, authority_len + 1);
+    char *colon = strrchr(config.host_name, ':');
+    config.port = "80";
+    if (colon && !strchr(colon, ']')) {
+        *colon = '\0';
+        config.port = host + (colon - config.host_name) + 1;
+    }
+    config.host = host;
+
+    static presign_args_t args;
+    strcpy(args.service, "s3");
+    if (snprintf(args.region, sizeof(args.region), "%s", region) >= (int)sizeof(args.region) ||
+        snprintf(args.bucket_url, sizeof(args.bucket_url), "%s", endpoint) >= (int)sizeof(args.bucket_url)) {
+        fprintf(stderr, "Error: Region or endpoint too long\n");
+        return 1;
+    }
+    signer_t signer;
+    if (init_signer(&signer, &args, NULL) != 0) {
+        return 1;
+    }
+    config.ctx = signer.ctx;
+    config.size = size;
+    char *body = malloc(size);
+    if (!body) {
+        fprintf(stderr, "Error: Out of memory\n");
+        presign_ctx_free(signer.ctx);
+        return 1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        body[i] = (char)('a' + i % 26);
+    }
+    config.body = body;
+
+    if (concurrency > requests) {
+        concurrency = requests;
+    }
+    int rc = run_workers(&config, requests, (unsigned int)concurrency);
+    free(body);
+    presign_ctx_free(signer.ctx);
+    return rc;
+}
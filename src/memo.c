@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cli.h"
+
+/*
+ * Memo cache of signed URLs for presign serve --memo.
+ *
+ * With a time bucket, a request frame and the start of its bucket fully
+ * determine the URL, so a repeated frame is answered from the cache without
+ * signing. The cache is a set-associative table of MEMO_WAYS entries per
+ * set, indexed by an FNV-1a hash of the frame; a full set gives up its least
+ * recently used entry. An entry of an older bucket is simply a miss and is
+ * overwritten when the frame is signed again, so the cache never needs a
+ * sweep and its size stays bounded.
+ */
+
+#define MEMO_WAYS 4
+
+struct memo_entry {
+    uint64_t hash;
+    time_t bucket;
+    uint64_t used;              // memo->clock at the last hit or store, 0 when free
+    char *data;                 // key bytes, then URL bytes
+    size_t key_len;
+    size_t url_len;
+    size_t cap;
+};
+
+uint64_t memo_hash(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int memo_init(memo_t *memo, size_t capacity) {
+    memset(memo, 0, sizeof(*memo));
+    size_t sets = 1;
+    while (sets * MEMO_WAYS < capacity) {
+        sets *= 2;
+    }
+    memo->entries = calloc(sets * MEMO_WAYS, sizeof(*memo->entries));
+    if (!memo->entries) {
+        return -1;
+    }
+    memo->set_mask = sets - 1;
+    return 0;
+}
+
+static memo_entry_t *memo_set(memo_t *memo, uint64_t hash) {
+    return &memo->entries[(size_t)(hash & memo->set_mask) * MEMO_WAYS];
+}
+
+static int entry_matches(const memo_entry_t *entry, uint64_t hash, const char *key, size_t key_len) {
+    return entry->used && entry->hash == hash && entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0;
+}
+
+const char *memo_lookup(memo_t *memo, uint64_t hash, const char *key, size_t key_len, time_t bucket,
+                        size_t *url_len) {
+    memo_entry_t *set = memo_set(memo, hash);
+    for (int way = 0; way < MEMO_WAYS; way++) {
+        memo_entry_t *entry = &set[way];
+        if (entry->bucket == bucket && entry_matches(entry, hash, key, key_len)) {
+            entry->used = ++memo->clock;
+            memo->hits++;
+            *url_len = entry->url_len;
+            return entry->data + key_len;
+        }
+    }
+    memo->misses++;
+    return NULL;
+}
+
+void memo_store(memo_t *memo, uint64_t hash, const char *key, size_t key_len, time_t bucket, const char *url,
+                size_t url_len) {
+    // The same frame from an older bucket first, then a free way, then the
+    // least recently used one
+    memo_entry_t *set = memo_set(memo, hash);
+    memo_entry_t *victim = NULL;
+    for (int way = 0; way < MEMO_WAYS && !victim; way++) {
+        if (entry_matches(&set[way], hash, key, key_len)) {
+            victim = &set[way];
+        }
+    }
+    for (int way = 0; way < MEMO_WAYS && !victim; way++) {
+        if (!set[way].used) {
+            victim = &set[way];
+        }
+    }
+    if (!victim) {
+        victim = &set[0];
+        for (int way = 1; way < MEMO_WAYS; way++) {
+            if (set[way].used < victim->used) {
+                victim = &set[way];
+            }
+        }
+    }
+
+    if (key_len + url_len > victim->cap) {
+        char *data = realloc(victim->data, key_len + url_len);
+        if (!data) {
+            return;
+        }
+        victim->data = data;
+        victim->cap = key_len + url_len;
+    }
+    memcpy(victim->data, key, key_len);
+    memcpy(victim->data + key_len, url, url_len);
+    victim->hash = hash;
+    victim->bucket = bucket;
+    victim->key_len = key_len;
+    victim->url_len = url_len;
+    victim->used = ++memo->clock;
+}
+
+void memo_free(memo_t *memo) {
+    if (memo->entries) {
+        for (size_t i = 0; i < (memo->set_mask + 1) * MEMO_WAYS; i++) {
+            free(memo->entries[i].data);
+        }
+    }
+    free(memo->entries);
+    free(memo->key.data);
+    memset(memo, 0, sizeof(*memo));
+}
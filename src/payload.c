@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "presign.h"
+#include "presign_internal.h"
+
+/*
+ * SHA-256 of a payload file for signed-payload requests.
+ *
+ * A regular file is mapped and its blocks are fed straight from the page
+ * cache to sha256_compress(), which runs on the best kernel the CPU has
+ * (SHA-NI, ARMv8 or portable) whatever the crypto backend; nothing is
+ * copied. The mapping is walked in PAYLOAD_WINDOW steps: the next window is
+ * requested ahead with MADV_WILLNEED so the disk keeps streaming while the
+ * current one is hashed, and windows already hashed are dropped from the
+ * mapping so a multi-gigabyte file does not inflate the resident set.
+ * Pipes, devices and files that cannot be mapped are read in large aligned
+ * blocks instead. The file must not shrink while it is being hashed.
+ */
+
+#define PAYLOAD_WINDOW (64u << 20)
+#define PAYLOAD_READ_BLOCK (1u << 20)
+#define SHA256_BLOCK 64
+
+static void store_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+// Pads the last tail_len (< 64) bytes of a total-byte message and writes the
+// digest of state as lowercase hex.
+static void finish_hex(uint32_t *state, const unsigned char *tail, size_t tail_len, uint64_t total, char *hex) {
+    unsigned char block[2 * SHA256_BLOCK] = {0};
+    memcpy(block, tail, tail_len);
+    block[tail_len] = 0x80;
+    size_t blocks = tail_len + 1 + 8 > SHA256_BLOCK ? 2 : 1;
+    uint64_t bits = total * 8;
+    store_be32(block + blocks * SHA256_BLOCK - 8, (uint32_t)(bits >> 32));
+    store_be32(block + blocks * SHA256_BLOCK - 4, (uint32_t)bits);
+    sha256_compress(state, block, blocks);
+
+    unsigned char digest[32];
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + i * 4, state[i]);
+    }
+    to_hex(digest, 32, hex);
+    hex[64] = '\0';
+}
+
+static int hash_mapped(int fd, size_t size, char *hex) {
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    uint32_t state[8];
+    memcpy(state, sha256_initial_state, sizeof(state));
+    size_t full = size - size % SHA256_BLOCK;
+    for (size_t offset = 0; offset < full; offset += PAYLOAD_WINDOW) {
+        size_t len = full - offset < PAYLOAD_WINDOW ? full - offset : PAYLOAD_WINDOW;
+        if (offset + len < size) {
+            size_t ahead = size - offset - len;
+            madvise(map + offset + len, ahead < PAYLOAD_WINDOW ? ahead : PAYLOAD_WINDOW, MADV_WILLNEED);
+        }
+        sha256_compress(state, map + offset, len / SHA256_BLOCK);
+        if (len == PAYLOAD_WINDOW) {
+            madvise(map + offset, len, MADV_DONTNEED);
+        }
+    }
+    finish_hex(state, map + full, size - full, size, hex);
+    munmap(map, size);
+    return 0;
+}
+
+static int hash_read(int fd, char *hex, unsigned long long *size) {
+    unsigned char *buffer = NULL;
+    if (posix_memalign((void **)&buffer, 4096, PAYLOAD_READ_BLOCK) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint32_t state[8];
+    memcpy(state, sha256_initial_state, sizeof(state));
+    uint64_t total = 0;
+    size_t filled = 0;
+    for (;;) {
+        ssize_t got = read(fd, buffer + filled, PAYLOAD_READ_BLOCK - filled);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            int saved = errno;
+            free(buffer);
+            errno = saved;
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        filled += (size_t)got;
+        total += (uint64_t)got;
+        if (filled == PAYLOAD_READ_BLOCK) {
+            sha256_compress(state, buffer, PAYLOAD_READ_BLOCK / SHA256_BLOCK);
+            filled = 0;
+        }
+    }
+    size_t full = filled - filled % SHA256_BLOCK;
+    sha256_compress(state, buffer, full / SHA256_BLOCK);
+    finish_hex(state, buffer + full, filled - full, total, hex);
+    free(buffer);
+    if (size) {
+        *size = total;
+    }
+    return 0;
+}
+
+int presign_hash_file(const char *path, char *hex, unsigned long long *size) {
+    if (!path || !hex) {
+        return PRESIGN_ERR_INVALID_ARGUMENT;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return PRESIGN_ERR_PAYLOAD_FILE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+        int saved = S_ISDIR(st.st_mode) ? EISDIR : errno;
+        close(fd);
+        errno = saved;
+        return PRESIGN_ERR_PAYLOAD_FILE;
+    }
+
+    stats_timer_t timer;
+    STATS_START(&timer);
+    int rc = -1;
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        rc = hash_mapped(fd, (size_t)st.st_size, hex);
+        if (rc == 0 && size) {
+            *size = (unsigned long long)st.st_size;
+        }
+    }
+    unsigned long long hashed = (unsigned long long)st.st_size;
+    if (rc != 0) {
+        rc = hash_read(fd, hex, &hashed);
+        if (rc == 0 && size) {
+            *size = hashed;
+        }
+    }
+    int saved = errno;
+    close(fd);
+    if (rc != 0) {
+        errno = saved;
+        return PRESIGN_ERR_PAYLOAD_FILE;
+    }
+    STATS_LAP(&timer, STAT_PAYLOAD);
+    STATS_END(&timer, -1);
+    STATS_COUNT(STAT_PAYLOAD_BYTES, hashed);
+    return PRESIGN_OK;
+}
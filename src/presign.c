@@ -4,455 +4,292 @@
 #include <time.h>
 #include <ctype.h>
 #include <limits.h>
+#include <unistd.h>
+#include <errno.h>
 #include "version.h"
-
-#ifdef USE_OPENSSL
-#include <openssl/hmac.h>
-#include <openssl/sha.h>
-#include <openssl/evp.h>
-#elif defined(USE_MBEDTLS)
-#include <mbedtls/md.h>
-#include <mbedtls/sha256.h>
-#endif
-
-#define MAX_URL_LEN 4096
-#define MAX_PATH_LEN 2048
-#define MAX_HEADER_LEN 1024
-#define MAX_HEADERS 32
-#define MAX_ENV_VAR_LEN 512
-
-typedef struct {
-    char key[MAX_HEADER_LEN];
-    char value[MAX_HEADER_LEN];
-} header_t;
-
-typedef struct {
-    char service[16];
-    char method[16];
-    char region[64];
-    char bucket_url[MAX_URL_LEN];
-    char path[MAX_PATH_LEN];
-    int expire_min;
-    header_t headers[MAX_HEADERS];
-    int header_count;
-    char now_override[32];
-} presign_args_t;
-
-int url_encode_component(const char *src, char *dest, size_t dest_size, int keep_slash) {
-    const char *hex = "0123456789ABCDEF";
-    char *d = dest;
-    size_t remaining = dest_size;
-
-    if (dest_size == 0) {
-        return -1;
-    }
-
-    while (*src) {
-        unsigned char c = (unsigned char)*src;
-        size_t needed = 0;
-
-        if ((c >= 'A' && c <= 'Z') ||
-            (c >= 'a' && c <= 'z') ||
-            (c >= '0' && c <= '9') ||
-            c == '-' || c == '_' || c == '.' || c == '~' ||
-            (keep_slash && c == '/')) {
-            needed = 1;
-        } else {
-            needed = 3;
-        }
-
-        if (needed >= remaining) {
-            return -1;
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+// Where --stats or PRESIGN_STATS sends the report, "-" for stderr; NULL
+// when statistics are off.
+static const char *stats_path;
+
+static int create_signer(signer_t *signer, const presign_args_t *args, const profile_t *profile) {
+    memset(signer, 0, sizeof(*signer));
+
+    presign_config_t config = {0};
+    config.region = args->region;
+    config.endpoint = args->bucket_url;
+    config.service = args->service;
+    config.region_set = args->region_set;
+    config.debug = getenv("PRESIGN_DEBUG") ? stderr : NULL;
+    size_t header_count = 0;
+
+    if (profile) {
+        config.access_key = profile->access_key;
+        config.secret_key = profile->secret_key;
+        config.session_token = profile->session_token;
+        if (profile->region && !args->region_from_cli) {
+            config.region = profile->region;
         }
-
-        if (needed == 1) {
-            *d++ = (char)c;
-            remaining--;
-        } else {
-            *d++ = '%';
-            *d++ = hex[(c >> 4) & 0xF];
-            *d++ = hex[c & 0xF];
-            remaining -= 3;
+        if (profile->endpoint && !args->endpoint_from_cli) {
+            config.endpoint = profile->endpoint;
         }
-
-        src++;
+        header_count = profile->header_count;
+        memcpy(signer->headers, profile->headers, header_count * sizeof(signer->headers[0]));
+    } else {
+        config.access_key = getenv("AWS_ACCESS_KEY_ID");
+        config.secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+        config.session_token = getenv("AWS_SESSION_TOKEN");
     }
+    const char *source = profile ? profile->name : "environment";
+    int source_len = profile ? (int)profile->name_len : (int)strlen(source);
 
-    if (remaining == 0) {
+    if (!config.access_key || !config.secret_key) {
+        fprintf(stderr, "Error: AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY must be set\n");
         return -1;
     }
-
-    *d = '\0';
-    return 0;
-}
-
-void to_hex(const unsigned char *data, int len, char *hex) {
-    const char *hex_chars = "0123456789abcdef";
-    for (int i = 0; i < len; i++) {
-        hex[i * 2] = hex_chars[(data[i] >> 4) & 0xF];
-        hex[i * 2 + 1] = hex_chars[data[i] & 0xF];
+    if (*config.region == '\0' && !config.region_set) {
+        fprintf(stderr, "Error: REGION is required for %.*s (provide CLI argument, S3_REGION or a profile region)\n",
+                source_len, source);
+        return -1;
     }
-    hex[len * 2] = '\0';
-}
-
-void hmac_sha256(const char *key, int key_len, const char *data, int data_len, unsigned char *result) {
-#ifdef USE_OPENSSL
-    unsigned int result_len;
-    HMAC(EVP_sha256(), key, key_len, (unsigned char*)data, data_len, result, &result_len);
-#elif defined(USE_MBEDTLS)
-    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    mbedtls_md_hmac(md_info, (const unsigned char*)key, key_len, (const unsigned char*)data, data_len, result);
-#endif
-}
-
-void sha256_hash(const char *data, int data_len, unsigned char *result) {
-#ifdef USE_OPENSSL
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    if (!ctx) {
-        fprintf(stderr, "Error: Failed to create EVP digest context\n");
-        exit(1);
+    if (*config.endpoint == '\0') {
+        fprintf(stderr, "Error: ENDPOINT is required for %.*s (provide CLI argument, S3_ENDPOINT or a profile endpoint)\n",
+                source_len, source);
+        return -1;
     }
-
-    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
-        fprintf(stderr, "Error: Failed to initialize SHA256 digest\n");
-        EVP_MD_CTX_free(ctx);
-        exit(1);
+    if (header_count + (size_t)args->header_count > MAX_HEADERS) {
+        fprintf(stderr, "Error: Too many headers for %.*s (max %d)\n", source_len, source, MAX_HEADERS);
+        return -1;
     }
 
-    if (!EVP_DigestUpdate(ctx, data, data_len)) {
-        fprintf(stderr, "Error: Failed to update SHA256 digest\n");
-        EVP_MD_CTX_free(ctx);
-        exit(1);
+    if (strlen(args->now_override) > 0 &&
+        presign_parse_timestamp(args->now_override, &signer->request.now) != PRESIGN_OK) {
+        fprintf(stderr, "Error: Invalid --now format. Use YYYY-MM-DDTHH:MM:SSZ\n");
+        return -1;
     }
 
-    if (!EVP_DigestFinal_ex(ctx, result, NULL)) {
-        fprintf(stderr, "Error: Failed to finalize SHA256 digest\n");
-        EVP_MD_CTX_free(ctx);
-        exit(1);
+    int status = presign_ctx_new(&config, &signer->ctx);
+    if (status != PRESIGN_OK) {
+        if (profile) {
+            fprintf(stderr, "Error: profile '%.*s': %s\n", source_len, source, presign_strerror(status));
+        } else {
+            fprintf(stderr, "Error: %s\n", presign_strerror(status));
+        }
+        return -1;
     }
 
-    EVP_MD_CTX_free(ctx);
-#elif defined(USE_MBEDTLS)
-    mbedtls_sha256((const unsigned char*)data, data_len, result, 0);
-#endif
-}
-
-void derive_signing_key(const char *secret, const char *date, const char *region, const char *service, unsigned char *signing_key) {
-    char aws_secret[MAX_ENV_VAR_LEN];
-    snprintf(aws_secret, sizeof(aws_secret), "AWS4%s", secret);
-
-    unsigned char date_key[32];
-    hmac_sha256(aws_secret, strlen(aws_secret), date, strlen(date), date_key);
-
-    unsigned char date_region_key[32];
-    hmac_sha256((char*)date_key, 32, region, strlen(region), date_region_key);
-
-    unsigned char date_region_service_key[32];
-    hmac_sha256((char*)date_region_key, 32, service, strlen(service), date_region_service_key);
-
-    hmac_sha256((char*)date_region_service_key, 32, "aws4_request", (int)strlen("aws4_request"), signing_key);
+    memcpy(signer->headers + header_count, args->headers, (size_t)args->header_count * sizeof(signer->headers[0]));
+    signer->request.method = args->method;
+    signer->request.headers = signer->headers;
+    signer->request.header_count = header_count + (size_t)args->header_count;
+    signer->request.expires = args->expire_min * 60;
+    signer->request.time_bucket = args->time_bucket_min * 60;
+    signer->request.params = args->params;
+    signer->request.param_count = (size_t)args->param_count;
+    signer->request.payload_hash = args->payload_hash[0] ? args->payload_hash : NULL;
+    if (args->chunked) {
+        signer->request.payload_hash = PRESIGN_STREAMING_PAYLOAD;
+    }
+    return 0;
 }
 
-int compare_headers(const void *a, const void *b) {
-    const header_t *ha = (const header_t *)a;
-    const header_t *hb = (const header_t *)b;
-    return strcmp(ha->key, hb->key);
+// Creates the signer from profile, or from the environment credentials when
+// profile is NULL, and the parsed arguments. Profile headers come before the
+// --header ones. Reports the problem on stderr and returns -1 on failure.
+int init_signer(signer_t *signer, const presign_args_t *args, const profile_t *profile) {
+    stats_timer_t timer;
+    STATS_START(&timer);
+    int rc = create_signer(signer, args, profile);
+    STATS_LAP(&timer, STAT_SETUP);
+    STATS_END(&timer, -1);
+    return rc;
 }
 
-void generate_presigned_url(presign_args_t *args) {
-    char *access_key = getenv("AWS_ACCESS_KEY_ID");
-    char *secret_key = getenv("AWS_SECRET_ACCESS_KEY");
-    const char *session_token = getenv("AWS_SESSION_TOKEN");
-
-    if (!access_key || !secret_key) {
-        fprintf(stderr, "Error: AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY must be set\n");
-        exit(1);
+int with_signer(const presign_args_t *args, signer_fn_t fn, void *arg) {
+    // A profile's signer belongs to the loaded profiles
+    if (args->profile) {
+        signer_t *signer = profile_signer(args->profiles, args->profile, args);
+        return !signer || fn(signer, args, arg) != 0;
     }
-
-    if (strlen(access_key) >= MAX_ENV_VAR_LEN) {
-        fprintf(stderr, "Error: AWS_ACCESS_KEY_ID too long (max %d chars)\n", MAX_ENV_VAR_LEN - 1);
-        exit(1);
+    signer_t signer;
+    if (init_signer(&signer, args, NULL) != 0) {
+        return 1;
     }
+    int failed = fn(&signer, args, arg) != 0;
+    presign_ctx_free(signer.ctx);
+    return failed;
+}
 
-    // Validate access key doesn't contain format specifiers
-    if (strchr(access_key, '%') != NULL) {
-        fprintf(stderr, "Error: AWS_ACCESS_KEY_ID contains invalid characters\n");
-        exit(1);
+// Writes the statistics report to the --stats destination, replacing the
+// previous report in a file. Returns -1 after reporting a write error.
+int write_stats(void) {
+    if (!stats_path) {
+        return 0;
     }
-
-    if (strlen(secret_key) >= MAX_ENV_VAR_LEN) {
-        fprintf(stderr, "Error: AWS_SECRET_ACCESS_KEY too long (max %d chars)\n", MAX_ENV_VAR_LEN - 1);
-        exit(1);
+    int to_stderr = strcmp(stats_path, "-") == 0;
+    FILE *out = to_stderr ? stderr : fopen(stats_path, "w");
+    int failed = !out || stats_write_json(out) != 0;
+    if (out && !to_stderr && fclose(out) != 0) {
+        failed = 1;
     }
-
-    if (strlen(secret_key) == 0 || strlen(secret_key) > 512) {
-        fprintf(stderr, "Error: AWS_SECRET_ACCESS_KEY invalid length (1-512 chars)\n");
-        exit(1);
+    if (failed) {
+        fprintf(stderr, "Error: Cannot write statistics to '%s'\n", stats_path);
+        return -1;
     }
+    return 0;
+}
 
-    time_t now;
-    struct tm *utc_tm;
-
-    if (strlen(args->now_override) > 0) {
-        struct tm tm_override = {0};
-        if (strptime(args->now_override, "%Y-%m-%dT%H:%M:%SZ", &tm_override) == NULL) {
-            fprintf(stderr, "Error: Invalid --now format. Use YYYY-MM-DDTHH:MM:SSZ\n");
-            exit(1);
-        }
-        
-        #ifdef _WIN32
-            now = _mkgmtime(&tm_override);
-        #else
-            now = timegm(&tm_override);
-        #endif
-        
-        if (now == (time_t)-1) {
-            fprintf(stderr, "Error: Invalid time conversion\n");
-            exit(1);
-        }
-        
-        utc_tm = gmtime(&now);
-    } else {
-        now = time(NULL);
-        utc_tm = gmtime(&now);
-    }
-
-    char date_stamp[16];
-    char datetime[32];
-    strftime(date_stamp, sizeof(date_stamp), "%Y%m%d", utc_tm);
-    strftime(datetime, sizeof(datetime), "%Y%m%dT%H%M%SZ", utc_tm);
-
-    char host[256];
-    char *url_start = strstr(args->bucket_url, "://");
-    if (!url_start) {
-        fprintf(stderr, "Error: Invalid bucket URL format\n");
-        exit(1);
-    }
-    url_start += 3;
-    char *path_start = strchr(url_start, '/');
-    if (path_start) {
-        size_t host_len = (size_t)(path_start - url_start);
-        if (host_len >= sizeof(host)) {
-            fprintf(stderr, "Error: Bucket host too long (max %zu chars)\n", sizeof(host) - 1);
-            exit(1);
-        }
-        strncpy(host, url_start, host_len);
-        host[host_len] = '\0';
-    } else {
-        size_t host_len = strlen(url_start);
-        if (host_len >= sizeof(host)) {
-            fprintf(stderr, "Error: Bucket host too long (max %zu chars)\n", sizeof(host) - 1);
-            exit(1);
+// Appends the presigned URL for req to out. URL_SLOT_LEN bytes are reserved
+// up front; a longer URL is signed again once out has room for it. Returns
+// a presign_status_t code and leaves out->len unchanged on error.
+int append_signed_url(presign_ctx_t *ctx, const presign_request_t *req, buffer_t *out) {
+    size_t url_len = 0;
+    if (buffer_reserve(out, URL_SLOT_LEN) != 0) {
+        return PRESIGN_ERR_OUT_OF_MEMORY;
+    }
+    int status = presign_sign_url(ctx, req, out->data + out->len, out->cap - out->len, &url_len);
+    if (status == PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        if (buffer_reserve(out, url_len + 1) != 0) {
+            return PRESIGN_ERR_OUT_OF_MEMORY;
         }
-        strncpy(host, url_start, sizeof(host) - 1);
-        host[sizeof(host) - 1] = '\0';
+        status = presign_sign_url(ctx, req, out->data + out->len, out->cap - out->len, &url_len);
     }
-
-    char canonical_uri[MAX_PATH_LEN];
-    if (args->path[0] != '/') {
-        canonical_uri[0] = '/';
-        if (url_encode_component(args->path, canonical_uri + 1, sizeof(canonical_uri) - 1, 1) != 0) {
-            fprintf(stderr, "Error: Encoded PATH exceeds maximum length\n");
-            exit(1);
-        }
-    } else {
-        if (url_encode_component(args->path, canonical_uri, sizeof(canonical_uri), 1) != 0) {
-            fprintf(stderr, "Error: Encoded PATH exceeds maximum length\n");
-            exit(1);
-        }
+    if (status == PRESIGN_OK) {
+        out->len += url_len;
     }
+    return status;
+}
 
-    char credential_scope[256];
-    snprintf(credential_scope, sizeof(credential_scope), "%s/%s/%s/aws4_request",
-             date_stamp, args->region, args->service);
-
-    char credential[512];
-    snprintf(credential, sizeof(credential), "%s/%s", access_key, credential_scope);
-
-    char canonical_headers[MAX_HEADER_LEN * MAX_HEADERS];
-    canonical_headers[0] = '\0';
-
-    header_t all_headers[MAX_HEADERS + 1];
-    strcpy(all_headers[0].key, "host");
-    strcpy(all_headers[0].value, host);
-    int total_headers = 1;
-
-    for (int i = 0; i < args->header_count; i++) {
-        strcpy(all_headers[total_headers].key, args->headers[i].key);
-        strcpy(all_headers[total_headers].value, args->headers[i].value);
-        total_headers++;
+// Ends the URL line in out. A signed payload's hash (or the streaming
+// marker) follows the URL after a tab, since the client has to send it as
+// x-amz-content-sha256.
+int end_url_line(buffer_t *out, const presign_request_t *req) {
+    if (req->payload_hash && (buffer_append(out, "\t", 1) != 0 ||
+                              buffer_append(out, req->payload_hash, strlen(req->payload_hash)) != 0)) {
+        return -1;
     }
+    return buffer_append(out, "\n", 1);
+}
 
-    qsort(all_headers, total_headers, sizeof(header_t), compare_headers);
-
-    for (int i = 0; i < total_headers; i++) {
-        char lower_key[MAX_HEADER_LEN];
-        for (int j = 0; all_headers[i].key[j]; j++) {
-            unsigned char key_ch = (unsigned char)all_headers[i].key[j];
-            lower_key[j] = (char)tolower(key_ch);
-        }
-        lower_key[strlen(all_headers[i].key)] = '\0';
-
-        char trimmed_value[MAX_HEADER_LEN];
-        strncpy(trimmed_value, all_headers[i].value, MAX_HEADER_LEN - 1);
-        trimmed_value[MAX_HEADER_LEN - 1] = '\0';
-
-        char *start = trimmed_value;
-        while (*start && isspace((unsigned char)*start)) {
-            start++;
-        }
-        size_t start_len = strlen(start);
-        if (start_len > 0) {
-            char *end = start + start_len - 1;
-            while (end > start && isspace((unsigned char)*end)) {
-                end--;
-            }
-            *(end + 1) = '\0';
-        }
-
-        size_t canonical_len = strlen(canonical_headers);
-        size_t key_len = strlen(lower_key);
-        size_t value_len = strlen(start);
-        
-        // Check for integer overflow
-        if (key_len > SIZE_MAX - 1 || value_len > SIZE_MAX - 1 ||
-            key_len + 1 > SIZE_MAX - (value_len + 1)) {
-            fprintf(stderr, "Error: Header too long - integer overflow\n");
-            exit(1);
-        }
-        
-        size_t needed_len = key_len + 1 + value_len + 1;
-        if (canonical_len > SIZE_MAX - needed_len ||
-            canonical_len + needed_len > sizeof(canonical_headers)) {
-            fprintf(stderr, "Error: Too many/large headers - canonical headers buffer overflow\n");
-            exit(1);
-        }
+// Signs a single path with the shared signer state and writes the URL line to
+// out. Returns 0 on success, -1 (after reporting on stderr) on failure.
+int sign_path(signer_t *signer, const char *path, FILE *out) {
+    buffer_t url = {0};
 
-        strcat(canonical_headers, lower_key);
-        strcat(canonical_headers, ":");
-        strcat(canonical_headers, start);
-        strcat(canonical_headers, "\n");
+    signer->request.path = path;
+    int status = append_signed_url(signer->ctx, &signer->request, &url);
+    if (status == PRESIGN_OK && end_url_line(&url, &signer->request) != 0) {
+        status = PRESIGN_ERR_OUT_OF_MEMORY;
     }
-
-    char signed_headers_final[MAX_HEADER_LEN];
-    signed_headers_final[0] = '\0';
-
-    for (int i = 0; i < total_headers; i++) {
-        if (i > 0) {
-            if (strlen(signed_headers_final) + 1 >= MAX_HEADER_LEN) {
-                fprintf(stderr, "Error: Too many headers - signed headers final buffer overflow\n");
-                exit(1);
-            }
-            strcat(signed_headers_final, ";");
-        }
-
-        size_t signed_headers_final_len = strlen(signed_headers_final);
-        size_t key_len = strlen(all_headers[i].key);
-        if (signed_headers_final_len + key_len >= MAX_HEADER_LEN) {
-            fprintf(stderr, "Error: Header names too long - signed headers final buffer overflow\n");
-            exit(1);
-        }
-
-        for (int j = 0; all_headers[i].key[j]; j++) {
-            unsigned char key_ch = (unsigned char)all_headers[i].key[j];
-            signed_headers_final[signed_headers_final_len] = (char)tolower(key_ch);
-            signed_headers_final_len++;
-        }
-        signed_headers_final[signed_headers_final_len] = '\0';
+    if (status != PRESIGN_OK) {
+        fprintf(stderr, "Error: %s\n", presign_strerror(status));
+        free(url.data);
+        return -1;
     }
 
-    char credential_encoded[sizeof(credential) * 3];
-    if (url_encode_component(credential, credential_encoded, sizeof(credential_encoded), 0) != 0) {
-        fprintf(stderr, "Error: Encoded credential exceeds maximum length\n");
-        exit(1);
+    uint64_t write_start = stats_enabled ? stats_clock() : 0;
+    fwrite(url.data, 1, url.len, out);
+    if (stats_enabled) {
+        stats_record(STAT_OUTPUT, stats_clock() - write_start);
+        stats_count(STAT_OUTPUT_BYTES, url.len);
     }
+    free(url.data);
+    return 0;
+}
 
-    char datetime_encoded[sizeof(datetime) * 3];
-    if (url_encode_component(datetime, datetime_encoded, sizeof(datetime_encoded), 0) != 0) {
-        fprintf(stderr, "Error: Encoded datetime exceeds maximum length\n");
-        exit(1);
+// Signs the --multipart part URLs or the --ranges URLs of args->path into
+// urls.
+static int sign_series(signer_t *signer, const presign_args_t *args, buffer_t *urls, size_t *urls_len) {
+    if (args->upload_id) {
+        return presign_sign_parts(signer->ctx, &signer->request, args->upload_id, 1, args->part_count,
+                                  urls->data, urls->cap, urls_len);
     }
+    return presign_sign_ranges(signer->ctx, &signer->request, args->object_size, args->range_size,
+                               urls->data, urls->cap, urls_len);
+}
 
-    char signed_headers_encoded[MAX_HEADER_LEN * 3];
-    if (url_encode_component(signed_headers_final, signed_headers_encoded, sizeof(signed_headers_encoded), 0) != 0) {
-        fprintf(stderr, "Error: Encoded signed headers exceeds maximum length\n");
-        exit(1);
+// Writes the URLs of parts 1 to args->part_count of the --multipart upload,
+// or of each --ranges piece followed by its Range value, one per line.
+// Returns -1 after reporting on stderr.
+static int sign_series_urls(signer_t *signer, const presign_args_t *args, void *out_file) {
+    FILE *out = out_file;
+    buffer_t urls = {0};
+    size_t urls_len = 0;
+    signer->request.path = args->path;
+    // The first call reports the exact length of all the URLs unless they
+    // fit in one slot; only the second one signs them
+    int status = buffer_reserve(&urls, URL_SLOT_LEN) != 0 ? PRESIGN_ERR_OUT_OF_MEMORY
+                 : sign_series(signer, args, &urls, &urls_len);
+    if (status == PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        status = buffer_reserve(&urls, urls_len + 1) != 0 ? PRESIGN_ERR_OUT_OF_MEMORY
+                 : sign_series(signer, args, &urls, &urls_len);
+    }
+    if (status != PRESIGN_OK) {
+        fprintf(stderr, "Error: %s\n", presign_strerror(status));
+        free(urls.data);
+        return -1;
     }
 
-    char query_params[MAX_URL_LEN];
-    int query_written = snprintf(query_params, sizeof(query_params),
-             "X-Amz-Algorithm=AWS4-HMAC-SHA256&"
-             "X-Amz-Credential=%s&"
-             "X-Amz-Date=%s&"
-             "X-Amz-Expires=%d&"
-             "X-Amz-SignedHeaders=%s",
-             credential_encoded, datetime_encoded, args->expire_min * 60, signed_headers_encoded);
-    if (query_written < 0 || (size_t)query_written >= sizeof(query_params)) {
-        fprintf(stderr, "Error: Query parameters too long\n");
-        exit(1);
+    uint64_t write_start = stats_enabled ? stats_clock() : 0;
+    int failed = fwrite(urls.data, 1, urls_len, out) != urls_len || fflush(out) != 0;
+    if (stats_enabled) {
+        stats_record(STAT_OUTPUT, stats_clock() - write_start);
+        stats_count(STAT_OUTPUT_BYTES, urls_len);
     }
-
-    if (session_token) {
-        char encoded_token[MAX_ENV_VAR_LEN * 3];
-        if (strlen(session_token) >= MAX_ENV_VAR_LEN) {
-            fprintf(stderr, "Error: AWS_SESSION_TOKEN too long (max %d chars)\n", MAX_ENV_VAR_LEN - 1);
-            exit(1);
-        }
-        if (url_encode_component(session_token, encoded_token, sizeof(encoded_token), 0) != 0) {
-            fprintf(stderr, "Error: Encoded session token exceeds maximum length\n");
-            exit(1);
-        }
-
-        size_t query_len = strlen(query_params);
-        size_t token_prefix_len = strlen("&X-Amz-Security-Token=");
-        size_t encoded_len = strlen(encoded_token);
-
-        if (query_len + token_prefix_len + encoded_len >= sizeof(query_params)) {
-            fprintf(stderr, "Error: Query parameters too long - buffer overflow\n");
-            exit(1);
-        }
-
-        strcat(query_params, "&X-Amz-Security-Token=");
-        strcat(query_params, encoded_token);
+    free(urls.data);
+    if (failed) {
+        fprintf(stderr, "Error: Failed to write URLs\n");
+        return -1;
     }
+    return 0;
+}
 
-    char canonical_request[MAX_URL_LEN * 2];
-    if (snprintf(canonical_request, sizeof(canonical_request),
-             "%s\n%s\n%s\n%s\n%s\nUNSIGNED-PAYLOAD",
-             args->method, canonical_uri, query_params, canonical_headers, signed_headers_final) < 0) {
-        fprintf(stderr, "Error: Failed to format canonical request\n");
-        exit(1);
+// Signs the POST policy of the BUCKET/PREFIX path and writes the form
+// fields. Returns -1 after reporting on stderr.
+static int sign_post_form(signer_t *signer, const presign_args_t *args, void *out_file) {
+    FILE *out = out_file;
+    const char *slash = strchr(args->path, '/');
+    size_t bucket_len = slash ? (size_t)(slash - args->path) : strlen(args->path);
+    char bucket[256];
+    if (bucket_len == 0 || bucket_len >= sizeof(bucket)) {
+        fprintf(stderr, "Error: S3_PATH must be BUCKET or BUCKET/KEY_PREFIX for POST\n");
+        return -1;
     }
-    unsigned char canonical_hash[32];
-    sha256_hash(canonical_request, strlen(canonical_request), canonical_hash);
-    char canonical_hash_hex[65];
-    to_hex(canonical_hash, 32, canonical_hash_hex);
-
-    char string_to_sign[1024];
-    snprintf(string_to_sign, sizeof(string_to_sign),
-             "AWS4-HMAC-SHA256\n%s\n%s\n%s",
-             datetime, credential_scope, canonical_hash_hex);
-
-    unsigned char signing_key[32];
-    derive_signing_key(secret_key, date_stamp, args->region, args->service, signing_key);
-
-    unsigned char signature[32];
-    hmac_sha256((char*)signing_key, 32, string_to_sign, strlen(string_to_sign), signature);
-    char signature_hex[65];
-    to_hex(signature, 32, signature_hex);
-
-    if (getenv("PRESIGN_DEBUG")) {
-        fprintf(stderr, "DEBUG canonical_request:\n%s\n", canonical_request);
-        fprintf(stderr, "DEBUG canonical_hash:%s\n", canonical_hash_hex);
-        fprintf(stderr, "DEBUG string_to_sign:\n%s\n", string_to_sign);
-        fprintf(stderr, "DEBUG credential_scope:%s\n", credential_scope);
-        fprintf(stderr, "DEBUG signed_headers:%s\n", signed_headers_final);
-        fprintf(stderr, "DEBUG signature:%s\n", signature_hex);
-        fprintf(stderr, "DEBUG query_params:%s\n", query_params);
+    memcpy(bucket, args->path, bucket_len);
+    bucket[bucket_len] = '\0';
+
+    presign_post_t post = {0};
+    post.bucket = bucket;
+    post.key_prefix = slash ? slash + 1 : "";
+    post.content_type = args->content_type;
+    post.min_length = args->min_length;
+    post.max_length = args->max_length;
+    post.expires = signer->request.expires;
+    post.now = signer->request.now;
+    buffer_t form = {0};
+    size_t form_len = 0;
+    int status = buffer_reserve(&form, URL_SLOT_LEN) != 0 ? PRESIGN_ERR_OUT_OF_MEMORY
+                 : presign_sign_post(signer->ctx, &post, form.data, form.cap, &form_len);
+    if (status == PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        status = buffer_reserve(&form, form_len + 1) != 0 ? PRESIGN_ERR_OUT_OF_MEMORY
+                 : presign_sign_post(signer->ctx, &post, form.data, form.cap, &form_len);
+    }
+    if (status != PRESIGN_OK) {
+        fprintf(stderr, "Error: %s\n", presign_strerror(status));
+        free(form.data);
+        return -1;
     }
+    fwrite(form.data, 1, form_len, out);
+    free(form.data);
+    return 0;
+}
 
-    printf("%s%s?%s&X-Amz-Signature=%s\n",
-           args->bucket_url, canonical_uri, query_params, signature_hex);
+// Signs the S3_PATH argument and writes its URL line to out.
+static int sign_args_path(signer_t *signer, const presign_args_t *args, void *out) {
+    return sign_path(signer, args->path, out);
 }
 
 void print_version(void) {
@@ -461,16 +298,54 @@ void print_version(void) {
 
 void print_usage(const char *prog_name) {
     printf("Usage: %s SERVICE METHOD [REGION] [ENDPOINT] S3_PATH EXPIRE_MIN [options]\n", prog_name);
+    printf("       %s SERVICE METHOD [REGION] [ENDPOINT] EXPIRE_MIN --batch FILE|- [options]\n", prog_name);
+    printf("       %s SERVICE PUT [REGION] [ENDPOINT] BUCKET/PREFIX EXPIRE_MIN --tree DIR [options]\n", prog_name);
+    printf("       %s serve --socket PATH [--region REGION] [--endpoint ENDPOINT] [--time-bucket MIN [--memo N]]\n",
+           prog_name);
+    printf("       %s client --socket PATH [--bench N [--pipeline DEPTH]]\n", prog_name);
+    printf("       %s verify [--method METHOD] [--header 'Key: Value']... [--region-set LIST] URL... | --batch FILE|-\n",
+           prog_name);
+    printf("       %s s3-local [--port PORT] [--dir DIR] [--region REGION]\n", prog_name);
+    printf("       %s load --endpoint http://HOST:PORT [--requests N] [--concurrency N] [--size BYTES]\n", prog_name);
     printf("\nPositional parameters:\n");
     printf("  SERVICE     constant, always 's3'\n");
-    printf("  METHOD      GET | PUT | DELETE (case insensitive)\n");
+    printf("  METHOD      GET | PUT | DELETE (case insensitive), or POST for a browser upload form\n");
     printf("  REGION      overrides S3_REGION environment variable (optional)\n");
     printf("  ENDPOINT    overrides S3_ENDPOINT environment variable (optional)\n");
-    printf("  S3_PATH     bucket and key path (e.g., bucket/object.txt)\n");
+    printf("  S3_PATH     bucket and key path (e.g., bucket/object.txt); BUCKET/KEY_PREFIX for POST\n");
     printf("  EXPIRE_MIN  expiration time in minutes (1 to 10080)\n");
     printf("\nOptions:\n");
     printf("  --header 'Key: Value'  Add header to be signed (can be used multiple times)\n");
     printf("  --now TIMESTAMP        Override current time (format: 2025-09-25T08:40:00Z)\n");
+    printf("  --time-bucket MIN      Sign at the start of MIN-minute windows and extend the expiry by MIN,\n");
+    printf("                         so repeated requests get identical URLs\n");
+    printf("  --query 'name=value'   Add a query parameter to be signed (can be used multiple times)\n");
+    printf("  --multipart UPLOAD_ID  Sign the part URLs of multipart upload UPLOAD_ID (PUT), one per line\n");
+    printf("  --parts N              Number of parts for --multipart, 1 to 10000\n");
+    printf("  --ranges SIZE          Sign one GET URL per byte range of a SIZE-byte object, each binding its\n");
+    printf("                         Range header; prints URL<TAB>bytes=FIRST-LAST per range\n");
+    printf("  --range-size BYTES     Bytes per range for --ranges\n");
+    printf("  --range-count N        Number of ranges for --ranges, 1 to 10000 (instead of --range-size)\n");
+    printf("  --payload-file PATH    Sign the SHA-256 of PATH as the body (PUT); prints URL<TAB>SHA256\n");
+    printf("  --content-type TYPE    POST: uploads must have Content-Type TYPE, or start with it when TYPE\n");
+    printf("                         ends in '*' (e.g., 'image/*')\n");
+    printf("  --content-length-range MIN-MAX  POST: uploads must be MIN to MAX bytes\n");
+    printf("  --batch FILE|-         Sign one S3_PATH per line from FILE or stdin (omit S3_PATH)\n");
+    printf("  --payload-files        Batch lines are S3_PATH<TAB>LOCAL_FILE; sign each file's SHA-256\n");
+    printf("  --chunked              Sign for an aws-chunked upload (PUT); prints URL<TAB>STREAMING-...\n");
+    printf("  --chunked-body FILE|-  Write the aws-chunked body of FILE or stdin for the --chunked URL\n");
+    printf("                         signed with the same arguments and --now\n");
+    printf("  --chunk-size BYTES     aws-chunked chunk size, 8192 to 67108864 (default: 65536)\n");
+    printf("  --decoded-length BYTES Sign x-amz-decoded-content-length, the body size before chunking\n");
+    printf("  --tree DIR             Sign a PUT URL for every file under DIR, keyed by its path under S3_PATH,\n");
+    printf("                         with its Content-Type; prints PATH<TAB>SIZE<TAB>URL<TAB>CONTENT_TYPE\n");
+    printf("  --format tsv|jsonl     --tree manifest format (default: tsv)\n");
+    printf("  --region-set LIST      Sign with SigV4A (ECDSA P-256) for the comma-separated regions in LIST,\n");
+    printf("                         or '*' for any; REGION is then not needed and is ignored when given\n");
+    printf("  --threads N            Batch or --tree worker threads, 0 for one per CPU (default: 1)\n");
+    printf("  --profiles FILE        Load named credentials, region, endpoint and headers from FILE\n");
+    printf("  --profile NAME         Sign with profile NAME; batch lines may also start with NAME<TAB>\n");
+    printf("  --stats FILE|-         Write per-stage timings and counters as JSON to FILE or stderr\n");
     printf("  --version, -v          Show version information\n");
     printf("\nEnvironment variables:\n");
     printf("  AWS_ACCESS_KEY_ID      required\n");
@@ -478,24 +353,43 @@ void print_usage(const char *prog_name) {
     printf("  AWS_SESSION_TOKEN      optional, for temporary credentials\n");
     printf("  S3_REGION              default for REGION\n");
     printf("  S3_ENDPOINT            default for ENDPOINT (e.g., https://s3.fr-par.scw.cloud)\n");
+    printf("  PRESIGN_PROFILES       default for --profiles\n");
+    printf("  PRESIGN_STATS          default for --stats\n");
 }
 
-int main(int argc, char *argv[]) {
-    // Handle version argument before other processing
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-v") == 0) {
-            print_version();
-            return 0;
+// Returns the value of the first occurrence of option in argv[first..], or
+// NULL.
+static const char *find_option(int argc, char *argv[], int first, const char *option) {
+    for (int j = first; j + 1 < argc; j++) {
+        if (strcmp(argv[j], option) == 0) {
+            return argv[j + 1];
         }
     }
+    return NULL;
+}
 
-    if (argc < 5) {
-        print_usage(argv[0]);
-        return 1;
+// Parses a --time-bucket value in minutes. With expire_min > 0 the padded
+// expiry must stay within 7 days. Returns -1 after reporting on stderr.
+int parse_time_bucket(const char *text, int expire_min, int *minutes) {
+    char *end = NULL;
+    long value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || value <= 0 || value > 10080) {
+        fprintf(stderr, "Error: --time-bucket must be between 1 and 10080 minutes\n");
+        return -1;
     }
+    if (expire_min > 0 && value > 10080 - expire_min) {
+        fprintf(stderr, "Error: EXPIRE_MIN plus --time-bucket must not exceed 10080 minutes (7 days)\n");
+        return -1;
+    }
+    *minutes = (int)value;
+    return 0;
+}
 
-    presign_args_t args = {0};
-
+// Parses the signing command line into args and runs it, single URL or
+// batch.
+static int run_command(int argc, char *argv[], presign_args_t *args) {
+    stats_timer_t timer;
+    STATS_START(&timer);
     int first_option = argc;
     for (int j = 3; j < argc; j++) {
         if (strncmp(argv[j], "--", 2) == 0) {
@@ -504,8 +398,21 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // In batch mode the S3_PATH positional is replaced by the lines of the
+    // batch source, so there is one positional parameter less.
+    const char *batch_source = find_option(argc, argv, first_option, "--batch");
+    // With a profiles file, region and endpoint may come from the profiles
+    const char *profiles_path = find_option(argc, argv, first_option, "--profiles");
+    if (!profiles_path && getenv("PRESIGN_PROFILES") && *getenv("PRESIGN_PROFILES")) {
+        profiles_path = getenv("PRESIGN_PROFILES");
+    }
+    const char *profile_name = find_option(argc, argv, first_option, "--profile");
+    // A SigV4A region set stands in for the region
+    args->region_set = find_option(argc, argv, first_option, "--region-set");
+    int path_slots = batch_source ? 0 : 1;
+
     int positional_count = first_option - 3;
-    if (positional_count < 2 || positional_count > 4) {
+    if (positional_count < 1 + path_slots || positional_count > 3 + path_slots) {
         fprintf(stderr, "Error: Invalid positional arguments\n");
         print_usage(argv[0]);
         return 1;
@@ -514,64 +421,66 @@ int main(int argc, char *argv[]) {
     const char *region_cli = NULL;
     const char *endpoint_cli = NULL;
 
-    if (positional_count >= 3) {
+    if (args->region_set && positional_count == 2 + path_slots) {
+        // No region to give, so the one optional argument is ENDPOINT
+        endpoint_cli = argv[3];
+    } else if (positional_count >= 2 + path_slots) {
         region_cli = argv[3];
     }
-    if (positional_count == 4) {
+    if (positional_count == 3 + path_slots) {
         endpoint_cli = argv[4];
     }
 
-    const char *path_arg = argv[first_option - 2];
+    const char *path_arg = batch_source ? "" : argv[first_option - 2];
     const char *expire_arg = argv[first_option - 1];
 
-    if (strlen(argv[1]) >= sizeof(args.service)) {
-        fprintf(stderr, "Error: Service name too long (max %zu chars)\n", sizeof(args.service) - 1);
-        return 1;
-    }
-    if (strlen(argv[2]) >= sizeof(args.method)) {
-        fprintf(stderr, "Error: Method name too long (max %zu chars)\n", sizeof(args.method) - 1);
+    if (strlen(argv[1]) >= sizeof(args->service)) {
+        fprintf(stderr, "Error: Service name too long (max %zu chars)\n", sizeof(args->service) - 1);
         return 1;
     }
-    if (strlen(path_arg) >= sizeof(args.path)) {
-        fprintf(stderr, "Error: Path too long (max %zu chars)\n", sizeof(args.path) - 1);
+    if (strlen(argv[2]) >= sizeof(args->method)) {
+        fprintf(stderr, "Error: Method name too long (max %zu chars)\n", sizeof(args->method) - 1);
         return 1;
     }
 
-    strncpy(args.service, argv[1], sizeof(args.service) - 1);
-    args.service[sizeof(args.service) - 1] = '\0';
-    strncpy(args.method, argv[2], sizeof(args.method) - 1);
-    args.method[sizeof(args.method) - 1] = '\0';
-    strncpy(args.path, path_arg, sizeof(args.path) - 1);
-    args.path[sizeof(args.path) - 1] = '\0';
+    strncpy(args->service, argv[1], sizeof(args->service) - 1);
+    args->service[sizeof(args->service) - 1] = '\0';
+    strncpy(args->method, argv[2], sizeof(args->method) - 1);
+    args->method[sizeof(args->method) - 1] = '\0';
+    args->path = path_arg;
 
     const char *region_env = getenv("S3_REGION");
     const char *region_value = region_cli ? region_cli : region_env;
-    if (!region_value) {
+    if (!region_value && !profiles_path && !args->region_set) {
         fprintf(stderr, "Error: REGION is required (provide CLI argument or set S3_REGION)\n");
         return 1;
     }
-    if (strlen(region_value) >= sizeof(args.region)) {
-        fprintf(stderr, "Error: Region name too long (max %zu chars)\n", sizeof(args.region) - 1);
+    region_value = region_value ? region_value : "";
+    if (strlen(region_value) >= sizeof(args->region)) {
+        fprintf(stderr, "Error: Region name too long (max %zu chars)\n", sizeof(args->region) - 1);
         return 1;
     }
-    strncpy(args.region, region_value, sizeof(args.region) - 1);
-    args.region[sizeof(args.region) - 1] = '\0';
+    strncpy(args->region, region_value, sizeof(args->region) - 1);
+    args->region[sizeof(args->region) - 1] = '\0';
+    args->region_from_cli = region_cli != NULL;
 
     const char *endpoint_env = getenv("S3_ENDPOINT");
     const char *endpoint_value = endpoint_cli ? endpoint_cli : endpoint_env;
-    if (!endpoint_value) {
+    if (!endpoint_value && !profiles_path) {
         fprintf(stderr, "Error: ENDPOINT is required (provide CLI argument or set S3_ENDPOINT)\n");
         return 1;
     }
-    if (strlen(endpoint_value) >= sizeof(args.bucket_url)) {
-        fprintf(stderr, "Error: Endpoint too long (max %zu chars)\n", sizeof(args.bucket_url) - 1);
+    endpoint_value = endpoint_value ? endpoint_value : "";
+    args->endpoint_from_cli = endpoint_cli != NULL;
+    if (strlen(endpoint_value) >= sizeof(args->bucket_url)) {
+        fprintf(stderr, "Error: Endpoint too long (max %zu chars)\n", sizeof(args->bucket_url) - 1);
         return 1;
     }
-    strncpy(args.bucket_url, endpoint_value, sizeof(args.bucket_url) - 1);
-    args.bucket_url[sizeof(args.bucket_url) - 1] = '\0';
-    size_t endpoint_len = strlen(args.bucket_url);
-    while (endpoint_len > 0 && args.bucket_url[endpoint_len - 1] == '/') {
-        args.bucket_url[endpoint_len - 1] = '\0';
+    strncpy(args->bucket_url, endpoint_value, sizeof(args->bucket_url) - 1);
+    args->bucket_url[sizeof(args->bucket_url) - 1] = '\0';
+    size_t endpoint_len = strlen(args->bucket_url);
+    while (endpoint_len > 0 && args->bucket_url[endpoint_len - 1] == '/') {
+        args->bucket_url[endpoint_len - 1] = '\0';
         endpoint_len--;
     }
 
@@ -585,85 +494,207 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: EXPIRE_MIN too large\n");
         return 1;
     }
-    args.expire_min = (int)expire_long;
+    args->expire_min = (int)expire_long;
 
-    size_t service_len = strlen(args.service);
+    size_t service_len = strlen(args->service);
     for (size_t i = 0; i < service_len; i++) {
-        unsigned char c = (unsigned char)args.service[i];
-        args.service[i] = (char)tolower(c);
+        unsigned char c = (unsigned char)args->service[i];
+        args->service[i] = (char)tolower(c);
     }
-    size_t method_len = strlen(args.method);
+    size_t method_len = strlen(args->method);
     for (size_t i = 0; i < method_len; i++) {
-        unsigned char c = (unsigned char)args.method[i];
-        args.method[i] = (char)toupper(c);
+        unsigned char c = (unsigned char)args->method[i];
+        args->method[i] = (char)toupper(c);
     }
 
-    if (strcmp(args.service, "s3") != 0) {
+    if (strcmp(args->service, "s3") != 0) {
         fprintf(stderr, "Error: SERVICE must be 's3'\n");
         return 1;
     }
 
-    if (strcmp(args.method, "GET") != 0 && strcmp(args.method, "PUT") != 0 && strcmp(args.method, "DELETE") != 0) {
-        fprintf(stderr, "Error: METHOD must be GET, PUT, or DELETE\n");
+    if (strcmp(args->method, "GET") != 0 && strcmp(args->method, "PUT") != 0 && strcmp(args->method, "DELETE") != 0 &&
+        strcmp(args->method, "POST") != 0) {
+        fprintf(stderr, "Error: METHOD must be GET, PUT, DELETE or POST\n");
         return 1;
     }
 
-    if (args.expire_min <= 0 || args.expire_min > 10080) {
+    if (args->expire_min <= 0 || args->expire_min > 10080) {
         fprintf(stderr, "Error: EXPIRE_MIN must be between 1 and 10080 (7 days)\n");
         return 1;
     }
 
+    int threads = 1;
+    const char *tree_root = NULL;
+    const char *payload_file = NULL;
+    const char *chunked_body = NULL;
+    int chunk_size_set = 0;
+    unsigned long long range_size = 0;
+    unsigned long long range_count = 0;
+    args->chunk_size = DEFAULT_CHUNK_SIZE;
     for (int i = first_option; i < argc; i++) {
         if (strcmp(argv[i], "--header") == 0 && i + 1 < argc) {
-            if (args.header_count >= MAX_HEADERS) {
+            if (args->header_count >= MAX_HEADERS) {
                 fprintf(stderr, "Error: Too many headers (max %d)\n", MAX_HEADERS);
                 return 1;
             }
 
-            char *colon = strchr(argv[i + 1], ':');
+            const char *header = argv[i + 1];
+            const char *colon = strchr(header, ':');
             if (!colon) {
                 fprintf(stderr, "Error: Invalid header format. Use 'Key: Value'\n");
                 return 1;
             }
 
-            int key_len = colon - argv[i + 1];
-            if (key_len >= MAX_HEADER_LEN) {
-                fprintf(stderr, "Error: Header key too long (max %d chars)\n", MAX_HEADER_LEN - 1);
-                return 1;
+            // Neither part has a length limit; the name is copied to end it
+            // at the colon, the value is used in place.
+            const char *value = colon[1] == ' ' ? colon + 2 : colon + 1;
+            for (const char *v = value; *v; v++) {
+                if ((unsigned char)*v < 32 && *v != '\t') {
+                    fprintf(stderr, "Error: Header value contains control characters\n");
+                    return 1;
+                }
             }
-            if (strlen(colon + 1) >= MAX_HEADER_LEN) {
-                fprintf(stderr, "Error: Header value too long (max %d chars)\n", MAX_HEADER_LEN - 1);
+            char *name = arena_strndup(&args->strings, header, (size_t)(colon - header));
+            if (!name) {
+                fprintf(stderr, "Error: Out of memory\n");
                 return 1;
             }
+            args->headers[args->header_count].name = name;
+            args->headers[args->header_count].value = value;
 
-            strncpy(args.headers[args.header_count].key, argv[i + 1], key_len);
-            args.headers[args.header_count].key[key_len] = '\0';
-
-            strncpy(args.headers[args.header_count].value, colon + 1, MAX_HEADER_LEN - 1);
-            args.headers[args.header_count].value[MAX_HEADER_LEN - 1] = '\0';
-            if (args.headers[args.header_count].value[0] == ' ') {
-                memmove(args.headers[args.header_count].value, args.headers[args.header_count].value + 1,
-                       strlen(args.headers[args.header_count].value));
+            args->header_count++;
+            i++;
+        } else if ((strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "--profiles") == 0 ||
+                    strcmp(argv[i], "--profile") == 0 || strcmp(argv[i], "--region-set") == 0 ||
+                    strcmp(argv[i], "--stats") == 0) && i + 1 < argc) {
+            i++;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *threads_end = NULL;
+            long threads_long = strtol(argv[i + 1], &threads_end, 10);
+            if (*argv[i + 1] == '\0' || *threads_end != '\0' ||
+                threads_long < 0 || threads_long > MAX_BATCH_THREADS) {
+                fprintf(stderr, "Error: --threads must be between 0 (all CPUs) and %d\n", MAX_BATCH_THREADS);
+                return 1;
             }
-
-            // Validate header value for control characters
-            for (size_t j = 0; j < strlen(args.headers[args.header_count].value); j++) {
-                if ((unsigned char)args.headers[args.header_count].value[j] < 32 && 
-                    args.headers[args.header_count].value[j] != '\t') {
-                    fprintf(stderr, "Error: Header value contains control characters\n");
-                    return 1;
-                }
+            threads = (int)threads_long;
+            if (threads == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cpus < 1 ? 1 : (cpus > MAX_BATCH_THREADS ? MAX_BATCH_THREADS : (int)cpus);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
+            if (args->param_count >= MAX_QUERY_PARAMS) {
+                fprintf(stderr, "Error: Too many query parameters (max %d)\n", MAX_QUERY_PARAMS);
+                return 1;
+            }
+            // name=value, or a bare name with an empty value; the value is
+            // used in place and encoded by the signer
+            const char *param = argv[++i];
+            const char *equals = strchr(param, '=');
+            size_t name_len = equals ? (size_t)(equals - param) : strlen(param);
+            char *name = arena_strndup(&args->strings, param, name_len);
+            if (!name) {
+                fprintf(stderr, "Error: Out of memory\n");
+                return 1;
+            }
+            args->params[args->param_count].name = name;
+            args->params[args->param_count].value = equals ? equals + 1 : "";
+            args->param_count++;
+        } else if (strcmp(argv[i], "--multipart") == 0 && i + 1 < argc) {
+            args->upload_id = argv[++i];
+        } else if (strcmp(argv[i], "--parts") == 0 && i + 1 < argc) {
+            char *parts_end = NULL;
+            unsigned long parts = strtoul(argv[i + 1], &parts_end, 10);
+            if (!isdigit((unsigned char)*argv[i + 1]) || *parts_end != '\0' || parts < 1 ||
+                parts > PRESIGN_MAX_PARTS) {
+                fprintf(stderr, "Error: --parts must be between 1 and %d\n", PRESIGN_MAX_PARTS);
+                return 1;
+            }
+            args->part_count = (unsigned int)parts;
+            i++;
+        } else if ((strcmp(argv[i], "--ranges") == 0 || strcmp(argv[i], "--range-size") == 0 ||
+                    strcmp(argv[i], "--range-count") == 0) && i + 1 < argc) {
+            size_t digits = strspn(argv[i + 1], "0123456789");
+            unsigned long long size = strtoull(argv[i + 1], NULL, 10);
+            if (digits == 0 || digits > 19 || argv[i + 1][digits] != '\0' || size == 0) {
+                fprintf(stderr, "Error: %s must be a positive number\n", argv[i]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--ranges") == 0) {
+                args->object_size = size;
+            } else if (strcmp(argv[i], "--range-size") == 0) {
+                range_size = size;
+            } else {
+                range_count = size;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--tree") == 0 && i + 1 < argc) {
+            tree_root = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "tsv") != 0 && strcmp(argv[i + 1], "jsonl") != 0) {
+                fprintf(stderr, "Error: --format must be tsv or jsonl\n");
+                return 1;
+            }
+            args->tree_jsonl = strcmp(argv[++i], "jsonl") == 0;
+            args->tree_format_set = 1;
+        } else if (strcmp(argv[i], "--payload-file") == 0 && i + 1 < argc) {
+            payload_file = argv[++i];
+        } else if (strcmp(argv[i], "--payload-files") == 0) {
+            args->payload_files = 1;
+        } else if (strcmp(argv[i], "--chunked") == 0) {
+            args->chunked = 1;
+        } else if (strcmp(argv[i], "--chunked-body") == 0 && i + 1 < argc) {
+            chunked_body = argv[++i];
+            args->chunked = 1;
+        } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+            char *size_end = NULL;
+            unsigned long long size = strtoull(argv[i + 1], &size_end, 10);
+            if (!isdigit((unsigned char)*argv[i + 1]) || *size_end != '\0' || size < MIN_CHUNK_SIZE ||
+                size > MAX_CHUNK_SIZE) {
+                fprintf(stderr, "Error: --chunk-size must be between %u and %u bytes\n", MIN_CHUNK_SIZE,
+                        MAX_CHUNK_SIZE);
+                return 1;
+            }
+            args->chunk_size = (size_t)size;
+            chunk_size_set = 1;
+            i++;
+        } else if (strcmp(argv[i], "--decoded-length") == 0 && i + 1 < argc) {
+            const char *length = argv[i + 1];
+            size_t digits = strspn(length, "0123456789");
+            if (digits == 0 || digits > 19 || length[digits] != '\0') {
+                fprintf(stderr, "Error: --decoded-length must be a byte count\n");
+                return 1;
+            }
+            args->decoded_length = length;
+            i++;
+        } else if (strcmp(argv[i], "--time-bucket") == 0 && i + 1 < argc) {
+            if (parse_time_bucket(argv[i + 1], args->expire_min, &args->time_bucket_min) != 0) {
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--content-type") == 0 && i + 1 < argc) {
+            args->content_type = argv[++i];
+        } else if (strcmp(argv[i], "--content-length-range") == 0 && i + 1 < argc) {
+            // MIN-MAX in bytes
+            const char *range = argv[i + 1];
+            size_t min_digits = strspn(range, "0123456789");
+            size_t max_digits = range[min_digits] == '-' ? strspn(range + min_digits + 1, "0123456789") : 0;
+            args->min_length = strtoull(range, NULL, 10);
+            args->max_length = max_digits > 0 ? strtoull(range + min_digits + 1, NULL, 10) : 0;
+            if (min_digits == 0 || min_digits > 19 || max_digits == 0 || max_digits > 19 ||
+                range[min_digits + 1 + max_digits] != '\0' || args->max_length == 0 ||
+                args->min_length > args->max_length) {
+                fprintf(stderr, "Error: --content-length-range must be MIN-MAX bytes with 0 < MAX and MIN <= MAX\n");
+                return 1;
             }
-
-            args.header_count++;
             i++;
         } else if (strcmp(argv[i], "--now") == 0 && i + 1 < argc) {
-            if (strlen(argv[i + 1]) >= sizeof(args.now_override)) {
-                fprintf(stderr, "Error: Timestamp too long (max %zu chars)\n", sizeof(args.now_override) - 1);
+            if (strlen(argv[i + 1]) >= sizeof(args->now_override)) {
+                fprintf(stderr, "Error: Timestamp too long (max %zu chars)\n", sizeof(args->now_override) - 1);
                 return 1;
             }
-            strncpy(args.now_override, argv[i + 1], sizeof(args.now_override) - 1);
-            args.now_override[sizeof(args.now_override) - 1] = '\0';
+            strncpy(args->now_override, argv[i + 1], sizeof(args->now_override) - 1);
+            args->now_override[sizeof(args->now_override) - 1] = '\0';
             i++;
         } else {
             fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
@@ -672,6 +703,183 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    generate_presigned_url(&args);
-    return 0;
+    if (profile_name && !profiles_path) {
+        fprintf(stderr, "Error: --profile requires --profiles FILE or PRESIGN_PROFILES\n");
+        return 1;
+    }
+    if ((payload_file || args->payload_files) && strcmp(args->method, "PUT") != 0) {
+        fprintf(stderr, "Error: --payload-file and --payload-files require METHOD PUT\n");
+        return 1;
+    }
+    if (args->payload_files && (!batch_source || payload_file)) {
+        fprintf(stderr, "Error: --payload-files requires --batch and excludes --payload-file\n");
+        return 1;
+    }
+    if (args->chunked && (strcmp(args->method, "PUT") != 0 || payload_file || args->payload_files)) {
+        fprintf(stderr, "Error: --chunked requires METHOD PUT and excludes --payload-file and --payload-files\n");
+        return 1;
+    }
+    if (chunked_body && batch_source) {
+        fprintf(stderr, "Error: --chunked-body signs a single S3_PATH and excludes --batch\n");
+        return 1;
+    }
+    if (chunk_size_set && !chunked_body) {
+        fprintf(stderr, "Error: --chunk-size requires --chunked-body\n");
+        return 1;
+    }
+    if (args->decoded_length && !args->chunked) {
+        fprintf(stderr, "Error: --decoded-length requires --chunked or --chunked-body\n");
+        return 1;
+    }
+    if (!args->upload_id != !args->part_count) {
+        fprintf(stderr, "Error: --multipart and --parts go together\n");
+        return 1;
+    }
+    if (args->upload_id && (strcmp(args->method, "PUT") != 0 || batch_source || args->chunked || payload_file)) {
+        fprintf(stderr, "Error: --multipart requires METHOD PUT and excludes --batch, --chunked and --payload-file\n");
+        return 1;
+    }
+    if (args->object_size && !range_size == !range_count) {
+        fprintf(stderr, "Error: --ranges requires one of --range-size and --range-count\n");
+        return 1;
+    }
+    if (!args->object_size && (range_size || range_count)) {
+        fprintf(stderr, "Error: --range-size and --range-count require --ranges\n");
+        return 1;
+    }
+    if (args->object_size && (strcmp(args->method, "GET") != 0 || batch_source || args->upload_id)) {
+        fprintf(stderr, "Error: --ranges requires METHOD GET and excludes --batch and --multipart\n");
+        return 1;
+    }
+    int is_post = strcmp(args->method, "POST") == 0;
+    if (is_post && (batch_source || args->header_count > 0 || args->param_count > 0 || args->upload_id ||
+                    args->object_size || payload_file || args->chunked || args->time_bucket_min)) {
+        fprintf(stderr, "Error: POST signs one upload form and excludes --batch, --header, --query, --multipart,\n"
+                        "       --ranges, --payload-file, --chunked and --time-bucket\n");
+        return 1;
+    }
+    if (tree_root && (strcmp(args->method, "PUT") != 0 || batch_source || args->upload_id || payload_file ||
+                      args->chunked)) {
+        fprintf(stderr, "Error: --tree requires METHOD PUT and excludes --batch, --multipart, --payload-file\n"
+                        "       and --chunked\n");
+        return 1;
+    }
+    if (args->tree_format_set && !tree_root) {
+        fprintf(stderr, "Error: --format requires --tree\n");
+        return 1;
+    }
+    if (args->region_set && (is_post || args->chunked)) {
+        fprintf(stderr, "Error: --region-set excludes POST, --chunked and --chunked-body\n");
+        return 1;
+    }
+    if (!is_post && (args->content_type || args->max_length)) {
+        fprintf(stderr, "Error: --content-type and --content-length-range require METHOD POST\n");
+        return 1;
+    }
+    if (args->object_size) {
+        args->range_size = range_size ? range_size : (args->object_size - 1) / range_count + 1;
+        if ((args->object_size - 1) / args->range_size >= PRESIGN_MAX_RANGES) {
+            fprintf(stderr, "Error: --ranges makes more than %d ranges\n", PRESIGN_MAX_RANGES);
+            return 1;
+        }
+    }
+    // The aws-chunked headers are signed after the --header ones
+    if (args->chunked) {
+        if (args->header_count + (args->decoded_length ? 2 : 1) > MAX_HEADERS) {
+            fprintf(stderr, "Error: Too many headers (max %d)\n", MAX_HEADERS);
+            return 1;
+        }
+        args->headers[args->header_count].name = "content-encoding";
+        args->headers[args->header_count++].value = "aws-chunked";
+        if (args->decoded_length) {
+            args->headers[args->header_count].name = "x-amz-decoded-content-length";
+            args->headers[args->header_count++].value = args->decoded_length;
+        }
+    }
+    STATS_LAP(&timer, STAT_ARGS);
+    if (payload_file && presign_hash_file(payload_file, args->payload_hash, NULL) != PRESIGN_OK) {
+        fprintf(stderr, "Error: Cannot read payload file '%s': %s\n", payload_file, strerror(errno));
+        return 1;
+    }
+    if (profiles_path && !(args->profiles = profiles_load(profiles_path))) {
+        return 1;
+    }
+    if (profile_name && !(args->profile = profiles_find(args->profiles, profile_name, strlen(profile_name)))) {
+        fprintf(stderr, "Error: Unknown profile '%s'\n", profile_name);
+        return 1;
+    }
+    if (profiles_path) {
+        STATS_LAP(&timer, STAT_SETUP);
+    }
+    STATS_END(&timer, -1);
+
+    if (batch_source) {
+        return run_batch(args, batch_source, threads);
+    }
+    if (tree_root) {
+        return run_tree(args, tree_root, threads);
+    }
+    if (threads != 1) {
+        fprintf(stderr, "Error: --threads requires --batch or --tree\n");
+        return 1;
+    }
+    if (chunked_body) {
+        return run_chunked_body(args, chunked_body);
+    }
+    if (args->upload_id || args->object_size) {
+        return with_signer(args, sign_series_urls, stdout);
+    }
+    if (is_post) {
+        return with_signer(args, sign_post_form, stdout);
+    }
+
+    return with_signer(args, sign_args_path, stdout);
+}
+
+int main(int argc, char *argv[]) {
+    // Handle version argument before other processing
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-v") == 0) {
+            print_version();
+            return 0;
+        }
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "client") == 0) {
+        return run_client(argc, argv);
+    }
+
+    // Statistics cover signing and serving; the options themselves are
+    // skipped by each mode's parser.
+    stats_path = find_option(argc, argv, 1, "--stats");
+    if (!stats_path && getenv("PRESIGN_STATS") && *getenv("PRESIGN_STATS")) {
+        stats_path = getenv("PRESIGN_STATS");
+    }
+    if (stats_path) {
+        stats_enable();
+    }
+
+    int rc;
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+        rc = run_serve(argc, argv);
+    } else if (argc >= 2 && strcmp(argv[1], "verify") == 0) {
+        rc = run_verify(argc, argv);
+    } else if (argc >= 2 && strcmp(argv[1], "s3-local") == 0) {
+        rc = run_s3_local(argc, argv);
+    } else if (argc >= 2 && strcmp(argv[1], "load") == 0) {
+        rc = run_load(argc, argv);
+    } else if (argc < 5) {
+        print_usage(argv[0]);
+        return 1;
+    } else {
+        presign_args_t args = {0};
+        arena_init(&args.strings, NULL, 0);
+        rc = run_command(argc, argv, &args);
+        profiles_free(args.profiles);
+        arena_free(&args.strings);
+    }
+    if (write_stats() != 0 && rc == 0) {
+        rc = 1;
+    }
+    return rc;
 }
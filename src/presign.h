@@ -0,0 +1,291 @@
+#ifndef PRESIGN_H
+#define PRESIGN_H
+
+/*
+ * libpresign - AWS Signature Version 4 presigned URL generation.
+ *
+ * A presign_ctx_t holds the credentials, region, service and endpoint of one
+ * signer. Create it once with presign_ctx_new() and share it between
+ * threads: presign_sign_url() does not touch the environment and only takes
+ * a short read lock to load its signing key.
+ *
+ * Signing keys are derived once per credential, region, service and UTC day
+ * and shared by every signer in the process. The next day's key is derived
+ * during the last minutes before 00:00 UTC, so signing does not stall when
+ * the date changes.
+ *
+ * With a time_bucket, the signing time is rounded down to a multiple of it
+ * and the expiry is extended by it, so every request for the same object
+ * within one bucket gets a byte-identical URL that is still valid for at
+ * least expires seconds; expires + time_bucket must not exceed
+ * PRESIGN_MAX_EXPIRES.
+ *
+ * Presigned URLs normally leave the body unsigned (UNSIGNED-PAYLOAD). With a
+ * payload_hash, the SHA-256 of the body is signed instead, as the
+ * x-amz-content-sha256 header: the client must send that header with
+ * exactly that value, and the server rejects any other body.
+ *
+ * A body whose hash is not known up front (a pipe) can be uploaded as
+ * aws-chunked instead: presign_chunked_new() signs the URL with
+ * PRESIGN_STREAMING_PAYLOAD as its payload hash, and every chunk of the
+ * body is then sent after a header carrying a signature chained from the
+ * previous one, starting from the URL's own signature.
+ *
+ * Query parameters of the request (versionId, partNumber and uploadId,
+ * response-content-disposition, ...) are signed along with the X-Amz-*
+ * ones, encoded and in canonical order.
+ *
+ * Browser uploads can use a POST policy instead of one URL per object:
+ * presign_sign_post() signs a policy for any key under a prefix, with
+ * optional size and Content-Type conditions, and one signature covers every
+ * upload of the form until the policy expires.
+ *
+ * With a region_set, a signer uses SigV4A (AWS4-ECDSA-P256-SHA256) instead:
+ * the credential scope has no region, X-Amz-Region-Set lists the regions
+ * (or "*") the URL is good for, and the signature is an ECDSA P-256
+ * signature with a key derived from the secret, so one URL works against
+ * every replica of a multi-region bucket. The key does not depend on the
+ * date and is derived once per credential. ECDSA signatures are randomized
+ * and their DER encoding varies in length, so SigV4A URLs of the same
+ * request differ even within one time_bucket. SigV4A needs the OpenSSL
+ * backend and does not sign aws-chunked bodies or POST policies.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) && !defined(PRESIGN_STATIC_ONLY)
+#define PRESIGN_API __attribute__((visibility("default")))
+#else
+#define PRESIGN_API
+#endif
+
+#define PRESIGN_MAX_HEADERS 32
+#define PRESIGN_MAX_EXPIRES (7 * 24 * 60 * 60)
+#define PRESIGN_STREAMING_PAYLOAD "STREAMING-AWS4-HMAC-SHA256-PAYLOAD"
+#define PRESIGN_MAX_PARTS 10000
+#define PRESIGN_MAX_RANGES 10000
+/* Longest aws-chunked chunk header, with its terminator */
+#define PRESIGN_CHUNK_HEADER_MAX 100
+
+typedef enum {
+    PRESIGN_OK = 0,
+    PRESIGN_ERR_INVALID_ARGUMENT,
+    PRESIGN_ERR_OUT_OF_MEMORY,
+    PRESIGN_ERR_MISSING_CREDENTIALS,
+    PRESIGN_ERR_ACCESS_KEY_TOO_LONG,
+    PRESIGN_ERR_ACCESS_KEY_INVALID,
+    PRESIGN_ERR_SECRET_KEY_INVALID,
+    PRESIGN_ERR_SESSION_TOKEN_TOO_LONG,
+    PRESIGN_ERR_REGION_INVALID,
+    PRESIGN_ERR_SERVICE_INVALID,
+    PRESIGN_ERR_ENDPOINT_INVALID,
+    PRESIGN_ERR_HOST_TOO_LONG,
+    PRESIGN_ERR_METHOD_INVALID,
+    PRESIGN_ERR_EXPIRES_INVALID,
+    PRESIGN_ERR_TIME_INVALID,
+    PRESIGN_ERR_PATH_TOO_LONG,
+    PRESIGN_ERR_HEADER_INVALID,
+    PRESIGN_ERR_TOO_MANY_HEADERS,
+    PRESIGN_ERR_HEADERS_TOO_LONG,
+    PRESIGN_ERR_QUERY_TOO_LONG,
+    PRESIGN_ERR_BUFFER_TOO_SMALL,
+    PRESIGN_ERR_CRYPTO,
+    PRESIGN_ERR_PAYLOAD_HASH_INVALID,
+    PRESIGN_ERR_PAYLOAD_FILE,
+    PRESIGN_ERR_PARAM_INVALID,
+    PRESIGN_ERR_PART_INVALID,
+    PRESIGN_ERR_RANGE_INVALID,
+    PRESIGN_ERR_URL_INVALID,
+    PRESIGN_ERR_CREDENTIAL_MISMATCH,
+    PRESIGN_ERR_EXPIRED,
+    PRESIGN_ERR_SIGNATURE_MISMATCH,
+    PRESIGN_ERR_POLICY_INVALID,
+    PRESIGN_ERR_SIGV4A_UNSUPPORTED
+} presign_status_t;
+
+typedef struct {
+    const char *access_key;     /* required */
+    const char *secret_key;     /* required */
+    const char *session_token;  /* optional, NULL when not using STS credentials */
+    const char *region;         /* required, e.g. "fr-par" */
+    const char *endpoint;       /* required, e.g. "https://s3.fr-par.scw.cloud" */
+    const char *service;        /* optional, defaults to "s3" */
+    FILE *debug;                /* optional, receives canonical strings per signature */
+    const char *region_set;     /* optional, e.g. "us-east-1,us-west-2" or "*": sign with SigV4A;
+                                   region is then ignored and may be NULL */
+} presign_config_t;
+
+typedef struct {
+    const char *name;
+    const char *value;
+} presign_header_t;
+
+/* A signed query parameter; value NULL is the same as "". */
+typedef struct {
+    const char *name;
+    const char *value;
+} presign_param_t;
+
+typedef struct {
+    const char *method;               /* HTTP method, any case */
+    const char *path;                 /* bucket/key, encoded by the signer */
+    const presign_header_t *headers;  /* headers the client will send, host is implicit */
+    size_t header_count;
+    int expires;                      /* validity in seconds, 1 to PRESIGN_MAX_EXPIRES */
+    time_t now;                       /* signing time, 0 for the current time */
+    int time_bucket;                  /* seconds, 0 for none; see above */
+    const char *payload_hash;         /* 64 lowercase hex digits or PRESIGN_STREAMING_PAYLOAD,
+                                         NULL for UNSIGNED-PAYLOAD */
+    const presign_param_t *params;    /* extra query parameters, e.g. versionId; not X-Amz-* ones */
+    size_t param_count;
+} presign_request_t;
+
+/* Conditions of a browser POST upload form; see presign_sign_post(). */
+typedef struct {
+    const char *bucket;               /* required, no '/' */
+    const char *key_prefix;           /* keys the form may upload to; NULL or "" for any */
+    const char *content_type;         /* exact value or, ending in an asterisk, a prefix; NULL for any */
+    unsigned long long min_length;    /* content-length-range; needs a max_length */
+    unsigned long long max_length;    /* 0 for no limit, then min_length must be 0 too */
+    int expires;                      /* validity in seconds, 1 to PRESIGN_MAX_EXPIRES */
+    time_t now;                       /* signing time, 0 for the current time */
+} presign_post_t;
+
+typedef struct presign_ctx presign_ctx_t;
+typedef struct presign_chunked presign_chunked_t;
+
+typedef struct {
+    unsigned long long hits;      /* signatures that found their key already derived */
+    unsigned long long misses;    /* signatures that had to derive it */
+    unsigned long long prewarms;  /* keys derived ahead of use */
+    size_t slots;                 /* credential, region and service combinations in use */
+} presign_key_stats_t;
+
+/* Validates config and creates a signer. Strings are copied. */
+PRESIGN_API int presign_ctx_new(const presign_config_t *config, presign_ctx_t **ctx_out);
+PRESIGN_API void presign_ctx_free(presign_ctx_t *ctx);
+
+/*
+ * Writes the presigned URL for req into out as a NUL-terminated string.
+ * out_len, when not NULL, receives the URL length without the terminator;
+ * with PRESIGN_ERR_BUFFER_TOO_SMALL it receives the length that is needed,
+ * so the caller can retry with out_size > *out_len (for SigV4A, the length
+ * of the longest signature). Paths and header values have no length limit
+ * of their own. Returns PRESIGN_OK or one of the
+ * presign_status_t error codes; out is left unspecified on error.
+ */
+PRESIGN_API int presign_sign_url(presign_ctx_t *ctx, const presign_request_t *req,
+                                 char *out, size_t out_size, size_t *out_len);
+
+/*
+ * Writes the presigned PUT URLs of parts first_part to first_part +
+ * part_count - 1 of the multipart upload upload_id into out, one
+ * newline-terminated URL per part and a terminator after the last. req is
+ * the upload's template: its method, path, headers and params are shared by
+ * every part, so it is canonicalized once and only the partNumber differs.
+ * out_len and PRESIGN_ERR_BUFFER_TOO_SMALL work as in presign_sign_url().
+ * Part numbers run from 1 to PRESIGN_MAX_PARTS.
+ */
+PRESIGN_API int presign_sign_parts(presign_ctx_t *ctx, const presign_request_t *req, const char *upload_id,
+                                   unsigned int first_part, unsigned int part_count,
+                                   char *out, size_t out_size, size_t *out_len);
+
+/*
+ * Splits an object of object_size bytes into range_size pieces (the last
+ * one may be shorter) and writes one line per piece into out:
+ * "<URL>\t<bytes=first-last>\n", with a terminator after the last. Each URL
+ * signs req with a range header of that value, which the client must send;
+ * req must not carry a range header of its own. out_len and
+ * PRESIGN_ERR_BUFFER_TOO_SMALL work as in presign_sign_url(). At most
+ * PRESIGN_MAX_RANGES pieces.
+ */
+PRESIGN_API int presign_sign_ranges(presign_ctx_t *ctx, const presign_request_t *req, unsigned long long object_size,
+                                    unsigned long long range_size, char *out, size_t out_size, size_t *out_len);
+
+/*
+ * Builds the POST policy of post, signs it and writes the upload form into
+ * out, one "<name>\t<value>\n" line per field with a terminator after the
+ * last: "action" (the URL to POST to, not a field), then the fields key
+ * (key_prefix followed by ${filename}), Content-Type (for an exact
+ * content_type), policy (base64 JSON), x-amz-algorithm, x-amz-credential,
+ * x-amz-date, x-amz-security-token (with a session token) and
+ * x-amz-signature. The file goes after them in the form. Strings must not
+ * contain control characters. out_len and PRESIGN_ERR_BUFFER_TOO_SMALL
+ * work as in presign_sign_url(); invalid conditions give
+ * PRESIGN_ERR_POLICY_INVALID.
+ */
+PRESIGN_API int presign_sign_post(presign_ctx_t *ctx, const presign_post_t *post, char *out, size_t out_size,
+                                  size_t *out_len);
+
+/*
+ * Checks a presigned URL received with method at time now (0 for the
+ * current time), the way S3 does: the credential scope and session token
+ * must be ctx's, X-Amz-Date plus X-Amz-Expires must not have passed, and
+ * the signature must match, compared in constant time. url (url_len bytes,
+ * no terminator needed) is "scheme://host/path?query" with ctx's host or
+ * "/path?query"; headers are the ones the client sent, of which the signed
+ * ones are looked up by name. Nothing is allocated for URLs of ordinary
+ * length, and the signing keys of the last days come from the key table.
+ * Returns PRESIGN_OK or the reason the URL is rejected:
+ * PRESIGN_ERR_URL_INVALID, PRESIGN_ERR_CREDENTIAL_MISMATCH,
+ * PRESIGN_ERR_EXPIRED, PRESIGN_ERR_HEADER_INVALID (a signed header was
+ * not sent) or PRESIGN_ERR_SIGNATURE_MISMATCH.
+ */
+PRESIGN_API int presign_verify_url(presign_ctx_t *ctx, const char *method, const char *url, size_t url_len,
+                                   const presign_header_t *headers, size_t header_count, time_t now);
+
+/*
+ * Derives the signing key ctx needs at time when (0 for now) before the
+ * first signature, e.g. for every region a server signs for at start-up.
+ */
+PRESIGN_API int presign_prewarm(presign_ctx_t *ctx, time_t when);
+
+/* Process-wide signing key counters. */
+PRESIGN_API void presign_key_stats(presign_key_stats_t *stats);
+
+/*
+ * Computes the SHA-256 of the file at path for payload_hash: hex receives
+ * 64 hex digits and a terminator, size (when not NULL) the number of bytes
+ * hashed. Returns PRESIGN_ERR_PAYLOAD_FILE with errno set when the file
+ * cannot be read.
+ */
+PRESIGN_API int presign_hash_file(const char *path, char *hex, unsigned long long *size);
+
+/*
+ * Signs req as an aws-chunked upload into url (as presign_sign_url(), with
+ * payload_hash set to PRESIGN_STREAMING_PAYLOAD) and creates the signer of
+ * its body in *chunked_out. The headers of req must include
+ * "content-encoding: aws-chunked" and, when the server wants it,
+ * x-amz-decoded-content-length. ctx must outlive the chunk signer.
+ */
+PRESIGN_API int presign_chunked_new(presign_ctx_t *ctx, const presign_request_t *req, char *url, size_t url_size,
+                                    size_t *url_len, presign_chunked_t **chunked_out);
+
+/*
+ * Signs the next len bytes of the body and writes their chunk header
+ * "<hex len>;chunk-signature=<signature>\r\n" (NUL-terminated, at most
+ * PRESIGN_CHUNK_HEADER_MAX bytes) to header; the chunk on the wire is the
+ * header, the data and "\r\n". A chunk of length 0 ends the body, after
+ * which the signer only accepts presign_chunked_free(). Chunks other than
+ * the last must be at least 8 KiB.
+ */
+PRESIGN_API int presign_chunked_sign(presign_chunked_t *chunked, const void *data, size_t len,
+                                     char *header, size_t header_size, size_t *header_len);
+PRESIGN_API void presign_chunked_free(presign_chunked_t *chunked);
+
+/* Parses a YYYY-MM-DDTHH:MM:SSZ timestamp as UTC. */
+PRESIGN_API int presign_parse_timestamp(const char *text, time_t *out);
+
+PRESIGN_API const char *presign_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef PRESIGN_INTERNAL_H
+#define PRESIGN_INTERNAL_H
+
+/*
+ * Building blocks shared by libpresign, the CLI and the tests. Not part of
+ * the public API: the shared library does not export these symbols.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "presign.h"
+
+#define MAX_URL_LEN 4096
+#define MAX_HEADERS PRESIGN_MAX_HEADERS
+#define MAX_ENV_VAR_LEN 512
+
+// Bytes of each request's strings kept on the stack before the request
+// arena falls back to the heap.
+#define REQUEST_ARENA_INLINE 4096
+
+// A string that is not necessarily NUL-terminated.
+typedef struct {
+    const char *data;
+    size_t len;
+} str_view_t;
+
+// Bump allocator for per-request strings (see arena.c). Pointers it returns
+// stay valid until arena_reset() or arena_free(); initial may be NULL.
+typedef struct arena_block arena_block_t;
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+    arena_block_t *blocks;
+    char *initial;
+    size_t initial_size;
+} arena_t;
+void arena_init(arena_t *arena, void *initial, size_t initial_size);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *src, size_t len);
+// Gives back the unused end of the most recent allocation, which now has
+// size bytes. Ignored for anything but the last allocation.
+void arena_shrink(arena_t *arena, void *last, size_t size);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+int url_encode_component(const char *src, char *dest, size_t dest_size, int keep_slash);
+// Encodes len bytes of src (which need not be terminated) and stores the
+// encoded length, excluding the terminator, in *encoded_len when not NULL.
+int url_encode_bytes(const char *src, size_t len, char *dest, size_t dest_size, int keep_slash,
+                     size_t *encoded_len);
+void to_hex(const unsigned char *data, int len, char *hex);
+// Standard base64 with padding; dest needs 4 * ((len + 2) / 3) + 1 bytes.
+// Returns the encoded length, without the terminator.
+size_t base64_encode(const void *src, size_t len, char *dest);
+int hmac_sha256(const char *key, int key_len, const char *data, int data_len, unsigned char *result);
+int sha256_hash(const char *data, int data_len, unsigned char *result);
+int derive_signing_key(const char *secret, const char *date, const char *region, const char *service,
+                       unsigned char *signing_key);
+
+// Incremental SHA-256 on the configured backend (see crypto.c).
+// crypto_backend_name() is "openssl", "mbedtls" or "native".
+const char *crypto_backend_name(void);
+typedef struct sha256_stream sha256_stream_t;
+sha256_stream_t *sha256_stream_new(void);
+void sha256_stream_free(sha256_stream_t *stream);
+int sha256_stream_start(sha256_stream_t *stream);
+int sha256_stream_update(sha256_stream_t *stream, const void *data, size_t len);
+int sha256_stream_finish(sha256_stream_t *stream, unsigned char *digest);
+int sha256_stream_copy(sha256_stream_t *dst, const sha256_stream_t *src);
+
+// HMAC-SHA256 key with precomputed inner and outer midstates. A MAC is
+// computed as hmac_sha256_begin(), sha256_stream_update(inner, ...) and
+// hmac_sha256_end(); the key itself is only read, so several threads may
+// begin from it at once.
+typedef struct {
+    sha256_stream_t *inner;
+    sha256_stream_t *outer;
+} hmac_sha256_key_t;
+int hmac_sha256_key_init(hmac_sha256_key_t *mac_key, const unsigned char *key, size_t key_len);
+void hmac_sha256_key_clear(hmac_sha256_key_t *mac_key);
+int hmac_sha256_begin(const hmac_sha256_key_t *mac_key, sha256_stream_t *inner, sha256_stream_t *outer);
+int hmac_sha256_end(sha256_stream_t *inner, sha256_stream_t *outer, unsigned char *mac);
+
+// Reusable digest and MAC contexts, with the algorithms fetched once per
+// process. crypto_thread_ctx() returns the calling thread's context,
+// created on first use and freed when the thread exits; hmac_sha256(),
+// sha256_hash() and derive_signing_key() run on it. The inner and outer
+// streams are free for a caller's own HMAC (see hmac_sha256_begin()); the
+// one-shot helpers never touch them.
+typedef struct crypto_ctx crypto_ctx_t;
+crypto_ctx_t *crypto_ctx_new(void);
+void crypto_ctx_free(crypto_ctx_t *cc);
+crypto_ctx_t *crypto_thread_ctx(void);
+sha256_stream_t *crypto_ctx_inner(crypto_ctx_t *cc);
+sha256_stream_t *crypto_ctx_outer(crypto_ctx_t *cc);
+int crypto_hmac(crypto_ctx_t *cc, const void *key, size_t key_len, const void *data, size_t data_len,
+                unsigned char *mac);
+int crypto_sha256(crypto_ctx_t *cc, const void *data, size_t len, unsigned char *digest);
+
+// ECDSA P-256 keys of SigV4A (see crypto.c). The private key is derived
+// from the credential alone; a derived key is only read, so threads may
+// sign with it at once. Signatures are DER, at most ECDSA_SIGNATURE_MAX
+// bytes, over a SHA-256 digest. Only the OpenSSL backend supports them.
+#define ECDSA_SIGNATURE_MAX 72
+typedef struct ecdsa_key ecdsa_key_t;
+int ecdsa_supported(void);
+int sigv4a_derive_private_key(const char *access_key, const char *secret_key, unsigned char *private_key);
+ecdsa_key_t *ecdsa_key_derive(const char *access_key, const char *secret_key);
+void ecdsa_key_free(ecdsa_key_t *key);
+// The public point's affine coordinates, 32 bytes each.
+void ecdsa_public_key(const ecdsa_key_t *key, unsigned char *x, unsigned char *y);
+int ecdsa_sign(const ecdsa_key_t *key, const unsigned char *digest, unsigned char *der, size_t *der_len);
+int ecdsa_verify(const ecdsa_key_t *key, const unsigned char *digest, const unsigned char *der, size_t der_len);
+
+// Reference encoders; url_encode_component() and to_hex() dispatch to the
+// fastest kernel the CPU supports, with identical results (see encode.c).
+int url_encode_component_scalar(const char *src, char *dest, size_t dest_size, int keep_slash);
+void to_hex_scalar(const unsigned char *data, int len, char *hex);
+const char *encode_kernel_name(void);
+// Forces a kernel ("avx2", "sse2", "neon" or "scalar") for tests and
+// benchmarks. Returns -1 if it is not built in or the CPU lacks it. Not
+// safe while other threads are encoding.
+int encode_select_kernel(const char *name);
+
+// Single-stream SHA-256 compression (see sha256.c). sha256_compress()
+// dispatches to the SHA-NI, ARMv8 or portable kernel.
+extern const uint32_t sha256_initial_state[8];
+extern const uint32_t sha256_round_constants[64];
+void sha256_compress(uint32_t *state, const unsigned char *blocks, size_t block_count);
+void sha256_compress_portable(uint32_t *state, const unsigned char *blocks, size_t block_count);
+const char *sha256_kernel_name(void);
+// Forces a kernel ("shani", "armv8" or "portable") for tests and benchmarks.
+// Returns -1 if it is not built in or the CPU lacks it. Not safe while other
+// threads are hashing.
+int sha256_select_kernel(const char *name);
+// State after compressing one 64-byte block from the SHA-256 initial value.
+void sha256_midstate(const unsigned char *block, uint32_t *state);
+
+// Multi-buffer SHA-256 (see sha256_mb.c). Each job hashes data[0..len)
+// starting from init (NULL for the SHA-256 initial value) after prefix_len
+// bytes already absorbed into init, and writes 32 bytes to digest.
+typedef struct {
+    const uint32_t *init;
+    uint64_t prefix_len;
+    const unsigned char *data;
+    size_t len;
+    unsigned char *digest;
+    size_t lane_index;          // used by the engine
+} sha256_mb_job_t;
+int sha256_mb_run(sha256_mb_job_t *jobs, size_t count);
+int sha256_mb_lanes(void);
+const char *sha256_mb_kernel_name(void);
+// Limits the engine to the named kernel ("avx512", "avx2" or "scalar") and
+// narrower ones. Returns -1 if the kernel is unknown or unsupported.
+int sha256_mb_select_kernel(const char *name);
+
+// Process-wide signing key table (see keytable.c). A slot is shared by
+// every signer with the same credential, region and service. begin and
+// midstates hand out the key for date_stamp, the date of now, deriving it
+// on first use; prewarm derives the key for the day of when in advance.
+typedef struct key_slot key_slot_t;
+key_slot_t *key_table_acquire(const char *access_key, const char *secret_key, const char *region,
+                              const char *service);
+void key_table_release(key_slot_t *slot);
+int key_table_begin(key_slot_t *slot, time_t now, const char *date_stamp,
+                    sha256_stream_t *inner, sha256_stream_t *outer);
+int key_table_midstates(key_slot_t *slot, time_t now, const char *date_stamp,
+                        uint32_t *inner_state, uint32_t *outer_state);
+int key_table_prewarm(key_slot_t *slot, time_t when);
+// The slot credential's SigV4A key, derived on first use and valid until
+// the slot is released.
+int key_table_ecdsa(key_slot_t *slot, const ecdsa_key_t **key);
+
+// Start of the time_bucket-second window now falls in (see presign.h).
+time_t bucket_start(time_t now, int bucket);
+
+// Canonical header block ("name:value\n" per header, host included) and
+// signed header list of req, as used by presign_sign_url(), allocated from
+// arena with their exact lengths.
+int canonicalize_headers(const presign_ctx_t *ctx, const presign_request_t *req, arena_t *arena,
+                         str_view_t *canonical_headers, str_view_t *signed_headers);
+
+// Chunk signer chained from seed_signature (64 hex digits) for a request
+// signed at now; presign_chunked_new() without the URL.
+presign_chunked_t *chunked_begin(presign_ctx_t *ctx, time_t now, const char *seed_signature);
+
+// Signs count requests at once, hashing them through the multi-buffer
+// engine. outs[i] (out_size bytes each) receives URL i, statuses[i] its
+// status, out_lens[i] the URL length (the needed length when statuses[i] is
+// PRESIGN_ERR_BUFFER_TOO_SMALL). Returns PRESIGN_OK unless the whole group
+// failed.
+int sign_url_group(presign_ctx_t *ctx, const presign_request_t *reqs, size_t count,
+                   char *const outs[], size_t out_size, size_t *out_lens, int *statuses);
+
+// Per-stage timers and counters (see stats.c). Off until stats_enable();
+// the STATS_* hooks then cost one test of a flag each. A stats_timer_t
+// adds up the laps of one signature on the stack: STATS_LAP charges the
+// time since the previous lap to stage, STATS_END records the laps and,
+// unless total is -1, the whole span as stage total.
+typedef enum {
+    STAT_ARGS,              // command-line parsing
+    STAT_SETUP,             // credentials, profiles and signer creation
+    STAT_ENCODE,            // URI encoding of the path and signed header list
+    STAT_CANONICALIZE,      // validation, timestamp, headers, query and URL layout
+    STAT_HASH,              // SHA-256 of the canonical request, and the thread's crypto context
+    STAT_KEY,               // signing key lookup or derivation
+    STAT_SIGN,              // string to sign, HMAC and hex signature
+    STAT_REQUEST,           // one presign_sign_url() call
+    STAT_GROUP_HASH,        // multi-buffer hash rounds of one group
+    STAT_GROUP,             // one sign_url_group() call
+    STAT_OUTPUT,            // one write of URLs to stdout or a socket
+    STAT_PAYLOAD,           // SHA-256 of one payload file
+    STAT_CHUNK,             // one aws-chunked chunk signature, data hash included
+    STAT_VERIFY,            // one presign_verify_url() call
+    STAT_STAGES
+} stat_stage_t;
+typedef enum {
+    STAT_SIGNATURES,
+    STAT_SIGN_ERRORS,
+    STAT_GROUPED_SIGNATURES,
+    STAT_OUTPUT_BYTES,
+    STAT_PAYLOAD_BYTES,
+    STAT_VERIFIED,
+    STAT_VERIFY_FAILURES,
+    STAT_MEMO_HITS,
+    STAT_MEMO_MISSES,
+    STAT_COUNTERS
+} stat_counter_t;
+typedef struct {
+    int on;
+    unsigned int stages;            // bit per stage with a lap in ns[]
+    uint64_t start;
+    uint64_t last;
+    uint64_t ns[STAT_STAGES];
+} stats_timer_t;
+extern int stats_enabled;
+void stats_enable(void);
+uint64_t stats_clock(void);
+void stats_timer_begin(stats_timer_t *timer);
+void stats_lap(stats_timer_t *timer, stat_stage_t stage);
+void stats_timer_end(stats_timer_t *timer, int total);
+void stats_record(stat_stage_t stage, uint64_t ns);
+void stats_count(stat_counter_t counter, uint64_t n);
+// Writes every thread's totals as one JSON object. Threads other than the
+// caller must not be signing.
+int stats_write_json(FILE *out);
+
+#define STATS_START(timer) \
+    do { if (((timer)->on = stats_enabled)) stats_timer_begin(timer); } while (0)
+#define STATS_LAP(timer, stage) \
+    do { if ((timer)->on) stats_lap(timer, stage); } while (0)
+#define STATS_END(timer, total) \
+    do { if ((timer)->on) stats_timer_end(timer, total); } while (0)
+#define STATS_COUNT(counter, n) \
+    do { if (stats_enabled) stats_count(counter, n); } while (0)
+
+#endif
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * Profiles file: named credentials, region, endpoint and default headers,
+ * so that one process can sign for many tenants.
+ *
+ *     # comment
+ *     [tenant-a]
+ *     access_key = SCWXXXXXXXXXXXXXXXXX
+ *     secret_key = ...
+ *     session_token = ...          (optional)
+ *     region = fr-par              (optional, else REGION / S3_REGION)
+ *     endpoint = https://s3.fr-par.scw.cloud
+ *     header = x-amz-acl: private  (repeatable)
+ *
+ * Loading maps the file read-only and only indexes the [name] lines: an
+ * array of names pointing into the mapping and an open-addressing hash
+ * table of 32-bit indexes into it. A profile's settings are parsed into a
+ * private copy the first time it is used, together with its signer, so a
+ * file with hundreds of tenants costs little more at start-up than the
+ * handful a run signs for, and a mistake in one tenant's section does not
+ * stop the others.
+ */
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static char *trim(char *start, char *end) {
+    while (start < end && is_blank(*start)) {
+        start++;
+    }
+    while (end > start && is_blank(end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return start;
+}
+
+// 1-based line number of pos, only needed for error messages.
+static unsigned long line_number(const profiles_t *profiles, const char *pos) {
+    unsigned long line_no = 1;
+    for (const char *p = profiles->data; p < pos; p++) {
+        line_no += *p == '\n';
+    }
+    return line_no;
+}
+
+static void report(const profiles_t *profiles, const char *pos, const char *message) {
+    fprintf(stderr, "Error: %s line %lu: %s\n", profiles->path, line_number(profiles, pos), message);
+}
+
+static int map_file(profiles_t *profiles) {
+    int fd = open(profiles->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open profiles file '%s'\n", profiles->path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: Profiles file '%s' is not a regular file\n", profiles->path);
+        close(fd);
+        return -1;
+    }
+    profiles->size = (size_t)st.st_size;
+    if (profiles->size > 0) {
+        void *map = mmap(NULL, profiles->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Error: Cannot read profiles file '%s'\n", profiles->path);
+            close(fd);
+            return -1;
+        }
+        profiles->data = map;
+    }
+    close(fd);
+    return 0;
+}
+
+// Text before the first section may only hold blank and comment lines.
+static int check_preamble(const profiles_t *profiles, const char *end) {
+    const char *line = profiles->data;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', (size_t)(end - line));
+        eol = eol ? eol : end;
+        const char *text = line;
+        while (text < eol && is_blank(*text)) {
+            text++;
+        }
+        if (text < eol && *text != '#' && *text != ';') {
+            report(profiles, line, "setting outside a [profile] section");
+            return -1;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+static int compare_name(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return cmp != 0 ? cmp : (a_len > b_len) - (a_len < b_len);
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Builds the lookup table, at most half full. Returns -1 after reporting a
+// name defined twice.
+static int hash_profiles(profiles_t *profiles) {
+    size_t size = 16;
+    while (size < profiles->count * 2) {
+        size *= 2;
+    }
+    if (!(profiles->slots = calloc(size, sizeof(profiles->slots[0])))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    profiles->slot_mask = size - 1;
+    for (size_t i = 0; i < profiles->count; i++) {
+        const profile_t *profile = &profiles->entries[i];
+        size_t slot = hash_name(profile->name, profile->name_len) & profiles->slot_mask;
+        for (; profiles->slots[slot]; slot = (slot + 1) & profiles->slot_mask) {
+            const profile_t *other = &profiles->entries[profiles->slots[slot] - 1];
+            if (compare_name(other->name, other->name_len, profile->name, profile->name_len) == 0) {
+                fprintf(stderr, "Error: %s: profile '%.*s' is defined twice\n", profiles->path,
+                        (int)profile->name_len, profile->name);
+                return -1;
+            }
+        }
+        profiles->slots[slot] = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+// Finds every "[name]" line. '[' is rare in values, so this mostly skips
+// through the file with memchr. Returns -1 after reporting a problem.
+static int index_profiles(profiles_t *profiles) {
+    const char *data = profiles->data;
+    const char *end = data + profiles->size;
+    const char *p = data;
+    size_t cap = 0;
+
+    while (p < end && (p = memchr(p, '[', (size_t)(end - p))) != NULL) {
+        const char *line = p;
+        while (line > data && (line[-1] == ' ' || line[-1] == '\t')) {
+            line--;
+        }
+        if (line > data && line[-1] != '\n') {
+            p++;
+            continue;
+        }
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        eol = eol ? eol : end;
+        const char *close = eol;
+        while (close > p && is_blank(close[-1])) {
+            close--;
+        }
+        if (close - p < 2 || close[-1] != ']') {
+            report(profiles, p, "expected [name]");
+            return -1;
+        }
+        const char *name = p + 1;
+        const char *name_end = close - 1;
+        while (name < name_end && is_blank(*name)) {
+            name++;
+        }
+        while (name_end > name && is_blank(name_end[-1])) {
+            name_end--;
+        }
+        if (name == name_end || memchr(name, '\t', (size_t)(name_end - name))) {
+            report(profiles, p, "profile names must be non-empty and free of tabs");
+            return -1;
+        }
+
+        if (profiles->count == 0) {
+            if (check_preamble(profiles, line) != 0) {
+                return -1;
+            }
+        } else {
+            profiles->entries[profiles->count - 1].body_end = line;
+        }
+        if (profiles->count == cap) {
+            if (cap >= UINT32_MAX / 4) {
+                report(profiles, p, "too many profiles");
+                return -1;
+            }
+            cap = cap ? cap * 2 : 64;
+            profile_t *entries = realloc(profiles->entries, cap * sizeof(*entries));
+            if (!entries) {
+                fprintf(stderr, "Error: Out of memory\n");
+                return -1;
+            }
+            profiles->entries = entries;
+        }
+        profile_t *profile = &profiles->entries[profiles->count++];
+        memset(profile, 0, sizeof(*profile));
+        profile->name = name;
+        profile->name_len = (size_t)(name_end - name);
+        profile->body = eol < end ? eol + 1 : end;
+        profile->body_end = end;
+        p = eol;
+    }
+    if (profiles->count == 0) {
+        return check_preamble(profiles, end);
+    }
+    return hash_profiles(profiles);
+}
+
+profiles_t *profiles_load(const char *path) {
+    profiles_t *profiles = calloc(1, sizeof(*profiles));
+    if (!profiles) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return NULL;
+    }
+    profiles->path = path;
+    if (map_file(profiles) != 0 || index_profiles(profiles) != 0) {
+        profiles_free(profiles);
+        return NULL;
+    }
+    return profiles;
+}
+
+profile_t *profiles_find(profiles_t *profiles, const char *name, size_t len) {
+    // Batch input is usually grouped by tenant, so try the last hit first
+    profile_t *last = profiles->last;
+    if (last && compare_name(last->name, last->name_len, name, len) == 0) {
+        return last;
+    }
+    if (!profiles->slots) {
+        return NULL;
+    }
+    size_t slot = hash_name(name, len) & profiles->slot_mask;
+    for (; profiles->slots[slot]; slot = (slot + 1) & profiles->slot_mask) {
+        profile_t *entry = &profiles->entries[profiles->slots[slot] - 1];
+        if (compare_name(entry->name, entry->name_len, name, len) == 0) {
+            profiles->last = entry;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Stores value under key in profile. Returns an error message or NULL.
+static const char *set_value(profile_t *profile, const char *key, char *value) {
+    const char **slot = NULL;
+    if (strcmp(key, "access_key") == 0) {
+        slot = &profile->access_key;
+    } else if (strcmp(key, "secret_key") == 0) {
+        slot = &profile->secret_key;
+    } else if (strcmp(key, "session_token") == 0) {
+        slot = &profile->session_token;
+    } else if (strcmp(key, "region") == 0) {
+        slot = &profile->region;
+    } else if (strcmp(key, "endpoint") == 0) {
+        slot = &profile->endpoint;
+    } else if (strcmp(key, "header") != 0) {
+        return "unknown key";
+    }
+    if (slot) {
+        if (*slot) {
+            return "key set twice";
+        }
+        *slot = value;
+        return NULL;
+    }
+
+    char *colon = strchr(value, ':');
+    if (!colon) {
+        return "header must be 'Name: Value'";
+    }
+    for (const char *v = colon + 1; *v; v++) {
+        if ((unsigned char)*v < 32 && *v != '\t') {
+            return "header value contains control characters";
+        }
+    }
+    if (profile->header_count >= MAX_HEADERS) {
+        return "too many headers";
+    }
+    *colon = '\0';
+    presign_header_t *header = &profile->headers[profile->header_count++];
+    header->name = trim(value, colon);
+    header->value = colon + 1 + strspn(colon + 1, " \t");
+    return NULL;
+}
+
+// Parses the settings of profile from a private copy of its section, in
+// which values are terminated in place. Returns -1 after reporting.
+static int parse_profile(const profiles_t *profiles, profile_t *profile) {
+    size_t body_len = (size_t)(profile->body_end - profile->body);
+    size_t headers_size = MAX_HEADERS * sizeof(presign_header_t);
+    profile->storage_size = headers_size + body_len + 1;
+    if (!(profile->storage = malloc(profile->storage_size))) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    profile->headers = (presign_header_t *)profile->storage;
+    char *copy = profile->storage + headers_size;
+    memcpy(copy, profile->body, body_len);
+    copy[body_len] = '\0';
+
+    char *cursor = copy;
+    char *end = copy + body_len;
+    while (cursor < end) {
+        char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        char *line_end = newline ? newline : end;
+        const char *line = profile->body + (cursor - copy);
+        char *text = trim(cursor, line_end);
+        cursor = newline ? newline + 1 : end;
+
+        if (*text == '\0' || *text == '#' || *text == ';') {
+            continue;
+        }
+        char *equals = strchr(text, '=');
+        const char *error = "expected key = value";
+        if (equals) {
+            char *value = trim(equals + 1, equals + 1 + strlen(equals + 1));
+            error = set_value(profile, trim(text, equals), value);
+        }
+        if (error) {
+            report(profiles, line, error);
+            return -1;
+        }
+    }
+    if (!profile->access_key || !profile->secret_key) {
+        fprintf(stderr, "Error: %s: profile '%.*s' needs access_key and secret_key\n", profiles->path,
+                (int)profile->name_len, profile->name);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the signer of profile, parsing the profile and creating the signer
+// on first use. A profile that failed is reported once and then returns
+// NULL.
+signer_t *profile_signer(profiles_t *profiles, profile_t *profile, const presign_args_t *args) {
+    if (!profile->signer && !profile->unusable) {
+        signer_t *signer = NULL;
+        if (parse_profile(profiles, profile) == 0) {
+            signer = malloc(sizeof(*signer));
+            if (!signer) {
+                fprintf(stderr, "Error: Out of memory\n");
+            } else if (init_signer(signer, args, profile) != 0) {
+                free(signer);
+                signer = NULL;
+            }
+        }
+        profile->signer = signer;
+        profile->unusable = signer == NULL;
+    }
+    return profile->signer;
+}
+
+void profiles_free(profiles_t *profiles) {
+    if (!profiles) {
+        return;
+    }
+    for (size_t i = 0; i < profiles->count; i++) {
+        profile_t *profile = &profiles->entries[i];
+        if (profile->signer) {
+            presign_ctx_free(profile->signer->ctx);
+            free(profile->signer);
+        }
+        if (profile->storage) {
+            memset(profile->storage, 0, profile->storage_size);
+            free(profile->storage);
+        }
+    }
+    if (profiles->data) {
+        munmap(profiles->data, profiles->size);
+    }
+    free(profiles->entries);
+    free(profiles->slots);
+    free(profiles);
+}
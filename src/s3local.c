@@ -0,0 +1,989 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * presign s3-local: a stand-in for S3 on a local TCP port, so presigned
+ * URLs can be exercised end to end (and under load, see load.c) without
+ * credentials for a real service or network access.
+ *
+ * It speaks just enough HTTP/1.1 for presigned requests: keep-alive,
+ * Content-Length bodies, GET (with a single byte Range), PUT and DELETE.
+ * Every request is checked with presign_verify_url() against the
+ * credentials of the environment and rejected with S3's error code when
+ * it fails; a signed x-amz-content-sha256 is also checked against the
+ * body. An aws-chunked body (STREAMING-AWS4-HMAC-SHA256-PAYLOAD) is
+ * decoded as it arrives, every chunk signature checked along the chain
+ * seeded by the URL's signature, and the decoded bytes are stored.
+ *
+ * An object "bucket/key" is stored as one file in the object directory,
+ * named by the URI encoding of its path, so no key can reach outside it.
+ * Without --dir the directory is a temporary one, removed on exit.
+ *
+ * Each connection is served by a thread of its own, so verification runs
+ * on as many cores as the clients keep busy. The endpoint to sign for is
+ * printed on stdout once the port is open.
+ */
+
+#define S3_MAX_HEAD 16384
+#define S3_MAX_HEADERS 64
+#define S3_IO_CHUNK 65536
+#define S3_MAX_OBJECT (1ull << 30)
+#define S3_BACKLOG 128
+
+typedef struct s3_conn s3_conn_t;
+
+typedef struct {
+    presign_ctx_t *ctx;
+    int dir_fd;
+    unsigned long long requests;    // updated atomically by the connection threads
+    unsigned long long rejected;
+    unsigned long long uploads;
+    // The connections being served, so shutdown can wait for them before
+    // the context and the directory go away
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    s3_conn_t *live;
+} s3_server_t;
+
+// One connection. Bytes [used, len) of buf were read but not consumed yet:
+// the rest of a request, or the next one when the client pipelines.
+struct s3_conn {
+    s3_server_t *server;
+    s3_conn_t *prev;    // in server->live, under server->lock
+    s3_conn_t *next;
+    int fd;
+    size_t used;
+    size_t len;
+    char buf[S3_MAX_HEAD + 1];
+    char io[S3_IO_CHUNK];
+};
+
+typedef struct {
+    char *method;
+    char *target;
+    presign_header_t headers[S3_MAX_HEADERS];
+    size_t header_count;
+    unsigned long long content_length;
+    unsigned long long body_left;   // body bytes not read yet
+    int has_length;
+    int keep_alive;
+} s3_request_t;
+
+static volatile sig_atomic_t s3_stop = 0;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    s3_stop = 1;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t wrote = write(fd, data, len);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            return -1;
+        }
+        data += wrote;
+        len -= (size_t)wrote;
+    }
+    return 0;
+}
+
+static ssize_t read_some(int fd, char *buf, size_t len) {
+    for (;;) {
+        ssize_t got = read(fd, buf, len);
+        if (got >= 0 || errno != EINTR) {
+            return got;
+        }
+    }
+}
+
+static const char *status_reason(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    default: return "Internal Server Error";
+    }
+}
+
+// Sends a status line and headers; extra is "" or more header lines.
+static int send_head(s3_conn_t *conn, const s3_request_t *req, int status, unsigned long long length,
+                     const char *extra) {
+    char head[512];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nServer: presign-s3-local\r\nContent-Length: %llu\r\n"
+                                           "%s%s\r\n",
+                       status, status_reason(status), length, extra,
+                       req->keep_alive ? "" : "Connection: close\r\n");
+    return len > 0 && len < (int)sizeof(head) ? write_all(conn->fd, head, (size_t)len) : -1;
+}
+
+// Sends an S3 error document.
+static int send_error(s3_conn_t *conn, s3_request_t *req, int status, const char *code, const char *message) {
+    char body[512];
+    int len = snprintf(body, sizeof(body), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                           "<Error><Code>%s</Code><Message>%s</Message></Error>\n", code, message);
+    if (len < 0 || len >= (int)sizeof(body)) {
+        len = 0;
+    }
+    __atomic_add_fetch(&conn->server->rejected, 1, __ATOMIC_RELAXED);
+    return send_head(conn, req, status, (unsigned long long)len, "Content-Type: application/xml\r\n") != 0 ||
+           write_all(conn->fd, body, (size_t)len) != 0 ? -1 : 0;
+}
+
+// Reads until a whole request head is buffered. Returns its length, 0 when
+// the client closed the connection between requests, -1 on errors and -2
+// when the head is too large.
+static long read_head(s3_conn_t *conn) {
+    memmove(conn->buf, conn->buf + conn->used, conn->len - conn->used);
+    conn->len -= conn->used;
+    conn->used = 0;
+    for (;;) {
+        char *end = memmem(conn->buf, conn->len, "\r\n\r\n", 4);
+        if (end) {
+            return (long)(end + 4 - conn->buf);
+        }
+        if (conn->len == S3_MAX_HEAD) {
+            return -2;
+        }
+        ssize_t got = read_some(conn->fd, conn->buf + conn->len, S3_MAX_HEAD - conn->len);
+        if (got <= 0) {
+            return got == 0 && conn->len == 0 ? 0 : -1;
+        }
+        conn->len += (size_t)got;
+    }
+}
+
+// Splits the head in place into method, target and headers.
+static int parse_head(char *head, size_t head_len, s3_request_t *req) {
+    head[head_len - 2] = '\0';
+    char *line_end = strstr(head, "\r\n");
+    *line_end = '\0';
+    req->method = head;
+    char *space = strchr(head, ' ');
+    if (!space) {
+        return -1;
+    }
+    *space = '\0';
+    req->target = space + 1;
+    space = strchr(req->target, ' ');
+    if (!space || req->target[0] != '/') {
+        return -1;
+    }
+    *space = '\0';
+    req->keep_alive = strcmp(space + 1, "HTTP/1.1") == 0;
+
+    for (char *line = line_end + 2; *line;) {
+        char *next = strstr(line, "\r\n");
+        if (next) {
+            *next = '\0';
+            next += 2;
+        } else {
+            next = line + strlen(line);
+        }
+        char *colon = strchr(line, ':');
+        if (!colon || colon == line || req->header_count == S3_MAX_HEADERS) {
+            return -1;
+        }
+        *colon = '\0';
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        char *value_end = value + strlen(value);
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            *--value_end = '\0';
+        }
+        if (strcasecmp(line, "content-length") == 0) {
+            char *end = NULL;
+            errno = 0;
+            req->content_length = strtoull(value, &end, 10);
+            if (!isdigit((unsigned char)*value) || *end != '\0' || errno != 0) {
+                return -1;
+            }
+            req->has_length = 1;
+        } else if (strcasecmp(line, "connection") == 0) {
+            req->keep_alive = strcasecmp(value, "close") != 0 &&
+                              (req->keep_alive || strcasecmp(value, "keep-alive") == 0);
+        } else if (strcasecmp(line, "transfer-encoding") == 0) {
+            return -2;
+        }
+        req->headers[req->header_count].name = line;
+        req->headers[req->header_count++].value = value;
+        line = next;
+    }
+    req->body_left = req->has_length ? req->content_length : 0;
+    return 0;
+}
+
+static const char *find_header(const s3_request_t *req, const char *name) {
+    for (size_t i = 0; i < req->header_count; i++) {
+        if (strcasecmp(req->headers[i].name, name) == 0) {
+            return req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+// Reads up to len body bytes into buf, buffered ones first. Returns the
+// number read, 0 at the end of the body, or -1.
+static ssize_t read_body(s3_conn_t *conn, s3_request_t *req, char *buf, size_t len) {
+    if (req->body_left == 0) {
+        return 0;
+    }
+    if (len > req->body_left) {
+        len = (size_t)req->body_left;
+    }
+    ssize_t got;
+    if (conn->used < conn->len) {
+        got = (ssize_t)(conn->len - conn->used < len ? conn->len - conn->used : len);
+        memcpy(buf, conn->buf + conn->used, (size_t)got);
+        conn->used += (size_t)got;
+    } else {
+        got = read_some(conn->fd, buf, len);
+        if (got <= 0) {
+            return -1;
+        }
+    }
+    req->body_left -= (unsigned long long)got;
+    return got;
+}
+
+// Reads and drops what is left of the body, so the connection can carry
+// the next request.
+static int discard_body(s3_conn_t *conn, s3_request_t *req) {
+    while (req->body_left > 0) {
+        if (read_body(conn, req, conn->io, sizeof(conn->io)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The value of query parameter name in target, or NULL. Only used for
+// parameters whose values need no decoding.
+static const char *query_value(const char *target, const char *name, size_t *len) {
+    const char *p = strchr(target, '?');
+    size_t name_len = strlen(name);
+    while (p) {
+        p++;
+        const char *end = strchr(p, '&');
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            p += name_len + 1;
+            *len = end ? (size_t)(end - p) : strlen(p);
+            return p;
+        }
+        p = end;
+    }
+    return NULL;
+}
+
+// Body bytes staged in conn->io for the aws-chunked decoder, which reads
+// its framing a line at a time.
+typedef struct {
+    s3_conn_t *conn;
+    s3_request_t *req;
+    size_t pos;
+    size_t len;
+} body_reader_t;
+
+// Copies len body bytes to dst; -1 when the body ends first.
+static int body_take(body_reader_t *reader, char *dst, size_t len) {
+    while (len > 0) {
+        if (reader->pos == reader->len) {
+            ssize_t got = read_body(reader->conn, reader->req, reader->conn->io, sizeof(reader->conn->io));
+            if (got <= 0) {
+                return -1;
+            }
+            reader->pos = 0;
+            reader->len = (size_t)got;
+        }
+        size_t n = reader->len - reader->pos < len ? reader->len - reader->pos : len;
+        memcpy(dst, reader->conn->io + reader->pos, n);
+        reader->pos += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads a CRLF-terminated line into line (NUL-terminated, CRLF dropped);
+// -1 when the body ends first or the line does not fit.
+static int body_line(body_reader_t *reader, char *line, size_t size) {
+    for (size_t len = 0; len + 1 < size; len++) {
+        if (body_take(reader, line + len, 1) != 0) {
+            return -1;
+        }
+        if (len > 0 && line[len - 1] == '\r' && line[len] == '\n') {
+            line[len - 1] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Compares two 64-digit hex signatures in constant time, in any case.
+static int same_signature(const char *a, const char *b) {
+    unsigned char difference = 0;
+    for (int i = 0; i < 64; i++) {
+        difference |= (unsigned char)(tolower((unsigned char)a[i]) ^ tolower((unsigned char)b[i]));
+    }
+    return difference == 0;
+}
+
+enum { CHUNKED_OK, CHUNKED_MALFORMED, CHUNKED_SIGNATURE, CHUNKED_TOO_LARGE, CHUNKED_FAILED };
+
+// Decodes an aws-chunked body into fd, checking each chunk's signature
+// against the chain seeded by the URL's. *decoded receives the number of
+// bytes written.
+static int store_chunked_body(s3_conn_t *conn, s3_request_t *req, int fd, unsigned long long *decoded) {
+    size_t date_len = 0;
+    size_t seed_len = 0;
+    const char *date = query_value(req->target, "X-Amz-Date", &date_len);
+    const char *seed = query_value(req->target, "X-Amz-Signature", &seed_len);
+    char timestamp[32];
+    time_t signed_at = 0;
+    // presign_verify_url() accepted both, so only the format is converted
+    if (!date || date_len != 16 || !seed || seed_len != 64) {
+        return CHUNKED_MALFORMED;
+    }
+    snprintf(timestamp, sizeof(timestamp), "%.4s-%.2s-%.2sT%.2s:%.2s:%.2sZ", date, date + 4, date + 6, date + 9,
+             date + 11, date + 13);
+    char seed_signature[65];
+    memcpy(seed_signature, seed, 64);
+    seed_signature[64] = '\0';
+    if (presign_parse_timestamp(timestamp, &signed_at) != PRESIGN_OK) {
+        return CHUNKED_MALFORMED;
+    }
+    presign_chunked_t *chunked = chunked_begin(conn->server->ctx, signed_at, seed_signature);
+    if (!chunked) {
+        return CHUNKED_FAILED;
+    }
+
+    body_reader_t reader = {conn, req, 0, 0};
+    char *data = NULL;
+    size_t data_cap = 0;
+    int rc = CHUNKED_OK;
+    *decoded = 0;
+    for (;;) {
+        char line[PRESIGN_CHUNK_HEADER_MAX];
+        char expected[PRESIGN_CHUNK_HEADER_MAX];
+        if (body_line(&reader, line, sizeof(line)) != 0) {
+            rc = CHUNKED_MALFORMED;
+            break;
+        }
+        char *end = NULL;
+        errno = 0;
+        unsigned long long size = strtoull(line, &end, 16);
+        static const char prefix[] = ";chunk-signature=";
+        if (!isxdigit((unsigned char)line[0]) || errno != 0 || strncmp(end, prefix, sizeof(prefix) - 1) != 0 ||
+            strlen(end + sizeof(prefix) - 1) != 64) {
+            rc = CHUNKED_MALFORMED;
+            break;
+        }
+        const char *signature = end + sizeof(prefix) - 1;
+        if (size > MAX_CHUNK_SIZE) {
+            rc = CHUNKED_TOO_LARGE;
+            break;
+        }
+        if (size > data_cap) {
+            char *grown = realloc(data, (size_t)size);
+            if (!grown) {
+                rc = CHUNKED_FAILED;
+                break;
+            }
+            data = grown;
+            data_cap = (size_t)size;
+        }
+        char crlf[2];
+        if (body_take(&reader, data, (size_t)size) != 0 || body_take(&reader, crlf, 2) != 0 ||
+            memcmp(crlf, "\r\n", 2) != 0) {
+            rc = CHUNKED_MALFORMED;
+            break;
+        }
+        // The expected header ends in the chunk's signature and CRLF
+        size_t expected_len = 0;
+        if (presign_chunked_sign(chunked, data, (size_t)size, expected, sizeof(expected), &expected_len) !=
+            PRESIGN_OK) {
+            rc = CHUNKED_FAILED;
+            break;
+        }
+        if (!same_signature(expected + expected_len - 66, signature)) {
+            rc = CHUNKED_SIGNATURE;
+            break;
+        }
+        if (size == 0) {
+            // Nothing may follow the final chunk
+            rc = reader.pos == reader.len && req->body_left == 0 ? CHUNKED_OK : CHUNKED_MALFORMED;
+            break;
+        }
+        if (write_all(fd, data, (size_t)size) != 0) {
+            rc = CHUNKED_FAILED;
+            break;
+        }
+        *decoded += size;
+    }
+    free(data);
+    presign_chunked_free(chunked);
+    return rc;
+}
+
+// The object file of the request's path: the decoded "bucket/key" URI
+// encoded as one path component. Returns -1 for a path that is not a key
+// in a bucket or does not fit in a file name.
+static int object_name(const char *target, char *name, size_t name_size) {
+    const char *end = strchr(target, '?');
+    size_t len = end ? (size_t)(end - target) : strlen(target);
+    char decoded[S3_MAX_HEAD];
+    size_t decoded_len = 0;
+    for (size_t i = 1; i < len; i++) {
+        char c = target[i];
+        if (c == '%') {
+            char hex[3] = {0};
+            if (i + 2 >= len || !isxdigit((unsigned char)target[i + 1]) || !isxdigit((unsigned char)target[i + 2])) {
+                return -1;
+            }
+            memcpy(hex, target + i + 1, 2);
+            c = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        decoded[decoded_len++] = c;
+    }
+    const char *slash = memchr(decoded, '/', decoded_len);
+    if (!slash || slash == decoded || slash + 1 == decoded + decoded_len) {
+        return -1;
+    }
+    return url_encode_bytes(decoded, decoded_len, name, name_size, 0, NULL);
+}
+
+// Parses "bytes=FIRST-LAST", "bytes=FIRST-" or "bytes=-SUFFIX" against an
+// object of size bytes. Returns 1 for a range to serve, 0 to serve the
+// whole object (as S3 does for a header it cannot parse) and -1 when the
+// range is not satisfiable.
+static int parse_range(const char *value, unsigned long long size, unsigned long long *first,
+                       unsigned long long *last) {
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+        return 0;
+    }
+    const char *p = value + 6;
+    char *end = NULL;
+    if (*p == '-') {
+        unsigned long long suffix = strtoull(p + 1, &end, 10);
+        if (!isdigit((unsigned char)p[1]) || *end != '\0') {
+            return 0;
+        }
+        if (suffix == 0 || size == 0) {
+            return -1;
+        }
+        *first = suffix >= size ? 0 : size - suffix;
+        *last = size - 1;
+        return 1;
+    }
+    if (!isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    *first = strtoull(p, &end, 10);
+    if (*end != '-') {
+        return 0;
+    }
+    p = end + 1;
+    *last = size - 1;
+    if (*p != '\0') {
+        unsigned long long requested = strtoull(p, &end, 10);
+        if (!isdigit((unsigned char)*p) || *end != '\0' || requested < *first) {
+            return 0;
+        }
+        if (requested < *last) {
+            *last = requested;
+        }
+    }
+    return *first < size ? 1 : -1;
+}
+
+static int handle_get(s3_conn_t *conn, s3_request_t *req, const char *name) {
+    int fd = openat(conn->server->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        int missing = errno == ENOENT;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return missing ? send_error(conn, req, 404, "NoSuchKey", "The specified key does not exist.")
+                       : send_error(conn, req, 500, "InternalError", "Cannot read the object.");
+    }
+
+    unsigned long long size = (unsigned long long)st.st_size;
+    unsigned long long first = 0;
+    unsigned long long last = size - 1;
+    const char *range = find_header(req, "range");
+    int ranged = range ? parse_range(range, size, &first, &last) : 0;
+    char extra[128] = "";
+    if (ranged < 0) {
+        close(fd);
+        return send_error(conn, req, 416, "InvalidRange", "The requested range is not satisfiable");
+    }
+    if (ranged) {
+        snprintf(extra, sizeof(extra), "Content-Range: bytes %llu-%llu/%llu\r\n", first, last, size);
+    }
+    unsigned long long left = size == 0 ? 0 : last - first + 1;
+    int rc = send_head(conn, req, ranged ? 206 : 200, left, extra);
+    off_t offset = (off_t)first;
+    while (rc == 0 && left > 0) {
+        size_t want = left < sizeof(conn->io) ? (size_t)left : sizeof(conn->io);
+        ssize_t got = pread(fd, conn->io, want, offset);
+        if (got <= 0 || write_all(conn->fd, conn->io, (size_t)got) != 0) {
+            rc = -1;    // the length is already sent, so the connection has to go
+            break;
+        }
+        offset += got;
+        left -= (unsigned long long)got;
+    }
+    close(fd);
+    return rc;
+}
+
+static int handle_put(s3_conn_t *conn, s3_request_t *req, const char *name) {
+    if (!req->has_length) {
+        req->keep_alive = 0;
+        return send_error(conn, req, 411, "MissingContentLength", "You must provide the Content-Length HTTP header.");
+    }
+    if (req->content_length > S3_MAX_OBJECT) {
+        req->keep_alive = 0;
+        return send_error(conn, req, 400, "EntityTooLarge", "Your proposed upload exceeds the maximum allowed size");
+    }
+
+    // A signed payload hash must match the body; presign_verify_url()
+    // already checked that the header is the signed one.
+    const char *expected = find_header(req, "x-amz-content-sha256");
+    int chunked = expected && strcmp(expected, PRESIGN_STREAMING_PAYLOAD) == 0;
+    if (expected && !chunked && strlen(expected) != 64 && strcmp(expected, "UNSIGNED-PAYLOAD") != 0) {
+        return strncmp(expected, "STREAMING-", 10) == 0
+                   ? send_error(conn, req, 501, "NotImplemented", "This payload signing method is not supported.")
+                   : send_error(conn, req, 400, "InvalidArgument", "x-amz-content-sha256 must be UNSIGNED-PAYLOAD, "
+                                "STREAMING-AWS4-HMAC-SHA256-PAYLOAD, or a valid sha256 value.");
+    }
+    const char *decoded_length = find_header(req, "x-amz-decoded-content-length");
+    if (chunked && !decoded_length) {
+        return send_error(conn, req, 411, "MissingContentLength",
+                          "You must provide the x-amz-decoded-content-length header.");
+    }
+    sha256_stream_t *stream = NULL;
+    if (expected && strlen(expected) == 64) {
+        stream = sha256_stream_new();
+        if (!stream || sha256_stream_start(stream) != 0) {
+            sha256_stream_free(stream);
+            return send_error(conn, req, 500, "InternalError", "Out of memory");
+        }
+    }
+
+    char temp[64];
+    snprintf(temp, sizeof(temp), ".upload-%llu",
+             __atomic_add_fetch(&conn->server->uploads, 1, __ATOMIC_RELAXED));
+    int fd = openat(conn->server->dir_fd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int failed = fd < 0;
+    ssize_t got = 0;
+    int chunked_status = CHUNKED_OK;
+    unsigned long long decoded = 0;
+    if (chunked && !failed) {
+        chunked_status = store_chunked_body(conn, req, fd, &decoded);
+        failed = chunked_status == CHUNKED_FAILED;
+    } else {
+        while ((got = read_body(conn, req, conn->io, sizeof(conn->io))) > 0) {
+            if (!failed && (write_all(fd, conn->io, (size_t)got) != 0 ||
+                            (stream && sha256_stream_update(stream, conn->io, (size_t)got) != 0))) {
+                failed = 1;
+            }
+        }
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        failed = 1;
+    }
+    if (chunked_status != CHUNKED_OK && chunked_status != CHUNKED_FAILED) {
+        unlinkat(conn->server->dir_fd, temp, 0);
+        return chunked_status == CHUNKED_SIGNATURE
+                   ? send_error(conn, req, 403, "SignatureDoesNotMatch", "A chunk signature does not match.")
+                   : chunked_status == CHUNKED_TOO_LARGE
+                   ? send_error(conn, req, 400, "EntityTooLarge", "A chunk exceeds the maximum allowed size.")
+                   : send_error(conn, req, 400, "IncompleteBody", "The aws-chunked body is malformed or truncated.");
+    }
+    if (!failed && chunked && strtoull(decoded_length, NULL, 10) != decoded) {
+        unlinkat(conn->server->dir_fd, temp, 0);
+        return send_error(conn, req, 400, "IncompleteBody",
+                          "The decoded body does not match x-amz-decoded-content-length.");
+    }
+    int mismatch = 0;
+    if (!failed && stream) {
+        unsigned char digest[32];
+        char hex[65];
+        failed = sha256_stream_finish(stream, digest) != 0;
+        to_hex(digest, 32, hex);
+        mismatch = !failed && strcasecmp(hex, expected) != 0;
+    }
+    sha256_stream_free(stream);
+    if (got < 0) {
+        unlinkat(conn->server->dir_fd, temp, 0);
+        return -1;
+    }
+    if (failed || mismatch || renameat(conn->server->dir_fd, temp, conn->server->dir_fd, name) != 0) {
+        unlinkat(conn->server->dir_fd, temp, 0);
+        return mismatch ? send_error(conn, req, 400, "XAmzContentSHA256Mismatch",
+                                     "The provided 'x-amz-content-sha256' header does not match what was computed.")
+                        : send_error(conn, req, 500, "InternalError", "Cannot store the object.");
+    }
+    return send_head(conn, req, 200, 0, "");
+}
+
+static int handle_delete(s3_conn_t *conn, s3_request_t *req, const char *name) {
+    if (unlinkat(conn->server->dir_fd, name, 0) != 0 && errno != ENOENT) {
+        return send_error(conn, req, 500, "InternalError", "Cannot delete the object.");
+    }
+    return send_head(conn, req, 204, 0, "");
+}
+
+// Answers one request; returns -1 when the connection has to be closed.
+static int handle_request(s3_conn_t *conn, s3_request_t *req) {
+    __atomic_add_fetch(&conn->server->requests, 1, __ATOMIC_RELAXED);
+    int is_get = strcmp(req->method, "GET") == 0;
+    int is_put = strcmp(req->method, "PUT") == 0;
+    if (!is_get && !is_put && strcmp(req->method, "DELETE") != 0) {
+        return send_error(conn, req, 405, "MethodNotAllowed", "The specified method is not allowed.");
+    }
+
+    int status = presign_verify_url(conn->server->ctx, req->method, req->target, strlen(req->target), req->headers,
+                                    req->header_count, 0);
+    if (status != PRESIGN_OK) {
+        const char *message = presign_strerror(status);
+        if (status == PRESIGN_ERR_EXPIRED) {
+            return send_error(conn, req, 403, "AccessDenied", message);
+        }
+        if (status == PRESIGN_ERR_CREDENTIAL_MISMATCH) {
+            return send_error(conn, req, 403, "InvalidAccessKeyId", message);
+        }
+        if (status == PRESIGN_ERR_SIGNATURE_MISMATCH || status == PRESIGN_ERR_HEADER_INVALID) {
+            return send_error(conn, req, 403, "SignatureDoesNotMatch", message);
+        }
+        return send_error(conn, req, 400, "AuthorizationQueryParametersError", message);
+    }
+
+    char name[256];
+    if (object_name(req->target, name, sizeof(name)) != 0) {
+        return send_error(conn, req, 400, "InvalidURI", "The path is not a key in a bucket, or too long.");
+    }
+    return is_get ? handle_get(conn, req, name) : is_put ? handle_put(conn, req, name) : handle_delete(conn, req, name);
+}
+
+static void *connection_thread(void *arg) {
+    s3_conn_t *conn = arg;
+    for (;;) {
+        long head_len = read_head(conn);
+        if (head_len <= 0) {
+            if (head_len == -2) {
+                s3_request_t req = {0};
+                send_error(conn, &req, 431, "RequestHeaderSectionTooLarge", "Your request header section is too large.");
+            }
+            break;
+        }
+        s3_request_t req;
+        memset(&req, 0, sizeof(req));
+        conn->used = (size_t)head_len;
+        int parsed = parse_head(conn->buf, (size_t)head_len, &req);
+        if (parsed != 0) {
+            req.keep_alive = 0;
+            if (parsed == -2) {
+                send_error(conn, &req, 501, "NotImplemented", "Transfer-Encoding is not supported.");
+            } else {
+                send_error(conn, &req, 400, "BadRequest", "Malformed request.");
+            }
+            break;
+        }
+        if (handle_request(conn, &req) != 0 || !req.keep_alive || discard_body(conn, &req) != 0) {
+            break;
+        }
+    }
+    // Closed under the lock so stop_connections() never shuts down a
+    // descriptor number that was already reused
+    s3_server_t *server = conn->server;
+    pthread_mutex_lock(&server->lock);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        server->live = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    close(conn->fd);
+    if (!server->live) {
+        pthread_cond_broadcast(&server->idle);
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(conn);
+    return NULL;
+}
+
+static int open_listener(const char *address, int port, int *bound_port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid --bind address '%s'\n", address);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, S3_BACKLOG) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s:%d: %s\n", address, port, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    *bound_port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Accepts connections until SIGINT or SIGTERM, each served by a detached
+// thread that has those signals blocked, so they interrupt accept().
+static void accept_loop(s3_server_t *server, int listen_fd) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigset_t stop_signals;
+    sigset_t previous;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    while (!s3_stop) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Error: accept");
+                break;
+            }
+            continue;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        s3_conn_t *conn = malloc(sizeof(*conn));
+        pthread_t thread;
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->server = server;
+        conn->prev = NULL;
+        conn->fd = fd;
+        conn->used = 0;
+        conn->len = 0;
+        pthread_mutex_lock(&server->lock);
+        conn->next = server->live;
+        if (conn->next) {
+            conn->next->prev = conn;
+        }
+        server->live = conn;
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+        int created = pthread_create(&thread, &attr, connection_thread, conn) == 0;
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        if (!created) {
+            server->live = conn->next;
+            if (conn->next) {
+                conn->next->prev = NULL;
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+        if (!created) {
+            close(fd);
+            free(conn);
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Ends every connection still served and waits for its thread: a client
+// blocked in a read sees end of file, and one mid-request fails its next
+// write. The threads use the context and the object directory up to then.
+static void stop_connections(s3_server_t *server) {
+    pthread_mutex_lock(&server->lock);
+    for (s3_conn_t *conn = server->live; conn; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    while (server->live) {
+        pthread_cond_wait(&server->idle, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Empties and removes the temporary object directory.
+static void remove_directory(int dir_fd, const char *path) {
+    int fd = dup(dir_fd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            unlinkat(dir_fd, entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static void print_s3_local_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s s3-local [--port PORT] [--bind ADDRESS] [--dir DIR] [--region REGION]\n"
+                    "       %*s [--endpoint ENDPOINT]\n",
+            prog_name, (int)strlen(prog_name), "");
+}
+
+int run_s3_local(int argc, char *argv[]) {
+    const char *region = getenv("S3_REGION");
+    const char *endpoint = NULL;
+    const char *bind_address = "127.0.0.1";
+    const char *dir = NULL;
+    long port = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            port = strtol(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0' || port < 0 || port > 65535) {
+                fprintf(stderr, "Error: --port must be between 0 and 65535\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
+            bind_address = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            region = argv[++i];
+        } else if (strcmp(argv[i], "--endpoint") == 0 && i + 1 < argc) {
+            endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            i++;    // enabled by main()
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            print_s3_local_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!region) {
+        fprintf(stderr, "Error: REGION is required (provide --region or set S3_REGION)\n");
+        return 1;
+    }
+
+    int bound_port = 0;
+    int listen_fd = open_listener(bind_address, (int)port, &bound_port);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    // Requests are signed for the address clients connect to
+    static presign_args_t args;
+    strcpy(args.service, "s3");
+    int too_long = snprintf(args.region, sizeof(args.region), "%s", region) >= (int)sizeof(args.region);
+    if (endpoint) {
+        too_long |= snprintf(args.bucket_url, sizeof(args.bucket_url), "%s", endpoint) >= (int)sizeof(args.bucket_url);
+    } else {
+        snprintf(args.bucket_url, sizeof(args.bucket_url), "http://%s:%d",
+                 strcmp(bind_address, "0.0.0.0") == 0 ? "127.0.0.1" : bind_address, bound_port);
+    }
+    if (too_long) {
+        fprintf(stderr, "Error: Region or endpoint too long\n");
+        close(listen_fd);
+        return 1;
+    }
+    signer_t signer;
+    if (init_signer(&signer, &args, NULL) != 0) {
+        close(listen_fd);
+        return 1;
+    }
+
+    static char temp_dir[4096];
+    int temporary = !dir;
+    if (temporary) {
+        const char *tmpdir = getenv("TMPDIR");
+        if (snprintf(temp_dir, sizeof(temp_dir), "%s/presign-s3-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp") >=
+                (int)sizeof(temp_dir) ||
+            !(dir = mkdtemp(temp_dir))) {
+            fprintf(stderr, "Error: Cannot create a temporary directory: %s\n", strerror(errno));
+            presign_ctx_free(signer.ctx);
+            close(listen_fd);
+            return 1;
+        }
+    }
+    s3_server_t server;
+    memset(&server, 0, sizeof(server));
+    server.ctx = signer.ctx;
+    server.dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (server.dir_fd < 0) {
+        fprintf(stderr, "Error: Cannot open object directory '%s': %s\n", dir, strerror(errno));
+        presign_ctx_free(signer.ctx);
+        close(listen_fd);
+        return 1;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%s\n", args.bucket_url);
+    fflush(stdout);
+    fprintf(stderr, "presign: s3-local serving %s from %s\n", args.bucket_url, dir);
+    accept_loop(&server, listen_fd);
+    close(listen_fd);
+    stop_connections(&server);
+
+    fprintf(stderr, "presign: s3-local served %llu requests, %llu rejected\n",
+            __atomic_load_n(&server.requests, __ATOMIC_RELAXED), __atomic_load_n(&server.rejected, __ATOMIC_RELAXED));
+    if (temporary) {
+        remove_directory(server.dir_fd, dir);
+    }
+    close(server.dir_fd);
+    pthread_cond_destroy(&server.idle);
+    pthread_mutex_destroy(&server.lock);
+    presign_ctx_free(signer.ctx);
+    return 0;
+}
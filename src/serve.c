@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+/*
+ * presign serve: a long-running signer on a Unix stream socket.
+ *
+ * Credentials are loaded and the library context is created once; derived
+ * signing keys stay cached in it for the life of the process. Each request
+ * is one line:
+ *
+ *     METHOD <TAB> EXPIRE_MIN <TAB> S3_PATH [<TAB> Header: value]... <LF>
+ *
+ * and is answered by exactly one line, in request order:
+ *
+ *     OK <TAB> URL <LF>        or        ERR <TAB> message <LF>
+ *
+ * Clients may pipeline any number of requests on one connection. The event
+ * loop is a single-threaded, level-triggered epoll loop over non-blocking
+ * sockets; a connection whose unsent responses exceed SERVE_MAX_PENDING is
+ * not read from until the client catches up.
+ *
+ * With --stats, SIGUSR1 writes the statistics gathered so far; the final
+ * report is written on shutdown.
+ *
+ * With --time-bucket every URL of a bucket is signed at its start, so the
+ * frame alone decides the URL; --memo N then answers repeated frames from a
+ * cache of N URLs (see memo.c) without signing them again.
+ */
+
+#define SERVE_MAX_FRAME (64 * 1024)
+#define SERVE_MAX_PENDING (1024 * 1024)
+#define SERVE_MAX_EVENTS 64
+#define SERVE_READ_CHUNK 16384
+#define SERVE_MAX_MEMO (16 * 1024 * 1024)
+
+// Splits one request frame, signs it and appends the response line to out.
+// With a memo cache, a frame seen before in the same time bucket is
+// answered from it.
+static void handle_frame(signer_t *signer, memo_t *memo, char *frame, buffer_t *out) {
+    char *fields[3 + MAX_HEADERS + 1];
+    int field_count = 0;
+    const char *error = NULL;
+
+    size_t frame_len = strlen(frame);
+    if (frame_len > 0 && frame[frame_len - 1] == '\r') {
+        frame[--frame_len] = '\0';
+    }
+
+    presign_request_t req = signer->request;
+    uint64_t key_hash = 0;
+    if (memo) {
+        req.now = bucket_start(req.now ? req.now : time(NULL), req.time_bucket);
+        key_hash = memo_hash(frame, frame_len);
+        size_t url_len = 0;
+        const char *url = memo_lookup(memo, key_hash, frame, frame_len, req.now, &url_len);
+        STATS_COUNT(url ? STAT_MEMO_HITS : STAT_MEMO_MISSES, 1);
+        if (url) {
+            buffer_append(out, "OK\t", 3);
+            buffer_append(out, url, url_len);
+            buffer_append(out, "\n", 1);
+            return;
+        }
+        // Splitting the fields overwrites the frame
+        memo->key.len = 0;
+        if (buffer_append(&memo->key, frame, frame_len) != 0) {
+            memo = NULL;
+        }
+    }
+
+    char *cursor = frame;
+    while (field_count < (int)(sizeof(fields) / sizeof(fields[0]))) {
+        fields[field_count++] = cursor;
+        char *tab = strchr(cursor, '\t');
+        if (!tab) {
+            break;
+        }
+        *tab = '\0';
+        cursor = tab + 1;
+    }
+
+    presign_header_t headers[MAX_HEADERS];
+    char method[16];
+
+    if (field_count < 3) {
+        error = "Expected METHOD<TAB>EXPIRE_MIN<TAB>S3_PATH";
+    } else if (field_count == (int)(sizeof(fields) / sizeof(fields[0]))) {
+        error = presign_strerror(PRESIGN_ERR_TOO_MANY_HEADERS);
+    } else {
+        size_t method_len = strlen(fields[0]);
+        if (method_len >= sizeof(method)) {
+            method_len = sizeof(method) - 1;
+        }
+        for (size_t i = 0; i < method_len; i++) {
+            method[i] = (char)toupper((unsigned char)fields[0][i]);
+        }
+        method[method_len] = '\0';
+
+        char *endptr = NULL;
+        long expire_min = strtol(fields[1], &endptr, 10);
+
+        if (strcmp(method, "GET") != 0 && strcmp(method, "PUT") != 0 && strcmp(method, "DELETE") != 0) {
+            error = "METHOD must be GET, PUT, or DELETE";
+        } else if (*fields[1] == '\0' || *endptr != '\0' || expire_min <= 0 || expire_min > 10080) {
+            error = "EXPIRE_MIN must be between 1 and 10080 (7 days)";
+        }
+
+        for (int i = 3; !error && i < field_count; i++) {
+            char *colon = strchr(fields[i], ':');
+            if (!colon) {
+                error = "Invalid header format. Use 'Key: Value'";
+                break;
+            }
+            *colon = '\0';
+            headers[i - 3].name = fields[i];
+            headers[i - 3].value = colon[1] == ' ' ? colon + 2 : colon + 1;
+        }
+
+        if (!error) {
+            req.method = method;
+            req.path = fields[2];
+            req.headers = headers;
+            req.header_count = (size_t)(field_count - 3);
+            req.expires = (int)expire_min * 60;
+
+            // The URL is signed straight into the response buffer
+            size_t start = out->len;
+            int status = buffer_append(out, "OK\t", 3) == 0 ? append_signed_url(signer->ctx, &req, out)
+                                                            : PRESIGN_ERR_OUT_OF_MEMORY;
+            if (status == PRESIGN_OK && buffer_append(out, "\n", 1) == 0) {
+                if (memo) {
+                    memo_store(memo, key_hash, memo->key.data, frame_len, req.now, out->data + start + 3,
+                               out->len - start - 4);
+                }
+                return;
+            }
+            out->len = start;
+            error = presign_strerror(status != PRESIGN_OK ? status : PRESIGN_ERR_OUT_OF_MEMORY);
+        }
+    }
+
+    buffer_append(out, "ERR\t", 4);
+    buffer_append(out, error, strlen(error));
+    buffer_append(out, "\n", 1);
+}
+
+#ifdef __linux__
+
+typedef struct {
+    int fd;
+    buffer_t in;
+    buffer_t out;
+    size_t out_sent;
+    int closing;        // protocol error, close once the error is sent
+    int peer_closed;    // client finished sending
+    unsigned int events;
+} connection_t;
+
+static volatile sig_atomic_t serve_stop = 0;
+static volatile sig_atomic_t serve_report = 0;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+static void handle_report_signal(int sig) {
+    (void)sig;
+    serve_report = 1;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void connection_close(int epoll_fd, connection_t *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+// Signs every complete frame in the input buffer, unless too much output is
+// already waiting for the client.
+static void connection_process(signer_t *signer, memo_t *memo, connection_t *conn) {
+    if (conn->in.len == 0) {
+        return;
+    }
+
+    size_t start = 0;
+    while (conn->out.len - conn->out_sent < SERVE_MAX_PENDING) {
+        char *newline = memchr(conn->in.data + start, '\n', conn->in.len - start);
+        if (!newline) {
+            break;
+        }
+        *newline = '\0';
+        handle_frame(signer, memo, conn->in.data + start, &conn->out);
+        start = (size_t)(newline - conn->in.data) + 1;
+    }
+
+    if (start > 0) {
+        memmove(conn->in.data, conn->in.data + start, conn->in.len - start);
+        conn->in.len -= start;
+    }
+
+    if (conn->in.len >= SERVE_MAX_FRAME && !memchr(conn->in.data, '\n', conn->in.len)) {
+        const char *error = "ERR\tFrame too long\n";
+        buffer_append(&conn->out, error, strlen(error));
+        conn->in.len = 0;
+        conn->closing = 1;
+    }
+}
+
+// Sends as much pending output as the socket takes. Returns -1 when the
+// connection is broken.
+static int connection_flush(connection_t *conn) {
+    while (conn->out_sent < conn->out.len) {
+        uint64_t send_start = stats_enabled ? stats_clock() : 0;
+        ssize_t sent = send(conn->fd, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (stats_enabled) {
+            stats_record(STAT_OUTPUT, stats_clock() - send_start);
+            stats_count(STAT_OUTPUT_BYTES, (uint64_t)sent);
+        }
+        conn->out_sent += (size_t)sent;
+    }
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    return 0;
+}
+
+// Reads while data is available. Returns 1 on end of stream, -1 on error.
+static int connection_read(connection_t *conn) {
+    while (conn->in.len < SERVE_MAX_FRAME * 2) {
+        if (buffer_reserve(&conn->in, SERVE_READ_CHUNK) != 0) {
+            return -1;
+        }
+        ssize_t received = recv(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len, 0);
+        if (received == 0) {
+            return 1;
+        }
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->in.len += (size_t)received;
+    }
+    return 0;
+}
+
+// Chooses the epoll interest set from the connection state: stop reading
+// while responses back up, wait for writability while output is pending.
+static void connection_update_events(int epoll_fd, connection_t *conn) {
+    unsigned int events = 0;
+    int pending = conn->out.len > conn->out_sent;
+    if (!conn->closing && !conn->peer_closed && (conn->out.len - conn->out_sent) < SERVE_MAX_PENDING) {
+        events |= EPOLLIN;
+    }
+    if (pending) {
+        events |= EPOLLOUT;
+    }
+    if (events != conn->events) {
+        struct epoll_event ev = {0};
+        ev.events = events;
+        ev.data.ptr = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+static int open_listener(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long (max %zu chars)\n", sizeof(addr.sun_path) - 1);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Error: socket");
+        return -1;
+    }
+
+    // Replace a stale socket left by a previous run, but nothing else
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+        set_nonblocking(fd) != 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve_loop(signer_t *signer, memo_t *memo, const char *socket_path) {
+    int listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("Error: epoll_create1");
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+
+    struct epoll_event listen_event = {0};
+    listen_event.events = EPOLLIN;
+    listen_event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (stats_enabled) {
+        sa.sa_handler = handle_report_signal;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+
+    fprintf(stderr, "presign: listening on %s\n", socket_path);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    while (!serve_stop) {
+        int ready = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (serve_report) {
+            serve_report = 0;
+            write_stats();
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            connection_t *conn = events[i].data.ptr;
+
+            if (!conn) {
+                int client_fd;
+                while ((client_fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                    connection_t *client = calloc(1, sizeof(*client));
+                    if (!client || set_nonblocking(client_fd) != 0) {
+                        free(client);
+                        close(client_fd);
+                        continue;
+                    }
+                    client->fd = client_fd;
+                    client->events = EPOLLIN;
+                    struct epoll_event ev = {0};
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = client;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+                        free(client);
+                        close(client_fd);
+                    }
+                }
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                int rc = connection_read(conn);
+                if (rc < 0) {
+                    connection_close(epoll_fd, conn);
+                    continue;
+                }
+                if (rc == 1) {
+                    conn->peer_closed = 1;
+                }
+            }
+
+            // Sign and send until the input has no complete frame left or the
+            // socket stops taking data; held-back frames resume on EPOLLOUT.
+            int broken = 0;
+            for (;;) {
+                size_t before = conn->in.len;
+                connection_process(signer, memo, conn);
+                if (connection_flush(conn) != 0) {
+                    broken = 1;
+                    break;
+                }
+                if (conn->in.len == before || conn->out.len > 0) {
+                    break;
+                }
+            }
+            if (broken || ((conn->peer_closed || conn->closing) && conn->out.len == 0)) {
+                connection_close(epoll_fd, conn);
+                continue;
+            }
+            connection_update_events(epoll_fd, conn);
+        }
+    }
+
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+#endif
+
+static void print_serve_usage(const char *prog_name) {
+    printf("Usage: %s serve --socket PATH [--region REGION] [--endpoint ENDPOINT] [--now TIMESTAMP]\n"
+           "       [--time-bucket MIN [--memo N]] [--stats FILE|-]\n", prog_name);
+    printf("\nAnswers one line per request on a Unix socket:\n");
+    printf("  request   METHOD<TAB>EXPIRE_MIN<TAB>S3_PATH[<TAB>Header: Value]...\n");
+    printf("  response  OK<TAB>URL  or  ERR<TAB>message\n");
+    printf("\nREGION and ENDPOINT default to S3_REGION and S3_ENDPOINT. --time-bucket signs at the start\n");
+    printf("of MIN-minute windows and extends the expiry by MIN; --memo then answers repeated requests\n");
+    printf("from a cache of N URLs. --stats writes JSON statistics on SIGUSR1 and at shutdown.\n");
+}
+
+int run_serve(int argc, char *argv[]) {
+    const char *socket_path = NULL;
+    const char *region = getenv("S3_REGION");
+    const char *endpoint = getenv("S3_ENDPOINT");
+    const char *now_override = NULL;
+    const char *time_bucket = NULL;
+    unsigned long memo_entries = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            region = argv[++i];
+        } else if (strcmp(argv[i], "--endpoint") == 0 && i + 1 < argc) {
+            endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--now") == 0 && i + 1 < argc) {
+            now_override = argv[++i];
+        } else if (strcmp(argv[i], "--time-bucket") == 0 && i + 1 < argc) {
+            time_bucket = argv[++i];
+        } else if (strcmp(argv[i], "--memo") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            memo_entries = strtoul(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0' || memo_entries == 0 || memo_entries > SERVE_MAX_MEMO) {
+                fprintf(stderr, "Error: --memo must be between 1 and %d entries\n", SERVE_MAX_MEMO);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            i++;    // enabled by main()
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            print_serve_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!socket_path) {
+        fprintf(stderr, "Error: --socket is required\n");
+        print_serve_usage(argv[0]);
+        return 1;
+    }
+    if (memo_entries > 0 && !time_bucket) {
+        fprintf(stderr, "Error: --memo requires --time-bucket\n");
+        return 1;
+    }
+    if (!region) {
+        fprintf(stderr, "Error: REGION is required (provide --region or set S3_REGION)\n");
+        return 1;
+    }
+    if (!endpoint) {
+        fprintf(stderr, "Error: ENDPOINT is required (provide --endpoint or set S3_ENDPOINT)\n");
+        return 1;
+    }
+
+    static presign_args_t args;
+    strcpy(args.service, "s3");
+    if (snprintf(args.region, sizeof(args.region), "%s", region) >= (int)sizeof(args.region) ||
+        snprintf(args.bucket_url, sizeof(args.bucket_url), "%s", endpoint) >= (int)sizeof(args.bucket_url) ||
+        (now_override && snprintf(args.now_override, sizeof(args.now_override), "%s", now_override) >= (int)sizeof(args.now_override))) {
+        fprintf(stderr, "Error: Region, endpoint or timestamp too long\n");
+        return 1;
+    }
+    // Each request has its own expiry, checked when it is signed
+    if (time_bucket && parse_time_bucket(time_bucket, 0, &args.time_bucket_min) != 0) {
+        return 1;
+    }
+
+#ifdef __linux__
+    signer_t signer;
+    if (init_signer(&signer, &args, NULL) != 0) {
+        return 1;
+    }
+    memo_t memo;
+    if (memo_entries > 0 && memo_init(&memo, memo_entries) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        presign_ctx_free(signer.ctx);
+        return 1;
+    }
+    int rc = serve_loop(&signer, memo_entries > 0 ? &memo : NULL, socket_path);
+    if (memo_entries > 0) {
+        unsigned long long lookups = memo.hits + memo.misses;
+        fprintf(stderr, "presign: memo cache %llu hits, %llu misses (%.2f%% hit ratio)\n", memo.hits, memo.misses,
+                lookups ? 100.0 * (double)memo.hits / (double)lookups : 0.0);
+        memo_free(&memo);
+    }
+    presign_ctx_free(signer.ctx);
+    return rc;
+#else
+    (void)handle_frame;
+    fprintf(stderr, "Error: serve mode requires Linux (epoll)\n");
+    return 1;
+#endif
+}
@@ -0,0 +1,301 @@
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "presign_internal.h"
+
+/*
+ * Single-stream SHA-256 compression.
+ *
+ * This is the hash core of the native crypto backend and of the straggler
+ * path of the multi-buffer engine. Besides the portable C version there are
+ * kernels for the x86 SHA extensions (SHA-NI) and the ARMv8 SHA2
+ * instructions, each of which runs the 64 rounds of a block in a few dozen
+ * instructions. They are compiled with function-level target attributes, so
+ * no extra compiler flags are needed, and the best one the CPU reports is
+ * picked on first use. All kernels produce identical states.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_SHANI 1
+#include <immintrin.h>
+#include <cpuid.h>
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_ARMV8 1
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#define SHA256_ARMV8_TARGET
+#elif defined(__clang__)
+#define SHA256_ARMV8_TARGET __attribute__((target("crypto")))
+#else
+#define SHA256_ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#endif
+
+const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+const uint32_t sha256_round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t load_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_compress_portable(uint32_t *state, const unsigned char *blocks, size_t block_count) {
+    uint32_t w[64];
+
+    for (size_t blk = 0; blk < block_count; blk++, blocks += 64) {
+        for (int t = 0; t < 16; t++) {
+            w[t] = load_be32(blocks + t * 4);
+        }
+        for (int t = 16; t < 64; t++) {
+            uint32_t s0 = ROTR32(w[t - 15], 7) ^ ROTR32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = ROTR32(w[t - 2], 17) ^ ROTR32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                          sha256_round_constants[t] + w[t];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef SHA256_SHANI
+// Four rounds: sha256rnds2 does two, taking W+K for them from the low half
+// of its third operand. The state lives in two registers as ABEF and CDGH.
+#define SHANI_ROUNDS(k, cur) do { \
+    __m128i wk = _mm_add_epi32((cur), _mm_loadu_si128((const __m128i *)(const void *)&sha256_round_constants[k])); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk); \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E)); \
+} while (0)
+
+// Message schedule, four words at a time: next becomes W[t..t+3] from the
+// msg1 partial already in it, cur (W[t-4..t-1]) and prev (W[t-8..t-5]),
+// then prev gets the msg1 partial for four rounds later.
+#define SHANI_EXPAND(cur, next, prev) do { \
+    (next) = _mm_sha256msg2_epu32(_mm_add_epi32((next), _mm_alignr_epi8((cur), (prev), 4)), (cur)); \
+    (prev) = _mm_sha256msg1_epu32((prev), (cur)); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_compress_shani(uint32_t *state, const unsigned char *blocks, size_t block_count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i dcba = _mm_loadu_si128((const __m128i *)(const void *)&state[0]);
+    __m128i hgfe = _mm_loadu_si128((const __m128i *)(const void *)&state[4]);
+
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (size_t blk = 0; blk < block_count; blk++, blocks += 64) {
+        __m128i abef_saved = abef;
+        __m128i cdgh_saved = cdgh;
+        __m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(const void *)(blocks + 0)), byte_swap);
+        __m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(const void *)(blocks + 16)), byte_swap);
+        __m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(const void *)(blocks + 32)), byte_swap);
+        __m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(const void *)(blocks + 48)), byte_swap);
+
+        SHANI_ROUNDS(0, m0);
+        SHANI_ROUNDS(4, m1);
+        m0 = _mm_sha256msg1_epu32(m0, m1);
+        SHANI_ROUNDS(8, m2);
+        m1 = _mm_sha256msg1_epu32(m1, m2);
+        SHANI_ROUNDS(12, m3);
+        SHANI_EXPAND(m3, m0, m2);
+        for (int k = 16; k < 48; k += 16) {
+            SHANI_ROUNDS(k, m0);
+            SHANI_EXPAND(m0, m1, m3);
+            SHANI_ROUNDS(k + 4, m1);
+            SHANI_EXPAND(m1, m2, m0);
+            SHANI_ROUNDS(k + 8, m2);
+            SHANI_EXPAND(m2, m3, m1);
+            SHANI_ROUNDS(k + 12, m3);
+            SHANI_EXPAND(m3, m0, m2);
+        }
+        SHANI_ROUNDS(48, m0);
+        SHANI_EXPAND(m0, m1, m3);
+        SHANI_ROUNDS(52, m1);
+        m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+        SHANI_ROUNDS(56, m2);
+        m3 = _mm_sha256msg2_epu32(_mm_add_epi32(m3, _mm_alignr_epi8(m2, m1, 4)), m2);
+        SHANI_ROUNDS(60, m3);
+
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)(void *)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i *)(void *)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+// __builtin_cpu_supports("sha") is not reliable on older compilers, so the
+// CPUID bits are read directly: SHA (leaf 7, EBX bit 29), SSSE3 and SSE4.1.
+static int shani_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx >> 29) & 1;
+}
+#endif
+
+#ifdef SHA256_ARMV8
+// Four rounds; sha256h/sha256h2 update ABCD and EFGH from W+K.
+#define ARMV8_ROUNDS(k, cur) do { \
+    uint32x4_t wk = vaddq_u32((cur), vld1q_u32(&sha256_round_constants[k])); \
+    uint32x4_t abcd_saved = abcd; \
+    abcd = vsha256hq_u32(abcd, efgh, wk); \
+    efgh = vsha256h2q_u32(efgh, abcd_saved, wk); \
+} while (0)
+
+// Replaces m0 (W[t-16..t-13]) with W[t..t+3].
+#define ARMV8_EXPAND(m0, m1, m2, m3) (m0) = vsha256su1q_u32(vsha256su0q_u32((m0), (m1)), (m2), (m3))
+
+SHA256_ARMV8_TARGET
+static void sha256_compress_armv8(uint32_t *state, const unsigned char *blocks, size_t block_count) {
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32x4_t efgh = vld1q_u32(&state[4]);
+
+    for (size_t blk = 0; blk < block_count; blk++, blocks += 64) {
+        uint32x4_t abcd_start = abcd;
+        uint32x4_t efgh_start = efgh;
+        uint32x4_t m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 0)));
+        uint32x4_t m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16)));
+        uint32x4_t m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 32)));
+        uint32x4_t m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 48)));
+
+        for (int k = 0; k < 48; k += 16) {
+            ARMV8_ROUNDS(k, m0);
+            ARMV8_EXPAND(m0, m1, m2, m3);
+            ARMV8_ROUNDS(k + 4, m1);
+            ARMV8_EXPAND(m1, m2, m3, m0);
+            ARMV8_ROUNDS(k + 8, m2);
+            ARMV8_EXPAND(m2, m3, m0, m1);
+            ARMV8_ROUNDS(k + 12, m3);
+            ARMV8_EXPAND(m3, m0, m1, m2);
+        }
+        ARMV8_ROUNDS(48, m0);
+        ARMV8_ROUNDS(52, m1);
+        ARMV8_ROUNDS(56, m2);
+        ARMV8_ROUNDS(60, m3);
+
+        abcd = vaddq_u32(abcd, abcd_start);
+        efgh = vaddq_u32(efgh, efgh_start);
+    }
+
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+
+static int armv8_supported(void) {
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO) || defined(__APPLE__)
+    return 1;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#else
+    return 0;
+#endif
+}
+#endif
+
+typedef struct {
+    const char *name;
+    void (*compress)(uint32_t *state, const unsigned char *blocks, size_t block_count);
+    int (*supported)(void);
+} sha256_kernel_t;
+
+static int always_supported(void) {
+    return 1;
+}
+
+// In order of preference.
+static const sha256_kernel_t sha256_kernels[] = {
+#ifdef SHA256_SHANI
+    {"shani", sha256_compress_shani, shani_supported},
+#endif
+#ifdef SHA256_ARMV8
+    {"armv8", sha256_compress_armv8, armv8_supported},
+#endif
+    {"portable", sha256_compress_portable, always_supported},
+};
+
+#define SHA256_KERNEL_COUNT (sizeof(sha256_kernels) / sizeof(sha256_kernels[0]))
+
+static const sha256_kernel_t *active_kernel = &sha256_kernels[SHA256_KERNEL_COUNT - 1];
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_best_kernel(void) {
+    for (size_t i = 0; i < SHA256_KERNEL_COUNT; i++) {
+        if (sha256_kernels[i].supported()) {
+            active_kernel = &sha256_kernels[i];
+            return;
+        }
+    }
+}
+
+void sha256_compress(uint32_t *state, const unsigned char *blocks, size_t block_count) {
+    pthread_once(&kernel_once, select_best_kernel);
+    active_kernel->compress(state, blocks, block_count);
+}
+
+const char *sha256_kernel_name(void) {
+    pthread_once(&kernel_once, select_best_kernel);
+    return active_kernel->name;
+}
+
+int sha256_select_kernel(const char *name) {
+    pthread_once(&kernel_once, select_best_kernel);
+    for (size_t i = 0; i < SHA256_KERNEL_COUNT; i++) {
+        if (strcmp(sha256_kernels[i].name, name) == 0) {
+            if (!sha256_kernels[i].supported()) {
+                return -1;
+            }
+            active_kernel = &sha256_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void sha256_midstate(const unsigned char *block, uint32_t *state) {
+    memcpy(state, sha256_initial_state, sizeof(sha256_initial_state));
+    sha256_compress(state, block, 1);
+}
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "presign_internal.h"
+
+/*
+ * Multi-buffer SHA-256.
+ *
+ * Bulk signing produces many short, independent messages: one canonical
+ * request and two HMAC halves per URL. Instead of hashing them one after
+ * the other, this engine puts one message in each 32-bit lane of a vector
+ * register and runs the compression function on 8 (AVX2) or 16 (AVX-512)
+ * messages at once. Messages are grouped by block count so that all lanes
+ * of a group finish together; groups that cannot fill a vector, and CPUs
+ * without AVX2, go through the single-stream compression of sha256.c.
+ *
+ * Jobs may start from an intermediate state (an HMAC midstate) instead of
+ * the SHA-256 initial value; prefix_len then tells the padding how many
+ * bytes that state has already absorbed.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_MB_X86 1
+#include <immintrin.h>
+#endif
+
+#define SHA256_MB_MAX_LANES 16
+
+static uint32_t load_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+#ifdef SHA256_MB_X86
+#define AVX2_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+// Compresses block_count blocks of 8 messages, one per lane.
+__attribute__((target("avx2")))
+static void sha256_x8_avx2(uint32_t *const states[], const unsigned char *const data[], size_t block_count) {
+    __m256i s[8];
+    __m256i w[64];
+
+    for (int i = 0; i < 8; i++) {
+        s[i] = _mm256_setr_epi32((int)states[0][i], (int)states[1][i], (int)states[2][i], (int)states[3][i],
+                                 (int)states[4][i], (int)states[5][i], (int)states[6][i], (int)states[7][i]);
+    }
+
+    for (size_t blk = 0; blk < block_count; blk++) {
+        size_t base = blk * 64;
+        for (int t = 0; t < 16; t++) {
+            size_t off = base + (size_t)t * 4;
+            w[t] = _mm256_setr_epi32((int)load_be32(data[0] + off), (int)load_be32(data[1] + off),
+                                     (int)load_be32(data[2] + off), (int)load_be32(data[3] + off),
+                                     (int)load_be32(data[4] + off), (int)load_be32(data[5] + off),
+                                     (int)load_be32(data[6] + off), (int)load_be32(data[7] + off));
+        }
+        for (int t = 16; t < 64; t++) {
+            __m256i x = w[t - 15];
+            __m256i y = w[t - 2];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(x, 7), AVX2_ROTR(x, 18)), _mm256_srli_epi32(x, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(y, 17), AVX2_ROTR(y, 19)), _mm256_srli_epi32(y, 10));
+            w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0), _mm256_add_epi32(w[t - 7], s1));
+        }
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; t++) {
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(e, 6), AVX2_ROTR(e, 11)), AVX2_ROTR(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1),
+                                          _mm256_add_epi32(_mm256_add_epi32(ch, _mm256_set1_epi32((int)sha256_round_constants[t])), w[t]));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROTR(a, 2), AVX2_ROTR(a, 13)), AVX2_ROTR(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2 = _mm256_add_epi32(sigma0, maj);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, t2);
+        }
+
+        s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, s[i]);
+        for (int lane = 0; lane < 8; lane++) {
+            states[lane][i] = lanes[lane];
+        }
+    }
+}
+
+// Same as the AVX2 kernel with 16 lanes; rotates and the Ch/Maj selects
+// map to single AVX-512 instructions.
+__attribute__((target("avx512f")))
+static void sha256_x16_avx512(uint32_t *const states[], const unsigned char *const data[], size_t block_count) {
+    __m512i s[8];
+    __m512i w[64];
+    uint32_t lanes[16];
+
+    for (int i = 0; i < 8; i++) {
+        for (int lane = 0; lane < 16; lane++) {
+            lanes[lane] = states[lane][i];
+        }
+        s[i] = _mm512_loadu_si512(lanes);
+    }
+
+    for (size_t blk = 0; blk < block_count; blk++) {
+        size_t base = blk * 64;
+        for (int t = 0; t < 16; t++) {
+            size_t off = base + (size_t)t * 4;
+            for (int lane = 0; lane < 16; lane++) {
+                lanes[lane] = load_be32(data[lane] + off);
+            }
+            w[t] = _mm512_loadu_si512(lanes);
+        }
+        for (int t = 16; t < 64; t++) {
+            __m512i x = w[t - 15];
+            __m512i y = w[t - 2];
+            __m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(x, 7), _mm512_ror_epi32(x, 18), _mm512_srli_epi32(x, 3), 0x96);
+            __m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(y, 17), _mm512_ror_epi32(y, 19), _mm512_srli_epi32(y, 10), 0x96);
+            w[t] = _mm512_add_epi32(_mm512_add_epi32(w[t - 16], s0), _mm512_add_epi32(w[t - 7], s1));
+        }
+
+        __m512i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; t++) {
+            __m512i sigma1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11), _mm512_ror_epi32(e, 25), 0x96);
+            __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+            __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, sigma1),
+                                          _mm512_add_epi32(_mm512_add_epi32(ch, _mm512_set1_epi32((int)sha256_round_constants[t])), w[t]));
+            __m512i sigma0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13), _mm512_ror_epi32(a, 22), 0x96);
+            __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+            h = g;
+            g = f;
+            f = e;
+            e = _mm512_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm512_add_epi32(t1, _mm512_add_epi32(sigma0, maj));
+        }
+
+        s[0] = _mm512_add_epi32(s[0], a); s[1] = _mm512_add_epi32(s[1], b);
+        s[2] = _mm512_add_epi32(s[2], c); s[3] = _mm512_add_epi32(s[3], d);
+        s[4] = _mm512_add_epi32(s[4], e); s[5] = _mm512_add_epi32(s[5], f);
+        s[6] = _mm512_add_epi32(s[6], g); s[7] = _mm512_add_epi32(s[7], h);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        _mm512_storeu_si512(lanes, s[i]);
+        for (int lane = 0; lane < 16; lane++) {
+            states[lane][i] = lanes[lane];
+        }
+    }
+}
+
+static int avx2_supported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_supported(void) {
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+typedef struct {
+    const char *name;
+    int lanes;
+    void (*compress)(uint32_t *const states[], const unsigned char *const data[], size_t block_count);
+    int (*supported)(void);
+} sha256_mb_kernel_t;
+
+// Widest first. Each group of jobs uses the widest kernel it can fill.
+static const sha256_mb_kernel_t sha256_mb_kernels[] = {
+#ifdef SHA256_MB_X86
+    {"avx512", 16, sha256_x16_avx512, avx512_supported},
+    {"avx2", 8, sha256_x8_avx2, avx2_supported},
+#endif
+    {"scalar", 1, NULL, NULL},
+};
+
+#define SHA256_MB_KERNEL_COUNT (sizeof(sha256_mb_kernels) / sizeof(sha256_mb_kernels[0]))
+
+// Index of the widest enabled kernel; kernels from there on are used.
+static size_t first_kernel = SHA256_MB_KERNEL_COUNT - 1;
+static pthread_once_t sha256_mb_once = PTHREAD_ONCE_INIT;
+
+static void sha256_mb_detect(void) {
+    for (size_t i = 0; i < SHA256_MB_KERNEL_COUNT; i++) {
+        if (!sha256_mb_kernels[i].supported || sha256_mb_kernels[i].supported()) {
+            first_kernel = i;
+            return;
+        }
+    }
+}
+
+int sha256_mb_lanes(void) {
+    pthread_once(&sha256_mb_once, sha256_mb_detect);
+    return sha256_mb_kernels[first_kernel].lanes;
+}
+
+const char *sha256_mb_kernel_name(void) {
+    pthread_once(&sha256_mb_once, sha256_mb_detect);
+    return sha256_mb_kernels[first_kernel].name;
+}
+
+int sha256_mb_select_kernel(const char *name) {
+    pthread_once(&sha256_mb_once, sha256_mb_detect);
+    for (size_t i = 0; i < SHA256_MB_KERNEL_COUNT; i++) {
+        if (strcmp(sha256_mb_kernels[i].name, name) == 0) {
+            if (sha256_mb_kernels[i].supported && !sha256_mb_kernels[i].supported()) {
+                return -1;
+            }
+            first_kernel = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t padded_blocks(const sha256_mb_job_t *job) {
+    return (job->len + 9 + 63) / 64;
+}
+
+static int compare_block_counts(const void *a, const void *b) {
+    size_t x = padded_blocks(*(const sha256_mb_job_t *const *)a);
+    size_t y = padded_blocks(*(const sha256_mb_job_t *const *)b);
+    return (x > y) - (x < y);
+}
+
+int sha256_mb_run(sha256_mb_job_t *jobs, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    pthread_once(&sha256_mb_once, sha256_mb_detect);
+
+    size_t total_blocks = 0;
+    for (size_t i = 0; i < count; i++) {
+        total_blocks += padded_blocks(&jobs[i]);
+    }
+
+    // One allocation holds the padded messages, their states and the
+    // block-count ordering of the jobs.
+    size_t padded_size = total_blocks * 64;
+    size_t state_size = count * 8 * sizeof(uint32_t);
+    unsigned char *scratch = malloc(padded_size + state_size + count * (sizeof(sha256_mb_job_t *) + sizeof(size_t)));
+    if (!scratch) {
+        return -1;
+    }
+    uint32_t *states = (uint32_t *)(void *)(scratch + padded_size);
+    sha256_mb_job_t **order = (sha256_mb_job_t **)(void *)(scratch + padded_size + state_size);
+    size_t *offsets = (size_t *)(void *)(order + count);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        sha256_mb_job_t *job = &jobs[i];
+        size_t blocks = padded_blocks(job);
+        unsigned char *p = scratch + offset;
+        uint64_t bit_len = (job->prefix_len + (uint64_t)job->len) * 8;
+
+        memcpy(p, job->data, job->len);
+        memset(p + job->len, 0, blocks * 64 - job->len);
+        p[job->len] = 0x80;
+        store_be32(p + blocks * 64 - 8, (uint32_t)(bit_len >> 32));
+        store_be32(p + blocks * 64 - 4, (uint32_t)bit_len);
+
+        job->lane_index = i;
+        memcpy(&states[i * 8], job->init ? job->init : sha256_initial_state, 8 * sizeof(uint32_t));
+        offsets[i] = offset;
+        order[i] = job;
+        offset += blocks * 64;
+    }
+    qsort(order, count, sizeof(order[0]), compare_block_counts);
+
+    // Walk runs of equal block count; fill the widest kernel possible,
+    // then narrower ones, and hash what is left one message at a time.
+    size_t start = 0;
+    while (start < count) {
+        size_t blocks = padded_blocks(order[start]);
+        size_t end = start;
+        while (end < count && padded_blocks(order[end]) == blocks) {
+            end++;
+        }
+
+        size_t next = start;
+        for (size_t k = first_kernel; k < SHA256_MB_KERNEL_COUNT; k++) {
+            const sha256_mb_kernel_t *kernel = &sha256_mb_kernels[k];
+            if (kernel->lanes == 1) {
+                break;
+            }
+            while (end - next >= (size_t)kernel->lanes) {
+                uint32_t *lane_states[SHA256_MB_MAX_LANES];
+                const unsigned char *lane_data[SHA256_MB_MAX_LANES];
+                for (int lane = 0; lane < kernel->lanes; lane++) {
+                    size_t index = order[next + (size_t)lane]->lane_index;
+                    lane_states[lane] = &states[index * 8];
+                    lane_data[lane] = scratch + offsets[index];
+                }
+                kernel->compress(lane_states, lane_data, blocks);
+                next += (size_t)kernel->lanes;
+            }
+        }
+        for (; next < end; next++) {
+            size_t index = order[next]->lane_index;
+            sha256_compress(&states[index * 8], scratch + offsets[index], blocks);
+        }
+        start = end;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 0; j < 8; j++) {
+            store_be32(jobs[i].digest + j * 4, states[i * 8 + (size_t)j]);
+        }
+    }
+
+    memset(scratch, 0, padded_size + state_size);
+    free(scratch);
+    return 0;
+}
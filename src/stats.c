@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "presign.h"
+#include "presign_internal.h"
+
+/*
+ * Per-stage timers and counters behind --stats and PRESIGN_STATS.
+ *
+ * Nothing is measured until stats_enable() is called: every hook in the
+ * signing path is a macro that tests stats_enabled (or the timer's copy of
+ * it) and does nothing else when it is clear. Once enabled, a signature
+ * reads CLOCK_MONOTONIC at each stage boundary, adds the laps up in a
+ * stats_timer_t on the stack and records them in the calling thread's
+ * block, so signing threads never share a cache line or take a lock.
+ *
+ * Latencies go into log-linear histograms: exact below 8 ns, then eight
+ * buckets per power of two, which bounds the error of a reported
+ * percentile to 1/16 of its value. Blocks of exited threads are folded into
+ * a retired block, so a report covers every thread that ever signed.
+ */
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXPONENT 39                       // ~18 minutes; longer laps share the last bucket
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) * STATS_SUB)
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+typedef struct stats_block {
+    struct stats_block *next;
+    stats_histogram_t stages[STAT_STAGES];
+    uint64_t counters[STAT_COUNTERS];
+} stats_block_t;
+
+static const char *const STAGE_NAMES[STAT_STAGES] = {
+    "args", "setup", "encode", "canonicalize", "hash", "key", "sign", "request", "group_hash", "group", "output", "payload",
+    "chunk", "verify",
+};
+
+static const char *const COUNTER_NAMES[STAT_COUNTERS] = {
+    "signatures", "sign_errors", "grouped_signatures", "output_bytes", "payload_bytes", "verified",
+    "verify_failures", "memo_hits", "memo_misses",
+};
+
+int stats_enabled;
+static uint64_t enabled_at;
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+static int block_key_ok;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_block_t *live_blocks;
+static stats_block_t retired;
+
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucket_index(uint64_t ns) {
+    if (ns < STATS_SUB) {
+        return (size_t)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > STATS_MAX_EXPONENT) {
+        return STATS_BUCKETS - 1;
+    }
+    size_t sub = (size_t)(ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB - 1);
+    return (size_t)(exponent - STATS_SUB_BITS + 1) * STATS_SUB + sub;
+}
+
+// Middle of bucket index, the value reported for a percentile that falls
+// into it.
+static uint64_t bucket_value(size_t index) {
+    if (index < STATS_SUB) {
+        return index;
+    }
+    int exponent = (int)(index / STATS_SUB) + STATS_SUB_BITS - 1;
+    uint64_t width = (uint64_t)1 << (exponent - STATS_SUB_BITS);
+    return ((STATS_SUB + index % STATS_SUB) << (exponent - STATS_SUB_BITS)) + width / 2;
+}
+
+static void histogram_add(stats_histogram_t *h, uint64_t ns) {
+    if (h->count == 0 || ns < h->min) {
+        h->min = ns;
+    }
+    if (ns > h->max) {
+        h->max = ns;
+    }
+    h->count++;
+    h->total += ns;
+    h->buckets[bucket_index(ns)]++;
+}
+
+static void histogram_merge(stats_histogram_t *into, const stats_histogram_t *from) {
+    if (from->count == 0) {
+        return;
+    }
+    if (into->count == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+    into->count += from->count;
+    into->total += from->total;
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+static void block_merge(stats_block_t *into, const stats_block_t *from) {
+    for (int i = 0; i < STAT_STAGES; i++) {
+        histogram_merge(&into->stages[i], &from->stages[i]);
+    }
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        into->counters[i] += from->counters[i];
+    }
+}
+
+// Value below which a fraction q of the samples fall, clamped to the exact
+// minimum and maximum.
+static uint64_t histogram_percentile(const stats_histogram_t *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t value = bucket_value(i);
+            return value < h->min ? h->min : (value > h->max ? h->max : value);
+        }
+    }
+    return h->max;
+}
+
+static void retire_block(void *p) {
+    stats_block_t *block = p;
+    pthread_mutex_lock(&blocks_lock);
+    block_merge(&retired, block);
+    for (stats_block_t **link = &live_blocks; *link; link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+    free(block);
+}
+
+static void create_block_key(void) {
+    block_key_ok = pthread_key_create(&block_key, retire_block) == 0;
+}
+
+// The calling thread's block, created on first use; NULL when out of
+// memory, in which case the sample is dropped.
+static stats_block_t *thread_block(void) {
+    pthread_once(&block_once, create_block_key);
+    if (!block_key_ok) {
+        return NULL;
+    }
+    stats_block_t *block = pthread_getspecific(block_key);
+    if (!block) {
+        block = calloc(1, sizeof(*block));
+        if (!block || pthread_setspecific(block_key, block) != 0) {
+            free(block);
+            return NULL;
+        }
+        pthread_mutex_lock(&blocks_lock);
+        block->next = live_blocks;
+        live_blocks = block;
+        pthread_mutex_unlock(&blocks_lock);
+    }
+    return block;
+}
+
+void stats_enable(void) {
+    enabled_at = stats_clock();
+    stats_enabled = 1;
+}
+
+void stats_timer_begin(stats_timer_t *timer) {
+    timer->start = timer->last = stats_clock();
+    timer->stages = 0;
+}
+
+void stats_lap(stats_timer_t *timer, stat_stage_t stage) {
+    uint64_t now = stats_clock();
+    uint64_t lap = now - timer->last;
+    timer->last = now;
+    if (timer->stages & (1u << stage)) {
+        timer->ns[stage] += lap;
+    } else {
+        timer->ns[stage] = lap;
+        timer->stages |= 1u << stage;
+    }
+}
+
+void stats_timer_end(stats_timer_t *timer, int total_stage) {
+    stats_block_t *block = thread_block();
+    if (!block) {
+        return;
+    }
+    for (int i = 0; i < STAT_STAGES; i++) {
+        if (timer->stages & (1u << i)) {
+            histogram_add(&block->stages[i], timer->ns[i]);
+        }
+    }
+    if (total_stage >= 0) {
+        histogram_add(&block->stages[total_stage], timer->last - timer->start);
+    }
+}
+
+void stats_record(stat_stage_t stage, uint64_t ns) {
+    stats_block_t *block = thread_block();
+    if (block) {
+        histogram_add(&block->stages[stage], ns);
+    }
+}
+
+void stats_count(stat_counter_t counter, uint64_t n) {
+    stats_block_t *block = thread_block();
+    if (block) {
+        block->counters[counter] += n;
+    }
+}
+
+int stats_write_json(FILE *out) {
+    // Only the calling thread can still be writing to its block; workers
+    // have been joined, or are idle, by the time a report is asked for.
+    stats_block_t *total = calloc(1, sizeof(*total));
+    if (!total) {
+        return -1;
+    }
+    pthread_mutex_lock(&blocks_lock);
+    block_merge(total, &retired);
+    for (stats_block_t *block = live_blocks; block; block = block->next) {
+        block_merge(total, block);
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    presign_key_stats_t keys;
+    presign_key_stats(&keys);
+
+    fprintf(out, "{\"wall_ns\": %llu,\n \"kernels\": {\"crypto\": \"%s\", \"sha256\": \"%s\", \"sha256_mb\": \"%s\", "
+                 "\"encode\": \"%s\"},\n \"counters\": {",
+            (unsigned long long)(stats_clock() - enabled_at), crypto_backend_name(), sha256_kernel_name(),
+            sha256_mb_kernel_name(), encode_kernel_name());
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        fprintf(out, "\"%s\": %llu, ", COUNTER_NAMES[i], (unsigned long long)total->counters[i]);
+    }
+    uint64_t memo_lookups = total->counters[STAT_MEMO_HITS] + total->counters[STAT_MEMO_MISSES];
+    fprintf(out, "\"memo_hit_ratio\": %.4f, \"key_hits\": %llu, \"key_misses\": %llu, \"key_prewarms\": %llu},\n"
+                 " \"stages\": {",
+            memo_lookups ? (double)total->counters[STAT_MEMO_HITS] / (double)memo_lookups : 0.0, keys.hits,
+            keys.misses, keys.prewarms);
+    for (int i = 0; i < STAT_STAGES; i++) {
+        const stats_histogram_t *h = &total->stages[i];
+        fprintf(out, "%s\n  \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"min_ns\": %llu, \"mean_ns\": %llu, "
+                     "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+                i == 0 ? "" : ",", STAGE_NAMES[i], (unsigned long long)h->count, (unsigned long long)h->total,
+                (unsigned long long)h->min, (unsigned long long)(h->count ? h->total / h->count : 0),
+                (unsigned long long)histogram_percentile(h, 0.50), (unsigned long long)histogram_percentile(h, 0.90),
+                (unsigned long long)histogram_percentile(h, 0.99), (unsigned long long)histogram_percentile(h, 0.999),
+                (unsigned long long)h->max);
+    }
+    fprintf(out, "}}\n");
+    free(total);
+    return ferror(out) ? -1 : 0;
+}
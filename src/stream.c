@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * aws-chunked upload body (--chunked-body).
+ *
+ * The source is read chunk_size bytes at a time into one buffer. Each chunk
+ * is hashed and signed in place and written between its chunk header and
+ * CRLF with a single writev(), so the data is not copied after it is read
+ * and a pipe of any length streams through in constant memory.
+ *
+ * The signatures are chained from the signature of the URL that the same
+ * arguments produce with --chunked, so both runs need the same --now (or a
+ * --time-bucket that both fall in).
+ */
+
+// Reads until len bytes are in buf or the input ends. Returns the number of
+// bytes read, or -1.
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t got = read(fd, buf + filled, len - filled);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        filled += (size_t)got;
+    }
+    return (ssize_t)filled;
+}
+
+static int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t wrote = writev(fd, iov, count);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote < 0) {
+            return -1;
+        }
+        size_t left = (size_t)wrote;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+// Signs len bytes of data (0 for the final chunk) and writes the chunk to
+// stdout. Returns -1 after reporting on stderr.
+static int write_chunk(presign_chunked_t *chunked, char *data, size_t len) {
+    char header[PRESIGN_CHUNK_HEADER_MAX];
+    size_t header_len = 0;
+    int status = presign_chunked_sign(chunked, data, len, header, sizeof(header), &header_len);
+    if (status != PRESIGN_OK) {
+        fprintf(stderr, "Error: %s\n", presign_strerror(status));
+        return -1;
+    }
+    struct iovec iov[3] = {
+        {header, header_len},
+        {data, len},
+        {(char *)"\r\n", 2},
+    };
+    uint64_t write_start = stats_enabled ? stats_clock() : 0;
+    if (write_all(STDOUT_FILENO, iov, 3) != 0) {
+        fprintf(stderr, "Error: Cannot write chunked body: %s\n", strerror(errno));
+        return -1;
+    }
+    if (stats_enabled) {
+        stats_record(STAT_OUTPUT, stats_clock() - write_start);
+        stats_count(STAT_OUTPUT_BYTES, header_len + len + 2);
+    }
+    return 0;
+}
+
+// Signs the URL of the upload, which seeds the chunk signatures, and
+// creates the chunk signer. Returns NULL after reporting on stderr.
+static presign_chunked_t *begin_body(signer_t *signer, const char *path) {
+    signer->request.path = path;
+    char slot[URL_SLOT_LEN];
+    size_t url_len = 0;
+    presign_chunked_t *chunked = NULL;
+    int status = presign_chunked_new(signer->ctx, &signer->request, slot, sizeof(slot), &url_len, &chunked);
+    if (status == PRESIGN_ERR_BUFFER_TOO_SMALL) {
+        char *url = malloc(url_len + 1);
+        status = url ? presign_chunked_new(signer->ctx, &signer->request, url, url_len + 1, &url_len, &chunked)
+                     : PRESIGN_ERR_OUT_OF_MEMORY;
+        free(url);
+    }
+    if (status != PRESIGN_OK) {
+        fprintf(stderr, "Error: %s\n", presign_strerror(status));
+        return NULL;
+    }
+    return chunked;
+}
+
+// Streams source ("-" for stdin) to stdout as the aws-chunked body of
+// args->path. With --decoded-length, a source of another size fails before
+// the final chunk, so the server rejects the upload.
+static int stream_body(signer_t *signer, const presign_args_t *args, void *source_fd) {
+    int fd = *(int *)source_fd;
+    presign_chunked_t *chunked = begin_body(signer, args->path);
+    char *buffer = chunked ? malloc(args->chunk_size) : NULL;
+    if (!buffer) {
+        if (chunked) {
+            fprintf(stderr, "Error: Out of memory\n");
+        }
+        presign_chunked_free(chunked);
+        return 1;
+    }
+
+    int rc = 0;
+    unsigned long long total = 0;
+    for (;;) {
+        ssize_t got = read_full(fd, buffer, args->chunk_size);
+        if (got < 0) {
+            fprintf(stderr, "Error: Cannot read chunked body source: %s\n", strerror(errno));
+            rc = 1;
+            break;
+        }
+        if (got > 0 && write_chunk(chunked, buffer, (size_t)got) != 0) {
+            rc = 1;
+            break;
+        }
+        total += (unsigned long long)got;
+        if ((size_t)got < args->chunk_size) {
+            break;
+        }
+    }
+    if (rc == 0 && args->decoded_length && strtoull(args->decoded_length, NULL, 10) != total) {
+        fprintf(stderr, "Error: Read %llu bytes but --decoded-length is %s\n", total, args->decoded_length);
+        rc = 1;
+    }
+    if (rc == 0 && write_chunk(chunked, buffer, 0) != 0) {
+        rc = 1;
+    }
+    free(buffer);
+    presign_chunked_free(chunked);
+    return rc;
+}
+
+int run_chunked_body(const presign_args_t *args, const char *source) {
+    int fd = STDIN_FILENO;
+    if (strcmp(source, "-") != 0) {
+        fd = open(source, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot open chunked body source '%s': %s\n", source, strerror(errno));
+            return 1;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    int rc = with_signer(args, stream_body, &fd);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return rc;
+}
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#else
+#include <dirent.h>
+#endif
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * Tree mode (--tree DIR): signs a PUT URL for every regular file below DIR,
+ * keyed by its path relative to DIR under S3_PATH, and writes one manifest
+ * line per file:
+ *
+ *     PATH <TAB> SIZE <TAB> URL <TAB> CONTENT_TYPE <LF>
+ *
+ * or, with --format jsonl, {"path":...,"size":...,"url":...,"content_type":...}.
+ *
+ * Directories are a shared work list: each worker takes one, reads its
+ * entries with getdents64, queues the subdirectories and signs the files,
+ * all without a process or a stat of the full path per file. A queued
+ * directory keeps its parent's descriptor open and is opened by name from
+ * it (openat with O_NOFOLLOW), so no path is resolved again and a
+ * directory swapped for a symbolic link during the walk cannot lead
+ * outside DIR. Lines are written in no particular order.
+ *
+ * Unless a Content-Type is given with --header, each file's type is taken
+ * from its extension or, failing that, from its first bytes, and signed
+ * as a header the uploader has to send. Symbolic links and special files
+ * are skipped.
+ */
+
+#define TREE_DIRENT_BUFFER (64 << 10)
+#define TREE_SNIFF_BYTES 512
+#define TREE_DEFAULT_TYPE "application/octet-stream"
+
+// An open directory, shared by the worker reading it and the queued
+// subdirectories that are opened from it; closed with the last reference.
+typedef struct {
+    int fd;
+    unsigned int refs;              // updated atomically
+} tree_parent_t;
+
+// A directory waiting to be read: its parent (NULL for the root) and its
+// path relative to the root, "" for the root itself, otherwise ending in
+// '/' after the name that starts at name_offset.
+typedef struct tree_dir {
+    struct tree_dir *next;
+    tree_parent_t *parent;
+    size_t name_offset;
+    char rel[];
+} tree_dir_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    tree_dir_t *pending;
+    int busy;                       // workers reading a directory
+    pthread_mutex_t out_lock;
+    int root_fd;
+    signer_t *signer;
+    const char *prefix;             // S3_PATH, with a trailing '/' when not empty
+    size_t prefix_len;
+    const char *content_type;       // from --header, NULL to sniff
+    int jsonl;
+    int failed;
+    unsigned long long skipped;
+} tree_walk_t;
+
+typedef struct {
+    tree_walk_t *walk;
+    presign_request_t request;
+    presign_header_t headers[MAX_HEADERS];
+    size_t type_header;             // index of the Content-Type header slot
+    buffer_t out;
+    buffer_t key;
+    char *entries;                  // getdents64 buffer
+    tree_parent_t *current;         // the directory being read
+} tree_worker_t;
+
+// Common artifact types by extension, matched case-insensitively.
+static const struct {
+    const char *extension;
+    const char *type;
+} tree_extensions[] = {
+    {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"}, {"js", "text/javascript"},
+    {"mjs", "text/javascript"}, {"json", "application/json"}, {"map", "application/json"},
+    {"xml", "application/xml"}, {"txt", "text/plain"}, {"md", "text/markdown"}, {"csv", "text/csv"},
+    {"svg", "image/svg+xml"}, {"png", "image/png"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"}, {"webp", "image/webp"}, {"ico", "image/vnd.microsoft.icon"}, {"avif", "image/avif"},
+    {"woff", "font/woff"}, {"woff2", "font/woff2"}, {"ttf", "font/ttf"}, {"otf", "font/otf"},
+    {"wasm", "application/wasm"}, {"pdf", "application/pdf"}, {"zip", "application/zip"},
+    {"gz", "application/gzip"}, {"tgz", "application/gzip"}, {"tar", "application/x-tar"},
+    {"xz", "application/x-xz"}, {"zst", "application/zstd"}, {"bz2", "application/x-bzip2"},
+    {"jar", "application/java-archive"}, {"deb", "application/vnd.debian.binary-package"},
+    {"rpm", "application/x-rpm"}, {"iso", "application/x-iso9660-image"}, {"mp4", "video/mp4"},
+    {"webm", "video/webm"}, {"mp3", "audio/mpeg"}, {"wav", "audio/wav"}, {"yaml", "application/yaml"},
+    {"yml", "application/yaml"}, {"sh", "text/x-shellscript"}, {"log", "text/plain"},
+};
+
+// Content-Type from the first bytes of a file: a few binary signatures,
+// else text/plain for data without NUL bytes.
+static const char *sniff_bytes(const unsigned char *data, size_t len) {
+    static const struct {
+        const char *magic;
+        size_t len;
+        const char *type;
+    } signatures[] = {
+        {"\x89PNG\r\n\x1a\n", 8, "image/png"}, {"\xff\xd8\xff", 3, "image/jpeg"}, {"GIF8", 4, "image/gif"},
+        {"%PDF-", 5, "application/pdf"}, {"PK\x03\x04", 4, "application/zip"},
+        {"\x1f\x8b", 2, "application/gzip"}, {"\xfd" "7zXZ", 5, "application/x-xz"},
+        {"\x28\xb5\x2f\xfd", 4, "application/zstd"}, {"BZh", 3, "application/x-bzip2"},
+        {"\0asm", 4, "application/wasm"}, {"<?xml", 5, "application/xml"},
+    };
+    if (len == 0) {
+        return TREE_DEFAULT_TYPE;
+    }
+    for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++) {
+        if (len >= signatures[i].len && memcmp(data, signatures[i].magic, signatures[i].len) == 0) {
+            return signatures[i].type;
+        }
+    }
+    return memchr(data, '\0', len) ? TREE_DEFAULT_TYPE : "text/plain";
+}
+
+static const char *sniff_content_type(int dir_fd, const char *name) {
+    const char *dot = strrchr(name, '.');
+    if (dot && dot != name) {
+        for (size_t i = 0; i < sizeof(tree_extensions) / sizeof(tree_extensions[0]); i++) {
+            if (strcasecmp(dot + 1, tree_extensions[i].extension) == 0) {
+                return tree_extensions[i].type;
+            }
+        }
+    }
+    // The entry may have been replaced since it was seen as a file:
+    // O_NONBLOCK keeps a FIFO from blocking the open, and only a regular
+    // file is read
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return TREE_DEFAULT_TYPE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return TREE_DEFAULT_TYPE;
+    }
+    unsigned char head[TREE_SNIFF_BYTES];
+    ssize_t got = pread(fd, head, sizeof(head), 0);
+    close(fd);
+    return sniff_bytes(head, got > 0 ? (size_t)got : 0);
+}
+
+// Appends s as the inside of a JSON string.
+static int append_json(buffer_t *out, const char *s, size_t len) {
+    static const char hex_digits[] = "0123456789abcdef";
+    if (buffer_reserve(out, len * 6) != 0) {
+        return -1;
+    }
+    char *p = out->data + out->len;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex_digits[c >> 4];
+            p[5] = hex_digits[c & 15];
+            p += 6;
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    out->len = (size_t)(p - out->data);
+    return 0;
+}
+
+static void tree_release(tree_parent_t *parent) {
+    if (parent && __atomic_sub_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(parent->fd);
+        free(parent);
+    }
+}
+
+static void tree_push(tree_walk_t *walk, tree_parent_t *parent, const char *rel, size_t rel_len, const char *name,
+                      size_t name_len) {
+    tree_dir_t *dir = malloc(sizeof(*dir) + rel_len + name_len + 2);
+    if (!dir) {
+        fprintf(stderr, "Error: Out of memory\n");
+        walk->failed = 1;
+        return;
+    }
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    dir->parent = parent;
+    dir->name_offset = rel_len;
+    memcpy(dir->rel, rel, rel_len);
+    memcpy(dir->rel + rel_len, name, name_len);
+    dir->rel[rel_len + name_len] = '/';
+    dir->rel[rel_len + name_len + 1] = '\0';
+    pthread_mutex_lock(&walk->lock);
+    dir->next = walk->pending;
+    walk->pending = dir;
+    pthread_cond_signal(&walk->work_ready);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static int tree_flush(tree_worker_t *worker) {
+    if (worker->out.len == 0) {
+        return 0;
+    }
+    uint64_t write_start = stats_enabled ? stats_clock() : 0;
+    pthread_mutex_lock(&worker->walk->out_lock);
+    int failed = fwrite(worker->out.data, 1, worker->out.len, stdout) != worker->out.len;
+    pthread_mutex_unlock(&worker->walk->out_lock);
+    if (stats_enabled) {
+        stats_record(STAT_OUTPUT, stats_clock() - write_start);
+        stats_count(STAT_OUTPUT_BYTES, worker->out.len);
+    }
+    worker->out.len = 0;
+    return failed ? -1 : 0;
+}
+
+// Signs the file rel/name of size bytes and appends its manifest line.
+static void tree_sign_file(tree_worker_t *worker, int dir_fd, const char *rel, size_t rel_len, const char *name,
+                           size_t name_len, unsigned long long size) {
+    tree_walk_t *walk = worker->walk;
+    const char *type = walk->content_type;
+    if (!type) {
+        type = sniff_content_type(dir_fd, name);
+        worker->headers[worker->type_header].value = type;
+    }
+
+    worker->key.len = 0;
+    if (buffer_append(&worker->key, walk->prefix, walk->prefix_len) != 0 ||
+        buffer_append(&worker->key, rel, rel_len) != 0 || buffer_append(&worker->key, name, name_len + 1) != 0) {
+        walk->failed = 1;
+        return;
+    }
+    worker->request.path = worker->key.data;
+    const char *path = worker->key.data + walk->prefix_len;
+    size_t path_len = rel_len + name_len;
+
+    buffer_t *out = &worker->out;
+    size_t line_start = out->len;
+    char size_text[24];
+    int size_len = snprintf(size_text, sizeof(size_text), "%llu", size);
+    int status;
+    if (walk->jsonl) {
+        status = buffer_append(out, "{\"path\":\"", 9) != 0 || append_json(out, path, path_len) != 0 ||
+                 buffer_append(out, "\",\"size\":", 9) != 0 || buffer_append(out, size_text, (size_t)size_len) != 0 ||
+                 buffer_append(out, ",\"url\":\"", 8) != 0 ? PRESIGN_ERR_OUT_OF_MEMORY : PRESIGN_OK;
+    } else if (strpbrk(path, "\t\n\r")) {
+        fprintf(stderr, "Error: Cannot list '%s' in a TSV manifest (use --format jsonl)\n", path);
+        walk->failed = 1;
+        return;
+    } else {
+        status = buffer_append(out, path, path_len) != 0 || buffer_append(out, "\t", 1) != 0 ||
+                 buffer_append(out, size_text, (size_t)size_len) != 0 || buffer_append(out, "\t", 1) != 0
+                 ? PRESIGN_ERR_OUT_OF_MEMORY : PRESIGN_OK;
+    }
+    if (status == PRESIGN_OK) {
+        status = append_signed_url(walk->signer->ctx, &worker->request, out);
+    }
+    if (status == PRESIGN_OK) {
+        status = (walk->jsonl ? buffer_append(out, "\",\"content_type\":\"", 18) != 0 ||
+                                    append_json(out, type, strlen(type)) != 0 || buffer_append(out, "\"}\n", 3) != 0
+                              : buffer_append(out, "\t", 1) != 0 || buffer_append(out, type, strlen(type)) != 0 ||
+                                    buffer_append(out, "\n", 1) != 0)
+                 ? PRESIGN_ERR_OUT_OF_MEMORY : PRESIGN_OK;
+    }
+    if (status != PRESIGN_OK) {
+        fprintf(stderr, "Error: %s: %s\n", path, presign_strerror(status));
+        out->len = line_start;
+        walk->failed = 1;
+        return;
+    }
+    if (out->len >= BATCH_OUTPUT_BUFFER && tree_flush(worker) != 0) {
+        walk->failed = 1;
+    }
+}
+
+// Handles one directory entry. Entries of unknown type are stat'ed to
+// tell directories from files; files are stat'ed for their size anyway.
+static void tree_entry(tree_worker_t *worker, int dir_fd, const char *rel, size_t rel_len, const char *name,
+                       int is_dir, int is_file) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;
+    }
+    size_t name_len = strlen(name);
+    struct stat st;
+    if (!is_dir) {
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            fprintf(stderr, "Error: Cannot stat '%s%s': %s\n", rel, name, strerror(errno));
+            worker->walk->failed = 1;
+            return;
+        }
+        is_dir = S_ISDIR(st.st_mode);
+        is_file = S_ISREG(st.st_mode);
+    }
+    if (is_dir) {
+        tree_push(worker->walk, worker->current, rel, rel_len, name, name_len);
+    } else if (is_file) {
+        tree_sign_file(worker, dir_fd, rel, rel_len, name, name_len, (unsigned long long)st.st_size);
+    } else {
+        __atomic_add_fetch(&worker->walk->skipped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+#ifdef __linux__
+struct tree_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int tree_read_entries(tree_worker_t *worker, int fd, const char *rel, size_t rel_len) {
+    for (;;) {
+        long got = syscall(SYS_getdents64, fd, worker->entries, TREE_DIRENT_BUFFER);
+        if (got <= 0) {
+            return got < 0 ? -1 : 0;
+        }
+        for (long offset = 0; offset < got;) {
+            struct tree_dirent64 *entry = (struct tree_dirent64 *)(worker->entries + offset);
+            unsigned char type = entry->d_type;
+            // DT_DIR, DT_REG and DT_UNKNOWN; links and special files are skipped
+            if (type == 4 || type == 8 || type == 0) {
+                tree_entry(worker, fd, rel, rel_len, entry->d_name, type == 4, type == 8);
+            } else {
+                __atomic_add_fetch(&worker->walk->skipped, 1, __ATOMIC_RELAXED);
+            }
+            offset += entry->d_reclen;
+        }
+    }
+}
+#else
+static int tree_read_entries(tree_worker_t *worker, int fd, const char *rel, size_t rel_len) {
+    int dir_fd = dup(fd);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        int error = errno;
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        errno = error;
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        tree_entry(worker, fd, rel, rel_len, entry->d_name, 0, 0);
+    }
+    closedir(dir);
+    return 0;
+}
+#endif
+
+static void tree_read_directory(tree_worker_t *worker, tree_dir_t *dir) {
+    tree_walk_t *walk = worker->walk;
+    size_t rel_len = strlen(dir->rel);
+    int fd;
+    if (dir->parent) {
+        // The name alone, without the trailing '/'
+        dir->rel[rel_len - 1] = '\0';
+        fd = openat(dir->parent->fd, dir->rel + dir->name_offset, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        dir->rel[rel_len - 1] = '/';
+    } else {
+        fd = openat(walk->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    int error = fd < 0 ? errno : 0;
+    tree_release(dir->parent);
+    tree_parent_t *current = fd >= 0 ? malloc(sizeof(*current)) : NULL;
+    if (fd >= 0 && !current) {
+        error = ENOMEM;
+        close(fd);
+    } else if (current) {
+        current->fd = fd;
+        current->refs = 1;
+        worker->current = current;
+        if (tree_read_entries(worker, fd, dir->rel, rel_len) != 0) {
+            error = errno;
+        }
+        worker->current = NULL;
+        tree_release(current);
+    }
+    if (error != 0) {
+        fprintf(stderr, "Error: Cannot read directory '%s': %s\n", dir->rel[0] ? dir->rel : ".", strerror(error));
+        walk->failed = 1;
+    }
+}
+
+static void *tree_worker(void *arg) {
+    tree_worker_t *worker = arg;
+    tree_walk_t *walk = worker->walk;
+    for (;;) {
+        pthread_mutex_lock(&walk->lock);
+        while (!walk->pending && walk->busy > 0) {
+            pthread_cond_wait(&walk->work_ready, &walk->lock);
+        }
+        tree_dir_t *dir = walk->pending;
+        if (!dir) {
+            // Nothing queued and nobody reading: the walk is over
+            pthread_cond_broadcast(&walk->work_ready);
+            pthread_mutex_unlock(&walk->lock);
+            break;
+        }
+        walk->pending = dir->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        tree_read_directory(worker, dir);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->busy == 0 && !walk->pending) {
+            pthread_cond_broadcast(&walk->work_ready);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+    if (tree_flush(worker) != 0) {
+        walk->failed = 1;
+    }
+    return NULL;
+}
+
+static int tree_worker_init(tree_worker_t *worker, tree_walk_t *walk) {
+    memset(worker, 0, sizeof(*worker));
+    worker->walk = walk;
+    worker->request = walk->signer->request;
+    size_t count = worker->request.header_count;
+    memcpy(worker->headers, worker->request.headers, count * sizeof(worker->headers[0]));
+    if (!walk->content_type) {
+        worker->type_header = count;
+        worker->headers[count].name = "Content-Type";
+        worker->headers[count].value = TREE_DEFAULT_TYPE;
+        count++;
+    }
+    worker->request.headers = worker->headers;
+    worker->request.header_count = count;
+    worker->entries = malloc(TREE_DIRENT_BUFFER);
+    return worker->entries && buffer_reserve(&worker->out, BATCH_OUTPUT_BUFFER + URL_SLOT_LEN) == 0 ? 0 : -1;
+}
+
+static void tree_worker_free(tree_worker_t *worker) {
+    free(worker->entries);
+    free(worker->out.data);
+    free(worker->key.data);
+}
+
+typedef struct {
+    const char *root;
+    int threads;
+} tree_source_t;
+
+// Walks the root with its threads workers and writes the manifest.
+static int sign_tree(signer_t *signer, const presign_args_t *args, void *source_arg) {
+    const tree_source_t *source = source_arg;
+    const char *root = source->root;
+    int threads = source->threads;
+    tree_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.signer = signer;
+    walk.jsonl = args->tree_jsonl;
+    for (size_t i = 0; i < signer->request.header_count; i++) {
+        if (strcasecmp(signer->request.headers[i].name, "content-type") == 0) {
+            walk.content_type = signer->request.headers[i].value;
+        }
+    }
+    if (!walk.content_type && signer->request.header_count >= MAX_HEADERS) {
+        fprintf(stderr, "Error: Too many headers (max %d)\n", MAX_HEADERS);
+        return -1;
+    }
+
+    // S3_PATH is the key prefix; keys continue after a '/'
+    buffer_t prefix = {0};
+    size_t path_len = strlen(args->path);
+    if (buffer_append(&prefix, args->path, path_len) != 0 ||
+        (path_len > 0 && args->path[path_len - 1] != '/' && buffer_append(&prefix, "/", 1) != 0)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(prefix.data);
+        return -1;
+    }
+    walk.prefix = prefix.data;
+    walk.prefix_len = prefix.len;
+
+    walk.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walk.root_fd < 0) {
+        fprintf(stderr, "Error: Cannot open directory '%s': %s\n", root, strerror(errno));
+        free(prefix.data);
+        return -1;
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_mutex_init(&walk.out_lock, NULL);
+    pthread_cond_init(&walk.work_ready, NULL);
+    tree_dir_t *top = calloc(1, sizeof(*top) + 1);
+    walk.pending = top;
+
+    tree_worker_t *workers = calloc((size_t)threads, sizeof(*workers));
+    pthread_t thread_ids[MAX_BATCH_THREADS];
+    int started = 0;
+    int failed = !top || !workers;
+    for (int i = 0; i < threads && !failed; i++) {
+        failed = tree_worker_init(&workers[i], &walk) != 0;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: Out of memory\n");
+    } else {
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&thread_ids[started], NULL, tree_worker, &workers[started + 1]) != 0) {
+                break;
+            }
+        }
+        // The calling thread is a worker too
+        tree_worker(&workers[0]);
+        for (int i = 0; i < started; i++) {
+            pthread_join(thread_ids[i], NULL);
+        }
+    }
+    if (failed) {
+        free(top);
+    }
+
+    if (fflush(stdout) != 0) {
+        fprintf(stderr, "Error: Cannot write manifest\n");
+        walk.failed = 1;
+    }
+    if (walk.skipped > 0) {
+        fprintf(stderr, "presign: skipped %llu symbolic links and special files\n", walk.skipped);
+    }
+    for (int i = 0; workers && i < threads; i++) {
+        tree_worker_free(&workers[i]);
+    }
+    free(workers);
+    close(walk.root_fd);
+    pthread_cond_destroy(&walk.work_ready);
+    pthread_mutex_destroy(&walk.out_lock);
+    pthread_mutex_destroy(&walk.lock);
+    free(prefix.data);
+    return failed || walk.failed ? -1 : 0;
+}
+
+int run_tree(const presign_args_t *args, const char *root, int threads) {
+    tree_source_t source = {root, threads};
+    return with_signer(args, sign_tree, &source);
+}
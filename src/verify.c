@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "presign.h"
+#include "presign_internal.h"
+#include "cli.h"
+
+/*
+ * presign verify: checks presigned URLs the way S3 would, with the
+ * credentials of the environment.
+ *
+ * URLs come from the command line or, with --batch, one per line:
+ *
+ *     URL <LF>        or        METHOD <TAB> URL <LF>
+ *
+ * and each is answered by one line, in input order:
+ *
+ *     OK <LF>         or        FAIL <TAB> reason <LF>
+ *
+ * The input is read in VERIFY_READ_CHUNK blocks and every line is verified
+ * where it lies in the block, so a batch costs one read() per block and one
+ * write() per BATCH_OUTPUT_BUFFER of answers on top of the verifications.
+ * The exit status is 0 only when every URL is valid.
+ */
+
+#define VERIFY_READ_CHUNK (1 << 20)
+
+typedef struct {
+    signer_t signer;
+    buffer_t out;
+    unsigned long long failed;
+} verifier_t;
+
+static void print_verify_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s verify [--method METHOD] [--header 'Key: Value']... [--now TIMESTAMP]\n"
+                    "       %*s [--region REGION | --region-set LIST] [--endpoint ENDPOINT] URL... | --batch FILE|-\n",
+            prog_name, (int)strlen(prog_name), "");
+}
+
+static int flush_output(buffer_t *out) {
+    if (out->len > 0 && fwrite(out->data, 1, out->len, stdout) != out->len) {
+        return -1;
+    }
+    out->len = 0;
+    return 0;
+}
+
+// Verifies one line and appends its answer.
+static int verify_line(verifier_t *verifier, const char *line, size_t len) {
+    const presign_request_t *req = &verifier->signer.request;
+    const char *method = req->method;
+    char line_method[16];
+    const char *tab = memchr(line, '\t', len);
+    if (tab) {
+        // A method too long to be one is left empty, which is rejected
+        size_t method_len = (size_t)(tab - line);
+        if (method_len >= sizeof(line_method)) {
+            method_len = 0;
+        }
+        memcpy(line_method, line, method_len);
+        line_method[method_len] = '\0';
+        method = line_method;
+        len -= (size_t)(tab + 1 - line);
+        line = tab + 1;
+    }
+
+    int status = presign_verify_url(verifier->signer.ctx, method, line, len, req->headers, req->header_count,
+                                    req->now);
+    if (status == PRESIGN_OK) {
+        return buffer_append(&verifier->out, "OK\n", 3);
+    }
+    verifier->failed++;
+    const char *reason = presign_strerror(status);
+    return buffer_append(&verifier->out, "FAIL\t", 5) != 0 ||
+           buffer_append(&verifier->out, reason, strlen(reason)) != 0 ||
+           buffer_append(&verifier->out, "\n", 1) != 0 ? -1 : 0;
+}
+
+// Verifies the complete lines of data[0..len) and returns how many bytes
+// they take up; the rest is the start of a line still being read.
+static size_t verify_lines(verifier_t *verifier, const char *data, size_t len, int at_end, int *failed) {
+    size_t done = 0;
+    while (done < len) {
+        const char *newline = memchr(data + done, '\n', len - done);
+        if (!newline && !at_end) {
+            break;
+        }
+        size_t line_end = newline ? (size_t)(newline - data) : len;
+        size_t line_len = line_end - done;
+        if (line_len > 0 && data[done + line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len > 0 && verify_line(verifier, data + done, line_len) != 0) {
+            *failed = 1;
+        }
+        done = newline ? line_end + 1 : len;
+        if (verifier->out.len >= BATCH_OUTPUT_BUFFER && flush_output(&verifier->out) != 0) {
+            *failed = 1;
+        }
+    }
+    return done;
+}
+
+static int verify_batch(verifier_t *verifier, const char *source) {
+    int fd = STDIN_FILENO;
+    if (strcmp(source, "-") != 0) {
+        fd = open(source, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot open batch file '%s': %s\n", source, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Whole lines are verified in place; an incomplete one moves to the
+    // front of the buffer, which grows for lines longer than a chunk.
+    buffer_t in = {0};
+    int failed = 0;
+    int rc = 0;
+    for (;;) {
+        if (buffer_reserve(&in, VERIFY_READ_CHUNK) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            rc = -1;
+            break;
+        }
+        ssize_t got = read(fd, in.data + in.len, in.cap - in.len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            fprintf(stderr, "Error: Cannot read batch input: %s\n", strerror(errno));
+            rc = -1;
+            break;
+        }
+        in.len += (size_t)got;
+        size_t done = verify_lines(verifier, in.data, in.len, got == 0, &failed);
+        memmove(in.data, in.data + done, in.len - done);
+        in.len -= done;
+        if (got == 0) {
+            break;
+        }
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    free(in.data);
+    if (failed) {
+        fprintf(stderr, "Error: Cannot write verification results\n");
+        rc = -1;
+    }
+    return rc;
+}
+
+static int verify_command(int argc, char *argv[], presign_args_t *args) {
+    const char *region = getenv("S3_REGION");
+    const char *endpoint = getenv("S3_ENDPOINT");
+    const char *now_override = NULL;
+    const char *batch = NULL;
+    const char *region_set = NULL;
+    int first_url = argc;
+    strcpy(args->service, "s3");
+    strcpy(args->method, "GET");
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            region = argv[++i];
+        } else if (strcmp(argv[i], "--endpoint") == 0 && i + 1 < argc) {
+            endpoint = argv[++i];
+        } else if (strcmp(argv[i], "--region-set") == 0 && i + 1 < argc) {
+            region_set = argv[++i];
+        } else if (strcmp(argv[i], "--now") == 0 && i + 1 < argc) {
+            now_override = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = argv[++i];
+        } else if (strcmp(argv[i], "--method") == 0 && i + 1 < argc) {
+            if (snprintf(args->method, sizeof(args->method), "%s", argv[++i]) >= (int)sizeof(args->method)) {
+                fprintf(stderr, "Error: Invalid method '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--header") == 0 && i + 1 < argc) {
+            // Headers as received: "Key: Value", the value used in place
+            const char *header = argv[++i];
+            const char *colon = strchr(header, ':');
+            if (!colon) {
+                fprintf(stderr, "Error: Invalid header format. Use 'Key: Value'\n");
+                return 1;
+            }
+            if (args->header_count >= MAX_HEADERS) {
+                fprintf(stderr, "Error: Too many headers (max %d)\n", MAX_HEADERS);
+                return 1;
+            }
+            char *name = arena_strndup(&args->strings, header, (size_t)(colon - header));
+            if (!name) {
+                fprintf(stderr, "Error: Out of memory\n");
+                return 1;
+            }
+            args->headers[args->header_count].name = name;
+            args->headers[args->header_count++].value = colon[1] == ' ' ? colon + 2 : colon + 1;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            i++;    // enabled by main()
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            print_verify_usage(argv[0]);
+            return 1;
+        } else if (first_url == argc) {
+            first_url = i;
+        }
+    }
+
+    if ((batch != NULL) == (first_url < argc)) {
+        fprintf(stderr, "Error: Give either URLs or --batch\n");
+        print_verify_usage(argv[0]);
+        return 1;
+    }
+    if (region_set) {
+        region = "";
+        args->region_set = region_set;
+    }
+    if (!region) {
+        fprintf(stderr, "Error: REGION is required (provide --region or set S3_REGION)\n");
+        return 1;
+    }
+    if (!endpoint) {
+        fprintf(stderr, "Error: ENDPOINT is required (provide --endpoint or set S3_ENDPOINT)\n");
+        return 1;
+    }
+    if (snprintf(args->region, sizeof(args->region), "%s", region) >= (int)sizeof(args->region) ||
+        snprintf(args->bucket_url, sizeof(args->bucket_url), "%s", endpoint) >= (int)sizeof(args->bucket_url) ||
+        (now_override && snprintf(args->now_override, sizeof(args->now_override), "%s", now_override) >= (int)sizeof(args->now_override))) {
+        fprintf(stderr, "Error: Region, endpoint or timestamp too long\n");
+        return 1;
+    }
+
+    verifier_t verifier = {0};
+    if (init_signer(&verifier.signer, args, NULL) != 0) {
+        return 1;
+    }
+    int rc = 0;
+    if (batch) {
+        rc = verify_batch(&verifier, batch) != 0;
+    } else {
+        for (int i = first_url; i < argc; i++) {
+            if (argv[i][0] == '-' && argv[i][1] == '-') {
+                i++;    // every option takes a value
+            } else if (verify_line(&verifier, argv[i], strlen(argv[i])) != 0) {
+                fprintf(stderr, "Error: Out of memory\n");
+                rc = 1;
+                break;
+            }
+        }
+    }
+    if (flush_output(&verifier.out) != 0 || fflush(stdout) != 0) {
+        fprintf(stderr, "Error: Cannot write verification results\n");
+        rc = 1;
+    }
+    if (rc == 0 && verifier.failed > 0) {
+        rc = 1;
+    }
+    free(verifier.out.data);
+    presign_ctx_free(verifier.signer.ctx);
+    return rc;
+}
+
+int run_verify(int argc, char *argv[]) {
+    static presign_args_t args;
+    arena_init(&args.strings, NULL, 0);
+    int rc = verify_command(argc, argv, &args);
+    arena_free(&args.strings);
+    return rc;
+}
@@ -0,0 +1,175 @@
+/*
+ * Differential tests for the URI encoding and hex kernels: every kernel the
+ * CPU supports must match the scalar reference byte for byte, return the
+ * same status for every output buffer size, and never write past the end of
+ * the buffer it was given.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "presign_internal.h"
+
+#define RANDOM_CASES 20000
+#define MAX_INPUT_LEN 700
+#define CANARY_LEN 64
+#define OUTPUT_LEN (MAX_INPUT_LEN * 3 + 128)
+
+static int total_tests = 0;
+static int failed_tests = 0;
+
+static void check(const char *name, int ok) {
+    total_tests++;
+    printf("Testing: %s ... %s\n", name, ok ? "PASS" : "FAIL");
+    if (!ok) {
+        failed_tests++;
+    }
+}
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+static unsigned int next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 32);
+}
+
+static const char unreserved[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~/";
+
+// Fills src with len non-NUL bytes; mode 0 is unreserved only, 1 mostly
+// unreserved, 2 uniformly random.
+static void random_input(char *src, size_t len, int mode) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned int r = next_random();
+        if (mode == 0 || (mode == 1 && r % 10 != 0)) {
+            src[i] = unreserved[(r >> 8) % (sizeof(unreserved) - 1)];
+        } else {
+            src[i] = (char)(1 + (r >> 8) % 255);
+        }
+    }
+    src[len] = '\0';
+}
+
+// Encodes src with the active kernel into a dest_size buffer followed by a
+// canary, and compares output and reported length with the reference.
+// Returns 0 when they agree.
+static int compare_encode(const char *src, size_t dest_size, int keep_slash) {
+    static char expected[OUTPUT_LEN];
+    static char actual[OUTPUT_LEN + CANARY_LEN];
+    size_t actual_len = 0;
+
+    int expected_rc = url_encode_component_scalar(src, expected, dest_size, keep_slash);
+    memset(actual, 0x5A, dest_size + CANARY_LEN);
+    int actual_rc = url_encode_bytes(src, strlen(src), actual, dest_size, keep_slash, &actual_len);
+
+    for (size_t i = dest_size; i < dest_size + CANARY_LEN; i++) {
+        if (actual[i] != 0x5A) {
+            return -1;
+        }
+    }
+    if (expected_rc != actual_rc) {
+        return -1;
+    }
+    return expected_rc == 0 && (strcmp(expected, actual) != 0 || actual_len != strlen(expected)) ? -1 : 0;
+}
+
+static size_t encoded_size(const char *src, int keep_slash) {
+    static char out[OUTPUT_LEN];
+    url_encode_component_scalar(src, out, sizeof(out), keep_slash);
+    return strlen(out) + 1;
+}
+
+static void test_kernel(const char *kernel) {
+    char name[128];
+    char src[MAX_INPUT_LEN + 1];
+    int mismatches;
+
+    // Every byte value, at every alignment and around every block boundary
+    for (int c = 1; c < 256; c++) {
+        src[c - 1] = (char)c;
+    }
+    src[255] = '\0';
+    mismatches = 0;
+    for (size_t offset = 0; offset < 64; offset++) {
+        for (int keep_slash = 0; keep_slash <= 1; keep_slash++) {
+            mismatches += compare_encode(src + offset, MAX_INPUT_LEN * 3, keep_slash) != 0;
+        }
+    }
+    snprintf(name, sizeof(name), "[%s] all byte values at every offset", kernel);
+    check(name, mismatches == 0);
+
+    // Long unreserved runs with a single escape at each position
+    mismatches = 0;
+    for (size_t len = 1; len <= 100; len++) {
+        for (size_t pos = 0; pos < len; pos++) {
+            memset(src, 'k', len);
+            src[len] = '\0';
+            src[pos] = ' ';
+            mismatches += compare_encode(src, MAX_INPUT_LEN * 3, 1) != 0;
+        }
+    }
+    snprintf(name, sizeof(name), "[%s] single escape at every position", kernel);
+    check(name, mismatches == 0);
+
+    // Every output buffer size up to and past the exact fit
+    mismatches = 0;
+    for (int mode = 0; mode < 3; mode++) {
+        random_input(src, 150, mode);
+        size_t needed = encoded_size(src, 1);
+        for (size_t size = 0; size <= needed + 40; size++) {
+            mismatches += compare_encode(src, size, 1) != 0;
+        }
+    }
+    snprintf(name, sizeof(name), "[%s] every output buffer size", kernel);
+    check(name, mismatches == 0);
+
+    mismatches = 0;
+    for (int i = 0; i < RANDOM_CASES; i++) {
+        size_t len = next_random() % (MAX_INPUT_LEN + 1);
+        int keep_slash = next_random() & 1;
+        random_input(src, len, next_random() % 3);
+        size_t needed = encoded_size(src, keep_slash);
+        size_t size;
+        switch (next_random() % 4) {
+        case 0: size = needed; break;
+        case 1: size = needed - 1; break;
+        case 2: size = needed + next_random() % 64; break;
+        default: size = next_random() % (needed + 1); break;
+        }
+        mismatches += compare_encode(src, size, keep_slash) != 0;
+    }
+    snprintf(name, sizeof(name), "[%s] %d random inputs", kernel, RANDOM_CASES);
+    check(name, mismatches == 0);
+
+    mismatches = 0;
+    unsigned char data[100];
+    char expected[2 * sizeof(data) + 1];
+    char actual[2 * sizeof(data) + 1 + CANARY_LEN];
+    for (int len = 0; len <= (int)sizeof(data); len++) {
+        for (int j = 0; j < len; j++) {
+            data[j] = (unsigned char)next_random();
+        }
+        to_hex_scalar(data, len, expected);
+        memset(actual, 0x5A, sizeof(actual));
+        to_hex(data, len, actual);
+        mismatches += strcmp(expected, actual) != 0 || actual[len * 2 + 1] != 0x5A;
+    }
+    snprintf(name, sizeof(name), "[%s] to_hex for lengths 0..%d", kernel, (int)sizeof(data));
+    check(name, mismatches == 0);
+}
+
+int main(void) {
+    static const char *kernels[] = {"avx2", "sse2", "neon", "scalar"};
+
+    printf("Default kernel: %s\n", encode_kernel_name());
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (encode_select_kernel(kernels[i]) != 0) {
+            printf("Skipping: %s kernel not available\n", kernels[i]);
+            continue;
+        }
+        test_kernel(kernels[i]);
+    }
+
+    printf("\nTotal tests run: %d\nPassed: %d\nFailed: %d\n", total_tests, total_tests - failed_tests, failed_tests);
+    return failed_tests == 0 ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+/*
+ * Tests for SHA-256 and HMAC-SHA256 on the configured crypto backend, and
+ * for the single-stream compression kernels of sha256.c. Known-answer
+ * vectors (FIPS 180-2, RFC 4231) and streaming checks run once per kernel,
+ * which exercises every kernel end to end when built with
+ * CRYPTO_BACKEND=native; each kernel is also compared with the portable
+ * version directly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "presign_internal.h"
+
+#define RANDOM_CASES 2000
+#define MAX_BLOCKS 8
+#define CONTEXT_THREADS 4
+#define CONTEXT_ROUNDS 500
+
+static int total_tests = 0;
+static int failed_tests = 0;
+
+static void check(const char *name, int ok) {
+    total_tests++;
+    printf("Testing: %s ... %s\n", name, ok ? "PASS" : "FAIL");
+    if (!ok) {
+        failed_tests++;
+    }
+}
+
+static unsigned long long rng_state = 0xD1B54A32D192ED03ULL;
+
+static unsigned int next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 32);
+}
+
+static int digest_is(const unsigned char *digest, const char *expected_hex) {
+    char hex[65];
+    to_hex_scalar(digest, 32, hex);
+    return strcmp(hex, expected_hex) == 0;
+}
+
+typedef struct {
+    const char *message;
+    size_t repeat;
+    const char *digest;
+} hash_vector_t;
+
+static const hash_vector_t hash_vectors[] = {
+    {"", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+};
+
+static int check_hash_vectors(void) {
+    for (size_t i = 0; i < sizeof(hash_vectors) / sizeof(hash_vectors[0]); i++) {
+        const hash_vector_t *v = &hash_vectors[i];
+        size_t unit = strlen(v->message);
+        size_t len = unit * v->repeat;
+        char *message = malloc(len + 1);
+        unsigned char digest[32];
+        if (!message) {
+            return -1;
+        }
+        for (size_t j = 0; j < v->repeat; j++) {
+            memcpy(message + j * unit, v->message, unit);
+        }
+        int ok = sha256_hash(message, (int)len, digest) == 0 && digest_is(digest, v->digest);
+        free(message);
+        if (!ok) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Feeds [from, to) of message to stream in random pieces, empty ones included.
+static int update_in_pieces(sha256_stream_t *stream, const unsigned char *message, size_t from, size_t to) {
+    while (from < to) {
+        size_t piece = next_random() % 80;
+        if (piece > to - from) {
+            piece = to - from;
+        }
+        if (sha256_stream_update(stream, message + from, piece) != 0) {
+            return -1;
+        }
+        from += piece;
+    }
+    return 0;
+}
+
+// Streams every message length up to several blocks in random pieces, and
+// finishes a copy taken halfway with the rest in one piece; both must match
+// the one-shot digest.
+static int check_stream_splits(void) {
+    static unsigned char message[MAX_BLOCKS * 64 + 63];
+    sha256_stream_t *stream = sha256_stream_new();
+    sha256_stream_t *copy = sha256_stream_new();
+    int rc = stream && copy ? 0 : -1;
+
+    for (size_t len = 0; len <= sizeof(message) && rc == 0; len++) {
+        unsigned char expected[32];
+        unsigned char streamed[32];
+        unsigned char copied[32];
+        size_t half = len / 2;
+        for (size_t i = 0; i < len; i++) {
+            message[i] = (unsigned char)next_random();
+        }
+        if (sha256_hash((const char *)message, (int)len, expected) != 0 ||
+            sha256_stream_start(stream) != 0 ||
+            update_in_pieces(stream, message, 0, half) != 0 ||
+            sha256_stream_copy(copy, stream) != 0 ||
+            update_in_pieces(stream, message, half, len) != 0 ||
+            sha256_stream_finish(stream, streamed) != 0 ||
+            sha256_stream_update(copy, message + half, len - half) != 0 ||
+            sha256_stream_finish(copy, copied) != 0 ||
+            memcmp(expected, streamed, 32) != 0 || memcmp(expected, copied, 32) != 0) {
+            rc = -1;
+        }
+    }
+
+    sha256_stream_free(stream);
+    sha256_stream_free(copy);
+    return rc;
+}
+
+static int check_hmac_vectors(void) {
+    unsigned char key[131];
+    unsigned char mac[32];
+
+    memset(key, 0x0b, 20);
+    if (hmac_sha256((const char *)key, 20, "Hi There", 8, mac) != 0 ||
+        !digest_is(mac, "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7")) {
+        return -1;
+    }
+    if (hmac_sha256("Jefe", 4, "what do ya want for nothing?", 28, mac) != 0 ||
+        !digest_is(mac, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843")) {
+        return -1;
+    }
+    memset(key, 0xaa, sizeof(key));
+    const char *data = "Test Using Larger Than Block-Size Key - Hash Key First";
+    if (hmac_sha256((const char *)key, (int)sizeof(key), data, (int)strlen(data), mac) != 0 ||
+        !digest_is(mac, "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54")) {
+        return -1;
+    }
+
+    // The midstate path must agree with the one-shot MAC for every key size
+    hmac_sha256_key_t mac_key;
+    sha256_stream_t *inner = sha256_stream_new();
+    sha256_stream_t *outer = sha256_stream_new();
+    int rc = inner && outer ? 0 : -1;
+    for (size_t key_len = 0; key_len <= sizeof(key) && rc == 0; key_len += 7) {
+        unsigned char expected[32];
+        for (size_t i = 0; i < key_len; i++) {
+            key[i] = (unsigned char)next_random();
+        }
+        if (hmac_sha256((const char *)key, (int)key_len, data, (int)strlen(data), expected) != 0 ||
+            hmac_sha256_key_init(&mac_key, key, key_len) != 0) {
+            rc = -1;
+            break;
+        }
+        if (hmac_sha256_begin(&mac_key, inner, outer) != 0 ||
+            sha256_stream_update(inner, data, strlen(data)) != 0 ||
+            hmac_sha256_end(inner, outer, mac) != 0 || memcmp(expected, mac, 32) != 0) {
+            rc = -1;
+        }
+        hmac_sha256_key_clear(&mac_key);
+    }
+    sha256_stream_free(inner);
+    sha256_stream_free(outer);
+    return rc;
+}
+
+// Mixes every one-shot helper on the calling thread's crypto context. The
+// signing key is the worked example from the AWS SigV4 documentation.
+static void *context_worker(void *arg) {
+    crypto_ctx_t *first = crypto_thread_ctx();
+    unsigned char digest[32];
+    intptr_t rc = first ? 0 : -1;
+    (void)arg;
+    for (int i = 0; i < CONTEXT_ROUNDS && rc == 0; i++) {
+        if (crypto_thread_ctx() != first ||
+            derive_signing_key("wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY", "20120215", "us-east-1", "iam",
+                               digest) != 0 ||
+            !digest_is(digest, "f4780e2d9f65fa895f9c67b32ce1baf0b0d8a43505a000a1a9e090d414db404d") ||
+            sha256_hash("abc", 3, digest) != 0 ||
+            !digest_is(digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") ||
+            hmac_sha256("Jefe", 4, "what do ya want for nothing?", 28, digest) != 0 ||
+            !digest_is(digest, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843")) {
+            rc = -1;
+        }
+    }
+    return (void *)rc;
+}
+
+// Reused contexts must give the same answers on every thread, and every
+// thread must get its own.
+static int check_thread_contexts(void) {
+    pthread_t threads[CONTEXT_THREADS];
+    int rc = 0;
+    int started = 0;
+    for (; started < CONTEXT_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, context_worker, NULL) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (context_worker(NULL) != NULL) {
+        rc = -1;
+    }
+    for (int i = 0; i < started; i++) {
+        void *result;
+        if (pthread_join(threads[i], &result) != 0 || result != NULL) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+// Compares the active kernel with the portable compression function on
+// random states and block runs.
+static int check_against_portable(void) {
+    static unsigned char blocks[MAX_BLOCKS * 64];
+    for (int i = 0; i < RANDOM_CASES; i++) {
+        uint32_t expected[8];
+        uint32_t actual[8];
+        size_t count = 1 + next_random() % MAX_BLOCKS;
+        for (int j = 0; j < 8; j++) {
+            expected[j] = actual[j] = next_random();
+        }
+        for (size_t j = 0; j < count * 64; j++) {
+            blocks[j] = (unsigned char)next_random();
+        }
+        sha256_compress_portable(expected, blocks, count);
+        sha256_compress(actual, blocks, count);
+        if (memcmp(expected, actual, sizeof(expected)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(void) {
+    static const char *kernels[] = {"shani", "armv8", "portable"};
+    char name[128];
+
+    printf("Crypto backend: %s, default kernel: %s\n", crypto_backend_name(), sha256_kernel_name());
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (sha256_select_kernel(kernels[k]) != 0) {
+            printf("Skipping: %s kernel not available\n", kernels[k]);
+            continue;
+        }
+        snprintf(name, sizeof(name), "[%s] %d random block runs match the portable code", kernels[k], RANDOM_CASES);
+        check(name, check_against_portable() == 0);
+        snprintf(name, sizeof(name), "[%s] SHA-256 known answers", kernels[k]);
+        check(name, check_hash_vectors() == 0);
+        snprintf(name, sizeof(name), "[%s] streamed and copied digests match one-shot", kernels[k]);
+        check(name, check_stream_splits() == 0);
+        snprintf(name, sizeof(name), "[%s] HMAC-SHA256 known answers and midstates", kernels[k]);
+        check(name, check_hmac_vectors() == 0);
+    }
+    check("Per-thread crypto contexts from several threads", check_thread_contexts() == 0);
+
+    printf("\nTotal tests run: %d\nPassed: %d\nFailed: %d\n", total_tests, total_tests - failed_tests, failed_tests);
+    return failed_tests == 0 ? 0 : 1;
+}